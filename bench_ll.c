@@ -0,0 +1,763 @@
+//
+// In-process benchmark of the tosfs handlers: no mount, no kernel, no /dev/fuse.
+//
+// The handlers of fuse_lowlevel_ops.c are linked against the stub fuse_reply_* layer below, which only records
+// what a reply would have sent. The program generates a v2 image, fills it through the handlers themselves, then
+// drives lookup, getattr, opendir, readdir and read in tight loops and reports ns/op and allocations/op. Two more
+// loops list whole directories as `ls -l` does, either with READDIRPLUS or with READDIR and a LOOKUP per entry.
+// The scan loop resolves names the way LOOKUP did before the dentry index, comparing every entry of the parent,
+// to weigh the index against it on directories of any size (-d 0 puts every file in the root).
+// Every READDIR loop walks the entries it got back to find where to resume, as the kernel does; the walk is timed.
+// With -i the calls go through the operation table the daemon registers instead, counted and traced as in a mount,
+// which measures what the statistics and the trace rings cost per request. With -z the files hold text and are
+// stored compressed, which measures the decompression and the block cache against the plain reads, fairest with
+// -C so that the plain reads pay for the copy the kernel would make of the bytes.
+//
+// gcc -Wall -O2 bench_ll.c `pkg-config fuse3 --cflags` -o bench_ll -lpthread
+//
+
+#define TOSFS_NO_MAIN
+#include "fuse_lowlevel_ops.c"
+
+#include <getopt.h>
+
+#define DEFAULT_FILES (10000)
+#define DEFAULT_DIRECTORIES (16)
+#define DEFAULT_FILE_SIZE (16 * 1024)
+#define DEFAULT_ITERATIONS (1000000)
+#define DEFAULT_READ_SIZE (128 * 1024)
+#define READDIR_SIZE (4096)
+#define NAME_SIZE (16)
+/// Size of the fuse_entry_out header that precedes every READDIRPLUS entry on the wire
+#define ENTRY_OUT_SIZE (128)
+/// Words the text of -z is made of, English prose being around a thousand common words
+#define TEXT_WORDS (1024)
+
+
+/// What the stub replies saw. Handlers only ever reply once per request.
+struct fuse_req {
+    int error;
+    fuse_ino_t ino;
+    size_t bytes;
+    /// Last buffer replied with fuse_reply_buf, which the handlers keep until their next call
+    const char* data;
+};
+
+/// Counted through the glibc entry points, which every allocation of the handlers goes through.
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* pointer, size_t size);
+
+static size_t allocations;
+
+/// Where the replies are copied with -C, NULL to only record their sizes
+static char* reply_copy;
+static size_t reply_copy_size;
+
+/// Handlers as they are, without the counting and tracing wrappers
+static const struct fuse_lowlevel_ops bare_oper = {
+    .lookup = ensea_ll_lookup,
+    .getattr = ensea_ll_getattr,
+    .opendir = ensea_ll_opendir,
+    .readdir = ensea_ll_readdir,
+    .readdirplus = ensea_ll_readdirplus,
+    .releasedir = ensea_ll_releasedir,
+    .read = ensea_ll_read,
+};
+
+/// Table the benchmarks call, bare_oper or ensea_ll_oper
+static const struct fuse_lowlevel_ops* oper = &bare_oper;
+
+void* malloc(size_t size) {
+    allocations++;
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+    allocations++;
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* pointer, size_t size) {
+    allocations++;
+    return __libc_realloc(pointer, size);
+}
+
+
+int fuse_reply_err(fuse_req_t req, int err) {
+    req->error = err;
+    return 0;
+}
+
+void fuse_reply_none(fuse_req_t req) {
+    (void) req;
+}
+
+int fuse_reply_entry(fuse_req_t req, const struct fuse_entry_param *e) {
+    req->ino = e->ino;
+    return 0;
+}
+
+int fuse_reply_create(fuse_req_t req, const struct fuse_entry_param *e, const struct fuse_file_info *fi) {
+    (void) fi;
+    req->ino = e->ino;
+    return 0;
+}
+
+int fuse_reply_attr(fuse_req_t req, const struct stat *attr, double attr_timeout) {
+    (void) attr_timeout;
+    req->ino = attr->st_ino;
+    return 0;
+}
+
+int fuse_reply_open(fuse_req_t req, const struct fuse_file_info *fi) {
+    (void) fi;
+    (void) req;
+    return 0;
+}
+
+int fuse_reply_write(fuse_req_t req, size_t count) {
+    req->bytes = count;
+    return 0;
+}
+
+int fuse_reply_buf(fuse_req_t req, const char *buf, size_t size) {
+    if (reply_copy != NULL && buf != NULL) {
+        memcpy(reply_copy, buf, min_macro(size, reply_copy_size));
+    }
+    req->bytes = size;
+    req->data = buf;
+    return 0;
+}
+
+/// The daemon replies with file descriptor buffers that the kernel splices, so only their sizes are summed, or with
+/// -C the bytes read as the kernel would without splice.
+int fuse_reply_data(fuse_req_t req, struct fuse_bufvec *bufv, enum fuse_buf_copy_flags flags) {
+    (void) flags;
+    req->bytes = 0;
+    for (size_t index = bufv->idx; index < bufv->count; index++) {
+        const struct fuse_buf* buf = &bufv->buf[index];
+        if (reply_copy != NULL && req->bytes < reply_copy_size) {
+            const size_t length = min_macro(buf->size, reply_copy_size - req->bytes);
+            if (!(buf->flags & FUSE_BUF_IS_FD)) {
+                memcpy(reply_copy + req->bytes, buf->mem, length);
+            } else if (pread(buf->fd, reply_copy + req->bytes, length, buf->pos) != (ssize_t) length) {
+                req->error = EIO;
+            }
+        }
+        req->bytes += buf->size;
+    }
+    return 0;
+}
+
+const struct fuse_ctx *fuse_req_ctx(fuse_req_t req) {
+    (void) req;
+    static struct fuse_ctx context;
+    context.uid = getuid();
+    context.gid = getgid();
+    context.pid = getpid();
+    return &context;
+}
+
+/// Same layout as struct fuse_dirent: inode, offset, name length, type, then the name padded to 8 bytes.
+size_t fuse_add_direntry(fuse_req_t req, char *buf, size_t bufsize, const char *name, const struct stat *stbuf, off_t off) {
+    (void) req;
+    const size_t name_length = strlen(name);
+    const size_t entry_size = (24 + name_length + 7) & ~(size_t) 7;
+    if (buf == NULL || entry_size > bufsize) {
+        return entry_size;
+    }
+
+    memset(buf, 0, entry_size);
+    const uint64_t ino = stbuf->st_ino;
+    const uint64_t offset = off;
+    const uint32_t length = name_length;
+    const uint32_t type = (stbuf->st_mode & S_IFMT) >> 12;
+    memcpy(buf, &ino, sizeof(ino));
+    memcpy(buf + 8, &offset, sizeof(offset));
+    memcpy(buf + 16, &length, sizeof(length));
+    memcpy(buf + 20, &type, sizeof(type));
+    memcpy(buf + 24, name, name_length);
+    return entry_size;
+}
+
+size_t fuse_add_direntry_plus(fuse_req_t req, char *buf, size_t bufsize, const char *name,
+                              const struct fuse_entry_param *e, off_t off) {
+    const size_t entry_size = ENTRY_OUT_SIZE + fuse_add_direntry(req, NULL, 0, name, &e->attr, off);
+    if (buf == NULL || entry_size > bufsize) {
+        return entry_size;
+    }
+
+    memset(buf, 0, ENTRY_OUT_SIZE);
+    memcpy(buf, &e->ino, sizeof(e->ino));
+    fuse_add_direntry(req, buf + ENTRY_OUT_SIZE, bufsize - ENTRY_OUT_SIZE, name, &e->attr, off);
+    return entry_size;
+}
+
+int fuse_lowlevel_notify_inval_inode(struct fuse_session *se, fuse_ino_t ino, off_t off, off_t len) {
+    (void) se;
+    (void) ino;
+    (void) off;
+    (void) len;
+    return 0;
+}
+
+int fuse_lowlevel_notify_inval_entry(struct fuse_session *se, fuse_ino_t parent, const char *name, size_t namelen) {
+    (void) se;
+    (void) parent;
+    (void) name;
+    (void) namelen;
+    return 0;
+}
+
+
+struct bench_settings {
+    __u32 files;
+    __u32 directories;
+    __u32 file_size;
+    size_t iterations;
+    __u32 read_size;
+    int writable;
+    int compressed;
+};
+
+/// Everything the loops pick from, generated with the image.
+struct bench_image {
+    __u32 files;
+    __u32 directories;
+    __u32 file_size;
+    __u32 read_size;
+    fuse_ino_t* file_inodes;
+    fuse_ino_t* file_parents;
+    char (*file_names)[NAME_SIZE];
+    fuse_ino_t* directory_inodes;
+    struct fuse_file_info* directory_handles;
+    off_t* directory_offsets;
+    /// Random picks drawn before timing, so that the draw is not measured. A pick encodes a file number
+    /// (pick % files) and a page of that file for bench_read (pick / files)
+    size_t* picks;
+    size_t pick_count;
+};
+
+static __u32 next_power_of_two(const __u32 value) {
+    __u32 power = 1;
+    while (power < value) {
+        power *= 2;
+    }
+    return power;
+}
+
+/// Writes an empty v2 image big enough for the settings: the superblock, its bitmap and inode table regions,
+/// and a root directory holding its two dots. The daemon reserves the metadata blocks itself at mount.
+static int write_blank_image(const int fd, const struct bench_settings* settings) {
+    const __u32 inode_count = settings->files + settings->directories + 2;
+    const __u32 inode_table_blocks = (__u32) ((inode_count * sizeof(struct tosfs_inode_v2) + TOSFS_BLOCK_SIZE - 1) / TOSFS_BLOCK_SIZE);
+    // Hashed directories grow by doubling and split at most half full
+    const __u32 entries_per_directory = settings->files / max_macro(settings->directories, 1u) + 3;
+    const __u32 directory_blocks = 2 * next_power_of_two(entries_per_directory * 2 / TOSFS_DENTRIES_PER_BLOCK + 1);
+    const __u32 data_blocks = settings->files * blocks_for_size(settings->file_size) +
+        (settings->directories + 1) * directory_blocks;
+    const __u32 metadata_blocks_estimate = 1 + 2 * (inode_count / TOSFS_BITMAP_BLOCK_BITS + 1) + inode_table_blocks;
+    const __u32 block_count = metadata_blocks_estimate + data_blocks + 64;
+    const __u32 block_bitmap_blocks = block_count / TOSFS_BITMAP_BLOCK_BITS + 1;
+    const __u32 inode_bitmap_blocks = inode_count / TOSFS_BITMAP_BLOCK_BITS + 1;
+
+    struct tosfs_superblock superblock = {
+        .magic = TOSFS_MAGIC,
+        .block_size = TOSFS_BLOCK_SIZE,
+        .blocks = block_count,
+        .inodes = 1,
+        .root_inode = TOSFS_ROOT_INODE,
+        .version = TOSFS_VERSION_2,
+        .block_bitmap_start = 1,
+        .block_bitmap_blocks = block_bitmap_blocks,
+        .inode_bitmap_start = 1 + block_bitmap_blocks,
+        .inode_bitmap_blocks = inode_bitmap_blocks,
+        .inode_table_start = 1 + block_bitmap_blocks + inode_bitmap_blocks,
+        .inode_table_blocks = inode_table_blocks,
+    };
+    const __u32 root_block = superblock.inode_table_start + inode_table_blocks;
+    if (root_block >= block_count) {
+        fprintf(stderr, "write_blank_image: image too small\n");
+        return SYSTEM_CALL_ERROR;
+    }
+
+    struct tosfs_inode_v2 root = {
+        .inode = TOSFS_ROOT_INODE,
+        .mode = S_IFDIR | 0755,
+        .perm = 0755,
+        .nlink = 2,
+        .size = TOSFS_BLOCK_SIZE,
+        .nr_extents = 1,
+        .extents = { { .start = root_block, .length = 1 } },
+    };
+    struct tosfs_dentry dots[2] = {
+        { .inode = TOSFS_ROOT_INODE, .name = "." },
+        { .inode = TOSFS_ROOT_INODE, .name = ".." },
+    };
+    const __u32 root_inode_bit = 1u << TOSFS_ROOT_INODE;
+    const __u32 root_block_bit = 1u << (root_block % BITMAP_BITS);
+
+    if (ftruncate(fd, (off_t) block_count * TOSFS_BLOCK_SIZE) == SYSTEM_CALL_ERROR ||
+        pwrite(fd, &superblock, sizeof(superblock), 0) != sizeof(superblock) ||
+        pwrite(fd, &root, sizeof(root), (off_t) superblock.inode_table_start * TOSFS_BLOCK_SIZE + TOSFS_ROOT_INODE * sizeof(root)) != sizeof(root) ||
+        pwrite(fd, dots, sizeof(dots), (off_t) root_block * TOSFS_BLOCK_SIZE) != sizeof(dots) ||
+        pwrite(fd, &root_inode_bit, sizeof(__u32), (off_t) superblock.inode_bitmap_start * TOSFS_BLOCK_SIZE) != sizeof(__u32) ||
+        pwrite(fd, &root_block_bit, sizeof(__u32),
+               (off_t) superblock.block_bitmap_start * TOSFS_BLOCK_SIZE + root_block / BITMAP_BITS * sizeof(__u32)) != sizeof(__u32)) {
+        perror("write_blank_image");
+        return SYSTEM_CALL_ERROR;
+    }
+    return EXIT_SUCCESS;
+}
+
+/// Fills a file with words drawn from a fixed vocabulary, separated by spaces and now and then a new line: data
+/// that compresses about as well as text does.
+static void fill_text(char* data, const size_t size, unsigned int seed) {
+    static char words[TEXT_WORDS][12];
+    static int words_ready;
+    if (!words_ready) {
+        unsigned int word_seed = 1;
+        for (unsigned int word = 0; word < TEXT_WORDS; word++) {
+            const unsigned int length = 2 + (unsigned int) rand_r(&word_seed) % 9;
+            for (unsigned int letter = 0; letter < length; letter++) {
+                words[word][letter] = (char) ('a' + rand_r(&word_seed) % 26);
+            }
+            words[word][length] = '\0';
+        }
+        words_ready = 1;
+    }
+
+    size_t done = 0;
+    while (done < size) {
+        // Frequent words come far more often than rare ones, as in any text: half of them are among the first 64
+        const unsigned int pick = (unsigned int) rand_r(&seed) % TEXT_WORDS;
+        const char* word = words[pick * pick / TEXT_WORDS * pick / TEXT_WORDS * pick / TEXT_WORDS];
+        const size_t length = min_macro(strlen(word), size - done);
+        memcpy(data + done, word, length);
+        done += length;
+        if (done < size) {
+            data[done++] = rand_r(&seed) % 12 == 0 ? '\n' : ' ';
+        }
+    }
+}
+
+/// Creates the directories under the root and spreads the files over them, each one filled with file_size bytes,
+/// all through the writable handlers.
+static int populate_image(struct bench_image* image, const int text) {
+    struct fuse_req req = { 0 };
+    char name[NAME_SIZE];
+
+    for (__u32 dir = 0; dir < image->directories; dir++) {
+        snprintf(name, sizeof(name), "d%u", dir);
+        req.error = 0;
+        ensea_ll_mkdir(&req, TOSFS_ROOT_INODE, name, 0755);
+        if (req.error != 0) {
+            fprintf(stderr, "populate_image: mkdir %s: %s\n", name, strerror(req.error));
+            return SYSTEM_CALL_ERROR;
+        }
+        image->directory_inodes[dir] = req.ino;
+    }
+
+    char* data = malloc(max_macro(image->file_size, 1u));
+    if (data == NULL) {
+        perror("populate_image: malloc");
+        return SYSTEM_CALL_ERROR;
+    }
+    memset(data, 'x', max_macro(image->file_size, 1u));
+
+    for (__u32 file = 0; file < image->files; file++) {
+        struct fuse_file_info fi = { 0 };
+        snprintf(image->file_names[file], NAME_SIZE, "f%u", file);
+        image->file_parents[file] = image->directories > 0 ? image->directory_inodes[file % image->directories] : TOSFS_ROOT_INODE;
+        if (text) {
+            fill_text(data, image->file_size, file + 1);
+        }
+        req.error = 0;
+        ensea_ll_create(&req, image->file_parents[file], image->file_names[file], 0644, &fi);
+        if (req.error == 0 && image->file_size > 0) {
+            ensea_ll_write(&req, req.ino, data, image->file_size, 0, &fi);
+        }
+        if (req.error != 0) {
+            fprintf(stderr, "populate_image: %s: %s\n", image->file_names[file], strerror(req.error));
+            free(data);
+            return SYSTEM_CALL_ERROR;
+        }
+        image->file_inodes[file] = req.ino;
+    }
+
+    free(data);
+    return EXIT_SUCCESS;
+}
+
+/// Stores every file compressed, as mkfs.tosfs -c does: the stored bytes over the first blocks, the other blocks
+/// given back. Files that would not take fewer blocks are kept as they are.
+static int compress_files(const struct bench_image* image) {
+    const size_t capacity = (size_t) blocks_for_size(image->file_size) * TOSFS_BLOCK_SIZE;
+    char* data = malloc(max_macro(capacity, (size_t) 1));
+    char* stored = malloc(max_macro(capacity, (size_t) 1));
+    if (data == NULL || stored == NULL) {
+        perror("compress_files: malloc");
+        free(data);
+        free(stored);
+        return SYSTEM_CALL_ERROR;
+    }
+
+    __u64 stored_blocks = 0;
+    __u32 compressed_files = 0;
+    for (__u32 file = 0; file < image->files; file++) {
+        const fuse_ino_t ino = image->file_inodes[file];
+        __u64 length = 0;
+        if (tosfs_inode_read_stored(&mapped_file->image, ino, 0, image->file_size, data) == 0) {
+            length = tosfs_compress_file(data, image->file_size, stored, capacity);
+        }
+        if (length == 0) {
+            stored_blocks += blocks_for_size(image->file_size);
+            continue;
+        }
+        struct tosfs_inode_v2* inode = &mapped_file->image.inodes_v2[ino];
+        const __u32 blocks = blocks_for_size(length);
+        inode_copy_in(ino, 0, stored, length);
+        inode_copy_in(ino, length, NULL, (size_t) blocks * TOSFS_BLOCK_SIZE - length);
+        inode_v2_release_blocks(inode, blocks);
+        inode->flags |= TOSFS_INODE_COMPRESSED;
+        stored_blocks += blocks;
+        compressed_files++;
+    }
+    free(data);
+    free(stored);
+
+    const double data_mib = (double) image->files * image->file_size / (1024.0 * 1024.0);
+    const double stored_mib = (double) stored_blocks * TOSFS_BLOCK_SIZE / (1024.0 * 1024.0);
+    printf("%u of %u files compressed: %.1f MiB of data in %.1f MiB of blocks (%.2fx)\n", compressed_files, image->files,
+           data_mib, stored_mib, stored_mib > 0 ? data_mib / stored_mib : 0.0);
+    return EXIT_SUCCESS;
+}
+
+/// Walks the entries of a READDIR reply, or with `plus` of a READDIRPLUS one, laid out as the stubs above do.
+/// Returns the d_off of the last one, where the next call resumes, and looks up every entry but the dots in `dir`
+/// when `lookup` is set.
+static off_t walk_entries(struct fuse_req* req, const int plus, const fuse_ino_t dir, const int lookup) {
+    const char* data = req->data;
+    const size_t bytes = req->bytes;
+    const size_t header = plus ? ENTRY_OUT_SIZE : 0;
+    char name[TOSFS_MAX_NAME_LENGTH + 1];
+    off_t offset = 0;
+    for (size_t position = 0; position + header + 24 <= bytes;) {
+        const char* entry = data + position + header;
+        uint64_t next;
+        uint32_t name_length;
+        memcpy(&next, entry + 8, sizeof(next));
+        memcpy(&name_length, entry + 16, sizeof(name_length));
+        offset = (off_t) next;
+        position += header + ((24 + name_length + 7) & ~(size_t) 7);
+        if (lookup) {
+            memcpy(name, entry + 24, min_macro(name_length, (uint32_t) TOSFS_MAX_NAME_LENGTH));
+            name[min_macro(name_length, (uint32_t) TOSFS_MAX_NAME_LENGTH)] = '\0';
+            if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+                oper->lookup(req, dir, name);
+            }
+        }
+    }
+    return offset;
+}
+
+static void bench_lookup(struct fuse_req* req, const struct bench_image* image, const size_t pick) {
+    oper->lookup(req, image->file_parents[pick % image->files], image->file_names[pick % image->files]);
+}
+
+/// LOOKUP as it was before the dentry index: every entry of the parent compared in turn, so the cost grows with
+/// the directory.
+static void bench_scan(struct fuse_req* req, const struct bench_image* image, const size_t pick) {
+    const fuse_ino_t parent = image->file_parents[pick % image->files];
+    const char* name = image->file_names[pick % image->files];
+    struct tosfs_dentry_cursor cursor;
+    tosfs_dentry_cursor_init(&mapped_file->image, &cursor, parent);
+
+    const struct tosfs_dentry* entry;
+    while ((entry = tosfs_dentry_next(&mapped_file->image, &cursor)) != NULL) {
+        if (strncmp(entry->name, name, TOSFS_MAX_NAME_LENGTH) == 0) {
+            struct fuse_entry_param entry_param;
+            fill_entry_param(&entry_param, entry->inode);
+            fuse_reply_entry(req, &entry_param);
+            return;
+        }
+    }
+    fuse_reply_err(req, ENOENT);
+}
+
+static void bench_getattr(struct fuse_req* req, const struct bench_image* image, const size_t pick) {
+    oper->getattr(req, image->file_inodes[pick % image->files], NULL);
+}
+
+/// Builds and frees the whole listing of a directory, as every `ls` does.
+static void bench_opendir(struct fuse_req* req, const struct bench_image* image, const size_t pick) {
+    struct fuse_file_info fi = { 0 };
+    const fuse_ino_t dir = image->directory_inodes[pick % image->directories];
+    oper->opendir(req, dir, &fi);
+    oper->releasedir(req, dir, &fi);
+}
+
+/// One READDIR page of an already open directory, walking each listing from start to end again and again.
+static void bench_readdir(struct fuse_req* req, const struct bench_image* image, const size_t pick) {
+    const __u32 dir = pick % image->directories;
+    req->bytes = 0;
+    oper->readdir(req, image->directory_inodes[dir], READDIR_SIZE, image->directory_offsets[dir], &image->directory_handles[dir]);
+    image->directory_offsets[dir] = req->bytes == 0 ? 0 : walk_entries(req, 0, image->directory_inodes[dir], 0);
+}
+
+/// Whole listing of a directory with its attributes, as `ls -l` gets it from a kernel that negotiated READDIRPLUS.
+static void bench_list_plus(struct fuse_req* req, const struct bench_image* image, const size_t pick) {
+    struct fuse_file_info fi = { 0 };
+    const fuse_ino_t dir = image->directory_inodes[pick % image->directories];
+    size_t bytes = 0;
+    oper->opendir(req, dir, &fi);
+    for (off_t offset = 0;;) {
+        req->bytes = 0;
+        oper->readdirplus(req, dir, READDIR_SIZE, offset, &fi);
+        if (req->bytes == 0) {
+            break;
+        }
+        bytes += req->bytes;
+        offset = walk_entries(req, 1, dir, 0);
+    }
+    oper->releasedir(req, dir, &fi);
+    req->bytes = bytes;
+}
+
+/// Same listing through READDIR and a LOOKUP of every name, as `ls -l` gets it without READDIRPLUS.
+static void bench_list_lookup(struct fuse_req* req, const struct bench_image* image, const size_t pick) {
+    struct fuse_file_info fi = { 0 };
+    const fuse_ino_t dir = image->directory_inodes[pick % image->directories];
+    size_t bytes = 0;
+    oper->opendir(req, dir, &fi);
+    for (off_t offset = 0;;) {
+        req->bytes = 0;
+        oper->readdir(req, dir, READDIR_SIZE, offset, &fi);
+        if (req->bytes == 0) {
+            break;
+        }
+        const size_t page_bytes = req->bytes;
+        offset = walk_entries(req, 0, dir, 1);
+        bytes += page_bytes;
+    }
+    oper->releasedir(req, dir, &fi);
+    req->bytes = bytes;
+}
+
+static void bench_read(struct fuse_req* req, const struct bench_image* image, const size_t pick) {
+    const __u32 pages = max_macro(blocks_for_size(image->file_size), 1u);
+    const off_t offset = (off_t) (pick / image->files % pages) * TOSFS_BLOCK_SIZE;
+    oper->read(req, image->file_inodes[pick % image->files], image->read_size, offset, NULL);
+}
+
+struct benchmark {
+    const char* name;
+    void (*run)(struct fuse_req* req, const struct bench_image* image, size_t pick);
+    int needs_directories;
+    /// Lists a whole directory per iteration: run as many times fewer as there are files per directory
+    int per_directory;
+};
+
+static const struct benchmark benchmarks[] = {
+    { "lookup", bench_lookup, 0, 0 },
+    { "scan", bench_scan, 0, 0 },
+    { "getattr", bench_getattr, 0, 0 },
+    { "opendir", bench_opendir, 1, 0 },
+    { "readdir", bench_readdir, 1, 0 },
+    { "read", bench_read, 0, 0 },
+    { "ls_plus", bench_list_plus, 1, 1 },
+    { "ls_lookup", bench_list_lookup, 1, 1 },
+};
+
+static double elapsed_ns(const struct timespec* started, const struct timespec* finished) {
+    return (double) (finished->tv_sec - started->tv_sec) * 1e9 + (double) (finished->tv_nsec - started->tv_nsec);
+}
+
+static void run_benchmark(const struct benchmark* benchmark, const struct bench_image* image, const size_t iterations) {
+    struct fuse_req req = { 0 };
+    size_t errors = 0;
+    struct timespec started, finished;
+
+    size_t bytes = 0;
+    const size_t allocations_before = allocations;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    for (size_t iteration = 0; iteration < iterations; iteration++) {
+        req.error = 0;
+        req.bytes = 0;
+        benchmark->run(&req, image, image->picks[iteration % image->pick_count]);
+        errors += req.error != 0;
+        bytes += req.bytes;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+
+    const double ns = elapsed_ns(&started, &finished);
+    printf("%-10s %12zu %12.1f %14.3f %10.1f %8zu\n", benchmark->name, iterations, ns / (double) iterations,
+           (double) (allocations - allocations_before) / (double) iterations, (double) bytes / (1024.0 * 1024.0) / (ns / 1e9),
+           errors);
+}
+
+static void usage(const char* program) {
+    printf("usage: %s [options] [image]\n\n", program);
+    printf(
+        "Generates a tosfs image (a temporary file unless `image` is given) and times the handlers on it.\n"
+        "    -f N    files (default: %u)\n"
+        "    -d N    directories the files are spread over (default: %u)\n"
+        "    -s N    bytes per file (default: %u)\n"
+        "    -n N    iterations per handler (default: %u)\n"
+        "    -r N    bytes per READ (default: %u)\n"
+        "    -w      keep the image writable instead of serving it read-only\n"
+        "    -i      call the handlers through the daemon's table, with statistics and traces\n"
+        "    -T N    requests each thread traces with -i, a power of two or 0 for statistics only (default: %u)\n"
+        "    -z      fill the files with text and store them compressed\n"
+        "    -c N    decompressed blocks the daemon caches with -z, 0 for none (default: %u)\n"
+        "    -C      copy every reply, file descriptor buffers included, as the kernel would without splice\n",
+        DEFAULT_FILES, DEFAULT_DIRECTORIES, DEFAULT_FILE_SIZE, DEFAULT_ITERATIONS, DEFAULT_READ_SIZE, DEFAULT_TRACE_EVENTS,
+        DEFAULT_CACHE_BLOCKS
+    );
+}
+
+int main(int argc, char *argv[]) {
+    struct bench_settings settings = {
+        .files = DEFAULT_FILES,
+        .directories = DEFAULT_DIRECTORIES,
+        .file_size = DEFAULT_FILE_SIZE,
+        .iterations = DEFAULT_ITERATIONS,
+        .read_size = DEFAULT_READ_SIZE,
+    };
+    int option;
+    int copy_replies = 0;
+    while ((option = getopt(argc, argv, "f:d:s:n:r:wiT:zc:Ch")) != -1) {
+        switch (option) {
+            case 'f': settings.files = (__u32) strtoul(optarg, NULL, 0); break;
+            case 'd': settings.directories = (__u32) strtoul(optarg, NULL, 0); break;
+            case 's': settings.file_size = (__u32) strtoul(optarg, NULL, 0); break;
+            case 'n': settings.iterations = strtoull(optarg, NULL, 0); break;
+            case 'r': settings.read_size = (__u32) strtoul(optarg, NULL, 0); break;
+            case 'w': settings.writable = 1; break;
+            case 'i': oper = &ensea_ll_oper; break;
+            case 'T': options.trace_events = (unsigned int) strtoul(optarg, NULL, 0); break;
+            case 'z': settings.compressed = 1; break;
+            case 'c': options.cache_blocks = (unsigned int) strtoul(optarg, NULL, 0); break;
+            case 'C': copy_replies = 1; break;
+            default:
+                usage(argv[0]);
+                return option == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (settings.files == 0 || settings.iterations == 0 || optind + 1 < argc ||
+        (options.trace_events & (options.trace_events - 1)) != 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    int fd;
+    if (optind < argc) {
+        snprintf(image_path, sizeof(image_path), "%s", argv[optind]);
+        fd = open(image_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    } else {
+        snprintf(image_path, sizeof(image_path), "/tmp/bench_ll.XXXXXX");
+        fd = mkstemp(image_path);
+    }
+    if (fd == SYSTEM_CALL_ERROR) {
+        perror(image_path);
+        return EXIT_FAILURE;
+    }
+    const int status = write_blank_image(fd, &settings);
+    close(fd);
+    if (status == SYSTEM_CALL_ERROR) {
+        return EXIT_FAILURE;
+    }
+
+    struct bench_image image = {
+        .files = settings.files,
+        .directories = settings.directories,
+        .file_size = settings.file_size,
+        .read_size = settings.read_size,
+        .file_inodes = calloc(settings.files, sizeof(fuse_ino_t)),
+        .file_parents = calloc(settings.files, sizeof(fuse_ino_t)),
+        .file_names = calloc(settings.files, NAME_SIZE),
+        .directory_inodes = calloc(max_macro(settings.directories, 1u), sizeof(fuse_ino_t)),
+        .directory_handles = calloc(max_macro(settings.directories, 1u), sizeof(struct fuse_file_info)),
+        .directory_offsets = calloc(max_macro(settings.directories, 1u), sizeof(off_t)),
+        .pick_count = min_macro(settings.iterations, (size_t) 1 << 20),
+    };
+    image.picks = calloc(image.pick_count, sizeof(size_t));
+    if (image.file_inodes == NULL || image.file_parents == NULL || image.file_names == NULL ||
+        image.directory_inodes == NULL || image.directory_handles == NULL || image.directory_offsets == NULL ||
+        image.picks == NULL) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+
+    options.read_only = 0;
+    mapped_file = map_example_file();
+    if (mapped_file == NULL || read_mapped_file_as_tosfs_file(mapped_file) == SYSTEM_CALL_ERROR ||
+        populate_image(&image, settings.compressed) == SYSTEM_CALL_ERROR ||
+        (settings.compressed && compress_files(&image) == SYSTEM_CALL_ERROR)) {
+        return EXIT_FAILURE;
+    }
+    close_mapped_file(mapped_file);
+
+    // Served again the way the daemon would after a fresh mount
+    options.read_only = !settings.writable;
+    mapped_file = map_example_file();
+    if (mapped_file == NULL || read_mapped_file_as_tosfs_file(mapped_file) == SYSTEM_CALL_ERROR) {
+        return EXIT_FAILURE;
+    }
+
+    struct fuse_req req = { 0 };
+    for (__u32 dir = 0; dir < settings.directories; dir++) {
+        ensea_ll_opendir(&req, image.directory_inodes[dir], &image.directory_handles[dir]);
+    }
+    if (copy_replies) {
+        reply_copy_size = max_macro((size_t) settings.read_size, (size_t) READDIR_SIZE);
+        reply_copy = malloc(reply_copy_size);
+        if (reply_copy == NULL) {
+            perror("malloc");
+            return EXIT_FAILURE;
+        }
+    }
+    unsigned int seed = 42;
+    for (size_t index = 0; index < image.pick_count; index++) {
+        const size_t file = (size_t) rand_r(&seed) % settings.files;
+        const size_t page = (size_t) rand_r(&seed) % max_macro(blocks_for_size(settings.file_size), 1u);
+        image.picks[index] = file + (size_t) settings.files * page;
+    }
+
+    printf("%s image, %u %sfiles in %u directories, %u bytes each, %s", settings.writable ? "writable" : "read-only",
+           settings.files, settings.compressed ? "compressed " : "", settings.directories, settings.file_size,
+           copy_replies ? "replies copied, " : "");
+    if (oper == &bare_oper) {
+        printf("bare handlers\n");
+    } else {
+        printf("counted, %u traced requests per thread\n", options.trace_events);
+    }
+    printf("%-10s %12s %12s %14s %10s %8s\n", "handler", "iterations", "ns/op", "allocs/op", "MiB/s", "errors");
+    for (size_t index = 0; index < sizeof(benchmarks) / sizeof(benchmarks[0]); index++) {
+        if (benchmarks[index].needs_directories && settings.directories == 0) {
+            continue;
+        }
+        const size_t iterations = benchmarks[index].per_directory
+            ? max_macro(settings.iterations * settings.directories / settings.files, (size_t) 1) : settings.iterations;
+        run_benchmark(&benchmarks[index], &image, iterations);
+    }
+
+    if (mapped_file->block_cache.capacity > 0) {
+        struct stats_snapshot* snapshot = stats_snapshot_new();
+        if (snapshot != NULL && strstr(snapshot->text, "block_cache") != NULL) {
+            printf("%s", strstr(snapshot->text, "block_cache"));
+        }
+        stats_snapshot_free(snapshot);
+    }
+
+    for (__u32 dir = 0; dir < settings.directories; dir++) {
+        ensea_ll_releasedir(&req, image.directory_inodes[dir], &image.directory_handles[dir]);
+    }
+    close_mapped_file(mapped_file);
+    free(reply_copy);
+    if (optind == argc) {
+        unlink(image_path);
+    }
+    return EXIT_SUCCESS;
+}
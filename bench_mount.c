@@ -0,0 +1,617 @@
+//
+// Workload benchmark of a mounted file system: the tosfs daemon, fusexmp_fh, or anything else that can be mounted.
+//
+// The daemon command given after `--` is started in the foreground, the program waits for its mount to show up,
+// runs the workloads against the tree under it, then unmounts it. Each workload writes one JSON line with its
+// throughput and its p50/p99/p999 latency, so that runs of two versions can be compared by a script. With -S the
+// concurrent workloads run once per client count from 1 up to -j, doubling, to show how the daemon scales.
+//
+// gcc -Wall -O2 bench_mount.c -o bench_mount -lpthread
+//
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define SYSTEM_CALL_ERROR (-1)
+#define DEFAULT_DURATION (5.0)
+#define DEFAULT_CLIENTS (4)
+#define DEFAULT_MAX_FILES (100000)
+#define MOUNT_TIMEOUT (10.0)
+#define LATENCIES_MIN_CAPACITY (4096)
+#define PATHS_MIN_CAPACITY (1024)
+/// Operations of the mixed workload out of 100: the rest after stat and read are directory listings
+#define MIXED_STAT_SHARE (70)
+#define MIXED_READ_SHARE (25)
+#define MIXED_READ_SIZE (4096)
+
+#define min_macro(x, y) ((x) < (y) ? (x) : (y))
+#define max_macro(x, y) ((x) > (y) ? (x) : (y))
+
+
+/// Paths found under the benchmarked tree. Regular files keep their size so that reads stay inside them.
+struct tree {
+    char** files;
+    off_t* file_sizes;
+    size_t file_count;
+    size_t file_capacity;
+    /// Files with at least one byte, the only ones the read workloads pick
+    size_t* readable_files;
+    size_t readable_count;
+    char** directories;
+    size_t directory_count;
+    size_t directory_capacity;
+    size_t max_files;
+};
+
+/// Latency of every operation of one client, in nanoseconds. `capacity` grows geometrically.
+struct latencies {
+    unsigned long long* values;
+    size_t count;
+    size_t capacity;
+};
+
+struct client;
+
+struct workload {
+    const char* name;
+    /// Runs one operation, adding what it moved to the client counters. Returns SYSTEM_CALL_ERROR on failure.
+    int (*run)(struct client* client);
+    size_t block_size;
+    int concurrent;
+    int needs_data;
+};
+
+/// State of one thread running a workload.
+struct client {
+    const struct tree* tree;
+    const struct workload* workload;
+    struct timespec deadline;
+    unsigned int seed;
+    int keep_cache;
+    char* buffer;
+    /// Cursor of the sequential workloads: the file being read and where
+    int fd;
+    size_t file;
+    off_t offset;
+    size_t next_path;
+
+    struct latencies latencies;
+    unsigned long long bytes;
+    unsigned long long items;
+    unsigned long long errors;
+};
+
+struct bench_settings {
+    const char* mountpoint;
+    const char* tree;
+    const char* label;
+    double duration;
+    unsigned int clients;
+    /// Concurrent workloads run at 1, 2, 4... clients up to `clients` instead of at `clients` only
+    int scaling;
+    int keep_cache;
+    char** daemon;
+    FILE* output;
+};
+
+
+static double timespec_seconds(const struct timespec* time) {
+    return (double) time->tv_sec + (double) time->tv_nsec / 1e9;
+}
+
+static unsigned long long elapsed_ns(const struct timespec* started, const struct timespec* finished) {
+    return (unsigned long long) ((finished->tv_sec - started->tv_sec) * 1000000000LL + (finished->tv_nsec - started->tv_nsec));
+}
+
+static int deadline_passed(const struct timespec* now, const struct timespec* deadline) {
+    return now->tv_sec > deadline->tv_sec || (now->tv_sec == deadline->tv_sec && now->tv_nsec >= deadline->tv_nsec);
+}
+
+static void* grow_array(void* array, size_t* capacity, const size_t min_capacity, const size_t element_size) {
+    const size_t new_capacity = max_macro(2 * *capacity, min_capacity);
+    void* new_array = realloc(array, new_capacity * element_size);
+    if (new_array == NULL) {
+        perror("grow_array: realloc");
+        exit(EXIT_FAILURE);
+    }
+    *capacity = new_capacity;
+    return new_array;
+}
+
+static void latencies_add(struct latencies* latencies, const unsigned long long value) {
+    if (latencies->count == latencies->capacity) {
+        latencies->values = grow_array(latencies->values, &latencies->capacity, LATENCIES_MIN_CAPACITY,
+                                       sizeof(unsigned long long));
+    }
+    latencies->values[latencies->count++] = value;
+}
+
+static int compare_latencies(const void* left, const void* right) {
+    const unsigned long long a = *(const unsigned long long*) left;
+    const unsigned long long b = *(const unsigned long long*) right;
+    return (a > b) - (a < b);
+}
+
+/// Value below which a `quantile` share of the sorted latencies lie, in microseconds.
+static double latency_quantile_us(const struct latencies* sorted, const double quantile) {
+    if (sorted->count == 0) {
+        return 0;
+    }
+    const size_t position = min_macro((size_t) (quantile * (double) sorted->count), sorted->count - 1);
+    return (double) sorted->values[position] / 1e3;
+}
+
+
+/// Collects the files and directories under `path`, depth first, until the tree holds max_files files.
+static void tree_walk(struct tree* tree, const char* path) {
+    if (tree->directory_count == tree->directory_capacity) {
+        tree->directories = grow_array(tree->directories, &tree->directory_capacity, PATHS_MIN_CAPACITY, sizeof(char*));
+    }
+    tree->directories[tree->directory_count++] = strdup(path);
+
+    DIR* directory = opendir(path);
+    if (directory == NULL) {
+        perror(path);
+        return;
+    }
+
+    char child[PATH_MAX];
+    struct dirent* entry;
+    while ((entry = readdir(directory)) != NULL && tree->file_count < tree->max_files) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+
+        struct stat stbuf;
+        if (lstat(child, &stbuf) == SYSTEM_CALL_ERROR) {
+            continue;
+        }
+        if (S_ISDIR(stbuf.st_mode)) {
+            tree_walk(tree, child);
+        } else if (S_ISREG(stbuf.st_mode)) {
+            if (tree->file_count == tree->file_capacity) {
+                // Both arrays grow to the same capacity
+                size_t sizes_capacity = tree->file_capacity;
+                tree->files = grow_array(tree->files, &tree->file_capacity, PATHS_MIN_CAPACITY, sizeof(char*));
+                tree->file_sizes = grow_array(tree->file_sizes, &sizes_capacity, PATHS_MIN_CAPACITY, sizeof(off_t));
+            }
+            tree->files[tree->file_count] = strdup(child);
+            tree->file_sizes[tree->file_count] = stbuf.st_size;
+            tree->file_count++;
+        }
+    }
+    closedir(directory);
+}
+
+static void tree_build(struct tree* tree, const char* root) {
+    tree_walk(tree, root);
+
+    tree->readable_files = calloc(max_macro(tree->file_count, (size_t) 1), sizeof(size_t));
+    if (tree->readable_files == NULL) {
+        perror("tree_build: calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t file = 0; file < tree->file_count; file++) {
+        if (tree->file_sizes[file] > 0) {
+            tree->readable_files[tree->readable_count++] = file;
+        }
+    }
+}
+
+static void tree_free(struct tree* tree) {
+    for (size_t file = 0; file < tree->file_count; file++) {
+        free(tree->files[file]);
+    }
+    for (size_t dir = 0; dir < tree->directory_count; dir++) {
+        free(tree->directories[dir]);
+    }
+    free(tree->files);
+    free(tree->file_sizes);
+    free(tree->readable_files);
+    free(tree->directories);
+}
+
+
+/// Opens a file for reading. Unless the cache is kept, its pages are dropped first so that the reads reach the daemon.
+static int open_for_read(const char* path, const int keep_cache) {
+    const int fd = open(path, O_RDONLY);
+    if (fd != SYSTEM_CALL_ERROR && !keep_cache) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    return fd;
+}
+
+/// One lstat, walking every file in turn: the `ls -l` / `find` pattern on many small files.
+static int run_stat(struct client* client) {
+    const struct tree* tree = client->tree;
+    struct stat stbuf;
+    const size_t file = client->next_path++ % tree->file_count;
+    client->items++;
+    return lstat(tree->files[file], &stbuf);
+}
+
+/// Lists a whole directory: opendir, readdir until the end, closedir.
+static int run_readdir(struct client* client) {
+    const struct tree* tree = client->tree;
+    DIR* directory = opendir(tree->directories[client->next_path++ % tree->directory_count]);
+    if (directory == NULL) {
+        return SYSTEM_CALL_ERROR;
+    }
+    while (readdir(directory) != NULL) {
+        client->items++;
+    }
+    return closedir(directory);
+}
+
+/// Reads the files one after the other from start to end, one block per operation.
+static int run_sequential_read(struct client* client) {
+    const struct tree* tree = client->tree;
+    if (client->fd == SYSTEM_CALL_ERROR || client->offset >= tree->file_sizes[client->file]) {
+        if (client->fd != SYSTEM_CALL_ERROR) {
+            close(client->fd);
+        }
+        client->file = tree->readable_files[client->next_path++ % tree->readable_count];
+        client->offset = 0;
+        client->fd = open_for_read(tree->files[client->file], client->keep_cache);
+        if (client->fd == SYSTEM_CALL_ERROR) {
+            return SYSTEM_CALL_ERROR;
+        }
+    }
+
+    const ssize_t read_size = pread(client->fd, client->buffer, client->workload->block_size, client->offset);
+    if (read_size == SYSTEM_CALL_ERROR) {
+        return SYSTEM_CALL_ERROR;
+    }
+    // A file shrunk since the walk ends here instead of looping on empty reads
+    client->offset = read_size == 0 ? tree->file_sizes[client->file] : client->offset + read_size;
+    client->bytes += read_size;
+    client->items++;
+    return EXIT_SUCCESS;
+}
+
+/// One block at a random block aligned offset of a random file, open included.
+static int run_random_read(struct client* client) {
+    const struct tree* tree = client->tree;
+    const size_t block_size = client->workload->block_size;
+    const size_t file = tree->readable_files[(size_t) rand_r(&client->seed) % tree->readable_count];
+    const size_t blocks = max_macro(((size_t) tree->file_sizes[file] + block_size - 1) / block_size, (size_t) 1);
+    const off_t offset = (off_t) ((size_t) rand_r(&client->seed) % blocks * block_size);
+
+    const int fd = open_for_read(tree->files[file], client->keep_cache);
+    if (fd == SYSTEM_CALL_ERROR) {
+        return SYSTEM_CALL_ERROR;
+    }
+    const ssize_t read_size = pread(fd, client->buffer, block_size, offset);
+    close(fd);
+    if (read_size == SYSTEM_CALL_ERROR) {
+        return SYSTEM_CALL_ERROR;
+    }
+    client->bytes += read_size;
+    client->items++;
+    return EXIT_SUCCESS;
+}
+
+/// Mostly stats, some small random reads and a few listings, as concurrent users of a shared tree would do.
+static int run_mixed(struct client* client) {
+    const unsigned int share = (unsigned int) rand_r(&client->seed) % 100;
+    if (share < MIXED_STAT_SHARE) {
+        client->next_path = (size_t) rand_r(&client->seed);
+        return run_stat(client);
+    }
+    if (share < MIXED_STAT_SHARE + MIXED_READ_SHARE && client->tree->readable_count > 0) {
+        return run_random_read(client);
+    }
+    client->next_path = (size_t) rand_r(&client->seed);
+    return run_readdir(client);
+}
+
+static const struct workload workloads[] = {
+    { "stat", run_stat, 0, 0, 0 },
+    { "readdir", run_readdir, 0, 0, 0 },
+    { "seqread-4k", run_sequential_read, 4096, 0, 1 },
+    { "seqread-64k", run_sequential_read, 64 * 1024, 0, 1 },
+    { "seqread-1m", run_sequential_read, 1024 * 1024, 0, 1 },
+    { "randread-4k", run_random_read, 4096, 0, 1 },
+    { "randread-64k", run_random_read, 64 * 1024, 0, 1 },
+    { "mixed", run_mixed, MIXED_READ_SIZE, 1, 0 },
+    { "stat-mt", run_stat, 0, 1, 0 },
+    { "randread-4k-mt", run_random_read, 4096, 1, 1 },
+};
+
+
+static void* client_loop(void* arg) {
+    struct client* client = arg;
+    struct timespec started, finished;
+
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    while (!deadline_passed(&finished, &client->deadline)) {
+        started = finished;
+        if (client->workload->run(client) == SYSTEM_CALL_ERROR) {
+            client->errors++;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &finished);
+        latencies_add(&client->latencies, elapsed_ns(&started, &finished));
+    }
+
+    if (client->fd != SYSTEM_CALL_ERROR) {
+        close(client->fd);
+    }
+    return NULL;
+}
+
+/// Runs one workload on `client_count` clients until the duration is over and writes its JSON line.
+static void run_workload(const struct bench_settings* settings, const struct tree* tree, const struct workload* workload,
+                         const unsigned int client_count) {
+    struct client* clients = calloc(client_count, sizeof(struct client));
+    pthread_t* threads = calloc(client_count, sizeof(pthread_t));
+    if (clients == NULL || threads == NULL) {
+        perror("run_workload: calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    struct timespec started, finished;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    struct timespec deadline = started;
+    deadline.tv_sec += (time_t) settings->duration;
+    deadline.tv_nsec += (long) ((settings->duration - (double) (time_t) settings->duration) * 1e9);
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    for (unsigned int index = 0; index < client_count; index++) {
+        struct client* client = &clients[index];
+        client->tree = tree;
+        client->workload = workload;
+        client->deadline = deadline;
+        client->seed = 42 + index;
+        client->keep_cache = settings->keep_cache;
+        client->fd = SYSTEM_CALL_ERROR;
+        // Clients start at different places so that they do not all hit the same file at once
+        client->next_path = (size_t) index * max_macro(tree->file_count / client_count, (size_t) 1);
+        client->buffer = malloc(max_macro(workload->block_size, (size_t) 1));
+        if (client->buffer == NULL) {
+            perror("run_workload: malloc");
+            exit(EXIT_FAILURE);
+        }
+        if (pthread_create(&threads[index], NULL, client_loop, client) != 0) {
+            perror("run_workload: pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    struct latencies all = { 0 };
+    unsigned long long bytes = 0, items = 0, errors = 0;
+    for (unsigned int index = 0; index < client_count; index++) {
+        struct client* client = &clients[index];
+        pthread_join(threads[index], NULL);
+        for (size_t position = 0; position < client->latencies.count; position++) {
+            latencies_add(&all, client->latencies.values[position]);
+        }
+        bytes += client->bytes;
+        items += client->items;
+        errors += client->errors;
+        free(client->latencies.values);
+        free(client->buffer);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    qsort(all.values, all.count, sizeof(unsigned long long), compare_latencies);
+
+    const double seconds = timespec_seconds(&finished) - timespec_seconds(&started);
+    fprintf(settings->output,
+            "{\"label\": \"%s\", \"workload\": \"%s\", \"clients\": %u, \"block_size\": %zu, \"ops\": %zu, "
+            "\"items\": %llu, \"bytes\": %llu, \"errors\": %llu, \"seconds\": %.3f, \"ops_per_second\": %.1f, "
+            "\"mib_per_second\": %.2f, \"p50_us\": %.2f, \"p99_us\": %.2f, \"p999_us\": %.2f}\n",
+            settings->label, workload->name, client_count, workload->block_size, all.count,
+            items, bytes, errors, seconds, (double) all.count / seconds,
+            (double) bytes / (1024.0 * 1024.0) / seconds,
+            latency_quantile_us(&all, 0.50), latency_quantile_us(&all, 0.99), latency_quantile_us(&all, 0.999));
+    fflush(settings->output);
+
+    free(all.values);
+    free(clients);
+    free(threads);
+}
+
+
+/// Whether something is mounted on `path`: its device differs from the one of its parent.
+static int is_mountpoint(const char* path) {
+    char parent[PATH_MAX];
+    struct stat path_stat, parent_stat;
+    snprintf(parent, sizeof(parent), "%s/..", path);
+    return stat(path, &path_stat) != SYSTEM_CALL_ERROR && stat(parent, &parent_stat) != SYSTEM_CALL_ERROR &&
+        path_stat.st_dev != parent_stat.st_dev;
+}
+
+/// Starts the daemon command and waits for its mount. Returns its pid, or SYSTEM_CALL_ERROR when it exits or does
+/// not mount in time.
+static pid_t start_daemon(const struct bench_settings* settings) {
+    const pid_t pid = fork();
+    if (pid == SYSTEM_CALL_ERROR) {
+        perror("start_daemon: fork");
+        return SYSTEM_CALL_ERROR;
+    }
+    if (pid == 0) {
+        execvp(settings->daemon[0], settings->daemon);
+        perror(settings->daemon[0]);
+        _exit(EXIT_FAILURE);
+    }
+
+    const struct timespec poll_interval = { .tv_sec = 0, .tv_nsec = 10 * 1000 * 1000 };
+    for (double waited = 0; waited < MOUNT_TIMEOUT; waited += 0.01) {
+        if (is_mountpoint(settings->mountpoint)) {
+            return pid;
+        }
+        if (waitpid(pid, NULL, WNOHANG) == pid) {
+            fprintf(stderr, "start_daemon: %s exited before mounting\n", settings->daemon[0]);
+            return SYSTEM_CALL_ERROR;
+        }
+        nanosleep(&poll_interval, NULL);
+    }
+
+    fprintf(stderr, "start_daemon: nothing mounted on %s after %.0f s\n", settings->mountpoint, MOUNT_TIMEOUT);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    return SYSTEM_CALL_ERROR;
+}
+
+/// Unmounts with fusermount3, or fusermount for libfuse 2 daemons, and waits for the daemon to exit.
+static void stop_daemon(const struct bench_settings* settings, const pid_t pid) {
+    static const char* unmount_commands[] = { "fusermount3", "fusermount" };
+    for (size_t index = 0; index < sizeof(unmount_commands) / sizeof(unmount_commands[0]); index++) {
+        const pid_t unmount_pid = fork();
+        if (unmount_pid == 0) {
+            execlp(unmount_commands[index], unmount_commands[index], "-u", settings->mountpoint, (char*) NULL);
+            _exit(EXIT_FAILURE);
+        }
+        int status;
+        if (unmount_pid != SYSTEM_CALL_ERROR && waitpid(unmount_pid, &status, 0) == unmount_pid &&
+            WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+            break;
+        }
+    }
+    waitpid(pid, NULL, 0);
+}
+
+
+static void usage(const char* program) {
+    printf("usage: %s [options] <mountpoint> [-- <daemon command>]\n\n", program);
+    printf(
+        "Starts the daemon command in the foreground, waits until it has mounted <mountpoint>, runs every workload on\n"
+        "the files under it, unmounts it and writes one JSON line per workload. Without a command, <mountpoint> must\n"
+        "already be mounted and stays so.\n"
+        "    -t DIR   tree to run on, under the mount (default: <mountpoint>)\n"
+        "    -l NAME  label of the JSON lines (default: the daemon name)\n"
+        "    -d S     seconds per workload (default: %.0f)\n"
+        "    -j N     clients of the concurrent workloads (default: %u)\n"
+        "    -S       run the concurrent workloads at 1, 2, 4... clients up to -j\n"
+        "    -F N     files taken from the tree at most (default: %u)\n"
+        "    -w NAME  only run the named workload, may be repeated\n"
+        "    -c       keep cached pages of the files read instead of dropping them first\n"
+        "    -o FILE  append the JSON lines to FILE instead of stdout\n"
+        "workloads:",
+        DEFAULT_DURATION, DEFAULT_CLIENTS, DEFAULT_MAX_FILES
+    );
+    for (size_t index = 0; index < sizeof(workloads) / sizeof(workloads[0]); index++) {
+        printf(" %s", workloads[index].name);
+    }
+    printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+    struct bench_settings settings = {
+        .duration = DEFAULT_DURATION,
+        .clients = DEFAULT_CLIENTS,
+        .output = stdout,
+    };
+    struct tree tree = { .max_files = DEFAULT_MAX_FILES };
+    const char* selected[sizeof(workloads) / sizeof(workloads[0])];
+    size_t selected_count = 0;
+
+    int option;
+    while ((option = getopt(argc, argv, "+t:l:d:j:F:w:Sco:h")) != -1) {
+        switch (option) {
+            case 't': settings.tree = optarg; break;
+            case 'l': settings.label = optarg; break;
+            case 'd': settings.duration = strtod(optarg, NULL); break;
+            case 'j': settings.clients = (unsigned int) strtoul(optarg, NULL, 0); break;
+            case 'F': tree.max_files = strtoull(optarg, NULL, 0); break;
+            case 'w':
+                if (selected_count < sizeof(selected) / sizeof(selected[0])) {
+                    selected[selected_count++] = optarg;
+                }
+                break;
+            case 'S': settings.scaling = 1; break;
+            case 'c': settings.keep_cache = 1; break;
+            case 'o':
+                settings.output = fopen(optarg, "a");
+                if (settings.output == NULL) {
+                    perror(optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return option == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (optind >= argc || settings.duration <= 0 || settings.clients == 0 || tree.max_files == 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    settings.mountpoint = argv[optind++];
+    if (optind < argc && strcmp(argv[optind], "--") == 0) {
+        optind++;
+    }
+    if (optind < argc) {
+        settings.daemon = &argv[optind];
+    }
+    if (settings.tree == NULL) {
+        settings.tree = settings.mountpoint;
+    }
+    if (settings.label == NULL) {
+        const char* slash = settings.daemon != NULL ? strrchr(settings.daemon[0], '/') : NULL;
+        settings.label = settings.daemon == NULL ? settings.mountpoint : slash != NULL ? slash + 1 : settings.daemon[0];
+    }
+
+    pid_t daemon_pid = SYSTEM_CALL_ERROR;
+    if (settings.daemon != NULL) {
+        if (is_mountpoint(settings.mountpoint)) {
+            fprintf(stderr, "%s: %s is already mounted\n", argv[0], settings.mountpoint);
+            return EXIT_FAILURE;
+        }
+        daemon_pid = start_daemon(&settings);
+        if (daemon_pid == SYSTEM_CALL_ERROR) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    tree_build(&tree, settings.tree);
+    fprintf(stderr, "%s: %zu files (%zu not empty) in %zu directories under %s\n", settings.label,
+            tree.file_count, tree.readable_count, tree.directory_count, settings.tree);
+
+    for (size_t index = 0; index < sizeof(workloads) / sizeof(workloads[0]); index++) {
+        const struct workload* workload = &workloads[index];
+        int wanted = selected_count == 0;
+        for (size_t position = 0; position < selected_count; position++) {
+            wanted |= strcmp(selected[position], workload->name) == 0;
+        }
+        if (!wanted || tree.file_count == 0 || (workload->needs_data && tree.readable_count == 0)) {
+            continue;
+        }
+        if (!workload->concurrent) {
+            run_workload(&settings, &tree, workload, 1);
+            continue;
+        }
+        unsigned int client_count = settings.scaling ? 1 : settings.clients;
+        for (; client_count < settings.clients; client_count *= 2) {
+            run_workload(&settings, &tree, workload, client_count);
+        }
+        run_workload(&settings, &tree, workload, settings.clients);
+    }
+
+    tree_free(&tree);
+    if (daemon_pid != SYSTEM_CALL_ERROR) {
+        stop_daemon(&settings, daemon_pid);
+    }
+    if (settings.output != stdout) {
+        fclose(settings.output);
+    }
+    return EXIT_SUCCESS;
+}
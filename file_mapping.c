@@ -4,119 +4,159 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <unistd.h>
-#include <fcntl.h>
-#include <sys/mman.h>
+#include <getopt.h>
 #include <sys/stat.h>
 
 #include "tosfs.h"
+#include "libtosfs.h"
 
 #define EXAMPLE_FILE_PATH "test_tosfs_files"
 
 #define SYSTEM_CALL_ERROR (-1)
+#define min_macro(x, y) ((x) < (y) ? (x) : (y))
 #define MAX_INODE_NUMBER (TOSFS_BLOCK_SIZE / sizeof(struct tosfs_inode))
 #define MAX_INODE_ENTRY_NUMBER (TOSFS_BLOCK_SIZE / sizeof(struct tosfs_inode))
-#define MAX_NB_DATA_BLOCKS (29)
 #define PRINT_ROW_SIZE (64)
 #define POS_OF_BLOCK_3_IN_DATA_BLOCKS (0)
 #define POS_OF_BLOCK_4_IN_DATA_BLOCKS (1)
+/// stdout is fully buffered in this many bytes, and every dump formats whole rows before writing them
+#define OUTPUT_BUFFER_SIZE (1024 * 1024)
+#define HEX_ROW_SIZE (16)
+/// Longest row a dump formats: a binary row of PRINT_ROW_SIZE bytes, or a hexdump -C row
+#define DUMP_ROW_CAPACITY (PRINT_ROW_SIZE * 8 + 2)
+/// Inodes the metadata dump loads at once
+#define INODE_BATCH_SIZE (256)
 
 
 struct data_block_structure {
     char data[TOSFS_BLOCK_SIZE];
 };
 
-struct mapped_file_struct {
-    int fd;
-    void* mapped_file;
-    struct stat file_info;
+/// Image to display, the first argument or test_tosfs_files of the working directory
+static const char* image_path = EXAMPLE_FILE_PATH;
+/// Bytes of each window when the image is walked through windows (--window), 0 to map it whole
+static size_t window_size = 0;
 
-    struct tosfs_superblock* superblock;
-    struct tosfs_inode* inodes;
-    struct tosfs_dentry* root_block;
-    struct data_block_structure* data_blocks;
+enum output_format {
+    OUTPUT_TEXT,
+    OUTPUT_JSON,
+    OUTPUT_CSV,
 };
 
+/// What to dump instead of the whole structure: one inode, or blocks first to last
+struct selection {
+    enum { SELECT_INODE, SELECT_BLOCKS } kind;
+    unsigned int first;
+    unsigned int last;
+};
 
-struct mapped_file_struct* map_example_file() {
-    struct mapped_file_struct* mapped_file = malloc(sizeof(struct mapped_file_struct));
+/// Eight '0'/'1' characters and two hex digits per byte value, filled once by init_dump_tables
+static char binary_digits[256][8];
+static char hex_digits[256][2];
 
-    mapped_file->fd = open(EXAMPLE_FILE_PATH, O_RDONLY);
-    if (mapped_file->fd == SYSTEM_CALL_ERROR) {
-        perror("map_example_file: open");
+struct tosfs_image* map_example_file() {
+    struct tosfs_image* image = malloc(sizeof(struct tosfs_image));
+    if (image == NULL || tosfs_image_open(image, image_path, 0, window_size) == SYSTEM_CALL_ERROR) {
         exit(EXIT_FAILURE);
     }
+    return image;
+}
 
-    if (stat(EXAMPLE_FILE_PATH, &mapped_file->file_info) == SYSTEM_CALL_ERROR) {
-        perror("map_example_file: stat");
+void close_mapped_file(struct tosfs_image* image) {
+    if (tosfs_image_close(image) == SYSTEM_CALL_ERROR) {
         exit(EXIT_FAILURE);
     }
-
-    mapped_file->mapped_file = mmap(
-        NULL,
-        mapped_file->file_info.st_size,
-        PROT_READ,
-        MAP_SHARED,
-        mapped_file->fd,
-        0
-    );
-
-    return mapped_file;
+    free(image);
 }
 
-void close_mapped_file(struct mapped_file_struct* mapped_file) {
-    if (munmap(mapped_file->mapped_file, mapped_file->file_info.st_size) == SYSTEM_CALL_ERROR) {
-        close(mapped_file->fd);
-        perror("close_mapped_file: munmap");
+/// Block of the image, already known to be inside it: only a window that cannot be mapped fails.
+void* block_address(const struct tosfs_image* image, const unsigned int block_no) {
+    void* block = tosfs_block(image, block_no);
+    if (block == NULL) {
+        fprintf(stderr, "block_address: cannot reach block %u\n", block_no);
         exit(EXIT_FAILURE);
     }
-    close(mapped_file->fd);
-    free(mapped_file);
+    return block;
 }
 
-
-void read_mapped_file_as_tosfs_file(struct mapped_file_struct* mapped_file) {
-    void* tmp_ptr = mapped_file->mapped_file;
-
-    mapped_file->superblock = (struct tosfs_superblock*) tmp_ptr;
-    if (mapped_file->superblock->magic != TOSFS_MAGIC) {
-        perror("read_mapped_file_as_tosfs_file: bad magic");
-        exit(EXIT_FAILURE);
-    }
-    if (mapped_file->superblock->inodes > MAX_INODE_NUMBER) {
-        perror("read_mapped_file_as_tosfs_file: too many inodes");
+void read_mapped_file_as_tosfs_file(struct tosfs_image* image) {
+    if (tosfs_image_read(image) == SYSTEM_CALL_ERROR) {
         exit(EXIT_FAILURE);
     }
+}
 
-    tmp_ptr += TOSFS_BLOCK_SIZE;
-    mapped_file->inodes = (struct tosfs_inode*) tmp_ptr;
-
-    tmp_ptr += TOSFS_BLOCK_SIZE;
-    mapped_file->root_block = (struct tosfs_dentry*) tmp_ptr;
-
-    tmp_ptr += TOSFS_BLOCK_SIZE;
-    mapped_file->data_blocks = (struct data_block_structure*) tmp_ptr;
+/// The root dentries live in block 2 of a v1 image, and in the first block of the root inode of a v2 one.
+unsigned int root_block_no(const struct tosfs_image* image) {
+    if (image->version == TOSFS_VERSION_1) {
+        return TOSFS_ROOT_BLOCK;
+    }
+    return tosfs_extent_at(image, image->superblock->root_inode, 0).start;
 }
 
 
-void disp_structure_tosfs_superblock(const struct mapped_file_struct* mapped_file) {
-    const struct tosfs_superblock* superblock = mapped_file->superblock;
+void disp_structure_tosfs_superblock(const struct tosfs_image* image) {
+    const struct tosfs_superblock* superblock = image->superblock;
 
     printf(
         "Reading mapped file as tosfs_superblock:"
         "\n\tmagic: %d"     "\n\tblock_bitmap: %d"      "\n\tinode_bitmap: %d"      "\n\tblock_size: %d"
-        "\n\tblocks: %d"    "\n\tinodes: %d"            "\n\troot_inode: %d"        "\n",
+        "\n\tblocks: %d"    "\n\tinodes: %d"            "\n\troot_inode: %d"        "\n\tversion: %d"
+        "\n",
         superblock->magic,  superblock->block_bitmap,   superblock->inode_bitmap,   superblock->block_size,
-        superblock->blocks, superblock->inodes,         superblock->root_inode
+        superblock->blocks, superblock->inodes,         superblock->root_inode,     superblock->version
     );
+    if (superblock->version == TOSFS_VERSION_2 && superblock->block_bitmap_blocks != 0) {
+        printf(
+            "\tblock_bitmap: blocks %d to %d"  "\n\tinode_bitmap: blocks %d to %d"  "\n\tinode_table: blocks %d to %d"
+            "\n",
+            superblock->block_bitmap_start, superblock->block_bitmap_start + superblock->block_bitmap_blocks - 1,
+            superblock->inode_bitmap_start, superblock->inode_bitmap_start + superblock->inode_bitmap_blocks - 1,
+            superblock->inode_table_start,  superblock->inode_table_start + superblock->inode_table_blocks - 1
+        );
+    }
+}
+
+void disp_structure_tosfs_inode_v2(const struct tosfs_image* image) {
+    // Freed inodes leave holes in the table, so every slot is visited and the free ones skipped
+    for (unsigned int i = 1; i < image->inode_table_capacity; i++) {
+        const struct tosfs_inode_v2* inode = tosfs_inode_v2(image, i);
+        if (inode == NULL || inode->inode == 0) {
+            continue;
+        }
+        printf(
+            "Reading node nb %u:"
+            "\n\tinode: %d" "\n\tuid: %d"   "\n\tgid: %d"   "\n\tmode: %d"  "\n\tperm: %d"
+            "\n\tnlink: %d" "\n\tsize: %llu" "\n\tnr_extents: %d" "\n\textent_block: %d" "\n\tflags: %d" "\n",
+            i,
+            inode->inode,   inode->uid,     inode->gid,     inode->mode,    inode->perm,
+            inode->nlink,   (unsigned long long) inode->size,   inode->nr_extents,  inode->extent_block,    inode->flags
+        );
+
+        const unsigned int extent_count = tosfs_extent_count(image, i);
+        for (unsigned int index = 0; index < extent_count; index++) {
+            const struct tosfs_extent extent = tosfs_extent_at(image, i, index);
+            printf("\textent %u: blocks %u to %u\n", index, extent.start, extent.start + extent.length - 1);
+        }
+    }
 }
 
-void disp_structure_tosfs_inode(const struct mapped_file_struct* mapped_file) {
-    const unsigned int root_inode_number = mapped_file->superblock->root_inode;
-    const unsigned int last_inode_number = root_inode_number + mapped_file->superblock->inodes;
+void disp_structure_tosfs_inode(const struct tosfs_image* image) {
+    if (image->superblock->version == TOSFS_VERSION_2) {
+        disp_structure_tosfs_inode_v2(image);
+        return;
+    }
+
+    const unsigned int root_inode_number = image->superblock->root_inode;
+    const unsigned int last_inode_number = root_inode_number + image->superblock->inodes;
 
     for (unsigned int i = root_inode_number; i < last_inode_number; i++) {
-        const struct tosfs_inode* inode = &mapped_file->inodes[i];
+        const struct tosfs_inode* inode = tosfs_inode_v1(image, i);
+        if (inode == NULL) {
+            break;
+        }
         printf(
             "Reading node nb %u:"
             "\n\tinode: %d" "\n\tblock_no: %d"  "\n\tuid: %d"   "\n\tgid: %d"   "\n\tmode: %d"
@@ -147,44 +187,138 @@ void disp_structure_block_tosfs_dentry(const struct tosfs_dentry* disk_entry) {
     }
 }
 
-void disp_data_block(const struct data_block_structure* data_block) {
-    printf(
-        "\tdata block as str:\n%s\n",
-        data_block->data
-    );
-    printf(
-        "\tdata block as binary:"
-    );
+void init_dump_tables() {
+    static const char hex[] = "0123456789abcdef";
+    for (unsigned int byte = 0; byte < 256; byte++) {
+        for (unsigned int bit = 0; bit < 8; bit++) {
+            binary_digits[byte][bit] = (byte & (0x80u >> bit)) ? '1' : '0';
+        }
+        hex_digits[byte][0] = hex[byte >> 4];
+        hex_digits[byte][1] = hex[byte & 0xf];
+    }
+}
 
-    for (unsigned int i = 0; i < TOSFS_BLOCK_SIZE; i++) {
-        if (i % PRINT_ROW_SIZE == 0) {
-            printf("\n");
+/// Rows of PRINT_ROW_SIZE bytes, each byte as eight binary digits, each row written at once.
+void dump_binary(const unsigned char* data, const size_t length) {
+    char row[DUMP_ROW_CAPACITY];
+    for (size_t row_start = 0; row_start < length; row_start += PRINT_ROW_SIZE) {
+        const size_t row_length = length - row_start < PRINT_ROW_SIZE ? length - row_start : PRINT_ROW_SIZE;
+        char* cursor = row;
+        *cursor++ = '\n';
+        for (size_t i = 0; i < row_length; i++) {
+            memcpy(cursor, binary_digits[data[row_start + i]], 8);
+            cursor += 8;
         }
-        const char byte_to_print = data_block->data[i];
-        printf(PRINTF_BINARY_PATTERN_INT8, PRINTF_BYTE_TO_BINARY_INT8(byte_to_print));
+        fwrite_unlocked(row, 1, cursor - row, stdout);
     }
 }
 
-void disp_structure_all_data_blocks(const struct mapped_file_struct* mapped_file) {
-    for (unsigned int block_number = 0; block_number < MAX_NB_DATA_BLOCKS; block_number++) {
-        printf(
-            "Data block nb %u:\n"
-            "%s",
-            block_number,
-            (const char*)&mapped_file->data_blocks[block_number]
-        );
+/// hexdump -C rows of HEX_ROW_SIZE bytes, numbered from `offset`. Rows repeating the previous one are folded into
+/// a single "*", so that the empty tail of a block costs one line.
+void dump_hex(const unsigned char* data, const size_t length, const unsigned long long offset) {
+    char row[DUMP_ROW_CAPACITY];
+    int folding = 0;
+
+    for (size_t row_start = 0; row_start < length; row_start += HEX_ROW_SIZE) {
+        const size_t row_length = length - row_start < HEX_ROW_SIZE ? length - row_start : HEX_ROW_SIZE;
+        if (row_start > 0 && row_length == HEX_ROW_SIZE &&
+            memcmp(data + row_start, data + row_start - HEX_ROW_SIZE, HEX_ROW_SIZE) == 0) {
+            if (!folding) {
+                fwrite_unlocked("*\n", 1, 2, stdout);
+                folding = 1;
+            }
+            continue;
+        }
+        folding = 0;
+
+        const unsigned long long row_offset = offset + row_start;
+        char* cursor = row;
+        for (int shift = 56; shift >= 0; shift -= 8) {
+            memcpy(cursor, hex_digits[(row_offset >> shift) & 0xff], 2);
+            cursor += 2;
+        }
+        *cursor++ = ' ';
+        for (size_t i = 0; i < HEX_ROW_SIZE; i++) {
+            *cursor++ = ' ';
+            if (i == HEX_ROW_SIZE / 2) {
+                *cursor++ = ' ';
+            }
+            if (i < row_length) {
+                memcpy(cursor, hex_digits[data[row_start + i]], 2);
+            } else {
+                memcpy(cursor, "  ", 2);
+            }
+            cursor += 2;
+        }
+        memcpy(cursor, "  |", 3);
+        cursor += 3;
+        for (size_t i = 0; i < row_length; i++) {
+            const unsigned char byte = data[row_start + i];
+            *cursor++ = byte >= 0x20 && byte < 0x7f ? (char) byte : '.';
+        }
+        *cursor++ = '|';
+        *cursor++ = '\n';
+        fwrite_unlocked(row, 1, cursor - row, stdout);
+    }
+    if (folding || length == 0) {
+        printf("%016llx\n", offset + length);
     }
 }
 
-void disp_structure_tosfs_dentry(const struct mapped_file_struct* mapped_file) {
-    const unsigned int root_inode_number = mapped_file->superblock->root_inode;
-    const unsigned int last_inode_number = root_inode_number + mapped_file->superblock->inodes;
+void disp_data_block(const struct data_block_structure* data_block) {
+    // A block is only a string up to its first NUL, and not at all when it has none
+    printf("\tdata block as str:\n");
+    fwrite_unlocked(data_block->data, 1, strnlen(data_block->data, TOSFS_BLOCK_SIZE), stdout);
+    printf("\n\tdata block as binary:");
+    dump_binary((const unsigned char*) data_block->data, TOSFS_BLOCK_SIZE);
+}
+
+/// Blocks of a batch, each as hexdump -C rows after its number.
+int disp_hex_blocks(const char* data, const __u32 block_no, const __u32 blocks, void* arg) {
+    (void) arg;
+    for (__u32 block = 0; block < blocks; block++) {
+        printf("Block %u:\n", block_no + block);
+        dump_hex((const unsigned char*) data + (size_t) block * TOSFS_BLOCK_SIZE, TOSFS_BLOCK_SIZE,
+                 (unsigned long long) (block_no + block) * TOSFS_BLOCK_SIZE);
+    }
+    return 0;
+}
+
+int disp_binary_blocks(const char* data, const __u32 block_no, const __u32 blocks, void* arg) {
+    (void) arg;
+    for (__u32 block = 0; block < blocks; block++) {
+        printf("Block %u:\n", block_no + block);
+        dump_binary((const unsigned char*) data + (size_t) block * TOSFS_BLOCK_SIZE, TOSFS_BLOCK_SIZE);
+        putchar_unlocked('\n');
+    }
+    return 0;
+}
+
+/// Every block past the metadata up to the last one the superblock declares.
+void disp_structure_all_data_blocks(const struct tosfs_image* image) {
+    if (image->metadata_blocks < image->block_count) {
+        tosfs_for_each_block(image, image->metadata_blocks, image->block_count - image->metadata_blocks, disp_hex_blocks, NULL);
+    }
+}
+
+void disp_structure_tosfs_dentry(const struct tosfs_image* image) {
+    if (image->superblock->version != TOSFS_VERSION_1) {
+        // v2 inodes have no block_no, the root block listing covers their dentries
+        disp_structure_block_tosfs_dentry(block_address(image, root_block_no(image)));
+        return;
+    }
+
+    const unsigned int root_inode_number = image->superblock->root_inode;
+    const unsigned int last_inode_number = root_inode_number + image->superblock->inodes;
 
     for (unsigned int i = root_inode_number; i < last_inode_number; i++) {
-        const struct tosfs_inode* inode = &mapped_file->inodes[i];
+        const struct tosfs_inode* inode = tosfs_inode_v1(image, i);
+        if (inode == NULL) {
+            break;
+        }
         const unsigned int block_number = inode->block_no;
 
-        const struct tosfs_dentry* disk_entry = &mapped_file->root_block[block_number];
+        const struct tosfs_dentry* disk_entry = (const struct tosfs_dentry*) block_address(image, root_block_no(image)) + block_number;
         printf(
             "Reading disk entry nb %u:"
             "\n\tinode: %d"
@@ -198,48 +332,408 @@ void disp_structure_tosfs_dentry(const struct mapped_file_struct* mapped_file) {
 }
 
 
-void disp_structures_tosfs() {
-    struct mapped_file_struct* mapped_file = map_example_file();
-    read_mapped_file_as_tosfs_file(mapped_file);
+typedef void (*dentry_visitor)(const struct tosfs_image* image, unsigned int dir,
+                               const struct tosfs_dentry* entry, void* arg);
 
-    printf("\n----------------------------------------------\nSuperblock is:\n");
-    disp_structure_tosfs_superblock(mapped_file);
-    printf("\n----------------------------------------------\nInode map is:\n");
-    disp_structure_tosfs_inode(mapped_file);
-    printf("\n----------------------------------------------\nRoot block is:\n");
-    disp_structure_block_tosfs_dentry(mapped_file->root_block);
-    printf("\n----------------------------------------------\nData block 3 is:\n");
-    disp_data_block(&mapped_file->data_blocks[POS_OF_BLOCK_3_IN_DATA_BLOCKS]);
-    printf("\n----------------------------------------------\nData block 4 is:\n");
-    disp_data_block(&mapped_file->data_blocks[POS_OF_BLOCK_4_IN_DATA_BLOCKS]);
-    printf("\n----------------------------------------------\n");
-
-    close_mapped_file(mapped_file);
+/// Calls `visit` on every live entry of a directory. Visitors must not reach the image: the block holding the
+/// entry may sit in a window.
+void for_each_dentry(const struct tosfs_image* image, const unsigned int dir, const dentry_visitor visit, void* arg) {
+    struct tosfs_dentry_cursor cursor;
+    tosfs_dentry_cursor_init(image, &cursor, dir);
+    const struct tosfs_dentry* entry;
+    while ((entry = tosfs_dentry_next(image, &cursor)) != NULL) {
+        visit(image, dir, entry, arg);
+    }
 }
 
-int main(int argc, char *argv[]) {
-    printf(
-        "\nINFO: tosfs can support %lu inodes and %lu inode entries\n",
-        MAX_INODE_NUMBER, MAX_INODE_ENTRY_NUMBER
-    );
+/// Writes `name` as a JSON string, or as a CSV field when `csv` is set.
+void print_quoted_name(const char* name, const int csv) {
+    putchar_unlocked('"');
+    for (unsigned int i = 0; i < TOSFS_MAX_NAME_LENGTH && name[i] != '\0'; i++) {
+        const unsigned char c = (unsigned char) name[i];
+        if (csv) {
+            if (c == '"') {
+                putchar_unlocked('"');
+            }
+            putchar_unlocked(c);
+        } else if (c == '"' || c == '\\') {
+            putchar_unlocked('\\');
+            putchar_unlocked(c);
+        } else if (c < 0x20) {
+            printf("\\u%04x", c);
+        } else {
+            putchar_unlocked(c);
+        }
+    }
+    putchar_unlocked('"');
+}
 
-    disp_structures_tosfs();
+void disp_text_dentry(const struct tosfs_image* image, const unsigned int dir, const struct tosfs_dentry* entry, void* arg) {
+    (void) image;
+    (void) dir;
+    (void) arg;
+    printf("\t%10u  %.*s\n", entry->inode, TOSFS_MAX_NAME_LENGTH, entry->name);
+}
 
-    return EXIT_SUCCESS;
+/// Content of a compressed file, decompressed a block at a time.
+void disp_compressed_dump(const struct tosfs_image* image, const unsigned int ino, const unsigned long long size, const int binary) {
+    unsigned char data[TOSFS_BLOCK_SIZE];
+    for (unsigned long long offset = 0; offset < size; offset += TOSFS_BLOCK_SIZE) {
+        const long length = tosfs_read_compressed_block(image, ino, (__u32) (offset / TOSFS_BLOCK_SIZE), data);
+        if (length < 0) {
+            fprintf(stderr, "disp_compressed_dump: block %llu of inode %u is corrupted\n", offset / TOSFS_BLOCK_SIZE, ino);
+            exit(EXIT_FAILURE);
+        }
+        if (binary) {
+            dump_binary(data, (size_t) length);
+        } else {
+            dump_hex(data, (size_t) length, offset);
+        }
+    }
+    if (binary && size > 0) {
+        putchar_unlocked('\n');
+    }
 }
 
+/// Attributes and runs of an inode, then its entries for a directory or its content for a file.
+void disp_inode_dump(const struct tosfs_image* image, const unsigned int ino, const int binary) {
+    struct tosfs_attributes attributes;
+    if (tosfs_inode_load(image, ino, &attributes) == SYSTEM_CALL_ERROR) {
+        printf("Inode %u: free or outside the inode table\n", ino);
+        return;
+    }
+    const int compressed = tosfs_inode_compressed(image, ino);
+    printf("Inode %u: mode %o, nlink %u, size %llu%s\n", ino, attributes.mode, attributes.nlink,
+           (unsigned long long) attributes.size, compressed ? ", compressed" : "");
+
+    const unsigned int extent_count = tosfs_extent_count(image, ino);
+    for (unsigned int index = 0; index < extent_count; index++) {
+        const struct tosfs_extent run = tosfs_extent_at(image, ino, index);
+        printf("\trun %u: blocks %u to %u%s\n", index, run.start, run.start + run.length - 1,
+               tosfs_range_valid(image, run.start, run.length) ? "" : " (outside the image)");
+    }
 
+    if (tosfs_is_directory(image, ino, &attributes)) {
+        printf("\tentries:\n");
+        for_each_dentry(image, ino, disp_text_dentry, NULL);
+        return;
+    }
+    if (compressed) {
+        disp_compressed_dump(image, ino, attributes.size, binary);
+        return;
+    }
 
+    // The content, span after span, each split where windows end
+    struct tosfs_span* spans = malloc((extent_count + 1) * sizeof(struct tosfs_span));
+    const size_t span_count = spans == NULL ? 0 : tosfs_inode_spans(image, ino, 0, attributes.size, spans, extent_count + 1);
+    for (size_t index = 0; index < span_count; index++) {
+        for (unsigned long long done = 0; done < spans[index].length;) {
+            const unsigned long long position = spans[index].position + done;
+            const unsigned int in_block = position % TOSFS_BLOCK_SIZE;
+            const unsigned long long wanted_blocks = (in_block + spans[index].length - done + TOSFS_BLOCK_SIZE - 1) / TOSFS_BLOCK_SIZE;
+            __u32 available;
+            const unsigned char* data = tosfs_blocks(image, position / TOSFS_BLOCK_SIZE,
+                                                     (__u32) min_macro(wanted_blocks, (unsigned long long) UINT32_MAX), &available);
+            if (data == NULL) {
+                fprintf(stderr, "disp_inode_dump: cannot reach block %llu\n", position / TOSFS_BLOCK_SIZE);
+                exit(EXIT_FAILURE);
+            }
+            const size_t length = min_macro((unsigned long long) available * TOSFS_BLOCK_SIZE - in_block, spans[index].length - done);
+            if (binary) {
+                dump_binary(data + in_block, length);
+            } else {
+                dump_hex(data + in_block, length, spans[index].file_offset + done);
+            }
+            done += length;
+        }
+    }
+    if (binary && span_count > 0) {
+        putchar_unlocked('\n');
+    }
+    free(spans);
+}
 
+/// Blocks first to last, in batches, then a single line for those past the end of the image.
+void disp_block_range(const struct tosfs_image* image, const unsigned int first, const unsigned int last, const int binary) {
+    if (first < image->file_blocks) {
+        const unsigned int last_in_image = (unsigned int) min_macro((unsigned long long) last, image->file_blocks - 1);
+        if (tosfs_for_each_block(image, first, last_in_image - first + 1, binary ? disp_binary_blocks : disp_hex_blocks, NULL) != 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (last >= image->file_blocks) {
+        const unsigned long long first_outside = first < image->file_blocks ? image->file_blocks : first;
+        if (first_outside == last) {
+            printf("Block %u: outside the image\n", last);
+        } else {
+            printf("Blocks %llu to %u: outside the image\n", first_outside, last);
+        }
+    }
+}
 
+/// Whether the metadata dump covers `ino`: every inode, or only the selected ones.
+int inode_selected(const struct selection* selections, const unsigned int selection_count, const unsigned int ino) {
+    if (selection_count == 0) {
+        return 1;
+    }
+    for (unsigned int index = 0; index < selection_count; index++) {
+        if (selections[index].kind == SELECT_INODE && selections[index].first == ino) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+struct dentry_output {
+    enum output_format format;
+    unsigned long long count;
+};
+
+void disp_metadata_dentry(const struct tosfs_image* image, const unsigned int dir, const struct tosfs_dentry* entry, void* arg) {
+    (void) image;
+    struct dentry_output* output = arg;
+    if (output->format == OUTPUT_JSON) {
+        printf("%s\n    {\"directory\": %u, \"inode\": %u, \"name\": ", output->count == 0 ? "" : ",", dir, entry->inode);
+        print_quoted_name(entry->name, 0);
+        putchar_unlocked('}');
+    } else {
+        printf("dentry,%u,,,,,,,,,%u,", entry->inode, dir);
+        print_quoted_name(entry->name, 1);
+        putchar_unlocked('\n');
+    }
+    output->count++;
+}
 
+/// Superblock, inodes and directory entries as one JSON document, or as CSV rows whose first column tells an
+/// inode from a dentry, after the superblock as `#` comment lines.
+void disp_metadata(const struct tosfs_image* image, const enum output_format format,
+                   const struct selection* selections, const unsigned int selection_count) {
+    const struct tosfs_superblock* superblock = image->superblock;
+    const int json = format == OUTPUT_JSON;
+    const char* const fields[] = {
+        "magic", "block_bitmap", "inode_bitmap", "block_size", "blocks", "inodes", "root_inode", "version",
+        "block_bitmap_start", "block_bitmap_blocks", "inode_bitmap_start", "inode_bitmap_blocks",
+        "inode_table_start", "inode_table_blocks",
+    };
+    const __u32* values = (const __u32*) superblock;
+
+    printf(json ? "{\"superblock\": {" : "");
+    for (unsigned int field = 0; field < sizeof(fields) / sizeof(fields[0]); field++) {
+        printf(json ? "%s\"%s\": %u" : "%s# %s=%u\n", json && field > 0 ? ", " : "", fields[field], values[field]);
+    }
+    printf(json ? "},\n  \"inodes\": [" : "record,inode,mode,perm,uid,gid,nlink,size,runs,blocks,directory,name\n");
+
+    // Selected inodes go through the table a batch at a time, and the directories among them are kept for the
+    // entries that follow
+    __u32 inos[INODE_BATCH_SIZE];
+    struct tosfs_attributes attributes[INODE_BATCH_SIZE];
+    __u32* directories = NULL;
+    size_t directory_count = 0, directory_capacity = 0;
+    unsigned long long inode_count = 0;
+    for (unsigned int batch_start = 1; batch_start < image->inode_table_capacity; batch_start += INODE_BATCH_SIZE) {
+        size_t batch_count = 0;
+        for (unsigned int ino = batch_start; ino < image->inode_table_capacity && ino - batch_start < INODE_BATCH_SIZE; ino++) {
+            if (inode_selected(selections, selection_count, ino)) {
+                inos[batch_count++] = ino;
+            }
+        }
+        if (tosfs_inode_load_many(image, inos, batch_count, attributes) == 0) {
+            continue;
+        }
 
+        for (size_t index = 0; index < batch_count; index++) {
+            const unsigned int ino = inos[index];
+            const struct tosfs_attributes* inode = &attributes[index];
+            if (inode->inode == 0) {
+                continue;
+            }
+            if (tosfs_is_directory(image, ino, inode)) {
+                if (directory_count == directory_capacity) {
+                    directory_capacity = directory_capacity == 0 ? INODE_BATCH_SIZE : 2 * directory_capacity;
+                    directories = realloc(directories, directory_capacity * sizeof(__u32));
+                    if (directories == NULL) {
+                        perror("disp_metadata: realloc");
+                        exit(EXIT_FAILURE);
+                    }
+                }
+                directories[directory_count++] = ino;
+            }
+
+            const unsigned int extent_count = tosfs_extent_count(image, ino);
+            if (json) {
+                printf("%s\n    {\"inode\": %u, \"mode\": %u, \"perm\": %u, \"uid\": %u, \"gid\": %u, \"nlink\": %u, "
+                       "\"size\": %llu, \"runs\": [", inode_count == 0 ? "" : ",", ino, inode->mode, inode->perm,
+                       inode->uid, inode->gid, inode->nlink, (unsigned long long) inode->size);
+                for (unsigned int run_index = 0; run_index < extent_count; run_index++) {
+                    const struct tosfs_extent run = tosfs_extent_at(image, ino, run_index);
+                    printf("%s[%u, %u]", run_index == 0 ? "" : ", ", run.start, run.length);
+                }
+                printf("]}");
+            } else {
+                unsigned long long blocks = 0;
+                for (unsigned int run_index = 0; run_index < extent_count; run_index++) {
+                    blocks += tosfs_extent_at(image, ino, run_index).length;
+                }
+                printf("inode,%u,%u,%u,%u,%u,%u,%llu,%u,%llu,,\n", ino, inode->mode, inode->perm, inode->uid, inode->gid,
+                       inode->nlink, (unsigned long long) inode->size, extent_count, blocks);
+            }
+            inode_count++;
+        }
+    }
 
+    struct dentry_output output = { .format = format };
+    printf(json ? "\n  ],\n  \"dentries\": [" : "");
+    for (size_t index = 0; index < directory_count; index++) {
+        for_each_dentry(image, directories[index], disp_metadata_dentry, &output);
+    }
+    printf(json ? "\n  ]\n}\n" : "");
+    free(directories);
+}
 
+void disp_structures_tosfs() {
+    struct tosfs_image* image = map_example_file();
+    read_mapped_file_as_tosfs_file(image);
 
+    printf("\n----------------------------------------------\nSuperblock is:\n");
+    disp_structure_tosfs_superblock(image);
+    printf("\n----------------------------------------------\nInode map is:\n");
+    disp_structure_tosfs_inode(image);
+    printf("\n----------------------------------------------\nRoot block is:\n");
+    disp_structure_block_tosfs_dentry(block_address(image, root_block_no(image)));
+    printf("\n----------------------------------------------\nData block 3 is:\n");
+    disp_data_block(block_address(image, TOSFS_ROOT_BLOCK + 1 + POS_OF_BLOCK_3_IN_DATA_BLOCKS));
+    printf("\n----------------------------------------------\nData block 4 is:\n");
+    disp_data_block(block_address(image, TOSFS_ROOT_BLOCK + 1 + POS_OF_BLOCK_4_IN_DATA_BLOCKS));
+    printf("\n----------------------------------------------\n");
 
+    close_mapped_file(image);
+}
 
+/// Bytes in `text`, with an optional K, M or G suffix, rounded up to whole pages and blocks. 0 when malformed.
+size_t parse_window_size(const char* text) {
+    char* end = NULL;
+    unsigned long long bytes = strtoull(text, &end, 0);
+    switch (*end) {
+        case 'G': bytes <<= 10; // fall through
+        case 'M': bytes <<= 10; // fall through
+        case 'K': bytes <<= 10; end++; break;
+        default: break;
+    }
+    if (end == text || *end != '\0' || bytes == 0 || bytes > (1ull << 40)) {
+        return 0;
+    }
+    const unsigned long long page_size = (unsigned long long) sysconf(_SC_PAGESIZE);
+    const unsigned long long alignment = page_size > TOSFS_BLOCK_SIZE ? page_size : TOSFS_BLOCK_SIZE;
+    return (bytes + alignment - 1) / alignment * alignment;
+}
 
+void usage(const char* program) {
+    printf("usage: %s [options] [image]\n\n", program);
+    printf(
+        "Displays the structures of a tosfs image (default: %s).\n"
+        "    --inode N         dump inode N: its attributes, runs, and its entries or its content\n"
+        "    --block N         dump block N\n"
+        "    --range FIRST-LAST  dump blocks FIRST to LAST\n"
+        "    --binary          dump content in binary instead of hexdump -C rows\n"
+        "    --format FORMAT   text, or the superblock, inodes and entries as json or csv\n"
+        "    --window SIZE     map at most %d windows of SIZE bytes (K, M or G) instead of the whole image\n"
+        "Selections repeat and are dumped in order; with json or csv only --inode filters.\n",
+        EXAMPLE_FILE_PATH, TOSFS_WINDOW_SLOTS
+    );
+}
 
+int main(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        { "inode", required_argument, NULL, 'i' },
+        { "block", required_argument, NULL, 'b' },
+        { "range", required_argument, NULL, 'r' },
+        { "binary", no_argument, NULL, 'B' },
+        { "format", required_argument, NULL, 'f' },
+        { "window", required_argument, NULL, 'w' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+    struct selection* selections = calloc(argc, sizeof(struct selection));
+    unsigned int selection_count = 0;
+    enum output_format format = OUTPUT_TEXT;
+    int binary = 0;
+    int option;
+    while ((option = getopt_long(argc, argv, "i:b:r:Bf:w:h", long_options, NULL)) != -1) {
+        struct selection* selection = &selections[selection_count];
+        char* end = NULL;
+        switch (option) {
+            case 'i':
+            case 'b':
+                selection->kind = option == 'i' ? SELECT_INODE : SELECT_BLOCKS;
+                selection->first = selection->last = (unsigned int) strtoul(optarg, &end, 0);
+                break;
+            case 'r':
+                selection->kind = SELECT_BLOCKS;
+                selection->first = (unsigned int) strtoul(optarg, &end, 0);
+                selection->last = *end == '-' ? (unsigned int) strtoul(end + 1, &end, 0) : selection->first;
+                break;
+            case 'B': binary = 1; continue;
+            case 'w':
+                window_size = parse_window_size(optarg);
+                if (window_size == 0) {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                continue;
+            case 'f':
+                if (strcmp(optarg, "json") == 0) {
+                    format = OUTPUT_JSON;
+                } else if (strcmp(optarg, "csv") == 0) {
+                    format = OUTPUT_CSV;
+                } else if (strcmp(optarg, "text") != 0) {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                continue;
+            default:
+                usage(argv[0]);
+                return option == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+        if (end == optarg || *end != '\0' || selection->last < selection->first) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        selection_count++;
+    }
+    if (optind + 1 < argc) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (optind < argc) {
+        image_path = argv[optind];
+    }
 
+    setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+    init_dump_tables();
+    if (format == OUTPUT_TEXT && selection_count == 0) {
+        printf(
+            "\nINFO: tosfs can support %lu inodes and %lu inode entries\n",
+            MAX_INODE_NUMBER, MAX_INODE_ENTRY_NUMBER
+        );
+        disp_structures_tosfs();
+        free(selections);
+        return EXIT_SUCCESS;
+    }
 
+    struct tosfs_image* image = map_example_file();
+    read_mapped_file_as_tosfs_file(image);
+    if (format != OUTPUT_TEXT) {
+        disp_metadata(image, format, selections, selection_count);
+    } else {
+        for (unsigned int index = 0; index < selection_count; index++) {
+            if (selections[index].kind == SELECT_INODE) {
+                disp_inode_dump(image, selections[index].first, binary);
+                continue;
+            }
+            disp_block_range(image, selections[index].first, selections[index].last, binary);
+        }
+    }
+    close_mapped_file(image);
+    free(selections);
+    return EXIT_SUCCESS;
+}
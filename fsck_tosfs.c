@@ -0,0 +1,809 @@
+//
+// fsck.tosfs: checks that a tosfs image is consistent before it gets mounted. Nothing is repaired.
+//
+// The image is mapped read-only and checked in passes, each one split over the threads by inode or block range:
+//  1. inodes: numbering, type, size, extents inside the image and past the metadata, and the block table of the
+//     compressed files. Every block an inode owns is claimed in an in-memory bitmap, so a block claimed twice is
+//     caught as it happens;
+//  2. directories: dots, entries naming live inodes, duplicate names, names outside their hash bucket;
+//  3. links: nlink of every inode against the names found, parent of every directory against its "..";
+//  4. bitmaps: the on-disk block and inode bitmaps against the ones rebuilt above, 64 bits at a time with
+//     popcount, so a multi-GiB image compares in a few milliseconds.
+// Problems are counted per kind and the first ones of each kind are printed. The exit status follows fsck(8):
+// 0 when clean, 4 when problems were found, 8 when the image cannot be read.
+//
+// gcc -Wall -O3 -march=native fsck_tosfs.c -o fsck.tosfs -lpthread
+//
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "libtosfs.h"
+
+#define SYSTEM_CALL_ERROR (-1)
+#define BITMAP_BITS (32)
+#define WORD_BITS (64)
+/// Inodes or blocks a thread takes at once; a multiple of WORD_BITS so that no two threads share a bitmap word
+#define PASS_SLICE (8192)
+#define DEFAULT_MAX_REPORTS (10)
+#define NAMES_MIN_CAPACITY (256)
+#define EXIT_CLEAN (0)
+#define EXIT_UNCORRECTED (4)
+#define EXIT_OPERATIONAL_ERROR (8)
+
+#define min_macro(x, y) ((x) < (y) ? (x) : (y))
+#define max_macro(x, y) ((x) > (y) ? (x) : (y))
+
+
+enum problem {
+    PROBLEM_SUPERBLOCK,
+    PROBLEM_INODE,
+    PROBLEM_EXTENT,
+    PROBLEM_CROSS_LINKED,
+    PROBLEM_DENTRY,
+    PROBLEM_DIRECTORY,
+    PROBLEM_NLINK,
+    PROBLEM_BLOCK_BITMAP,
+    PROBLEM_INODE_BITMAP,
+    /// Kinds from here on are only warnings: the daemon copes with them, and they leave the exit status alone
+    PROBLEM_PLACEMENT,
+    PROBLEM_ORPHAN,
+    PROBLEM_COUNT,
+};
+
+static const char* const problem_names[PROBLEM_COUNT] = {
+    "superblock", "inode", "extent", "cross-linked", "dentry", "directory", "nlink", "block bitmap", "inode bitmap",
+    "placement", "orphan",
+};
+
+static unsigned long long problem_counts[PROBLEM_COUNT];
+static unsigned long long max_reports = DEFAULT_MAX_REPORTS;
+
+/// The image and what the passes rebuild from it. Bit arrays are 64 bit words, set with atomic ORs.
+struct checker {
+    const char* mapped;
+    size_t mapped_size;
+    const struct tosfs_superblock* superblock;
+    __u32 version;
+    /// Blocks both described by the superblock and present in the file
+    __u32 block_count;
+    /// Blocks before this one hold the superblock, the bitmaps and the inode table, and belong to no inode
+    __u32 metadata_end;
+    const __u32* block_bitmap;
+    __u32 block_bitmap_bits;
+    const __u32* inode_bitmap;
+    __u32 inode_bitmap_bits;
+    const void* inode_table;
+    __u32 inode_capacity;
+    __u32 root_inode;
+
+    __u64* owned_blocks;
+    __u64* live_inodes;
+    /// Inodes whose extents cannot be trusted, left out of the directory pass
+    __u64* broken_inodes;
+    /// Names other than the dots pointing at each inode
+    __u32* references;
+    /// Names of subdirectories in each directory
+    __u32* subdirectories;
+    /// Directory holding the name of each directory, and target of its ".."
+    __u32* parents;
+    __u32* dot_dots;
+
+    unsigned long long live_count;
+    unsigned long long directory_count;
+    unsigned long long entry_count;
+    unsigned int threads;
+};
+
+/// Read-only view of a v1 or v2 inode.
+struct inode_view {
+    __u32 inode;
+    __u16 mode;
+    __u16 nlink;
+    __u64 size;
+    __u32 extent_count;
+    const struct tosfs_inode* v1;
+    const struct tosfs_inode_v2* v2;
+};
+
+
+/// Counts a problem, and prints it while fewer than max_reports of its kind were printed.
+static void report(const enum problem problem, const char* format, ...) {
+    const unsigned long long count = __atomic_add_fetch(&problem_counts[problem], 1, __ATOMIC_RELAXED);
+    if (max_reports != 0 && count > max_reports) {
+        return;
+    }
+
+    va_list arguments;
+    va_start(arguments, format);
+    flockfile(stdout);
+    printf("%s: %s: ", problem >= PROBLEM_PLACEMENT ? "warning" : "error", problem_names[problem]);
+    vprintf(format, arguments);
+    putchar('\n');
+    funlockfile(stdout);
+    va_end(arguments);
+}
+
+static int bit_test(const __u64* words, const __u64 bit) {
+    return (__atomic_load_n(&words[bit / WORD_BITS], __ATOMIC_RELAXED) >> (bit % WORD_BITS)) & 1;
+}
+
+static void bit_set(__u64* words, const __u64 bit) {
+    __atomic_fetch_or(&words[bit / WORD_BITS], 1ull << (bit % WORD_BITS), __ATOMIC_RELAXED);
+}
+
+/// Sets the bits [start, start + length) one word at a time. Returns how many of them were already set.
+static __u64 bit_claim_range(__u64* words, __u64 start, const __u64 length) {
+    const __u64 end = start + length;
+    __u64 already_set = 0;
+    while (start < end) {
+        const __u64 word = start / WORD_BITS;
+        const unsigned int first = start % WORD_BITS;
+        const __u64 bits = min_macro(end - start, (__u64) (WORD_BITS - first));
+        const __u64 mask = (bits == WORD_BITS ? ~0ull : ((1ull << bits) - 1)) << first;
+        already_set += __builtin_popcountll(__atomic_fetch_or(&words[word], mask, __ATOMIC_RELAXED) & mask);
+        start += bits;
+    }
+    return already_set;
+}
+
+static const char* block_address(const struct checker* checker, const __u32 block_no) {
+    return checker->mapped + (size_t) block_no * TOSFS_BLOCK_SIZE;
+}
+
+static int block_range_valid(const struct checker* checker, const __u32 start, const __u32 blocks) {
+    return blocks > 0 && start >= checker->metadata_end && start <= checker->block_count &&
+        blocks <= checker->block_count - start;
+}
+
+static void inode_view(const struct checker* checker, const __u32 ino, struct inode_view* view) {
+    memset(view, 0, sizeof(struct inode_view));
+    if (checker->version == TOSFS_VERSION_1) {
+        const struct tosfs_inode* inode = (const struct tosfs_inode*) checker->inode_table + ino;
+        view->v1 = inode;
+        view->inode = inode->inode;
+        view->mode = inode->mode;
+        view->nlink = inode->nlink;
+        view->size = inode->size;
+        view->extent_count = 1;
+        return;
+    }
+
+    const struct tosfs_inode_v2* inode = (const struct tosfs_inode_v2*) checker->inode_table + ino;
+    view->v2 = inode;
+    view->inode = inode->inode;
+    view->mode = inode->mode;
+    view->nlink = inode->nlink;
+    view->size = inode->size;
+    view->extent_count = inode->nr_extents;
+}
+
+/// The index-th run of an inode. The extent block of a v2 inode must have been checked before.
+static struct tosfs_extent inode_extent(const struct checker* checker, const struct inode_view* view, const __u32 index) {
+    if (view->v1 != NULL) {
+        const struct tosfs_extent extent = { .start = view->v1->block_no, .length = 1 };
+        return extent;
+    }
+    if (index < TOSFS_INLINE_EXTENTS) {
+        return view->v2->extents[index];
+    }
+    return ((const struct tosfs_extent*) block_address(checker, view->v2->extent_block))[index - TOSFS_INLINE_EXTENTS];
+}
+
+/// Images built by hand may leave the mode of the root to zero, which the daemon takes for a directory.
+static int is_directory(const struct checker* checker, const __u32 ino, const struct inode_view* view) {
+    return ino == checker->root_inode || S_ISDIR(view->mode);
+}
+
+/// The offset table at the head of a compressed file: offsets[0] right after the table, then each block stored in
+/// at least one byte and at most as many as it holds, and the last offset within the blocks the inode owns.
+static void check_compressed(const struct checker* checker, const __u32 ino, const struct inode_view* view,
+                             const __u64 allocated_blocks) {
+    if (is_directory(checker, ino, view) || view->size == 0 || view->size > UINT32_MAX) {
+        report(PROBLEM_INODE, "inode %u of %llu bytes flagged compressed", ino, (unsigned long long) view->size);
+        return;
+    }
+    const __u64 allocated_bytes = allocated_blocks * TOSFS_BLOCK_SIZE;
+    const __u64 table_size = tosfs_compressed_table_size(view->size);
+    if (table_size > allocated_bytes) {
+        report(PROBLEM_INODE, "inode %u has a %llu byte block table, its blocks hold %llu", ino,
+               (unsigned long long) table_size, (unsigned long long) allocated_bytes);
+        return;
+    }
+
+    const __u32 blocks = (__u32) ((view->size + TOSFS_BLOCK_SIZE - 1) / TOSFS_BLOCK_SIZE);
+    __u64 previous = 0;
+    __u32 entry = 0;
+    for (__u32 index = 0; index < view->extent_count && entry <= blocks; index++) {
+        const struct tosfs_extent extent = inode_extent(checker, view, index);
+        for (__u32 block = 0; block < extent.length && entry <= blocks; block++) {
+            const __u32* offsets = (const __u32*) block_address(checker, extent.start + block);
+            for (__u32 word = 0; word < TOSFS_BLOCK_SIZE / sizeof(__u32) && entry <= blocks; word++, entry++) {
+                const __u64 lowest = entry == 0 ? table_size : previous + 1;
+                const __u64 highest = entry == 0 ? table_size
+                    : previous + min_macro(view->size - (__u64) (entry - 1) * TOSFS_BLOCK_SIZE, (__u64) TOSFS_BLOCK_SIZE);
+                if (offsets[word] < lowest || offsets[word] > highest) {
+                    report(PROBLEM_INODE, "inode %u block table entry %u is %u, expected %llu to %llu", ino, entry,
+                           offsets[word], (unsigned long long) lowest, (unsigned long long) highest);
+                    return;
+                }
+                previous = offsets[word];
+            }
+        }
+    }
+    if (previous > allocated_bytes) {
+        report(PROBLEM_INODE, "inode %u stores %llu compressed bytes, its blocks hold %llu", ino,
+               (unsigned long long) previous, (unsigned long long) allocated_bytes);
+    }
+}
+
+/// Reads the superblock and locates the bitmaps and the inode table. Returns SYSTEM_CALL_ERROR when the image
+/// cannot be checked any further.
+static int check_superblock(struct checker* checker) {
+    if (checker->mapped_size < TOSFS_BLOCK_SIZE) {
+        report(PROBLEM_SUPERBLOCK, "image shorter than one block");
+        return SYSTEM_CALL_ERROR;
+    }
+    const struct tosfs_superblock* superblock = (const struct tosfs_superblock*) checker->mapped;
+    checker->superblock = superblock;
+    if (superblock->magic != TOSFS_MAGIC) {
+        report(PROBLEM_SUPERBLOCK, "bad magic %#x", superblock->magic);
+        return SYSTEM_CALL_ERROR;
+    }
+    if (superblock->version != TOSFS_VERSION_1 && superblock->version != TOSFS_VERSION_2) {
+        report(PROBLEM_SUPERBLOCK, "unknown version %u", superblock->version);
+        return SYSTEM_CALL_ERROR;
+    }
+    if (superblock->block_size != TOSFS_BLOCK_SIZE) {
+        report(PROBLEM_SUPERBLOCK, "block size %u instead of %u", superblock->block_size, TOSFS_BLOCK_SIZE);
+    }
+
+    checker->version = superblock->version;
+    const __u64 file_blocks = checker->mapped_size / TOSFS_BLOCK_SIZE;
+    if (superblock->blocks > file_blocks) {
+        report(PROBLEM_SUPERBLOCK, "%u blocks described, the file only holds %llu", superblock->blocks,
+               (unsigned long long) file_blocks);
+    }
+    checker->block_count = (__u32) min_macro((__u64) superblock->blocks, file_blocks);
+    checker->root_inode = superblock->root_inode;
+
+    if (checker->version == TOSFS_VERSION_1 || superblock->block_bitmap_blocks == 0) {
+        // 32 block layout: both bitmaps are words of the superblock and the inode table is block 1
+        checker->block_bitmap = &superblock->block_bitmap;
+        checker->block_bitmap_bits = min_macro(checker->block_count, (__u32) BITMAP_BITS);
+        checker->inode_capacity = checker->version == TOSFS_VERSION_1 ? TOSFS_INODES_PER_BLOCK : TOSFS_INODES_V2_PER_BLOCK;
+        checker->inode_bitmap = &superblock->inode_bitmap;
+        checker->inode_bitmap_bits = min_macro(checker->inode_capacity, (__u32) BITMAP_BITS);
+        checker->metadata_end = TOSFS_INODE_BLOCK + 1;
+        if (checker->block_count <= TOSFS_INODE_BLOCK) {
+            report(PROBLEM_SUPERBLOCK, "no room for the inode table");
+            return SYSTEM_CALL_ERROR;
+        }
+        checker->inode_table = block_address(checker, TOSFS_INODE_BLOCK);
+    } else {
+        const struct {
+            const char* name;
+            __u32 start;
+            __u32 blocks;
+        } regions[] = {
+            { "block bitmap", superblock->block_bitmap_start, superblock->block_bitmap_blocks },
+            { "inode bitmap", superblock->inode_bitmap_start, superblock->inode_bitmap_blocks },
+            { "inode table", superblock->inode_table_start, superblock->inode_table_blocks },
+        };
+        const unsigned int region_count = sizeof(regions) / sizeof(regions[0]);
+        checker->metadata_end = 1;
+        for (unsigned int region = 0; region < region_count; region++) {
+            if (regions[region].start == TOSFS_SUPERBLOCK || regions[region].blocks == 0 ||
+                (__u64) regions[region].start + regions[region].blocks > checker->block_count) {
+                report(PROBLEM_SUPERBLOCK, "%s region %u+%u outside the image", regions[region].name,
+                       regions[region].start, regions[region].blocks);
+                return SYSTEM_CALL_ERROR;
+            }
+            for (unsigned int other = 0; other < region; other++) {
+                if (regions[region].start < regions[other].start + regions[other].blocks &&
+                    regions[other].start < regions[region].start + regions[region].blocks) {
+                    report(PROBLEM_SUPERBLOCK, "%s and %s regions overlap", regions[other].name, regions[region].name);
+                }
+            }
+            checker->metadata_end = max_macro(checker->metadata_end, regions[region].start + regions[region].blocks);
+        }
+
+        checker->block_bitmap = (const __u32*) block_address(checker, superblock->block_bitmap_start);
+        checker->block_bitmap_bits = (__u32) min_macro((__u64) checker->block_count,
+                                                       (__u64) superblock->block_bitmap_blocks * TOSFS_BITMAP_BLOCK_BITS);
+        if (checker->block_bitmap_bits < checker->block_count) {
+            report(PROBLEM_SUPERBLOCK, "block bitmap covers %u of %u blocks", checker->block_bitmap_bits, checker->block_count);
+        }
+        checker->inode_capacity = (__u32) min_macro(
+            min_macro((__u64) superblock->inode_bitmap_blocks * TOSFS_BITMAP_BLOCK_BITS,
+                      (__u64) superblock->inode_table_blocks * TOSFS_INODES_V2_PER_BLOCK),
+            (__u64) INT32_MAX);
+        checker->inode_bitmap = (const __u32*) block_address(checker, superblock->inode_bitmap_start);
+        checker->inode_bitmap_bits = checker->inode_capacity;
+        checker->inode_table = block_address(checker, superblock->inode_table_start);
+    }
+
+    if (superblock->inodes > checker->inode_capacity) {
+        report(PROBLEM_SUPERBLOCK, "%u inodes counted, the table holds %u", superblock->inodes, checker->inode_capacity);
+    }
+    if (checker->root_inode == 0 || checker->root_inode >= checker->inode_capacity) {
+        report(PROBLEM_SUPERBLOCK, "root inode %u outside the inode table", checker->root_inode);
+        return SYSTEM_CALL_ERROR;
+    }
+    return EXIT_SUCCESS;
+}
+
+
+/// Pass 1: every live inode in [first, end), and the blocks it owns.
+static void check_inodes(struct checker* checker, const __u32 first, const __u32 end) {
+    unsigned long long live = 0;
+    unsigned long long directories = 0;
+
+    for (__u32 ino = max_macro(first, 1u); ino < end; ino++) {
+        struct inode_view view;
+        inode_view(checker, ino, &view);
+        if (view.inode == 0) {
+            continue;
+        }
+        live++;
+        bit_set(checker->live_inodes, ino);
+        if (view.inode != ino) {
+            report(PROBLEM_INODE, "inode %u numbered %u", ino, view.inode);
+        }
+        if (is_directory(checker, ino, &view)) {
+            directories++;
+        } else if (!S_ISREG(view.mode)) {
+            report(PROBLEM_INODE, "inode %u has unknown type %#o", ino, view.mode & S_IFMT);
+        }
+
+        int broken = 0;
+        if (checker->version == TOSFS_VERSION_2 && view.extent_count > TOSFS_MAX_EXTENTS) {
+            report(PROBLEM_EXTENT, "inode %u has %u extents, at most %u fit", ino, view.extent_count, (unsigned int) TOSFS_MAX_EXTENTS);
+            broken = 1;
+        }
+        if (!broken && checker->version == TOSFS_VERSION_2 && view.extent_count > TOSFS_INLINE_EXTENTS) {
+            if (!block_range_valid(checker, view.v2->extent_block, 1)) {
+                report(PROBLEM_EXTENT, "inode %u has its extent block %u outside the data blocks", ino, view.v2->extent_block);
+                broken = 1;
+            } else if (bit_claim_range(checker->owned_blocks, view.v2->extent_block, 1) != 0) {
+                report(PROBLEM_CROSS_LINKED, "extent block %u of inode %u already owned", view.v2->extent_block, ino);
+            }
+        }
+
+        __u64 allocated_blocks = 0;
+        for (__u32 index = 0; !broken && index < view.extent_count; index++) {
+            const struct tosfs_extent extent = inode_extent(checker, &view, index);
+            if (!block_range_valid(checker, extent.start, extent.length)) {
+                report(PROBLEM_EXTENT, "inode %u extent %u covers blocks %u+%u, outside the data blocks", ino, index,
+                       extent.start, extent.length);
+                broken = 1;
+                break;
+            }
+            const __u64 already_owned = bit_claim_range(checker->owned_blocks, extent.start, extent.length);
+            if (already_owned != 0) {
+                report(PROBLEM_CROSS_LINKED, "inode %u extent %u shares %llu of blocks %u+%u with another inode", ino, index,
+                       (unsigned long long) already_owned, extent.start, extent.length);
+            }
+            allocated_blocks += extent.length;
+        }
+        if (broken) {
+            bit_set(checker->broken_inodes, ino);
+            continue;
+        }
+
+        if (view.v2 != NULL && (view.v2->flags & TOSFS_INODE_COMPRESSED)) {
+            check_compressed(checker, ino, &view, allocated_blocks);
+        } else if (view.size > allocated_blocks * TOSFS_BLOCK_SIZE) {
+            report(PROBLEM_INODE, "inode %u is %llu bytes long, its blocks hold %llu", ino, (unsigned long long) view.size,
+                   (unsigned long long) allocated_blocks * TOSFS_BLOCK_SIZE);
+        }
+        if (is_directory(checker, ino, &view) && allocated_blocks == 0) {
+            report(PROBLEM_DIRECTORY, "directory %u owns no block", ino);
+        }
+    }
+
+    __atomic_add_fetch(&checker->live_count, live, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&checker->directory_count, directories, __ATOMIC_RELAXED);
+}
+
+static int compare_names(const void* left, const void* right) {
+    return strncmp(*(const char* const*) left, *(const char* const*) right, TOSFS_MAX_NAME_LENGTH);
+}
+
+/// Names of the directory being checked, sorted to find the duplicates. One list per thread.
+struct name_list {
+    const char** names;
+    size_t count;
+    size_t capacity;
+};
+
+static void name_list_add(struct name_list* list, const char* name) {
+    if (list->count == list->capacity) {
+        const size_t new_capacity = max_macro(2 * list->capacity, (size_t) NAMES_MIN_CAPACITY);
+        const char** new_names = realloc(list->names, new_capacity * sizeof(const char*));
+        if (new_names == NULL) {
+            perror("name_list_add: realloc");
+            exit(EXIT_OPERATIONAL_ERROR);
+        }
+        list->names = new_names;
+        list->capacity = new_capacity;
+    }
+    list->names[list->count++] = name;
+}
+
+/// Pass 2, for one directory: its entries, whose targets are counted for the links pass.
+static void check_directory(struct checker* checker, const __u32 dir, const struct inode_view* view, struct name_list* names) {
+    __u32 allocated_blocks = 0;
+    for (__u32 index = 0; index < view->extent_count; index++) {
+        allocated_blocks += inode_extent(checker, view, index).length;
+    }
+    // The daemon hashes names over the largest power of two of blocks; v1 directories are a single block
+    const __u32 buckets = checker->version == TOSFS_VERSION_1 ? 1 : 1u << (31 - __builtin_clz(allocated_blocks));
+
+    unsigned long long entries = 0;
+    unsigned int dots = 0;
+    __u32 logical_block = 0;
+    names->count = 0;
+    for (__u32 index = 0; index < view->extent_count; index++) {
+        const struct tosfs_extent extent = inode_extent(checker, view, index);
+        for (__u32 block = 0; block < extent.length; block++, logical_block++) {
+            const struct tosfs_dentry* entries_of_block = (const struct tosfs_dentry*) block_address(checker, extent.start + block);
+            for (unsigned int entry_number = 0; entry_number < TOSFS_DENTRIES_PER_BLOCK; entry_number++) {
+                const struct tosfs_dentry* entry = &entries_of_block[entry_number];
+                if (entry->inode == 0) {
+                    continue;
+                }
+                entries++;
+
+                char name[TOSFS_MAX_NAME_LENGTH + 1];
+                memcpy(name, entry->name, TOSFS_MAX_NAME_LENGTH);
+                name[TOSFS_MAX_NAME_LENGTH] = '\0';
+                if (name[0] == '\0') {
+                    report(PROBLEM_DENTRY, "directory %u block %u slot %u names inode %u without a name", dir,
+                           extent.start + block, entry_number, entry->inode);
+                    continue;
+                }
+                name_list_add(names, entry->name);
+                if (checker->version == TOSFS_VERSION_2 && (logical_block >= buckets || (tosfs_name_hash(name) & (buckets - 1)) != logical_block)) {
+                    report(PROBLEM_PLACEMENT, "directory %u holds \"%s\" in block %u instead of %u", dir, name, logical_block,
+                           tosfs_name_hash(name) & (buckets - 1));
+                }
+                if (entry->inode >= checker->inode_capacity || !bit_test(checker->live_inodes, entry->inode)) {
+                    report(PROBLEM_DENTRY, "directory %u names free inode %u \"%s\"", dir, entry->inode, name);
+                    continue;
+                }
+
+                if (strcmp(name, ".") == 0) {
+                    dots++;
+                    if (entry->inode != dir) {
+                        report(PROBLEM_DIRECTORY, "\".\" of directory %u names inode %u", dir, entry->inode);
+                    }
+                    continue;
+                }
+                if (strcmp(name, "..") == 0) {
+                    dots++;
+                    checker->dot_dots[dir] = entry->inode;
+                    continue;
+                }
+
+                __atomic_add_fetch(&checker->references[entry->inode], 1, __ATOMIC_RELAXED);
+                struct inode_view target;
+                inode_view(checker, entry->inode, &target);
+                if (is_directory(checker, entry->inode, &target)) {
+                    checker->subdirectories[dir]++;
+                    __atomic_store_n(&checker->parents[entry->inode], dir, __ATOMIC_RELAXED);
+                }
+            }
+        }
+    }
+    if (dots != 2) {
+        report(PROBLEM_DIRECTORY, "directory %u has %u dot entries instead of 2", dir, dots);
+    }
+
+    qsort(names->names, names->count, sizeof(const char*), compare_names);
+    for (size_t index = 1; index < names->count; index++) {
+        if (compare_names(&names->names[index - 1], &names->names[index]) == 0) {
+            report(PROBLEM_DENTRY, "directory %u holds \"%.*s\" twice", dir, TOSFS_MAX_NAME_LENGTH, names->names[index]);
+        }
+    }
+    __atomic_add_fetch(&checker->entry_count, entries, __ATOMIC_RELAXED);
+}
+
+/// Pass 2: every directory in [first, end) whose extents passed pass 1.
+static void check_directories(struct checker* checker, const __u32 first, const __u32 end) {
+    struct name_list names = { 0 };
+    for (__u32 ino = max_macro(first, 1u); ino < end; ino++) {
+        struct inode_view view;
+        inode_view(checker, ino, &view);
+        if (view.inode != 0 && is_directory(checker, ino, &view) && !bit_test(checker->broken_inodes, ino)) {
+            check_directory(checker, ino, &view, &names);
+        }
+    }
+    free(names.names);
+}
+
+/// Pass 3: nlink of the live inodes in [first, end) against the names found, and the ".." of the directories.
+static void check_links(struct checker* checker, const __u32 first, const __u32 end) {
+    for (__u32 ino = max_macro(first, 1u); ino < end; ino++) {
+        struct inode_view view;
+        inode_view(checker, ino, &view);
+        if (view.inode == 0) {
+            continue;
+        }
+        const __u32 references = checker->references[ino];
+
+        if (!is_directory(checker, ino, &view)) {
+            if (view.nlink == 0 && references == 0) {
+                report(PROBLEM_ORPHAN, "inode %u is unlinked, the daemon reclaims it at the next writable mount", ino);
+            } else if (view.nlink != references) {
+                report(PROBLEM_NLINK, "inode %u has nlink %u and %u names", ino, view.nlink, references);
+            }
+            continue;
+        }
+        if (bit_test(checker->broken_inodes, ino)) {
+            continue;
+        }
+
+        const __u32 expected_references = ino == checker->root_inode ? 0 : 1;
+        const __u32 expected_parent = ino == checker->root_inode ? ino : checker->parents[ino];
+        if (references != expected_references) {
+            report(PROBLEM_DIRECTORY, "directory %u has %u names instead of %u", ino, references, expected_references);
+        }
+        if (checker->dot_dots[ino] != 0 && references <= 1 && checker->dot_dots[ino] != expected_parent) {
+            report(PROBLEM_DIRECTORY, "\"..\" of directory %u names %u, its parent is %u", ino, checker->dot_dots[ino],
+                   expected_parent);
+        }
+        if (view.nlink != 2 + checker->subdirectories[ino]) {
+            report(PROBLEM_NLINK, "directory %u has nlink %u and %u subdirectories", ino, view.nlink,
+                   checker->subdirectories[ino]);
+        }
+    }
+}
+
+/// Bits [64 * word, 64 * word + 64) of an on-disk bitmap, made of 32 bit words. Only the bits below `end` are
+/// read, since a bitmap held in the superblock is a single 32 bit word.
+static __u64 disk_bitmap_word(const __u32* words, const __u64 word, const __u64 end) {
+    const __u64 low = words[2 * word];
+    return 64 * word + BITMAP_BITS < end ? low | (__u64) words[2 * word + 1] << 32 : low;
+}
+
+/// Counts the bits of `mask` in use but free on disk, and free but taken on disk.
+static void count_differences(const __u64 on_disk, const __u64 expected, const __u64 mask,
+                              unsigned long long* missing, unsigned long long* leaked) {
+    *missing += __builtin_popcountll(expected & ~on_disk & mask);
+    *leaked += __builtin_popcountll(on_disk & ~expected & mask);
+}
+
+/// Compares bits [first, end) of an on-disk bitmap with the expected one. The differences are counted 64 bits
+/// at a time with popcount, the inner words in a branch-free loop; they are only located bit by bit while some
+/// are left to print.
+static void compare_bitmap(const __u32* disk, const __u64* expected, const __u64 first, const __u64 end,
+                           const enum problem problem, const char* unit) {
+    if (first >= end) {
+        return;
+    }
+    const __u64 first_word = first / WORD_BITS;
+    const __u64 last_word = (end - 1) / WORD_BITS;
+    const __u64 head_mask = ~0ull << (first % WORD_BITS);
+    const __u64 tail_mask = end % WORD_BITS == 0 ? ~0ull : (1ull << (end % WORD_BITS)) - 1;
+
+    unsigned long long missing = 0;
+    unsigned long long leaked = 0;
+    if (first_word == last_word) {
+        count_differences(disk_bitmap_word(disk, first_word, end), expected[first_word], head_mask & tail_mask, &missing, &leaked);
+    } else {
+        count_differences(disk_bitmap_word(disk, first_word, end), expected[first_word], head_mask, &missing, &leaked);
+        for (__u64 word = first_word + 1; word < last_word; word++) {
+            const __u64 on_disk = (__u64) disk[2 * word] | (__u64) disk[2 * word + 1] << 32;
+            missing += __builtin_popcountll(expected[word] & ~on_disk);
+            leaked += __builtin_popcountll(on_disk & ~expected[word]);
+        }
+        count_differences(disk_bitmap_word(disk, last_word, end), expected[last_word], tail_mask, &missing, &leaked);
+    }
+
+    const unsigned long long differences = missing + leaked;
+    unsigned long long reported = 0;
+    for (__u64 bit = first; bit < end && reported < differences; bit++) {
+        const int on_disk = (disk[bit / BITMAP_BITS] >> (bit % BITMAP_BITS)) & 1;
+        const int wanted = bit_test(expected, bit);
+        if (on_disk == wanted) {
+            continue;
+        }
+        if (max_reports != 0 && __atomic_load_n(&problem_counts[problem], __ATOMIC_RELAXED) >= max_reports) {
+            break;
+        }
+        report(problem, wanted ? "%s %llu in use but free in the bitmap" : "%s %llu free but taken in the bitmap", unit,
+               (unsigned long long) bit);
+        reported++;
+    }
+    __atomic_add_fetch(&problem_counts[problem], differences - reported, __ATOMIC_RELAXED);
+}
+
+/// Pass 4: blocks [first, end) of the block bitmap.
+static void check_block_bitmap(struct checker* checker, const __u32 first, const __u32 end) {
+    compare_bitmap(checker->block_bitmap, checker->owned_blocks, first, min_macro(end, checker->block_bitmap_bits),
+                   PROBLEM_BLOCK_BITMAP, "block");
+}
+
+/// Pass 4: inodes [first, end) of the inode bitmap. Bit 0 never names an inode and is left out.
+static void check_inode_bitmap(struct checker* checker, const __u32 first, const __u32 end) {
+    compare_bitmap(checker->inode_bitmap, checker->live_inodes, max_macro(first, 1u), min_macro(end, checker->inode_bitmap_bits),
+                   PROBLEM_INODE_BITMAP, "inode");
+}
+
+
+typedef void (*pass_function)(struct checker* checker, __u32 first, __u32 end);
+
+struct pass {
+    struct checker* checker;
+    pass_function run;
+    __u32 item_count;
+    __u32 next;
+};
+
+/// Takes slices of the pass until none is left, so that threads that get sparse ranges take more of them.
+static void* pass_worker(void* arg) {
+    struct pass* pass = arg;
+    while (1) {
+        const __u32 first = __atomic_fetch_add(&pass->next, PASS_SLICE, __ATOMIC_RELAXED);
+        if (first >= pass->item_count) {
+            return NULL;
+        }
+        pass->run(pass->checker, first, (__u32) min_macro((__u64) first + PASS_SLICE, (__u64) pass->item_count));
+    }
+}
+
+static void run_pass(struct checker* checker, const pass_function run, const __u32 item_count) {
+    struct pass pass = { .checker = checker, .run = run, .item_count = item_count };
+    const unsigned int threads = (unsigned int) min_macro((__u64) checker->threads, (__u64) item_count / PASS_SLICE + 1);
+    pthread_t workers[threads];
+    unsigned int started = 0;
+    while (started + 1 < threads && pthread_create(&workers[started], NULL, pass_worker, &pass) == 0) {
+        started++;
+    }
+    pass_worker(&pass);
+    for (unsigned int worker = 0; worker < started; worker++) {
+        pthread_join(workers[worker], NULL);
+    }
+}
+
+static __u64* bit_array(const __u64 bits) {
+    __u64* words = calloc(bits / WORD_BITS + 1, sizeof(__u64));
+    if (words == NULL) {
+        perror("bit_array: calloc");
+        exit(EXIT_OPERATIONAL_ERROR);
+    }
+    return words;
+}
+
+static __u32* counter_array(const __u32 count) {
+    __u32* counters = calloc(count, sizeof(__u32));
+    if (counters == NULL) {
+        perror("counter_array: calloc");
+        exit(EXIT_OPERATIONAL_ERROR);
+    }
+    return counters;
+}
+
+static void check_image(struct checker* checker) {
+    checker->owned_blocks = bit_array(checker->block_count);
+    checker->live_inodes = bit_array(checker->inode_capacity);
+    checker->broken_inodes = bit_array(checker->inode_capacity);
+    checker->references = counter_array(checker->inode_capacity);
+    checker->subdirectories = counter_array(checker->inode_capacity);
+    checker->parents = counter_array(checker->inode_capacity);
+    checker->dot_dots = counter_array(checker->inode_capacity);
+    bit_claim_range(checker->owned_blocks, TOSFS_SUPERBLOCK, checker->metadata_end);
+
+    run_pass(checker, check_inodes, checker->inode_capacity);
+    if (!bit_test(checker->live_inodes, checker->root_inode)) {
+        report(PROBLEM_SUPERBLOCK, "root inode %u is free", checker->root_inode);
+    }
+    if (checker->superblock->inodes != checker->live_count) {
+        report(PROBLEM_SUPERBLOCK, "%u inodes counted, %llu in use", checker->superblock->inodes, checker->live_count);
+    }
+    run_pass(checker, check_directories, checker->inode_capacity);
+    run_pass(checker, check_links, checker->inode_capacity);
+    run_pass(checker, check_block_bitmap, checker->block_count);
+    run_pass(checker, check_inode_bitmap, checker->inode_capacity);
+
+    free(checker->owned_blocks);
+    free(checker->live_inodes);
+    free(checker->broken_inodes);
+    free(checker->references);
+    free(checker->subdirectories);
+    free(checker->parents);
+    free(checker->dot_dots);
+}
+
+
+static void usage(const char* program) {
+    printf("usage: %s [options] image\n\n", program);
+    printf(
+        "Checks a tosfs image without changing it. Exits with 0 when it is clean, 4 when it is not, 8 when it\n"
+        "cannot be read.\n"
+        "    -j N    threads (default: online processors)\n"
+        "    -m N    problems printed per kind, 0 for all (default: %u)\n",
+        DEFAULT_MAX_REPORTS
+    );
+}
+
+int main(int argc, char *argv[]) {
+    struct checker checker = { .threads = (unsigned int) max_macro(sysconf(_SC_NPROCESSORS_ONLN), 1L) };
+    int option;
+    while ((option = getopt(argc, argv, "j:m:h")) != -1) {
+        switch (option) {
+            case 'j': checker.threads = (unsigned int) strtoul(optarg, NULL, 0); break;
+            case 'm': max_reports = strtoull(optarg, NULL, 0); break;
+            default:
+                usage(argv[0]);
+                return option == 'h' ? EXIT_CLEAN : EXIT_OPERATIONAL_ERROR;
+        }
+    }
+    if (checker.threads == 0 || optind + 1 != argc) {
+        usage(argv[0]);
+        return EXIT_OPERATIONAL_ERROR;
+    }
+
+    struct timespec started, finished;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    const char* path = argv[optind];
+    const int fd = open(path, O_RDONLY);
+    struct stat file_info;
+    if (fd == SYSTEM_CALL_ERROR || fstat(fd, &file_info) == SYSTEM_CALL_ERROR) {
+        perror(path);
+        return EXIT_OPERATIONAL_ERROR;
+    }
+    checker.mapped_size = (size_t) file_info.st_size;
+    checker.mapped = checker.mapped_size == 0 ? NULL : mmap(NULL, checker.mapped_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (checker.mapped == MAP_FAILED) {
+        perror("mmap");
+        return EXIT_OPERATIONAL_ERROR;
+    }
+
+    if (check_superblock(&checker) == EXIT_SUCCESS) {
+        check_image(&checker);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    if (checker.mapped != NULL) {
+        munmap((void*) checker.mapped, checker.mapped_size);
+    }
+
+    unsigned long long errors = 0;
+    unsigned long long warnings = 0;
+    for (unsigned int problem = 0; problem < PROBLEM_COUNT; problem++) {
+        if (problem_counts[problem] != 0) {
+            printf("%s: %llu %s problems\n", path, problem_counts[problem], problem_names[problem]);
+        }
+        if (problem < PROBLEM_PLACEMENT) {
+            errors += problem_counts[problem];
+        } else {
+            warnings += problem_counts[problem];
+        }
+    }
+    printf("%s: v%u image, %u blocks (%.1f GiB), %llu inodes, %llu directories, %llu entries checked in %.3f s by %u threads: ",
+           path, checker.version == TOSFS_VERSION_1 ? 1 : 2, checker.block_count,
+           (double) checker.block_count * TOSFS_BLOCK_SIZE / (1024.0 * 1024.0 * 1024.0), checker.live_count,
+           checker.directory_count, checker.entry_count,
+           (double) (finished.tv_sec - started.tv_sec) + (double) (finished.tv_nsec - started.tv_nsec) / 1e9, checker.threads);
+    if (errors == 0) {
+        printf(warnings == 0 ? "clean\n" : "clean, %llu warnings\n", warnings);
+        return EXIT_CLEAN;
+    }
+    printf("%llu errors, %llu warnings\n", errors, warnings);
+    return EXIT_UNCORRECTED;
+}
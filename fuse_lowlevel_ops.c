@@ -2,7 +2,8 @@
 // Created by sebas on 10/21/25.
 //
 
-#define FUSE_USE_VERSION 26
+#define FUSE_USE_VERSION 35
+#define _GNU_SOURCE
 
 #include <fuse_lowlevel.h>
 #include <stdio.h>
@@ -11,6 +12,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -18,295 +20,3221 @@
 #include <time.h>
 #include <sys/mman.h>
 #include <assert.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <signal.h>
+#include <sys/syscall.h>
 
-#include "tosfs.h"
+#include "libtosfs.h"
+#include "op_stats.h"
 
 #define EXAMPLE_FILE_PATH "test_tosfs_files"
 
 #define SYSTEM_CALL_ERROR (-1)
-#define MAX_INODE_NUMBER (TOSFS_BLOCK_SIZE / sizeof(struct tosfs_inode))
-#define MAX_INODE_ENTRY_NUMBER (TOSFS_BLOCK_SIZE / sizeof(struct tosfs_inode))
-#define MAX_NB_DATA_BLOCKS (29)
-#define DATA_BLOCK_POS_OFFSET (-3)
+#define DENTRY_INDEX_MIN_CAPACITY (64)
+#define DIRECTORY_BUFFER_MIN_CAPACITY (1024)
+#define FNV_OFFSET_BASIS (2166136261u)
+#define FNV_PRIME (16777619u)
+#define DEFAULT_MAX_WRITE (1024 * 1024)
+#define DEFAULT_TIMEOUT (1.0)
+#define BITMAP_BITS (32)
+/// Bits summarized by one free counter: 128 words, so a group is scanned in a handful of cache lines
+#define BITMAP_GROUP_BITS (4096)
+#define BITMAP_GROUP_WORDS (BITMAP_GROUP_BITS / BITMAP_BITS)
+/// Hidden file of the root directory serving the request statistics. Its inode number is past any 32 bit tosfs one.
+#define STATS_FILE_NAME ".tosfs_stats"
+#define STATS_INODE ((fuse_ino_t) 1 << 32)
+#define DEFAULT_TRACE_EVENTS (4096)
+/// Decompressed blocks kept by default, 16 MiB
+#define DEFAULT_CACHE_BLOCKS (4096)
+/// Independently locked parts of the block cache, each holding an equal share of its blocks
+#define BLOCK_CACHE_SHARDS (16)
+#define BLOCK_CACHE_NONE (UINT32_MAX)
+/// Sent to the daemon to dump the request traces
+#define TRACE_DUMP_SIGNAL (SIGUSR1)
 
 #define min_macro(x, y) ((x) < (y) ? (x) : (y))
 #define max_macro(x, y) ((x) > (y) ? (x) : (y))
 
 
-struct data_block_structure {
-    char data[TOSFS_BLOCK_SIZE];
+/// One slot of the (parent, name) -> dentry hash table. An empty slot has a NULL dentry.
+struct dentry_index_slot {
+    __u32 hash;
+    __u32 parent;
+    struct tosfs_dentry* dentry;
+};
+
+/// Open addressing table (linear probing) indexing every dentry of the image by its parent and name,
+/// so that a lookup does not depend on the number of entries in the directory.
+struct dentry_index {
+    struct dentry_index_slot* slots;
+    size_t capacity;
+    size_t count;
+};
+
+/// Allocation bitmap stored on disk as 32 bit words. Bits below `first_bit` are never handed out.
+/// `group_free` counts the free bits of every group of BITMAP_GROUP_BITS bits and every group below
+/// `first_free_group` is full, so a search skips full groups without reading their words.
+struct allocation_bitmap {
+    __u32* words;
+    __u32 first_bit;
+    __u32 bit_count;
+    __u32* group_free;
+    __u32 group_count;
+    __u32 first_free_group;
+};
+
+/// Tables built by the mount pass of a read-only image, which never changes afterwards. `contiguous[ino]` is the
+/// single run holding the whole file, or has a zero length when the data is split or absent. The entries of
+/// directory d are directory_entries[directory_first[d]] up to directory_entries[directory_first[d + 1]].
+struct image_tables {
+    struct tosfs_extent* contiguous;
+    __u32* directory_first;
+    struct tosfs_dentry** directory_entries;
+    size_t directory_entry_count;
+    size_t directory_entry_capacity;
+};
+
+/// One decompressed block of a compressed file, chained in its hash bucket and in the LRU list of its shard, by
+/// entry number. The block itself is data[entry number] of the shard.
+struct block_cache_entry {
+    __u32 ino;
+    __u32 block;
+    __u32 length;
+    __u32 bucket_next;
+    __u32 lru_previous;
+    __u32 lru_next;
+};
+
+/// Shard of the block cache: a fixed set of entries allocated once, reused least recently used first when full.
+/// Aligned, and allocated aligned, so that the locks of two shards never share a cache line.
+struct block_cache_shard {
+    pthread_mutex_t lock;
+    struct block_cache_entry* entries;
+    char (*data)[TOSFS_BLOCK_SIZE];
+    __u32* buckets;
+    __u32 bucket_mask;
+    __u32 capacity;
+    __u32 used;
+    /// Most and least recently used entries
+    __u32 lru_head;
+    __u32 lru_tail;
+    unsigned long long hits;
+    unsigned long long misses;
+} __attribute__((aligned(64)));
+
+/// Blocks of compressed files kept decompressed, so that reading one again costs a copy. A block goes to the
+/// shard its (inode, block) hash picks, so that threads reading different files rarely wait on the same lock.
+struct block_cache {
+    /// BLOCK_CACHE_SHARDS of them, NULL when the cache is not set up
+    struct block_cache_shard* shards;
+    __u32 capacity;
 };
 
 struct mapped_file_struct {
-    int fd;
-    void* mapped_file;
-    struct stat file_info;
-
-    struct tosfs_superblock* superblock;
-    struct tosfs_inode* inodes;
-    struct tosfs_dentry* root_block;
-    struct data_block_structure* data_blocks;
+    /// Always mapped whole, so its inode table pointers are set and block addresses never move
+    struct tosfs_image image;
+
+    struct allocation_bitmap block_allocation;
+    struct allocation_bitmap inode_allocation;
+
+    struct dentry_index dentry_index;
+    /// Only built for a read-only image
+    struct image_tables tables;
+    /// Only set up when the image holds compressed files. Tied to the image, so that a reload starts empty.
+    struct block_cache block_cache;
+    /// Listings used when the kernel skips OPENDIR (no_opendir) and READDIR comes without a handle, indexed by
+    /// directory inode. Each one is built once on first use, then read without locking.
+    struct directory_handle** shared_handles;
 };
 
+/// Serialized direntries of a directory. `capacity` grows geometrically so that adding n entries costs O(n).
+/// Entry i ends at byte entry_ends[i], and its d_off is i + 1: offsets count entries, not bytes.
 struct directory_buffer {
     char* data_pointer;
     size_t size;
+    size_t capacity;
+    size_t* entry_ends;
+    size_t entry_count;
+    size_t entry_capacity;
 };
 
-static struct mapped_file_struct* mapped_file;
+/// State of an open directory. READDIR and READDIRPLUS serialize entries differently, so each one gets its
+/// own snapshot; the READDIRPLUS one is only built if the kernel asks for it. Both number their entries the
+/// same way, since the kernel may go on with READDIR from where a READDIRPLUS stopped (FUSE_CAP_READDIRPLUS_AUTO).
+struct directory_handle {
+    struct directory_buffer entries;
+    struct directory_buffer entries_plus;
+    int entries_plus_ready;
+};
 
+/// Mount options specific to tosfs, parsed from `-o` before libfuse sees the command line.
+/// A zero value keeps what libfuse and the kernel negotiated.
+struct ensea_options {
+    unsigned int max_write;
+    unsigned int max_readahead;
+    unsigned int max_background;
+    unsigned int congestion_threshold;
+    int no_open;
+    int no_opendir;
+    int read_only;
+    int reload;
+    /// Seconds the kernel may trust attributes, names and missing names without asking again
+    double attr_timeout;
+    double entry_timeout;
+    double negative_timeout;
+    /// Image file, test_tosfs_files of the working directory by default
+    const char* image;
+    /// Residency of the mapping: fault every page in at mount, prefetch or lock the metadata blocks, and the
+    /// madvise pattern of the data blocks ("normal", "random" or "sequential")
+    int populate;
+    int prefetch_metadata;
+    int lock_metadata;
+    const char* data_access;
+    /// Requests each thread remembers for the trace dumps, rounded up to a power of two, 0 to trace nothing
+    unsigned int trace_events;
+    /// Where TRACE_DUMP_SIGNAL writes the traces, /tmp/tosfs_trace.<pid>.json by default
+    const char* trace_file;
+    /// Decompressed blocks of compressed files kept in memory, 0 to decompress on every read
+    unsigned int cache_blocks;
+    /// Read replies copied through a buffer by libfuse instead of spliced from the image, to compare against
+    int no_splice;
+};
 
-static struct mapped_file_struct* map_example_file() {
-    mapped_file = malloc(sizeof(struct mapped_file_struct));
+#define ENSEA_OPTION(template, field) { template, offsetof(struct ensea_options, field), 1 }
+
+static const struct fuse_opt ensea_opts[] = {
+    ENSEA_OPTION("max_write=%u", max_write),
+    ENSEA_OPTION("max_readahead=%u", max_readahead),
+    ENSEA_OPTION("max_background=%u", max_background),
+    ENSEA_OPTION("congestion_threshold=%u", congestion_threshold),
+    ENSEA_OPTION("no_open", no_open),
+    ENSEA_OPTION("no_opendir", no_opendir),
+    ENSEA_OPTION("readonly", read_only),
+    ENSEA_OPTION("reload", reload),
+    ENSEA_OPTION("attr_timeout=%lf", attr_timeout),
+    ENSEA_OPTION("entry_timeout=%lf", entry_timeout),
+    ENSEA_OPTION("negative_timeout=%lf", negative_timeout),
+    ENSEA_OPTION("image=%s", image),
+    ENSEA_OPTION("populate", populate),
+    ENSEA_OPTION("prefetch_metadata", prefetch_metadata),
+    ENSEA_OPTION("lock_metadata", lock_metadata),
+    ENSEA_OPTION("data_access=%s", data_access),
+    ENSEA_OPTION("trace_events=%u", trace_events),
+    ENSEA_OPTION("trace_file=%s", trace_file),
+    ENSEA_OPTION("cache_blocks=%u", cache_blocks),
+    ENSEA_OPTION("no_splice", no_splice),
+    FUSE_OPT_END
+};
 
-    mapped_file->fd = open(EXAMPLE_FILE_PATH, O_RDONLY);
-    if (mapped_file->fd == SYSTEM_CALL_ERROR) {
-        perror("map_example_file: open");
-        exit(EXIT_FAILURE);
+static struct ensea_options options = {
+    .max_write = DEFAULT_MAX_WRITE,
+    .attr_timeout = DEFAULT_TIMEOUT,
+    .entry_timeout = DEFAULT_TIMEOUT,
+    .image = EXAMPLE_FILE_PATH,
+    .data_access = "normal",
+    .trace_events = DEFAULT_TRACE_EVENTS,
+    .cache_blocks = DEFAULT_CACHE_BLOCKS,
+};
+
+/// madvise value matching options.data_access, set by main
+static int data_advice = MADV_NORMAL;
+
+static pthread_mutex_t shared_handles_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/// Image state shared by every worker thread. The pointers are only written before the session starts and after
+/// it ends. Namespace and allocation changes (dentries, bitmaps, inode table) are serialized by the write side of
+/// metadata_lock; lookup and listing builds take the read side. getattr takes no lock: the kernel holds an inode
+/// reference while a file is in use, and only one WRITE/SETATTR runs at a time on a given inode. A READ is not
+/// serialized against a SETATTR truncating the file from another file descriptor, so on a writable image read
+/// takes the read side too, until its reply has left; a read-only image never changes and reads take no lock.
+static struct mapped_file_struct* mapped_file;
+static pthread_rwlock_t metadata_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/// With `-o reload`, the watcher thread replaces mapped_file when a new image is renamed over it. Handlers that read
+/// the image hold the read side of image_lock for their whole run, reply included, so a request started on the
+/// old image finishes on it. Writers are preferred so that a steady stream of requests cannot delay a reload.
+static pthread_rwlock_t image_lock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+/// Absolute, so that the image can still be found once fuse_daemonize has moved to /
+static char image_path[PATH_MAX];
+#ifndef TOSFS_NO_MAIN
+/// Where the reloads send their invalidations
+static struct fuse_session* session;
+#endif
+
+
+static size_t dentry_name_length(const char* name) {
+    return strnlen(name, TOSFS_MAX_NAME_LENGTH);
+}
+
+static __u32 dentry_name_hash(const __u32 parent, const char* name, const size_t name_length) {
+    __u32 hash = FNV_OFFSET_BASIS;
+    for (unsigned int i = 0; i < sizeof(parent); i++) {
+        hash = (hash ^ ((parent >> (8 * i)) & 0xff)) * FNV_PRIME;
+    }
+    for (size_t i = 0; i < name_length; i++) {
+        hash = (hash ^ (unsigned char) name[i]) * FNV_PRIME;
     }
+    return hash;
+}
 
-    if (stat(EXAMPLE_FILE_PATH, &mapped_file->file_info) == SYSTEM_CALL_ERROR) {
-        perror("map_example_file: stat");
+static void dentry_index_init(struct dentry_index* index, const size_t capacity) {
+    index->capacity = capacity;
+    index->count = 0;
+    index->slots = calloc(capacity, sizeof(struct dentry_index_slot));
+    if (index->slots == NULL) {
+        perror("dentry_index_init: calloc failed");
         exit(EXIT_FAILURE);
     }
+}
 
-    mapped_file->mapped_file = mmap(
-        NULL,
-        mapped_file->file_info.st_size,
-        PROT_READ,
-        MAP_SHARED,
-        mapped_file->fd,
-        0
-    );
+static void dentry_index_free(struct dentry_index* index) {
+    free(index->slots);
+    index->slots = NULL;
+    index->capacity = 0;
+    index->count = 0;
+}
 
-    return mapped_file;
+static void dentry_index_place(struct dentry_index* index, const struct dentry_index_slot* new_slot) {
+    const size_t mask = index->capacity - 1;
+    size_t position = new_slot->hash & mask;
+    while (index->slots[position].dentry != NULL) {
+        position = (position + 1) & mask;
+    }
+    index->slots[position] = *new_slot;
+    index->count++;
 }
 
-static void close_mapped_file() {
-    if (munmap(mapped_file->mapped_file, mapped_file->file_info.st_size) == SYSTEM_CALL_ERROR) {
-        close(mapped_file->fd);
-        perror("close_mapped_file: munmap");
-        exit(EXIT_FAILURE);
+static void dentry_index_grow(struct dentry_index* index) {
+    struct dentry_index old_index = *index;
+
+    dentry_index_init(index, old_index.capacity * 2);
+    for (size_t i = 0; i < old_index.capacity; i++) {
+        if (old_index.slots[i].dentry != NULL) {
+            dentry_index_place(index, &old_index.slots[i]);
+        }
     }
-    close(mapped_file->fd);
-    free(mapped_file);
+    dentry_index_free(&old_index);
 }
 
-static void read_mapped_file_as_tosfs_file() {
-    void* tmp_ptr = mapped_file->mapped_file;
+static void dentry_index_insert(struct dentry_index* index, const __u32 parent, struct tosfs_dentry* dentry) {
+    // Keep the load factor under 1/2 so that probe sequences stay short
+    if (2 * (index->count + 1) > index->capacity) {
+        dentry_index_grow(index);
+    }
+
+    const struct dentry_index_slot new_slot = {
+        .hash = dentry_name_hash(parent, dentry->name, dentry_name_length(dentry->name)),
+        .parent = parent,
+        .dentry = dentry,
+    };
+    dentry_index_place(index, &new_slot);
+}
 
-    mapped_file->superblock = (struct tosfs_superblock*) tmp_ptr;
-    if (mapped_file->superblock->magic != TOSFS_MAGIC) {
-        perror("read_mapped_file_as_tosfs_file: bad magic");
-        exit(EXIT_FAILURE);
+static struct dentry_index_slot* dentry_index_find_slot(const struct dentry_index* index, const __u32 parent, const char* name) {
+    const size_t name_length = strlen(name);
+    if (name_length > TOSFS_MAX_NAME_LENGTH) {
+        return NULL;
     }
-    if (mapped_file->superblock->inodes > MAX_INODE_NUMBER) {
-        perror("read_mapped_file_as_tosfs_file: too many inodes");
-        exit(EXIT_FAILURE);
+
+    const __u32 hash = dentry_name_hash(parent, name, name_length);
+    const size_t mask = index->capacity - 1;
+    for (size_t position = hash & mask; index->slots[position].dentry != NULL; position = (position + 1) & mask) {
+        struct dentry_index_slot* slot = &index->slots[position];
+        if (slot->hash == hash && slot->parent == parent &&
+            dentry_name_length(slot->dentry->name) == name_length &&
+            memcmp(slot->dentry->name, name, name_length) == 0) {
+            return slot;
+        }
     }
 
-    tmp_ptr += TOSFS_BLOCK_SIZE;
-    mapped_file->inodes = (struct tosfs_inode*) tmp_ptr;
+    return NULL;
+}
+
+static struct tosfs_dentry* dentry_index_find(const struct dentry_index* index, const __u32 parent, const char* name) {
+    const struct dentry_index_slot* slot = dentry_index_find_slot(index, parent, name);
+    return slot == NULL ? NULL : slot->dentry;
+}
+
+/// Removes a slot with backward shift deletion, so that no tombstone ever lengthens later probes.
+static void dentry_index_remove(struct dentry_index* index, struct dentry_index_slot* slot) {
+    const size_t mask = index->capacity - 1;
+    size_t hole = slot - index->slots;
+    size_t position = hole;
+
+    while (1) {
+        position = (position + 1) & mask;
+        if (index->slots[position].dentry == NULL) {
+            break;
+        }
+
+        // Move the entry back into the hole unless its home slot lies cyclically in (hole, position]
+        const size_t home = index->slots[position].hash & mask;
+        const int home_after_hole = hole <= position ? (home > hole && home <= position)
+                                                     : (home > hole || home <= position);
+        if (!home_after_hole) {
+            index->slots[hole] = index->slots[position];
+            hole = position;
+        }
+    }
 
-    tmp_ptr += TOSFS_BLOCK_SIZE;
-    mapped_file->root_block = (struct tosfs_dentry*) tmp_ptr;
+    index->slots[hole].dentry = NULL;
+    index->count--;
+}
 
-    tmp_ptr += TOSFS_BLOCK_SIZE;
-    mapped_file->data_blocks = (struct data_block_structure*) tmp_ptr;
+/// Mask of the bits [first, first + count) of a single word, with first + count <= BITMAP_BITS.
+static __u32 word_range_mask(const __u32 first, const __u32 count) {
+    const __u32 low_bits = count >= BITMAP_BITS ? ~0u : (1u << count) - 1;
+    return low_bits << first;
 }
 
+/// Builds the free counters with one popcount per word. Bits below `first_bit` are not counted as free.
+static void bitmap_summary_init(struct allocation_bitmap* bitmap) {
+    bitmap->group_count = (bitmap->bit_count + BITMAP_GROUP_BITS - 1) / BITMAP_GROUP_BITS;
+    bitmap->group_free = calloc(max_macro(bitmap->group_count, 1u), sizeof(__u32));
+    if (bitmap->group_free == NULL) {
+        perror("bitmap_summary_init: calloc");
+        exit(EXIT_FAILURE);
+    }
 
-static int ensea_ll_stat(fuse_ino_t ino, struct stat *stbuf) {
-    struct tosfs_inode* inode = &mapped_file->inodes[ino];
-    if (inode->inode == mapped_file->superblock->root_inode) {
-        stbuf->st_ino = (ino_t) inode->inode;
-        stbuf->st_nlink = (nlink_t) inode->nlink;
-        stbuf->st_mode = S_IFDIR | (inode->perm & 0777);
-        return EXIT_SUCCESS;
+    const __u32 word_count = (bitmap->bit_count + BITMAP_BITS - 1) / BITMAP_BITS;
+    for (__u32 word_number = 0; word_number < word_count; word_number++) {
+        const __u32 first = word_number * BITMAP_BITS;
+        const __u32 last = min_macro(first + BITMAP_BITS, bitmap->bit_count);
+        __u32 counted = word_range_mask(0, last - first);
+        if (bitmap->first_bit > first) {
+            counted &= ~word_range_mask(0, min_macro(bitmap->first_bit - first, (__u32) BITMAP_BITS));
+        }
+        bitmap->group_free[word_number / BITMAP_GROUP_WORDS] += __builtin_popcount(~bitmap->words[word_number] & counted);
     }
 
-    if (inode->inode < mapped_file->superblock->root_inode || inode->inode >= MAX_INODE_NUMBER) {
-        return SYSTEM_CALL_ERROR;
+    bitmap->first_free_group = 0;
+    while (bitmap->first_free_group < bitmap->group_count && bitmap->group_free[bitmap->first_free_group] == 0) {
+        bitmap->first_free_group++;
     }
+}
 
-    stbuf->st_ino = (ino_t) inode->inode;
-    stbuf->st_uid = (uid_t) inode->uid;
-    stbuf->st_gid = (gid_t) inode->gid;
-    stbuf->st_nlink = (nlink_t) inode->nlink;
+static void bitmap_summary_free(struct allocation_bitmap* bitmap) {
+    free(bitmap->group_free);
+    bitmap->group_free = NULL;
+}
 
-    if (ino != mapped_file->superblock->root_inode) {
-        stbuf->st_size = (off_t) inode->size;
+/// Sets (or clears) the bits of `mask` in one word and keeps the free counter of its group in sync.
+static void bitmap_update_word(struct allocation_bitmap* bitmap, const __u32 word_number, const __u32 mask, const int set) {
+    __u32* word = &bitmap->words[word_number];
+    const __u32 group = word_number / BITMAP_GROUP_WORDS;
+    if (set) {
+        bitmap->group_free[group] -= __builtin_popcount(~*word & mask);
+        *word |= mask;
+    } else {
+        bitmap->group_free[group] += __builtin_popcount(*word & mask);
+        *word &= ~mask;
+        bitmap->first_free_group = min_macro(bitmap->first_free_group, group);
     }
+}
 
-    stbuf->st_mode = S_IFREG | (inode->perm & 0777);
+static void bitmap_set(struct allocation_bitmap* bitmap, const __u32 bit) {
+    bitmap_update_word(bitmap, bit / BITMAP_BITS, word_range_mask(bit % BITMAP_BITS, 1), 1);
+}
 
-    return EXIT_SUCCESS;
+static void bitmap_clear(struct allocation_bitmap* bitmap, const __u32 bit) {
+    bitmap_update_word(bitmap, bit / BITMAP_BITS, word_range_mask(bit % BITMAP_BITS, 1), 0);
 }
 
-static void dirbuf_add(fuse_req_t req, struct directory_buffer *buf, const char *name, fuse_ino_t ino) {
-    struct stat stbuf;
-    const size_t old_size = buf->size;
-    buf->size += fuse_add_direntry(req, NULL, 0, name, NULL, 0);
-    char* new_ptr = realloc(buf->data_pointer, buf->size);
-    if (new_ptr == NULL) {
-        perror("dirbuf_add: realloc failed");
-        exit(EXIT_FAILURE);
+/// Sets (or clears) the bits [start, start + length) a whole word at a time.
+static void bitmap_update_range(struct allocation_bitmap* bitmap, __u32 start, __u32 length, const int set) {
+    while (length > 0) {
+        const __u32 first = start % BITMAP_BITS;
+        const __u32 count = min_macro(length, BITMAP_BITS - first);
+        bitmap_update_word(bitmap, start / BITMAP_BITS, word_range_mask(first, count), set);
+        start += count;
+        length -= count;
     }
-    buf->data_pointer = new_ptr;
-    memset(&stbuf, 0, sizeof(stbuf));
-    stbuf.st_ino = ino;
-    fuse_add_direntry(req, buf->data_pointer + old_size, buf->size - old_size, name, &stbuf, buf->size);
 }
 
-static int reply_buf_limited(fuse_req_t req, const char *buf, const size_t buffer_size, const off_t offset, size_t maxsize) {
-    if (offset < buffer_size) {
-        return fuse_reply_buf(req, buf + offset, min_macro(buffer_size - offset, maxsize));
+/// Whether no bit of the group can match `value`: a free search skips full groups, a used search skips empty ones.
+static int bitmap_group_skippable(const struct allocation_bitmap* bitmap, const __u32 group, const int value) {
+    if (!value) {
+        return bitmap->group_free[group] == 0;
+    }
+    return bitmap->group_free[group] == min_macro((__u32) BITMAP_GROUP_BITS, bitmap->bit_count - group * BITMAP_GROUP_BITS);
+}
+
+/// First bit at or after `from` whose value is `value`, scanning one word per step with a bit scan and skipping
+/// the groups the free counters rule out. Returns `bit_count` when there is none.
+static __u32 bitmap_find(struct allocation_bitmap* bitmap, __u32 from, const int value) {
+    // Every group below first_free_group is full, and a search covering them all moves it forward
+    const __u32 first_free_bit = max_macro(bitmap->first_free_group * BITMAP_GROUP_BITS, bitmap->first_bit);
+    const int from_first_free_group = !value && from <= first_free_bit;
+    if (from_first_free_group) {
+        from = first_free_bit;
+    }
+    if (from >= bitmap->bit_count) {
+        return bitmap->bit_count;
     }
 
-    return fuse_reply_buf(req, NULL, 0);
+    __u32 word_number = from / BITMAP_BITS;
+    __u32 candidates = (value ? bitmap->words[word_number] : ~bitmap->words[word_number]) & (~0u << (from % BITMAP_BITS));
+    if (bitmap_group_skippable(bitmap, word_number / BITMAP_GROUP_WORDS, value)) {
+        candidates = 0;
+        word_number = (word_number / BITMAP_GROUP_WORDS + 1) * BITMAP_GROUP_WORDS - 1;
+    }
+    while (candidates == 0) {
+        word_number++;
+        if (word_number % BITMAP_GROUP_WORDS == 0) {
+            __u32 group = word_number / BITMAP_GROUP_WORDS;
+            while (group < bitmap->group_count && bitmap_group_skippable(bitmap, group, value)) {
+                group++;
+            }
+            word_number = group * BITMAP_GROUP_WORDS;
+        }
+        if (word_number * BITMAP_BITS >= bitmap->bit_count) {
+            if (from_first_free_group) {
+                bitmap->first_free_group = bitmap->group_count;
+            }
+            return bitmap->bit_count;
+        }
+        candidates = value ? bitmap->words[word_number] : ~bitmap->words[word_number];
+    }
+
+    const __u32 bit = min_macro(word_number * BITMAP_BITS + __builtin_ctz(candidates), bitmap->bit_count);
+    if (from_first_free_group) {
+        bitmap->first_free_group = bit / BITMAP_GROUP_BITS;
+    }
+    return bit;
 }
 
+/// Allocates the lowest free bit, or returns SYSTEM_CALL_ERROR when the bitmap is full.
+static int bitmap_allocate(struct allocation_bitmap* bitmap) {
+    const __u32 bit = bitmap_find(bitmap, bitmap->first_bit, 0);
+    if (bit == bitmap->bit_count) {
+        return SYSTEM_CALL_ERROR;
+    }
 
-static void ensea_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
-    struct fuse_entry_param entry_param;
-    struct tosfs_dentry* disk_entry = mapped_file->root_block;
+    bitmap_set(bitmap, bit);
+    return (int) bit;
+}
 
-    for (unsigned int entry_number = 0; entry_number < MAX_INODE_ENTRY_NUMBER; entry_number++) {
-        if (disk_entry->inode == 0) {
-            // We don't break the loop because (depending on how we remove inodes) all inodes might not be at the start
-            // of the inode map
-            disk_entry++;
-            continue;
-        }
+/// Allocates a run of at most `max_length` free bits, starting at `hint` when that bit is free so that a file
+/// keeps growing in place, else at the first free bit. Returns the length of the run, 0 when the bitmap is full.
+static __u32 bitmap_allocate_run(struct allocation_bitmap* bitmap, const __u32 hint, const __u32 max_length, __u32* start) {
+    __u32 run_start = bitmap_find(bitmap, max_macro(hint, bitmap->first_bit), 0);
+    if (run_start == bitmap->bit_count) {
+        run_start = bitmap_find(bitmap, bitmap->first_bit, 0);
+    }
+    if (run_start == bitmap->bit_count) {
+        return 0;
+    }
 
-        if (parent != 1 || strcmp(name, disk_entry->name) != 0) {
-            disk_entry++;
-            continue;
-        }
+    const __u32 run_end = min_macro(bitmap_find(bitmap, run_start, 1), run_start + max_length);
+    bitmap_update_range(bitmap, run_start, run_end - run_start, 1);
+    *start = run_start;
+    return run_end - run_start;
+}
 
-        memset(&entry_param, 0, sizeof(entry_param));
-        entry_param.ino = disk_entry->inode;
-        entry_param.attr_timeout = 1.0;
-        entry_param.entry_timeout = 1.0;
-        ensea_ll_stat(entry_param.ino, &entry_param.attr);
+/// Sets up a cache of `blocks` blocks split evenly over the shards, all its memory allocated at once.
+static void block_cache_init(struct block_cache* cache, const __u32 blocks) {
+    memset(cache, 0, sizeof(struct block_cache));
+    const __u32 shard_capacity = (blocks + BLOCK_CACHE_SHARDS - 1) / BLOCK_CACHE_SHARDS;
+    __u32 bucket_count = 1;
+    while (bucket_count < 2 * shard_capacity) {
+        bucket_count *= 2;
+    }
 
-        fuse_reply_entry(req, &entry_param);
+    cache->shards = aligned_alloc(__alignof__(struct block_cache_shard), BLOCK_CACHE_SHARDS * sizeof(struct block_cache_shard));
+    if (cache->shards == NULL) {
+        perror("block_cache_init: aligned_alloc failed");
+        exit(EXIT_FAILURE);
+    }
+    memset(cache->shards, 0, BLOCK_CACHE_SHARDS * sizeof(struct block_cache_shard));
+    for (unsigned int index = 0; index < BLOCK_CACHE_SHARDS; index++) {
+        struct block_cache_shard* shard = &cache->shards[index];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->entries = calloc(shard_capacity, sizeof(struct block_cache_entry));
+        shard->data = malloc((size_t) shard_capacity * TOSFS_BLOCK_SIZE);
+        shard->buckets = malloc(bucket_count * sizeof(__u32));
+        if (shard->entries == NULL || shard->data == NULL || shard->buckets == NULL) {
+            perror("block_cache_init: malloc failed");
+            exit(EXIT_FAILURE);
+        }
+        memset(shard->buckets, 0xff, bucket_count * sizeof(__u32));
+        shard->bucket_mask = bucket_count - 1;
+        shard->capacity = shard_capacity;
+        shard->lru_head = BLOCK_CACHE_NONE;
+        shard->lru_tail = BLOCK_CACHE_NONE;
+    }
+    cache->capacity = shard_capacity * BLOCK_CACHE_SHARDS;
+}
+
+static void block_cache_free(struct block_cache* cache) {
+    if (cache->capacity == 0) {
         return;
     }
+    for (unsigned int index = 0; index < BLOCK_CACHE_SHARDS; index++) {
+        struct block_cache_shard* shard = &cache->shards[index];
+        pthread_mutex_destroy(&shard->lock);
+        free(shard->entries);
+        free(shard->data);
+        free(shard->buckets);
+    }
+    free(cache->shards);
+    memset(cache, 0, sizeof(struct block_cache));
+}
 
-    fuse_reply_err(req, ENOENT);
+/// Hash of a cached block: its high bits pick the shard, its low bits the bucket in the shard.
+static __u32 block_cache_hash(const __u32 ino, const __u32 block) {
+    __u32 hash = ino * 0x9e3779b1u ^ block * 0x85ebca6bu;
+    hash ^= hash >> 15;
+    return hash * 0xc2b2ae35u;
 }
 
-static void ensea_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
-    struct stat stbuf = {0};
-    (void) fi;
+static struct block_cache_shard* block_cache_shard(struct block_cache* cache, const __u32 hash) {
+    return &cache->shards[(hash >> 24) % BLOCK_CACHE_SHARDS];
+}
 
-    if (ensea_ll_stat(ino, &stbuf) == SYSTEM_CALL_ERROR) {
-        fuse_reply_err(req, ENOENT);
+/// Entry number holding a block in a shard, or BLOCK_CACHE_NONE. Must be called with the shard locked.
+static __u32 block_cache_find(const struct block_cache_shard* shard, const __u32 hash, const __u32 ino, const __u32 block) {
+    __u32 entry_number = shard->buckets[hash & shard->bucket_mask];
+    while (entry_number != BLOCK_CACHE_NONE) {
+        const struct block_cache_entry* entry = &shard->entries[entry_number];
+        if (entry->ino == ino && entry->block == block) {
+            return entry_number;
+        }
+        entry_number = entry->bucket_next;
+    }
+    return BLOCK_CACHE_NONE;
+}
+
+static void block_cache_lru_unlink(struct block_cache_shard* shard, const __u32 entry_number) {
+    const struct block_cache_entry* entry = &shard->entries[entry_number];
+    if (entry->lru_previous == BLOCK_CACHE_NONE) {
+        shard->lru_head = entry->lru_next;
     } else {
-        fuse_reply_attr(req, &stbuf, 1.0);
+        shard->entries[entry->lru_previous].lru_next = entry->lru_next;
+    }
+    if (entry->lru_next == BLOCK_CACHE_NONE) {
+        shard->lru_tail = entry->lru_previous;
+    } else {
+        shard->entries[entry->lru_next].lru_previous = entry->lru_previous;
     }
 }
 
-static void ensea_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
-    (void) fi;
-    if (ino != mapped_file->superblock->root_inode) {
-        fuse_reply_err(req, ENOTDIR);
-        return;
+static void block_cache_lru_push(struct block_cache_shard* shard, const __u32 entry_number) {
+    struct block_cache_entry* entry = &shard->entries[entry_number];
+    entry->lru_previous = BLOCK_CACHE_NONE;
+    entry->lru_next = shard->lru_head;
+    if (shard->lru_head == BLOCK_CACHE_NONE) {
+        shard->lru_tail = entry_number;
+    } else {
+        shard->entries[shard->lru_head].lru_previous = entry_number;
     }
+    shard->lru_head = entry_number;
+}
 
-    struct directory_buffer buf = {0};
+/// Copies a cached block to `destination` and marks it most recently used. Returns its length, or
+/// SYSTEM_CALL_ERROR when the cache does not hold it.
+static long block_cache_get(struct block_cache* cache, const __u32 ino, const __u32 block, char* destination) {
+    const __u32 hash = block_cache_hash(ino, block);
+    struct block_cache_shard* shard = block_cache_shard(cache, hash);
+    pthread_mutex_lock(&shard->lock);
+    const __u32 entry_number = block_cache_find(shard, hash, ino, block);
+    if (entry_number == BLOCK_CACHE_NONE) {
+        shard->misses++;
+        pthread_mutex_unlock(&shard->lock);
+        return SYSTEM_CALL_ERROR;
+    }
+    shard->hits++;
+    if (shard->lru_head != entry_number) {
+        block_cache_lru_unlink(shard, entry_number);
+        block_cache_lru_push(shard, entry_number);
+    }
+    const __u32 length = shard->entries[entry_number].length;
+    memcpy(destination, shard->data[entry_number], length);
+    pthread_mutex_unlock(&shard->lock);
+    return length;
+}
 
-    struct tosfs_dentry* disk_entry = mapped_file->root_block;
-    for (unsigned int entry_number = 0; entry_number < MAX_INODE_ENTRY_NUMBER; entry_number++) {
-        if (disk_entry->inode == 0) {
-            break;
+/// Adds a block, taking the place of the least recently used one of its shard when the shard is full. A block
+/// another thread added meanwhile is left as it is.
+static void block_cache_put(struct block_cache* cache, const __u32 ino, const __u32 block, const char* data, const __u32 length) {
+    const __u32 hash = block_cache_hash(ino, block);
+    struct block_cache_shard* shard = block_cache_shard(cache, hash);
+    pthread_mutex_lock(&shard->lock);
+    if (block_cache_find(shard, hash, ino, block) != BLOCK_CACHE_NONE) {
+        pthread_mutex_unlock(&shard->lock);
+        return;
+    }
+
+    __u32 entry_number;
+    if (shard->used < shard->capacity) {
+        entry_number = shard->used++;
+    } else {
+        entry_number = shard->lru_tail;
+        block_cache_lru_unlink(shard, entry_number);
+        const struct block_cache_entry* victim = &shard->entries[entry_number];
+        __u32* link = &shard->buckets[block_cache_hash(victim->ino, victim->block) & shard->bucket_mask];
+        while (*link != entry_number) {
+            link = &shard->entries[*link].bucket_next;
         }
+        *link = victim->bucket_next;
+    }
+
+    struct block_cache_entry* entry = &shard->entries[entry_number];
+    entry->ino = ino;
+    entry->block = block;
+    entry->length = length;
+    entry->bucket_next = shard->buckets[hash & shard->bucket_mask];
+    shard->buckets[hash & shard->bucket_mask] = entry_number;
+    block_cache_lru_push(shard, entry_number);
+    memcpy(shard->data[entry_number], data, length);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+static __u32 blocks_for_size(const __u64 size) {
+    return (__u32) ((size + TOSFS_BLOCK_SIZE - 1) / TOSFS_BLOCK_SIZE);
+}
+
+static char* block_address(const __u32 block_no) {
+    return (char*) mapped_file->image.map + (size_t) block_no * TOSFS_BLOCK_SIZE;
+}
 
-        dirbuf_add(req, &buf, disk_entry->name, disk_entry->inode);
-        disk_entry++;
+/// Largest file the format can describe: a v1 file owns a single block.
+static __u64 max_file_size() {
+    if (mapped_file->image.version == TOSFS_VERSION_1) {
+        return TOSFS_BLOCK_SIZE;
     }
+    return (__u64) mapped_file->image.block_count * TOSFS_BLOCK_SIZE;
+}
 
-    reply_buf_limited(req, buf.data_pointer, buf.size, off, size);
-    free(buf.data_pointer);
+/// Copies the attributes of a live inode, or returns SYSTEM_CALL_ERROR for a free or out of range inode number.
+static int inode_load(const fuse_ino_t ino, struct tosfs_attributes* attributes) {
+    return tosfs_inode_load(&mapped_file->image, ino, attributes) == -1 ? SYSTEM_CALL_ERROR : EXIT_SUCCESS;
 }
 
-static void ensea_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
-    /// TODO open file (below is code from hello_ll.c)
-    if (ino != 2 && ino != 3) {
-        fuse_reply_err(req, EISDIR);
-    } else if ((fi->flags & 3) != O_RDONLY) {
-        fuse_reply_err(req, EACCES);
+static void inode_store(const fuse_ino_t ino, const struct tosfs_attributes* attributes) {
+    if (mapped_file->image.version == TOSFS_VERSION_1) {
+        struct tosfs_inode* inode = &mapped_file->image.inodes[ino];
+        inode->inode = attributes->inode;
+        inode->uid = attributes->uid;
+        inode->gid = attributes->gid;
+        inode->mode = attributes->mode;
+        inode->perm = attributes->perm;
+        inode->nlink = attributes->nlink;
+        inode->size = (__u16) attributes->size;
+        return;
+    }
+
+    struct tosfs_inode_v2* inode = &mapped_file->image.inodes_v2[ino];
+    inode->inode = attributes->inode;
+    inode->uid = attributes->uid;
+    inode->gid = attributes->gid;
+    inode->mode = attributes->mode;
+    inode->perm = attributes->perm;
+    inode->nlink = attributes->nlink;
+    inode->size = attributes->size;
+}
+
+static void inode_store_size(const fuse_ino_t ino, const __u64 size) {
+    if (mapped_file->image.version == TOSFS_VERSION_1) {
+        mapped_file->image.inodes[ino].size = (__u16) size;
     } else {
-        fuse_reply_open(req, fi);
+        mapped_file->image.inodes_v2[ino].size = size;
     }
 }
 
-static void ensea_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
-    (void) fi;
-    if (ino <= mapped_file->superblock->root_inode || ino >= MAX_INODE_NUMBER) {
-		fuse_reply_err(req, EISDIR);
-        return;
+static __u32 inode_extent_count(const fuse_ino_t ino) {
+    return tosfs_extent_count(&mapped_file->image, ino);
+}
+
+/// Slot of the index-th extent of a v2 inode, inline or in its extent block.
+static struct tosfs_extent* inode_v2_extent_slot(const struct tosfs_inode_v2* inode, const __u32 index) {
+    if (index < TOSFS_INLINE_EXTENTS) {
+        return (struct tosfs_extent*) &inode->extents[index];
     }
+    return (struct tosfs_extent*) block_address(inode->extent_block) + (index - TOSFS_INLINE_EXTENTS);
+}
 
-    struct tosfs_inode* inode = &mapped_file->inodes[ino];
-    if (inode->inode == 0) {
-		fuse_reply_err(req, ENOENT);
-        return;
+/// The index-th run of blocks of an inode; a v1 inode has a single run made of its only block.
+static struct tosfs_extent inode_extent(const fuse_ino_t ino, const __u32 index) {
+    return tosfs_extent_at(&mapped_file->image, ino, index);
+}
+
+static __u32 inode_allocated_blocks(const fuse_ino_t ino) {
+    __u32 blocks = 0;
+    const __u32 extent_count = inode_extent_count(ino);
+    for (__u32 index = 0; index < extent_count; index++) {
+        blocks += inode_extent(ino, index).length;
     }
+    return blocks;
+}
 
-    struct data_block_structure* data_block = &mapped_file->data_blocks[inode->block_no+DATA_BLOCK_POS_OFFSET];
-    reply_buf_limited(req, &(data_block->data[0]), strlen(data_block->data), off, size);
+/// Copies `length` bytes at `offset` of the file from `source`, or zeroes them when `source` is NULL,
+/// with one memcpy per extent crossed. The range must already be backed by allocated blocks.
+static void inode_copy_in(const fuse_ino_t ino, __u64 offset, const char* source, size_t length) {
+    __u64 extent_offset = 0;
+    const __u32 extent_count = inode_extent_count(ino);
+
+    for (__u32 index = 0; index < extent_count && length > 0; index++) {
+        const struct tosfs_extent extent = inode_extent(ino, index);
+        const __u64 extent_size = (__u64) extent.length * TOSFS_BLOCK_SIZE;
+        if (offset < extent_offset + extent_size) {
+            const __u64 in_extent = offset - extent_offset;
+            const size_t chunk = min_macro((__u64) length, extent_size - in_extent);
+            char* destination = block_address(extent.start) + in_extent;
+            if (source != NULL) {
+                memcpy(destination, source, chunk);
+                source += chunk;
+            } else {
+                memset(destination, 0, chunk);
+            }
+            offset += chunk;
+            length -= chunk;
+        }
+        extent_offset += extent_size;
+    }
 }
 
+/// Adds a run of blocks at the end of a v2 inode, merging it with the last extent when contiguous.
+static int inode_v2_append_extent(struct tosfs_inode_v2* inode, const __u32 start, const __u32 length) {
+    if (inode->nr_extents > 0) {
+        struct tosfs_extent* last = inode_v2_extent_slot(inode, inode->nr_extents - 1);
+        if (last->start + last->length == start) {
+            last->length += length;
+            return EXIT_SUCCESS;
+        }
+    }
+
+    if (inode->nr_extents >= TOSFS_MAX_EXTENTS) {
+        return EFBIG;
+    }
+    if (inode->nr_extents == TOSFS_INLINE_EXTENTS && inode->extent_block == 0) {
+        const int extent_block = bitmap_allocate(&mapped_file->block_allocation);
+        if (extent_block == SYSTEM_CALL_ERROR) {
+            return ENOSPC;
+        }
+        memset(block_address(extent_block), 0, TOSFS_BLOCK_SIZE);
+        inode->extent_block = extent_block;
+    }
 
-static struct fuse_lowlevel_ops ensea_ll_oper = {
-    .lookup		= ensea_ll_lookup,
-    .getattr	= ensea_ll_getattr,
-    .readdir	= ensea_ll_readdir,
-    .open		= ensea_ll_open,
-    .read		= ensea_ll_read,
-};
+    struct tosfs_extent* slot = inode_v2_extent_slot(inode, inode->nr_extents);
+    slot->start = start;
+    slot->length = length;
+    // Lock free readers must never see the new count before the extent it covers
+    __atomic_store_n(&inode->nr_extents, inode->nr_extents + 1, __ATOMIC_RELEASE);
+    return EXIT_SUCCESS;
+}
 
+/// Gives back every block of a v2 inode past its first `kept_blocks` ones.
+/// Must be called with metadata_lock held for writing.
+static void inode_v2_release_blocks(struct tosfs_inode_v2* inode, const __u32 kept_blocks) {
+    __u32 extent_first_block = 0;
+    __u32 kept_extents = 0;
+
+    for (__u32 index = 0; index < min_macro(inode->nr_extents, (__u32) TOSFS_MAX_EXTENTS); index++) {
+        struct tosfs_extent* extent = inode_v2_extent_slot(inode, index);
+        const __u32 extent_length = extent->length;
+
+        if (extent_first_block >= kept_blocks) {
+            bitmap_update_range(&mapped_file->block_allocation, extent->start, extent_length, 0);
+        } else {
+            if (extent_first_block + extent_length > kept_blocks) {
+                extent->length = kept_blocks - extent_first_block;
+                bitmap_update_range(&mapped_file->block_allocation, extent->start + extent->length, extent_length - extent->length, 0);
+            }
+            kept_extents++;
+        }
+        extent_first_block += extent_length;
+    }
 
-int main(int argc, char *argv[]) {
-    map_example_file();
-    read_mapped_file_as_tosfs_file();
+    inode->nr_extents = kept_extents;
+    if (kept_extents <= TOSFS_INLINE_EXTENTS && inode->extent_block != 0) {
+        bitmap_clear(&mapped_file->block_allocation, inode->extent_block);
+        inode->extent_block = 0;
+    }
+}
 
-    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
-    struct fuse_chan *ch;
-    char *mountpoint;
-    int errors = -1;
+/// Makes sure the first `needed_blocks` blocks of the file are allocated, growing the last extent in place when
+/// the following blocks are free. New blocks are zeroed, so bytes past the end of file always read as zeros.
+/// Must be called with metadata_lock held for writing.
+static int inode_reserve_blocks(const fuse_ino_t ino, const __u32 needed_blocks) {
+    if (mapped_file->image.version == TOSFS_VERSION_1) {
+        // The only block of a v1 file is allocated with the file
+        return needed_blocks <= 1 ? EXIT_SUCCESS : EFBIG;
+    }
 
-    if (fuse_parse_cmdline(&args, &mountpoint, NULL, NULL) != -1 &&
-        (ch = fuse_mount(mountpoint, &args)) != NULL) {
-        struct fuse_session *se;
+    struct tosfs_inode_v2* inode = &mapped_file->image.inodes_v2[ino];
+    const __u32 initial_blocks = inode_allocated_blocks(ino);
+    __u32 allocated_blocks = initial_blocks;
+    while (allocated_blocks < needed_blocks) {
+        __u32 hint = 0;
+        if (inode->nr_extents > 0) {
+            const struct tosfs_extent* last = inode_v2_extent_slot(inode, inode->nr_extents - 1);
+            hint = last->start + last->length;
+        }
 
-        se = fuse_lowlevel_new(&args, &ensea_ll_oper,
-                       sizeof(ensea_ll_oper), NULL);
-        if (se != NULL) {
-            if (fuse_set_signal_handlers(se) != -1) {
-                fuse_session_add_chan(se, ch);
-                errors = fuse_session_loop(se);
-                fuse_remove_signal_handlers(se);
-                fuse_session_remove_chan(ch);
+        __u32 start;
+        const __u32 length = bitmap_allocate_run(&mapped_file->block_allocation, hint, needed_blocks - allocated_blocks, &start);
+        int error = length == 0 ? ENOSPC : EXIT_SUCCESS;
+        if (error == EXIT_SUCCESS) {
+            memset(block_address(start), 0, (size_t) length * TOSFS_BLOCK_SIZE);
+            error = inode_v2_append_extent(inode, start, length);
+            if (error != EXIT_SUCCESS) {
+                bitmap_update_range(&mapped_file->block_allocation, start, length, 0);
             }
-            fuse_session_destroy(se);
         }
-        fuse_unmount(mountpoint, ch);
+        if (error != EXIT_SUCCESS) {
+            // A request that cannot be fully served leaves the file as it was
+            inode_v2_release_blocks(inode, initial_blocks);
+            return error;
+        }
+        allocated_blocks += length;
     }
-    fuse_opt_free_args(&args);
 
-    close_mapped_file();
-	return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+    return EXIT_SUCCESS;
+}
+
+/// The block-th decompressed block of a compressed file, from the block cache when it holds it. `destination`
+/// holds TOSFS_BLOCK_SIZE bytes. Returns the length of the block, or SYSTEM_CALL_ERROR when its stored bytes
+/// are corrupted.
+static long compressed_block_read(const fuse_ino_t ino, const __u32 block, char* destination) {
+    struct block_cache* cache = &mapped_file->block_cache;
+    if (cache->capacity > 0) {
+        const long cached = block_cache_get(cache, (__u32) ino, block, destination);
+        if (cached != SYSTEM_CALL_ERROR) {
+            return cached;
+        }
+    }
+
+    const long length = tosfs_read_compressed_block(&mapped_file->image, ino, block, destination);
+    if (length == -1) {
+        return SYSTEM_CALL_ERROR;
+    }
+    if (cache->capacity > 0) {
+        block_cache_put(cache, (__u32) ino, block, destination, (__u32) length);
+    }
+    return length;
+}
+
+/// Turns a compressed file into a plain one, which the daemon only ever writes, before it is written to or
+/// truncated. When the plain blocks cannot be allocated the file is put back as it was. Blocks of the file left
+/// in the block cache are never read again: the daemon does not compress. Must be called with metadata_lock
+/// held for writing.
+static int inode_uncompress(const fuse_ino_t ino) {
+    if (!tosfs_inode_compressed(&mapped_file->image, ino)) {
+        return EXIT_SUCCESS;
+    }
+
+    struct tosfs_attributes attributes;
+    inode_load(ino, &attributes);
+    const __u32 data_blocks = blocks_for_size(attributes.size);
+    const __u32 stored_blocks = inode_allocated_blocks(ino);
+    char* data = malloc(((size_t) data_blocks + stored_blocks) * TOSFS_BLOCK_SIZE);
+    if (data == NULL) {
+        return ENOMEM;
+    }
+    char* stored = data + (size_t) data_blocks * TOSFS_BLOCK_SIZE;
+    int error = tosfs_inode_read_stored(&mapped_file->image, ino, 0, (size_t) stored_blocks * TOSFS_BLOCK_SIZE, stored) == -1
+        ? EIO : EXIT_SUCCESS;
+    for (__u32 block = 0; block < data_blocks && error == EXIT_SUCCESS; block++) {
+        if (tosfs_read_compressed_block(&mapped_file->image, ino, block, data + (size_t) block * TOSFS_BLOCK_SIZE) == -1) {
+            error = EIO;
+        }
+    }
+    if (error != EXIT_SUCCESS) {
+        free(data);
+        return error;
+    }
+
+    struct tosfs_inode_v2* inode = &mapped_file->image.inodes_v2[ino];
+    inode_v2_release_blocks(inode, 0);
+    inode->flags &= ~TOSFS_INODE_COMPRESSED;
+    error = inode_reserve_blocks(ino, data_blocks);
+    if (error == EXIT_SUCCESS) {
+        inode_copy_in(ino, 0, data, attributes.size);
+    } else if (inode_reserve_blocks(ino, stored_blocks) == EXIT_SUCCESS) {
+        // The blocks just given back are enough for the stored bytes
+        inode_copy_in(ino, 0, stored, (size_t) stored_blocks * TOSFS_BLOCK_SIZE);
+        inode->flags |= TOSFS_INODE_COMPRESSED;
+    }
+    free(data);
+    return error;
+}
+
+/// Gives the inode and its blocks back to the allocator. Must be called with metadata_lock held for writing.
+static void release_inode(const fuse_ino_t ino) {
+    if (mapped_file->image.version == TOSFS_VERSION_1) {
+        struct tosfs_inode* inode = &mapped_file->image.inodes[ino];
+        if (inode->block_no < mapped_file->block_allocation.bit_count) {
+            bitmap_clear(&mapped_file->block_allocation, inode->block_no);
+        }
+        memset(inode, 0, sizeof(struct tosfs_inode));
+    } else {
+        struct tosfs_inode_v2* inode = &mapped_file->image.inodes_v2[ino];
+        inode_v2_release_blocks(inode, 0);
+        memset(inode, 0, sizeof(struct tosfs_inode_v2));
+    }
+
+    bitmap_clear(&mapped_file->inode_allocation, ino);
+    mapped_file->image.superblock->inodes--;
+}
+
+/// Makes sure the bitmaps flag a live inode and every block it owns before the allocator trusts them: images
+/// built by hand do not always flag the metadata blocks or the last data block.
+static void reserve_inode_bits(const fuse_ino_t ino) {
+    struct allocation_bitmap* blocks = &mapped_file->block_allocation;
+
+    bitmap_set(&mapped_file->inode_allocation, ino);
+    const __u32 extent_count = inode_extent_count(ino);
+    for (__u32 index = 0; index < extent_count; index++) {
+        const struct tosfs_extent extent = inode_extent(ino, index);
+        if (extent.start < blocks->bit_count) {
+            bitmap_update_range(blocks, extent.start, min_macro(extent.length, blocks->bit_count - extent.start), 1);
+        }
+    }
+    if (mapped_file->image.version == TOSFS_VERSION_2 && mapped_file->image.inodes_v2[ino].extent_block != 0 &&
+        mapped_file->image.inodes_v2[ino].extent_block < blocks->bit_count) {
+        bitmap_set(blocks, mapped_file->image.inodes_v2[ino].extent_block);
+    }
+}
+
+/// Unlinked inodes stay allocated until the kernel forgets them; the ones still held when the image was last
+/// closed are reclaimed here.
+static void release_orphan_inodes() {
+    for (__u32 ino = 1; ino < mapped_file->inode_allocation.bit_count; ino++) {
+        struct tosfs_attributes attributes;
+        if (inode_load(ino, &attributes) != SYSTEM_CALL_ERROR && attributes.nlink == 0) {
+            release_inode(ino);
+        }
+    }
+}
+
+/// Whether the inode is a directory. Images built by hand may leave the mode of the root to zero.
+static int inode_is_directory(const fuse_ino_t ino, const struct tosfs_attributes* attributes) {
+    return tosfs_is_directory(&mapped_file->image, ino, attributes);
+}
+
+/// Blocks of a directory, where logical_block counts blocks across its extents.
+static struct tosfs_dentry* directory_block(const fuse_ino_t dir, __u32 logical_block) {
+    const __u32 extent_count = inode_extent_count(dir);
+    for (__u32 index = 0; index < extent_count; index++) {
+        const struct tosfs_extent extent = inode_extent(dir, index);
+        if (logical_block < extent.length) {
+            return (struct tosfs_dentry*) block_address(extent.start + logical_block);
+        }
+        logical_block -= extent.length;
+    }
+    return NULL;
+}
+
+/// Number of blocks names are hashed over: the directory size rounded down to a power of two, so that an image
+/// built by hand with an odd number of blocks still gets a consistent layout.
+static __u32 directory_bucket_count(const fuse_ino_t dir) {
+    const __u32 blocks = inode_allocated_blocks(dir);
+    return blocks == 0 ? 0 : 1u << (31 - __builtin_clz(blocks));
+}
+
+static struct tosfs_dentry* dentry_block_free_slot(struct tosfs_dentry* block) {
+    for (unsigned int entry_number = 0; entry_number < TOSFS_DENTRIES_PER_BLOCK; entry_number++) {
+        if (block[entry_number].inode == 0) {
+            return &block[entry_number];
+        }
+    }
+    return NULL;
 }
 
+/// Copies an on disk name, which is not NUL terminated when it uses the whole field.
+static void dentry_name_copy(char name[TOSFS_MAX_NAME_LENGTH + 1], const struct tosfs_dentry* entry) {
+    memcpy(name, entry->name, TOSFS_MAX_NAME_LENGTH);
+    name[TOSFS_MAX_NAME_LENGTH] = '\0';
+}
+
+/// Doubles a v2 directory. Block b keeps the names whose hash has the `buckets` bit cleared and hands the others
+/// to the new block b + buckets, which starts empty, so a split never overflows.
+static int directory_grow(const fuse_ino_t dir, const __u32 buckets) {
+    if (mapped_file->image.version == TOSFS_VERSION_1) {
+        return ENOSPC;
+    }
+    const int error = inode_reserve_blocks(dir, 2 * buckets);
+    if (error != EXIT_SUCCESS) {
+        return error;
+    }
 
+    char name[TOSFS_MAX_NAME_LENGTH + 1];
+    for (__u32 block = 0; block < buckets; block++) {
+        struct tosfs_dentry* source = directory_block(dir, block);
+        struct tosfs_dentry* destination = directory_block(dir, block + buckets);
+        for (unsigned int entry_number = 0; entry_number < TOSFS_DENTRIES_PER_BLOCK; entry_number++) {
+            if (source[entry_number].inode == 0 || (tosfs_name_hash(source[entry_number].name) & buckets) == 0) {
+                continue;
+            }
+            struct tosfs_dentry* moved = dentry_block_free_slot(destination);
+            if (moved == NULL) {
+                // Only an image built by hand with an odd number of blocks can get here; the name stays put
+                break;
+            }
+
+            // The index compares names through its dentry pointer, so it is looked up before the entry moves
+            dentry_name_copy(name, &source[entry_number]);
+            struct dentry_index_slot* slot = dentry_index_find_slot(&mapped_file->dentry_index, dir, name);
+            *moved = source[entry_number];
+            memset(&source[entry_number], 0, sizeof(struct tosfs_dentry));
+            if (slot != NULL) {
+                slot->dentry = moved;
+            }
+        }
+    }
 
+    inode_store_size(dir, (__u64) inode_allocated_blocks(dir) * TOSFS_BLOCK_SIZE);
+    return EXIT_SUCCESS;
+}
 
+/// Writes a name in a free slot of its home block, doubling the directory while that block is full.
+/// Must be called with metadata_lock held for writing.
+static int directory_add_entry(const fuse_ino_t dir, const char* name, const __u32 ino) {
+    const __u32 hash = tosfs_name_hash(name);
+
+    while (1) {
+        const __u32 buckets = directory_bucket_count(dir);
+        struct tosfs_dentry* block = buckets == 0 ? NULL : directory_block(dir, hash & (buckets - 1));
+        struct tosfs_dentry* entry = block == NULL ? NULL : dentry_block_free_slot(block);
+        if (entry != NULL) {
+            memset(entry->name, 0, TOSFS_MAX_NAME_LENGTH);
+            memcpy(entry->name, name, dentry_name_length(name));
+            entry->inode = ino;
+            dentry_index_insert(&mapped_file->dentry_index, dir, entry);
+            return EXIT_SUCCESS;
+        }
 
+        const int error = buckets == 0 ? ENOSPC : directory_grow(dir, buckets);
+        if (error != EXIT_SUCCESS) {
+            return error;
+        }
+    }
+}
 
+/// Must be called with metadata_lock held for writing.
+static void directory_remove_entry(struct dentry_index_slot* slot) {
+    struct tosfs_dentry* entry = slot->dentry;
+    dentry_index_remove(&mapped_file->dentry_index, slot);
+    memset(entry, 0, sizeof(struct tosfs_dentry));
+}
 
+/// Drops the "." and ".." entries of a directory about to go. Must be called with metadata_lock held for writing.
+static void directory_remove_dots(const fuse_ino_t dir) {
+    static const char* dots[] = { ".", ".." };
+    for (unsigned int i = 0; i < sizeof(dots) / sizeof(dots[0]); i++) {
+        struct dentry_index_slot* slot = dentry_index_find_slot(&mapped_file->dentry_index, dir, dots[i]);
+        if (slot != NULL) {
+            directory_remove_entry(slot);
+        }
+    }
+}
 
+static int directory_is_empty(const fuse_ino_t dir) {
+    struct tosfs_dentry_cursor cursor;
+    tosfs_dentry_cursor_init(&mapped_file->image, &cursor, dir);
 
+    const struct tosfs_dentry* entry;
+    while ((entry = tosfs_dentry_next(&mapped_file->image, &cursor)) != NULL) {
+        if (strncmp(entry->name, ".", TOSFS_MAX_NAME_LENGTH) != 0 && strncmp(entry->name, "..", TOSFS_MAX_NAME_LENGTH) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
 
+/// Whether every run of an inode, and its extent block, lies past the superblock and inside the image.
+static int inode_extents_valid(const struct mapped_file_struct* file, const fuse_ino_t ino) {
+    const __u32 extent_count = tosfs_extent_count(&file->image, ino);
+    // The count read back stops at the inline extents when the extent block is outside the file, which the
+    // writers that append extents would not know
+    if (file->image.version == TOSFS_VERSION_2 && file->image.inodes_v2[ino].nr_extents > TOSFS_INLINE_EXTENTS &&
+        !tosfs_range_valid(&file->image, file->image.inodes_v2[ino].extent_block, 1)) {
+        return 0;
+    }
+    for (__u32 index = 0; index < extent_count; index++) {
+        const struct tosfs_extent extent = tosfs_extent_at(&file->image, ino, index);
+        if (extent.length > 0 && !tosfs_range_valid(&file->image, extent.start, extent.length)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/// The single run holding all the blocks of an inode, merging extents that follow each other on disk.
+static struct tosfs_extent inode_contiguous_run(const struct mapped_file_struct* file, const fuse_ino_t ino) {
+    struct tosfs_extent run = { .start = 0, .length = 0 };
+    const __u32 extent_count = tosfs_extent_count(&file->image, ino);
+    for (__u32 index = 0; index < extent_count; index++) {
+        const struct tosfs_extent extent = tosfs_extent_at(&file->image, ino, index);
+        if (index == 0) {
+            run = extent;
+        } else if (extent.start == run.start + run.length) {
+            run.length += extent.length;
+        } else {
+            run.length = 0;
+            break;
+        }
+    }
+    return run;
+}
+
+static void image_tables_add_entry(struct image_tables* tables, struct tosfs_dentry* entry) {
+    if (tables->directory_entry_count == tables->directory_entry_capacity) {
+        const size_t new_capacity = max_macro(2 * tables->directory_entry_capacity, (size_t) DENTRY_INDEX_MIN_CAPACITY);
+        struct tosfs_dentry** new_entries = realloc(tables->directory_entries, new_capacity * sizeof(struct tosfs_dentry*));
+        if (new_entries == NULL) {
+            perror("image_tables_add_entry: realloc failed");
+            exit(EXIT_FAILURE);
+        }
+        tables->directory_entries = new_entries;
+        tables->directory_entry_capacity = new_capacity;
+    }
+    tables->directory_entries[tables->directory_entry_count++] = entry;
+}
+
+static void image_tables_init(struct image_tables* tables, const __u32 inode_capacity) {
+    memset(tables, 0, sizeof(struct image_tables));
+    tables->contiguous = calloc(inode_capacity, sizeof(struct tosfs_extent));
+    tables->directory_first = calloc((size_t) inode_capacity + 1, sizeof(__u32));
+    if (tables->contiguous == NULL || tables->directory_first == NULL) {
+        perror("image_tables_init: calloc failed");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void image_tables_free(struct image_tables* tables) {
+    free(tables->contiguous);
+    free(tables->directory_first);
+    free(tables->directory_entries);
+    memset(tables, 0, sizeof(struct image_tables));
+}
+
+/// Builds the in-memory state of the image in a single walk of the inode table: the dentry index, then the
+/// bitmap bits of every inode in use for a writable image, or the contiguous runs and directory entry arrays
+/// of a read-only one. Orphans of a writable image are reclaimed on the way. Returns SYSTEM_CALL_ERROR when an
+/// inode owns blocks outside the image, and logs how long the walk took and the memory its tables use.
+/// A read-only image is indexed before it is swapped in, so nothing here may go through mapped_file; a writable
+/// one is never reloaded and is always mapped_file already, whose allocator releases the orphans.
+static int index_image(struct mapped_file_struct* file) {
+    struct timespec started, finished;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    // Every inode has a name and every directory two dots: sized so that a typical image never rehashes
+    size_t index_capacity = DENTRY_INDEX_MIN_CAPACITY;
+    while (index_capacity < 4 * (size_t) file->image.superblock->inodes) {
+        index_capacity *= 2;
+    }
+    dentry_index_init(&file->dentry_index, index_capacity);
+
+    struct image_tables* tables = &file->tables;
+    if (options.read_only) {
+        image_tables_init(tables, file->image.inode_table_capacity);
+    } else {
+        bitmap_summary_init(&file->block_allocation);
+        bitmap_summary_init(&file->inode_allocation);
+        bitmap_update_range(&file->block_allocation, TOSFS_SUPERBLOCK,
+                            min_macro(file->image.metadata_blocks, file->block_allocation.bit_count), 1);
+    }
+
+    __u32 live_inodes = 0;
+    __u32 compressed_inodes = 0;
+    size_t dangling_entries = 0;
+    for (__u32 ino = 1; ino < file->image.inode_table_capacity; ino++) {
+        if (options.read_only) {
+            tables->directory_first[ino] = (__u32) tables->directory_entry_count;
+        }
+        struct tosfs_attributes attributes;
+        if (tosfs_inode_load(&file->image, ino, &attributes) == -1) {
+            continue;
+        }
+        if (!inode_extents_valid(file, ino)) {
+            fprintf(stderr, "index_image: inode %u owns blocks outside the image\n", ino);
+            return SYSTEM_CALL_ERROR;
+        }
+        if (!options.read_only && attributes.nlink == 0) {
+            // Unlinked while the kernel still held it when the image was last closed
+            release_inode(ino);
+            continue;
+        }
+
+        live_inodes++;
+        compressed_inodes += tosfs_inode_compressed(&file->image, ino);
+        if (options.read_only) {
+            tables->contiguous[ino] = inode_contiguous_run(file, ino);
+        } else {
+            reserve_inode_bits(ino);
+        }
+        if (!tosfs_is_directory(&file->image, ino, &attributes)) {
+            continue;
+        }
+
+        struct tosfs_dentry_cursor cursor;
+        tosfs_dentry_cursor_init(&file->image, &cursor, ino);
+        struct tosfs_dentry* entry;
+        while ((entry = tosfs_dentry_next(&file->image, &cursor)) != NULL) {
+            struct tosfs_attributes target;
+            if (tosfs_inode_load(&file->image, entry->inode, &target) == -1) {
+                // Left out of the index and the listings, so the name is never served with no attributes
+                dangling_entries++;
+                continue;
+            }
+            dentry_index_insert(&file->dentry_index, ino, entry);
+            if (options.read_only) {
+                image_tables_add_entry(tables, entry);
+            }
+        }
+    }
+
+    if (compressed_inodes > 0 && options.cache_blocks > 0) {
+        block_cache_init(&file->block_cache, options.cache_blocks);
+    }
+
+    size_t table_bytes = file->dentry_index.capacity * sizeof(struct dentry_index_slot);
+    if (options.read_only) {
+        tables->directory_first[file->image.inode_table_capacity] = (__u32) tables->directory_entry_count;
+        table_bytes += (size_t) file->image.inode_table_capacity * (sizeof(struct tosfs_extent) + sizeof(__u32)) +
+            tables->directory_entry_capacity * sizeof(struct tosfs_dentry*);
+    } else {
+        table_bytes += ((size_t) file->block_allocation.group_count + file->inode_allocation.group_count) *
+            sizeof(__u32);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    fprintf(stderr, "tosfs: indexed %u inodes and %zu entries in %.3f ms, %zu KiB of tables\n",
+            live_inodes, file->dentry_index.count,
+            (double) (finished.tv_sec - started.tv_sec) * 1e3 + (double) (finished.tv_nsec - started.tv_nsec) / 1e6,
+            table_bytes / 1024);
+    if (dangling_entries > 0) {
+        fprintf(stderr, "tosfs: %zu entries name a free inode and are left out, fsck.tosfs lists them\n", dangling_entries);
+    }
+    if (compressed_inodes > 0) {
+        fprintf(stderr, "tosfs: %u compressed files, %u decompressed blocks cached at most\n", compressed_inodes,
+                file->block_cache.capacity);
+    }
+    return EXIT_SUCCESS;
+}
+
+/// Maps the image at image_path, or returns NULL when it cannot be opened.
+static struct mapped_file_struct* map_example_file() {
+    struct mapped_file_struct* image = calloc(1, sizeof(struct mapped_file_struct));
+    if (image == NULL) {
+        perror("map_example_file: calloc");
+        return NULL;
+    }
+
+    const int flags = options.read_only ? 0 : TOSFS_OPEN_WRITE;
+    if (tosfs_image_open(&image->image, image_path, flags | (options.populate ? TOSFS_OPEN_POPULATE : 0), 0) == -1) {
+        free(image);
+        return NULL;
+    }
+    return image;
+}
+
+static void directory_handle_free(struct directory_handle* handle) {
+    free(handle->entries.data_pointer);
+    free(handle->entries.entry_ends);
+    free(handle->entries_plus.data_pointer);
+    free(handle->entries_plus.entry_ends);
+    free(handle);
+}
+
+static void free_shared_handles(struct mapped_file_struct* image) {
+    if (image->shared_handles == NULL) {
+        return;
+    }
+    for (__u32 dir = 0; dir < image->image.inode_table_capacity; dir++) {
+        struct directory_handle* handle = image->shared_handles[dir];
+        if (handle != NULL) {
+            directory_handle_free(handle);
+        }
+    }
+    free(image->shared_handles);
+}
+
+/// Unmaps an image. Orphans are only reclaimed and pages only flushed for the writable image, which is always
+/// the current one.
+static void close_mapped_file(struct mapped_file_struct* image) {
+    if (!options.read_only) {
+        release_orphan_inodes();
+    }
+    if (tosfs_image_close(&image->image) == -1) {
+        exit(EXIT_FAILURE);
+    }
+    dentry_index_free(&image->dentry_index);
+    image_tables_free(&image->tables);
+    bitmap_summary_free(&image->block_allocation);
+    bitmap_summary_free(&image->inode_allocation);
+    block_cache_free(&image->block_cache);
+    free_shared_handles(image);
+    free(image);
+}
+
+/// Byte range of the image covering blocks [first, last), widened to whole pages as madvise and mlock want.
+static void image_page_range(const struct mapped_file_struct* file, const __u32 first, const __u32 last, char** start,
+                             size_t* length) {
+    const size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    const size_t begin = (size_t) first * TOSFS_BLOCK_SIZE / page_size * page_size;
+    const size_t end = min_macro((size_t) last * TOSFS_BLOCK_SIZE, (size_t) file->image.file_info.st_size);
+    *start = (char*) file->image.map + begin;
+    *length = end > begin ? end - begin : 0;
+}
+
+/// Applies the residency options once the metadata region is known. Every call only tunes paging, so a failure
+/// is reported and the mount goes on.
+static void advise_mapped_file(const struct mapped_file_struct* file) {
+    char* start;
+    size_t length;
+
+    image_page_range(file, file->image.metadata_blocks, file->image.block_count, &start, &length);
+    if (data_advice != MADV_NORMAL && length > 0 && madvise(start, length, data_advice) == SYSTEM_CALL_ERROR) {
+        perror("advise_mapped_file: madvise data");
+    }
+
+    // The dentry index build and every lookup walk the inode table first
+    image_page_range(file, 0, file->image.metadata_blocks, &start, &length);
+    if (options.prefetch_metadata && madvise(start, length, MADV_WILLNEED) == SYSTEM_CALL_ERROR) {
+        perror("advise_mapped_file: madvise metadata");
+    }
+    // Unlocked again by munmap, so a reloaded image drops the lock of the old one
+    if (options.lock_metadata && mlock(start, length) == SYSTEM_CALL_ERROR) {
+        perror("advise_mapped_file: mlock metadata");
+    }
+}
+
+/// Checks a mapped image and builds its in-memory state, without touching the one being served. Returns
+/// SYSTEM_CALL_ERROR for an image tosfs cannot serve.
+static int read_mapped_file_as_tosfs_file(struct mapped_file_struct* file) {
+    if (tosfs_image_read(&file->image) == -1) {
+        return SYSTEM_CALL_ERROR;
+    }
+
+    struct tosfs_superblock* superblock = file->image.superblock;
+    if (tosfs_image_has_regions(&file->image)) {
+        file->block_allocation.words = (__u32*) tosfs_block(&file->image, superblock->block_bitmap_start);
+        file->block_allocation.bit_count = (__u32) min_macro(
+            (__u64) file->image.block_count, (__u64) superblock->block_bitmap_blocks * TOSFS_BITMAP_BLOCK_BITS);
+        file->inode_allocation.words = (__u32*) tosfs_block(&file->image, superblock->inode_bitmap_start);
+        file->inode_allocation.bit_count = file->image.inode_table_capacity;
+    } else {
+        // 32 block layout: both bitmaps are words of the superblock
+        file->block_allocation.words = &superblock->block_bitmap;
+        file->block_allocation.bit_count = min_macro(file->image.block_count, (__u32) BITMAP_BITS);
+        file->inode_allocation.words = &superblock->inode_bitmap;
+        file->inode_allocation.bit_count = min_macro(file->image.inode_table_capacity, (__u32) BITMAP_BITS);
+    }
+    file->block_allocation.first_bit = 0;
+    file->inode_allocation.first_bit = 1;
+    advise_mapped_file(file);
+
+    return index_image(file);
+}
+
+
+/// Requests counted in the statistics, one per entry of ensea_ll_oper.
+enum ensea_op {
+    ENSEA_OP_LOOKUP,
+    ENSEA_OP_FORGET,
+    ENSEA_OP_GETATTR,
+    ENSEA_OP_SETATTR,
+    ENSEA_OP_MKDIR,
+    ENSEA_OP_UNLINK,
+    ENSEA_OP_RMDIR,
+    ENSEA_OP_CREATE,
+    ENSEA_OP_OPENDIR,
+    ENSEA_OP_READDIR,
+    ENSEA_OP_READDIRPLUS,
+    ENSEA_OP_RELEASEDIR,
+    ENSEA_OP_OPEN,
+    ENSEA_OP_READ,
+    ENSEA_OP_WRITE,
+    ENSEA_OP_RELEASE,
+    ENSEA_OP_FSYNC,
+    ENSEA_OP_COUNT,
+};
+
+static const char* const ensea_op_names[ENSEA_OP_COUNT] = {
+    "lookup", "forget", "getattr", "setattr", "mkdir", "unlink", "rmdir", "create", "opendir", "readdir",
+    "readdirplus", "releasedir", "open", "read", "write", "release", "fsync",
+};
+
+/// What the request served by the calling thread answered, read by the statistics once the handler returns.
+struct request_outcome {
+    int error;
+    size_t bytes;
+};
+
+static __thread struct request_outcome request_outcome;
+
+static int reply_err(fuse_req_t req, const int err) {
+    request_outcome.error = err;
+    return fuse_reply_err(req, err);
+}
+
+/// Snapshot of the statistics taken when the stats file is opened, so that every read of one open sees the same text.
+struct stats_snapshot {
+    char* text;
+    size_t size;
+};
+
+static struct stats_snapshot* stats_snapshot_new() {
+    struct stats_snapshot* snapshot = calloc(1, sizeof(struct stats_snapshot));
+    if (snapshot == NULL) {
+        return NULL;
+    }
+    snapshot->text = op_stats_render(ensea_op_names, ENSEA_OP_COUNT, &snapshot->size);
+    if (snapshot->text == NULL) {
+        free(snapshot);
+        return NULL;
+    }
+
+    struct block_cache* cache = &mapped_file->block_cache;
+    if (cache->capacity > 0) {
+        unsigned long long hits = 0, misses = 0, used = 0;
+        for (unsigned int index = 0; index < BLOCK_CACHE_SHARDS; index++) {
+            struct block_cache_shard* shard = &cache->shards[index];
+            pthread_mutex_lock(&shard->lock);
+            hits += shard->hits;
+            misses += shard->misses;
+            used += shard->used;
+            pthread_mutex_unlock(&shard->lock);
+        }
+        char line[128];
+        const int length = snprintf(line, sizeof(line), "block_cache hits=%llu misses=%llu blocks=%llu capacity=%u\n",
+                                    hits, misses, used, cache->capacity);
+        char* text = realloc(snapshot->text, snapshot->size + (size_t) length + 1);
+        if (text != NULL) {
+            memcpy(text + snapshot->size, line, (size_t) length + 1);
+            snapshot->text = text;
+            snapshot->size += (size_t) length;
+        }
+    }
+    return snapshot;
+}
+
+static void stats_snapshot_free(struct stats_snapshot* snapshot) {
+    if (snapshot != NULL) {
+        free(snapshot->text);
+        free(snapshot);
+    }
+}
+
+/// The file is opened in direct I/O, which reads until the end of the text whatever the size, so the size stays 0
+/// and a stat formats nothing. Only a kernel reading through its page cache (no_open) needs the real size, the
+/// one of a snapshot taken now.
+static void stats_file_stat(struct stat *stbuf) {
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_ino = STATS_INODE;
+    stbuf->st_mode = S_IFREG | 0444;
+    stbuf->st_nlink = 1;
+    stbuf->st_uid = getuid();
+    stbuf->st_gid = getgid();
+
+    if (options.no_open) {
+        struct stats_snapshot* snapshot = stats_snapshot_new();
+        if (snapshot != NULL) {
+            stbuf->st_size = (off_t) snapshot->size;
+            stats_snapshot_free(snapshot);
+        }
+    }
+}
+
+static int ensea_ll_stat(fuse_ino_t ino, struct stat *stbuf) {
+    struct tosfs_attributes attributes;
+    if (inode_load(ino, &attributes) == SYSTEM_CALL_ERROR) {
+        return SYSTEM_CALL_ERROR;
+    }
+
+    stbuf->st_ino = (ino_t) attributes.inode;
+    stbuf->st_nlink = (nlink_t) attributes.nlink;
+    stbuf->st_uid = (uid_t) attributes.uid;
+    stbuf->st_gid = (gid_t) attributes.gid;
+    stbuf->st_size = (off_t) attributes.size;
+    stbuf->st_mode = (inode_is_directory(ino, &attributes) ? S_IFDIR : S_IFREG) | (attributes.perm & 0777);
+
+    return EXIT_SUCCESS;
+}
+
+/// Returns SYSTEM_CALL_ERROR when the inode is free, in which case the entry must not be replied.
+static int fill_entry_param(struct fuse_entry_param* entry_param, const fuse_ino_t ino) {
+    memset(entry_param, 0, sizeof(struct fuse_entry_param));
+    entry_param->ino = ino;
+    entry_param->attr_timeout = options.attr_timeout;
+    entry_param->entry_timeout = options.entry_timeout;
+    return ensea_ll_stat(ino, &entry_param->attr);
+}
+
+static void dirbuf_reserve(struct directory_buffer *buf, const size_t needed_size) {
+    if (needed_size <= buf->capacity) {
+        return;
+    }
+
+    size_t new_capacity = max_macro(buf->capacity, (size_t) DIRECTORY_BUFFER_MIN_CAPACITY);
+    while (new_capacity < needed_size) {
+        new_capacity *= 2;
+    }
+
+    char* new_ptr = realloc(buf->data_pointer, new_capacity);
+    if (new_ptr == NULL) {
+        perror("dirbuf_reserve: realloc failed");
+        exit(EXIT_FAILURE);
+    }
+    buf->data_pointer = new_ptr;
+    buf->capacity = new_capacity;
+}
+
+/// Records the end of the entry just serialized, and returns its d_off: the number of the entry after it.
+static off_t dirbuf_end_entry(struct directory_buffer *buf) {
+    if (buf->entry_count == buf->entry_capacity) {
+        const size_t new_capacity = max_macro(2 * buf->entry_capacity, (size_t) DIRECTORY_BUFFER_MIN_CAPACITY / sizeof(size_t));
+        size_t* new_ends = realloc(buf->entry_ends, new_capacity * sizeof(size_t));
+        if (new_ends == NULL) {
+            perror("dirbuf_end_entry: realloc failed");
+            exit(EXIT_FAILURE);
+        }
+        buf->entry_ends = new_ends;
+        buf->entry_capacity = new_capacity;
+    }
+    buf->entry_ends[buf->entry_count++] = buf->size;
+    return (off_t) buf->entry_count;
+}
+
+static void dirbuf_add(fuse_req_t req, struct directory_buffer *buf, const char *name, fuse_ino_t ino) {
+    struct stat stbuf;
+    const size_t old_size = buf->size;
+    const size_t entry_size = fuse_add_direntry(req, NULL, 0, name, NULL, 0);
+    dirbuf_reserve(buf, old_size + entry_size);
+    buf->size += entry_size;
+    memset(&stbuf, 0, sizeof(stbuf));
+    stbuf.st_ino = ino;
+    fuse_add_direntry(req, buf->data_pointer + old_size, entry_size, name, &stbuf, dirbuf_end_entry(buf));
+}
+
+static void dirbuf_add_plus(fuse_req_t req, struct directory_buffer *buf, const char *name, fuse_ino_t ino) {
+    struct fuse_entry_param entry_param;
+    memset(&entry_param, 0, sizeof(entry_param));
+
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        // A zero node id tells the kernel not to instantiate an entry, so no lookup count is taken
+        entry_param.attr.st_ino = ino;
+        entry_param.attr.st_mode = S_IFDIR;
+    } else if (fill_entry_param(&entry_param, ino) == SYSTEM_CALL_ERROR) {
+        // dirbuf_fill leaves free inodes out; should one get here, it is listed without an entry, as the dots
+        memset(&entry_param, 0, sizeof(entry_param));
+        entry_param.attr.st_ino = ino;
+    }
+
+    const size_t old_size = buf->size;
+    const size_t entry_size = fuse_add_direntry_plus(req, NULL, 0, name, NULL, 0);
+    dirbuf_reserve(buf, old_size + entry_size);
+    buf->size += entry_size;
+    fuse_add_direntry_plus(req, buf->data_pointer + old_size, entry_size, name, &entry_param, dirbuf_end_entry(buf));
+}
+
+static void dirbuf_fill(fuse_req_t req, const fuse_ino_t dir, struct directory_buffer *buf,
+                        void (*add_entry)(fuse_req_t, struct directory_buffer*, const char*, fuse_ino_t)) {
+    char name[TOSFS_MAX_NAME_LENGTH + 1];
+    const struct image_tables* tables = &mapped_file->tables;
+    if (tables->directory_first != NULL) {
+        // Read-only image: the live entries were gathered at mount, no need to scan the free slots again
+        for (__u32 position = tables->directory_first[dir]; position < tables->directory_first[dir + 1]; position++) {
+            dentry_name_copy(name, tables->directory_entries[position]);
+            add_entry(req, buf, name, tables->directory_entries[position]->inode);
+        }
+        return;
+    }
+
+    struct tosfs_dentry_cursor cursor;
+    tosfs_dentry_cursor_init(&mapped_file->image, &cursor, dir);
+
+    const struct tosfs_dentry* disk_entry;
+    while ((disk_entry = tosfs_dentry_next(&mapped_file->image, &cursor)) != NULL) {
+        struct tosfs_attributes target;
+        if (inode_load(disk_entry->inode, &target) == SYSTEM_CALL_ERROR) {
+            // Names of a free inode are left out at mount, see index_image
+            continue;
+        }
+        dentry_name_copy(name, disk_entry);
+        add_entry(req, buf, name, disk_entry->inode);
+    }
+}
+
+static int reply_buf_limited(fuse_req_t req, const char *buf, const size_t buffer_size, const off_t offset, size_t maxsize) {
+    if (offset < buffer_size) {
+        request_outcome.bytes = min_macro(buffer_size - offset, maxsize);
+        return fuse_reply_buf(req, buf + offset, request_outcome.bytes);
+    }
+
+    return fuse_reply_buf(req, NULL, 0);
+}
+
+/// Replies with the whole entries of a listing from entry number `offset` on, as many as fit in maxsize bytes.
+/// The kernel asks for at least a page, which always holds an entry.
+static int reply_entries_limited(fuse_req_t req, const struct directory_buffer *buf, const off_t offset, const size_t maxsize) {
+    if (offset < 0 || (size_t) offset >= buf->entry_count) {
+        return fuse_reply_buf(req, NULL, 0);
+    }
+
+    const size_t start = offset == 0 ? 0 : buf->entry_ends[offset - 1];
+    // First entry that ends past maxsize bytes from the start
+    size_t low = (size_t) offset;
+    size_t high = buf->entry_count;
+    while (low < high) {
+        const size_t middle = low + (high - low) / 2;
+        if (buf->entry_ends[middle] - start <= maxsize) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    const size_t end = low == (size_t) offset ? start : buf->entry_ends[low - 1];
+    request_outcome.bytes = end - start;
+    return fuse_reply_buf(req, buf->data_pointer + start, end - start);
+}
+
+static void ensea_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    struct fuse_entry_param entry_param;
+
+    if (parent == mapped_file->image.superblock->root_inode && strcmp(name, STATS_FILE_NAME) == 0) {
+        memset(&entry_param, 0, sizeof(entry_param));
+        entry_param.ino = STATS_INODE;
+        entry_param.entry_timeout = options.entry_timeout;
+        stats_file_stat(&entry_param.attr);
+        fuse_reply_entry(req, &entry_param);
+        return;
+    }
+
+    pthread_rwlock_rdlock(&metadata_lock);
+    const struct tosfs_dentry* disk_entry = dentry_index_find(&mapped_file->dentry_index, parent, name);
+    if (disk_entry == NULL) {
+        pthread_rwlock_unlock(&metadata_lock);
+        request_outcome.error = ENOENT;
+        if (options.negative_timeout > 0) {
+            // A zero node id makes the kernel cache the miss; creating the name through the mount replaces it
+            memset(&entry_param, 0, sizeof(entry_param));
+            entry_param.entry_timeout = options.negative_timeout;
+            fuse_reply_entry(req, &entry_param);
+        } else {
+            reply_err(req, ENOENT);
+        }
+        return;
+    }
+
+    const int status = fill_entry_param(&entry_param, disk_entry->inode);
+    pthread_rwlock_unlock(&metadata_lock);
+
+    if (status == SYSTEM_CALL_ERROR) {
+        reply_err(req, EIO);
+        return;
+    }
+    fuse_reply_entry(req, &entry_param);
+}
+
+static void ensea_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct stat stbuf = {0};
+    (void) fi;
+
+    if (ino == STATS_INODE) {
+        stats_file_stat(&stbuf);
+        fuse_reply_attr(req, &stbuf, 0);
+        return;
+    }
+    if (ensea_ll_stat(ino, &stbuf) == SYSTEM_CALL_ERROR) {
+        reply_err(req, ENOENT);
+    } else {
+        fuse_reply_attr(req, &stbuf, options.attr_timeout);
+    }
+}
+
+static void directory_handle_fill_plus(fuse_req_t req, const fuse_ino_t dir, struct directory_handle* handle) {
+    if (!handle->entries_plus_ready) {
+        pthread_rwlock_rdlock(&metadata_lock);
+        dirbuf_fill(req, dir, &handle->entries_plus, dirbuf_add_plus);
+        pthread_rwlock_unlock(&metadata_lock);
+        handle->entries_plus_ready = 1;
+    }
+}
+
+/// Listing of a directory read without a handle. Only no_opendir, which needs a read-only image, gets here,
+/// so a listing never changes once built.
+static struct directory_handle* get_shared_handle(fuse_req_t req, const fuse_ino_t dir) {
+    if (dir >= mapped_file->image.inode_table_capacity) {
+        return NULL;
+    }
+
+    struct directory_handle** handles = __atomic_load_n(&mapped_file->shared_handles, __ATOMIC_ACQUIRE);
+    struct directory_handle* handle = handles == NULL ? NULL : __atomic_load_n(&handles[dir], __ATOMIC_ACQUIRE);
+    if (handle != NULL) {
+        return handle;
+    }
+
+    pthread_mutex_lock(&shared_handles_lock);
+    struct directory_handle** shared_handles = mapped_file->shared_handles;
+    if (shared_handles == NULL) {
+        shared_handles = calloc(mapped_file->image.inode_table_capacity, sizeof(struct directory_handle*));
+        __atomic_store_n(&mapped_file->shared_handles, shared_handles, __ATOMIC_RELEASE);
+    }
+    handle = shared_handles == NULL ? NULL : shared_handles[dir];
+    if (shared_handles != NULL && handle == NULL) {
+        handle = calloc(1, sizeof(struct directory_handle));
+        if (handle != NULL) {
+            pthread_rwlock_rdlock(&metadata_lock);
+            dirbuf_fill(req, dir, &handle->entries, dirbuf_add);
+            pthread_rwlock_unlock(&metadata_lock);
+            directory_handle_fill_plus(req, dir, handle);
+            __atomic_store_n(&shared_handles[dir], handle, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&shared_handles_lock);
+
+    return handle;
+}
+
+static struct directory_handle* get_directory_handle(fuse_req_t req, const fuse_ino_t dir, const struct fuse_file_info *fi) {
+    if (fi->fh == 0) {
+        return get_shared_handle(req, dir);
+    }
+    return (struct directory_handle*) (uintptr_t) fi->fh;
+}
+
+/// Serializes the whole listing once per open handle; every READDIR on that handle is then a slice of it.
+static void ensea_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct tosfs_attributes attributes;
+    if (inode_load(ino, &attributes) == SYSTEM_CALL_ERROR) {
+        reply_err(req, ENOENT);
+        return;
+    }
+    if (!inode_is_directory(ino, &attributes)) {
+        reply_err(req, ENOTDIR);
+        return;
+    }
+
+    if (options.no_opendir) {
+        // The kernel takes ENOSYS as a success and stops sending OPENDIR, READDIR then uses the shared listing
+        reply_err(req, ENOSYS);
+        return;
+    }
+
+    struct directory_handle* handle = calloc(1, sizeof(struct directory_handle));
+    if (handle == NULL) {
+        reply_err(req, ENOMEM);
+        return;
+    }
+
+    pthread_rwlock_rdlock(&metadata_lock);
+    dirbuf_fill(req, ino, &handle->entries, dirbuf_add);
+    pthread_rwlock_unlock(&metadata_lock);
+
+    fi->fh = (uint64_t) (uintptr_t) handle;
+    // Same for listings: the kernel can answer later READDIRs of a read-only image from its own cache
+    fi->cache_readdir = options.read_only;
+    fi->keep_cache = options.read_only;
+    fuse_reply_open(req, fi);
+}
+
+static void ensea_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    const struct directory_handle* handle = get_directory_handle(req, ino, fi);
+    if (handle == NULL) {
+        reply_err(req, ENOMEM);
+        return;
+    }
+
+    reply_entries_limited(req, &handle->entries, off, size);
+}
+
+/// Same listing as ensea_ll_readdir, with the attributes of every entry inlined so that `ls -l` does not
+/// need a LOOKUP and a GETATTR per file. The kernel serializes readdir calls on a handle, so the lazy build
+/// does not race.
+static void ensea_ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    struct directory_handle* handle = get_directory_handle(req, ino, fi);
+    if (handle == NULL) {
+        reply_err(req, ENOMEM);
+        return;
+    }
+
+    directory_handle_fill_plus(req, ino, handle);
+    reply_entries_limited(req, &handle->entries_plus, off, size);
+}
+
+static void ensea_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    (void) ino;
+    struct directory_handle* handle = (struct directory_handle*) (uintptr_t) fi->fh;
+
+    if (handle != NULL) {
+        directory_handle_free(handle);
+    }
+    reply_err(req, 0);
+}
+
+/// Only the stats file keeps per open state.
+static void ensea_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    if (ino == STATS_INODE) {
+        stats_snapshot_free((struct stats_snapshot*) (uintptr_t) fi->fh);
+    }
+    reply_err(req, 0);
+}
+
+/// Loads the attributes of a regular file, or replies with the matching error and returns SYSTEM_CALL_ERROR.
+static int get_file_attributes(fuse_req_t req, const fuse_ino_t ino, struct tosfs_attributes* attributes) {
+    if (inode_load(ino, attributes) == SYSTEM_CALL_ERROR) {
+        reply_err(req, ENOENT);
+        return SYSTEM_CALL_ERROR;
+    }
+    if (inode_is_directory(ino, attributes)) {
+        reply_err(req, EISDIR);
+        return SYSTEM_CALL_ERROR;
+    }
+    return EXIT_SUCCESS;
+}
+
+/// Must be called with metadata_lock held for writing.
+static int truncate_inode(const fuse_ino_t ino, const __u64 new_size) {
+    struct tosfs_attributes attributes;
+    inode_load(ino, &attributes);
+
+    if (new_size > max_file_size()) {
+        return EFBIG;
+    }
+    // Nothing of an emptied file is kept, so its blocks go back as they are instead of being uncompressed first
+    if (new_size == 0 && tosfs_inode_compressed(&mapped_file->image, ino)) {
+        struct tosfs_inode_v2* inode = &mapped_file->image.inodes_v2[ino];
+        inode_v2_release_blocks(inode, 0);
+        inode->flags &= ~TOSFS_INODE_COMPRESSED;
+    }
+    const int uncompress_error = inode_uncompress(ino);
+    if (uncompress_error != EXIT_SUCCESS) {
+        return uncompress_error;
+    }
+
+    if (new_size < attributes.size) {
+        // Whatever lies past the end of file must read back as zeros if the file grows again
+        const __u64 kept_end = min_macro((__u64) blocks_for_size(new_size) * TOSFS_BLOCK_SIZE, attributes.size);
+        inode_copy_in(ino, new_size, NULL, kept_end - new_size);
+        if (mapped_file->image.version == TOSFS_VERSION_2) {
+            inode_v2_release_blocks(&mapped_file->image.inodes_v2[ino], blocks_for_size(new_size));
+        }
+    } else {
+        const int error = inode_reserve_blocks(ino, blocks_for_size(new_size));
+        if (error != EXIT_SUCCESS) {
+            return error;
+        }
+    }
+
+    inode_store_size(ino, new_size);
+    return EXIT_SUCCESS;
+}
+
+/// Snapshot of the statistics, read in direct I/O so that every open shows fresh numbers.
+static void open_stats_file(fuse_req_t req, struct fuse_file_info *fi) {
+    if ((fi->flags & 3) != O_RDONLY) {
+        reply_err(req, EACCES);
+        return;
+    }
+
+    struct stats_snapshot* snapshot = stats_snapshot_new();
+    if (snapshot == NULL) {
+        reply_err(req, ENOMEM);
+        return;
+    }
+    fi->fh = (uint64_t) (uintptr_t) snapshot;
+    fi->direct_io = 1;
+    fi->keep_cache = 0;
+    fuse_reply_open(req, fi);
+}
+
+static void ensea_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    // Checked first: answering ENOSYS would turn OPEN off for good, the stats file included
+    if (ino == STATS_INODE) {
+        open_stats_file(req, fi);
+        return;
+    }
+    if (options.no_open) {
+        // The image is read-only and no per open state is kept, the kernel can skip OPEN altogether
+        reply_err(req, ENOSYS);
+        return;
+    }
+
+    struct tosfs_attributes attributes;
+    if (get_file_attributes(req, ino, &attributes) == SYSTEM_CALL_ERROR) {
+        return;
+    }
+
+    if (options.read_only && (fi->flags & 3) != O_RDONLY) {
+        reply_err(req, EACCES);
+        return;
+    }
+
+    if (!options.read_only && (fi->flags & O_TRUNC)) {
+        pthread_rwlock_wrlock(&metadata_lock);
+        const int error = truncate_inode(ino, 0);
+        pthread_rwlock_unlock(&metadata_lock);
+        if (error != EXIT_SUCCESS) {
+            reply_err(req, error);
+            return;
+        }
+    }
+    // Nothing changes a read-only image, so pages cached by an earlier open are still good
+    fi->keep_cache = options.read_only;
+    fuse_reply_open(req, fi);
+}
+
+/// Answers a read of a compressed file with its decompressed blocks, copied into a single buffer: straight from
+/// the block cache for the blocks read recently. A writable image takes the read side of metadata_lock, which
+/// inode_uncompress holds for writing. Returns SYSTEM_CALL_ERROR without replying when the file has been turned
+/// into a plain one meanwhile.
+static int read_compressed(fuse_req_t req, const fuse_ino_t ino, const __u64 file_size, const size_t size, const __u64 offset) {
+    if (!options.read_only) {
+        pthread_rwlock_rdlock(&metadata_lock);
+        if (!tosfs_inode_compressed(&mapped_file->image, ino)) {
+            pthread_rwlock_unlock(&metadata_lock);
+            return SYSTEM_CALL_ERROR;
+        }
+    }
+
+    const size_t length = min_macro((__u64) size, file_size - offset);
+    char* buffer = malloc(length);
+    char block_data[TOSFS_BLOCK_SIZE];
+    size_t done = 0;
+    int error = buffer == NULL ? ENOMEM : EXIT_SUCCESS;
+    while (error == EXIT_SUCCESS && done < length) {
+        const __u64 position = offset + done;
+        const size_t in_block = position % TOSFS_BLOCK_SIZE;
+        const size_t chunk = min_macro(length - done, TOSFS_BLOCK_SIZE - in_block);
+        // Whole blocks are decompressed or copied from the cache straight into the reply
+        char* destination = chunk == TOSFS_BLOCK_SIZE ? buffer + done : block_data;
+        if (compressed_block_read(ino, (__u32) (position / TOSFS_BLOCK_SIZE), destination) < (long) (in_block + chunk)) {
+            error = EIO;
+        } else if (destination == block_data) {
+            memcpy(buffer + done, block_data + in_block, chunk);
+        }
+        done += chunk;
+    }
+    if (!options.read_only) {
+        pthread_rwlock_unlock(&metadata_lock);
+    }
+
+    if (error != EXIT_SUCCESS) {
+        reply_err(req, error);
+    } else {
+        request_outcome.bytes += length;
+        fuse_reply_buf(req, buffer, length);
+    }
+    free(buffer);
+    return EXIT_SUCCESS;
+}
+
+/// Answers with one file descriptor buffer per extent crossed, pointing into the image: the kernel can splice
+/// the pages of the image straight into the reply, and a large read costs one contiguous I/O per extent.
+static void ensea_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    if (ino == STATS_INODE) {
+        // Without OPEN (no_open) there is no snapshot to read from, so each read takes its own
+        struct stats_snapshot* snapshot = fi != NULL && fi->fh != 0
+            ? (struct stats_snapshot*) (uintptr_t) fi->fh : stats_snapshot_new();
+        if (snapshot == NULL) {
+            reply_err(req, ENOMEM);
+            return;
+        }
+        reply_buf_limited(req, snapshot->text, snapshot->size, off, size);
+        if (fi == NULL || fi->fh == 0) {
+            stats_snapshot_free(snapshot);
+        }
+        return;
+    }
+
+    struct tosfs_attributes attributes;
+    if (get_file_attributes(req, ino, &attributes) == SYSTEM_CALL_ERROR) {
+        return;
+    }
+
+    if (off < 0 || (__u64) off >= attributes.size) {
+        fuse_reply_buf(req, NULL, 0);
+        return;
+    }
+    if (tosfs_inode_compressed(&mapped_file->image, ino) &&
+        read_compressed(req, ino, attributes.size, size, off) == EXIT_SUCCESS) {
+        return;
+    }
+
+    // A truncate may free the blocks past the new end and hand them to another file: its extents, and the blocks
+    // they name until the reply has spliced them, stay the file's under the read side of metadata_lock
+    if (!options.read_only) {
+        pthread_rwlock_rdlock(&metadata_lock);
+        if (inode_load(ino, &attributes) == SYSTEM_CALL_ERROR || (__u64) off >= attributes.size) {
+            pthread_rwlock_unlock(&metadata_lock);
+            fuse_reply_buf(req, NULL, 0);
+            return;
+        }
+    }
+
+    // A read-only image knows at mount which files sit in a single run and spares the extent walk
+    const struct tosfs_extent* contiguous = mapped_file->tables.contiguous != NULL &&
+        mapped_file->tables.contiguous[ino].length > 0 ? &mapped_file->tables.contiguous[ino] : NULL;
+    const __u32 extent_count = contiguous != NULL ? 1 : inode_extent_count(ino);
+    struct fuse_bufvec single_buf = FUSE_BUFVEC_INIT(0);
+    struct fuse_bufvec* buf = &single_buf;
+    if (extent_count > 1) {
+        buf = calloc(1, sizeof(struct fuse_bufvec) + (extent_count - 1) * sizeof(struct fuse_buf));
+        if (buf == NULL) {
+            if (!options.read_only) {
+                pthread_rwlock_unlock(&metadata_lock);
+            }
+            reply_err(req, ENOMEM);
+            return;
+        }
+    }
+
+    __u64 offset = off;
+    size_t remaining = min_macro((__u64) size, attributes.size - offset);
+    __u64 extent_offset = 0;
+    buf->count = 0;
+    for (__u32 index = 0; index < extent_count && remaining > 0; index++) {
+        const struct tosfs_extent extent = contiguous != NULL ? *contiguous : inode_extent(ino, index);
+        const __u64 extent_size = (__u64) extent.length * TOSFS_BLOCK_SIZE;
+        if (extent.start + extent.length > mapped_file->image.block_count) {
+            break;
+        }
+        if (offset < extent_offset + extent_size) {
+            const __u64 in_extent = offset - extent_offset;
+            const size_t chunk = min_macro((__u64) remaining, extent_size - in_extent);
+            struct fuse_buf* chunk_buf = &buf->buf[buf->count++];
+            chunk_buf->size = chunk;
+            chunk_buf->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+            chunk_buf->mem = NULL;
+            chunk_buf->fd = mapped_file->image.fd;
+            chunk_buf->pos = (off_t) extent.start * TOSFS_BLOCK_SIZE + in_extent;
+            request_outcome.bytes += chunk;
+            offset += chunk;
+            remaining -= chunk;
+        }
+        extent_offset += extent_size;
+    }
+
+    if (buf->count == 0) {
+        fuse_reply_buf(req, NULL, 0);
+    } else {
+        fuse_reply_data(req, buf, FUSE_BUF_SPLICE_MOVE);
+    }
+    if (!options.read_only) {
+        pthread_rwlock_unlock(&metadata_lock);
+    }
+    if (buf != &single_buf) {
+        free(buf);
+    }
+}
+
+/// Writes go straight into the shared mapping, one memcpy per extent. Only a write past the allocated blocks
+/// takes metadata_lock, to grow the file.
+static void ensea_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi) {
+    (void) fi;
+    struct tosfs_attributes attributes;
+    if (get_file_attributes(req, ino, &attributes) == SYSTEM_CALL_ERROR) {
+        return;
+    }
+
+    const __u64 end = (__u64) off + size;
+    if (off < 0 || end > max_file_size()) {
+        reply_err(req, EFBIG);
+        return;
+    }
+
+    if (tosfs_inode_compressed(&mapped_file->image, ino)) {
+        pthread_rwlock_wrlock(&metadata_lock);
+        const int error = inode_uncompress(ino);
+        pthread_rwlock_unlock(&metadata_lock);
+        if (error != EXIT_SUCCESS) {
+            reply_err(req, error);
+            return;
+        }
+    }
+
+    const __u32 needed_blocks = blocks_for_size(end);
+    if (needed_blocks > inode_allocated_blocks(ino)) {
+        pthread_rwlock_wrlock(&metadata_lock);
+        const int error = inode_reserve_blocks(ino, needed_blocks);
+        pthread_rwlock_unlock(&metadata_lock);
+        if (error != EXIT_SUCCESS) {
+            reply_err(req, error);
+            return;
+        }
+    }
+
+    inode_copy_in(ino, off, buf, size);
+    if (end > attributes.size) {
+        inode_store_size(ino, end);
+    }
+
+    request_outcome.bytes = size;
+    fuse_reply_write(req, size);
+}
+
+/// Allocates an inode and links it as `name` in `parent`; a directory gets its first block with its "." and ".."
+/// entries. Must be called with metadata_lock held for writing.
+static int new_inode(fuse_req_t req, const fuse_ino_t parent, const char* name, const mode_t mode, fuse_ino_t* new_ino) {
+    struct tosfs_attributes parent_attributes;
+    if (inode_load(parent, &parent_attributes) == SYSTEM_CALL_ERROR) {
+        return ENOENT;
+    }
+    if (!inode_is_directory(parent, &parent_attributes)) {
+        return ENOTDIR;
+    }
+    // The statistics file shadows the name in the root, where an entry made with it could never be reached
+    if (dentry_index_find(&mapped_file->dentry_index, parent, name) != NULL ||
+        (parent == mapped_file->image.superblock->root_inode && strcmp(name, STATS_FILE_NAME) == 0)) {
+        return EEXIST;
+    }
+
+    const int ino = bitmap_allocate(&mapped_file->inode_allocation);
+    if (ino == SYSTEM_CALL_ERROR) {
+        return ENOSPC;
+    }
+
+    const int is_directory = S_ISDIR(mode);
+    const struct fuse_ctx* context = fuse_req_ctx(req);
+    const struct tosfs_attributes attributes = {
+        .inode = ino,
+        .uid = (__u16) context->uid,
+        .gid = (__u16) context->gid,
+        .mode = (is_directory ? S_IFDIR : S_IFREG) | (mode & 0777),
+        .perm = mode & 0777,
+        .nlink = is_directory ? 2 : 1,
+        .size = 0,
+    };
+
+    int error = EXIT_SUCCESS;
+    if (mapped_file->image.version == TOSFS_VERSION_1) {
+        // A v1 inode owns its single block from the start
+        memset(&mapped_file->image.inodes[ino], 0, sizeof(struct tosfs_inode));
+        const int block_no = bitmap_allocate(&mapped_file->block_allocation);
+        if (block_no == SYSTEM_CALL_ERROR) {
+            bitmap_clear(&mapped_file->inode_allocation, ino);
+            return ENOSPC;
+        }
+        mapped_file->image.inodes[ino].block_no = block_no;
+        memset(block_address(block_no), 0, TOSFS_BLOCK_SIZE);
+        inode_store(ino, &attributes);
+    } else {
+        memset(&mapped_file->image.inodes_v2[ino], 0, sizeof(struct tosfs_inode_v2));
+        inode_store(ino, &attributes);
+        if (is_directory) {
+            error = inode_reserve_blocks(ino, 1);
+        }
+    }
+    mapped_file->image.superblock->inodes++;
+
+    if (is_directory && error == EXIT_SUCCESS) {
+        inode_store_size(ino, TOSFS_BLOCK_SIZE);
+        directory_add_entry(ino, ".", ino);
+        directory_add_entry(ino, "..", parent);
+    }
+    if (error == EXIT_SUCCESS) {
+        error = directory_add_entry(parent, name, ino);
+    }
+    if (error != EXIT_SUCCESS) {
+        if (is_directory) {
+            directory_remove_dots(ino);
+        }
+        release_inode(ino);
+        return error;
+    }
+
+    if (is_directory) {
+        parent_attributes.nlink++;
+        inode_store(parent, &parent_attributes);
+    }
+    *new_ino = ino;
+    return EXIT_SUCCESS;
+}
+
+static void ensea_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi) {
+    if (strlen(name) > TOSFS_MAX_NAME_LENGTH) {
+        reply_err(req, ENAMETOOLONG);
+        return;
+    }
+
+    struct fuse_entry_param entry_param;
+    fuse_ino_t ino;
+    pthread_rwlock_wrlock(&metadata_lock);
+    const int error = new_inode(req, parent, name, S_IFREG | (mode & 0777), &ino);
+    if (error == EXIT_SUCCESS) {
+        fill_entry_param(&entry_param, ino);
+    }
+    pthread_rwlock_unlock(&metadata_lock);
+
+    if (error != EXIT_SUCCESS) {
+        reply_err(req, error);
+        return;
+    }
+    fuse_reply_create(req, &entry_param, fi);
+}
+
+static void ensea_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+    if (strlen(name) > TOSFS_MAX_NAME_LENGTH) {
+        reply_err(req, ENAMETOOLONG);
+        return;
+    }
+
+    struct fuse_entry_param entry_param;
+    fuse_ino_t ino;
+    pthread_rwlock_wrlock(&metadata_lock);
+    const int error = new_inode(req, parent, name, S_IFDIR | (mode & 0777), &ino);
+    if (error == EXIT_SUCCESS) {
+        fill_entry_param(&entry_param, ino);
+    }
+    pthread_rwlock_unlock(&metadata_lock);
+
+    if (error != EXIT_SUCCESS) {
+        reply_err(req, error);
+        return;
+    }
+    fuse_reply_entry(req, &entry_param);
+}
+
+/// Removes the name right away; the inode and its blocks are released on FORGET, once the kernel (and thus
+/// every open file) is done with it.
+static void ensea_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    pthread_rwlock_wrlock(&metadata_lock);
+
+    struct dentry_index_slot* slot = dentry_index_find_slot(&mapped_file->dentry_index, parent, name);
+    if (slot == NULL) {
+        pthread_rwlock_unlock(&metadata_lock);
+        reply_err(req, ENOENT);
+        return;
+    }
+
+    const fuse_ino_t ino = slot->dentry->inode;
+    struct tosfs_attributes attributes;
+    if (inode_load(ino, &attributes) == SYSTEM_CALL_ERROR) {
+        pthread_rwlock_unlock(&metadata_lock);
+        reply_err(req, ENOENT);
+        return;
+    }
+    if (inode_is_directory(ino, &attributes)) {
+        pthread_rwlock_unlock(&metadata_lock);
+        reply_err(req, EISDIR);
+        return;
+    }
+
+    directory_remove_entry(slot);
+    if (attributes.nlink > 0) {
+        attributes.nlink--;
+        inode_store(ino, &attributes);
+    }
+
+    pthread_rwlock_unlock(&metadata_lock);
+    reply_err(req, 0);
+}
+
+/// Same lifetime as a file: the name goes now, the blocks on FORGET.
+static void ensea_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    pthread_rwlock_wrlock(&metadata_lock);
+
+    struct dentry_index_slot* slot = dentry_index_find_slot(&mapped_file->dentry_index, parent, name);
+    if (slot == NULL) {
+        pthread_rwlock_unlock(&metadata_lock);
+        reply_err(req, ENOENT);
+        return;
+    }
+
+    const fuse_ino_t ino = slot->dentry->inode;
+    struct tosfs_attributes attributes;
+    int error = EXIT_SUCCESS;
+    if (inode_load(ino, &attributes) == SYSTEM_CALL_ERROR) {
+        error = ENOENT;
+    } else if (!inode_is_directory(ino, &attributes)) {
+        error = ENOTDIR;
+    } else if (ino == mapped_file->image.superblock->root_inode) {
+        error = EBUSY;
+    } else if (!directory_is_empty(ino)) {
+        error = ENOTEMPTY;
+    }
+    if (error != EXIT_SUCCESS) {
+        pthread_rwlock_unlock(&metadata_lock);
+        reply_err(req, error);
+        return;
+    }
+
+    directory_remove_entry(slot);
+    directory_remove_dots(ino);
+    attributes.nlink = 0;
+    inode_store(ino, &attributes);
+
+    struct tosfs_attributes parent_attributes;
+    if (inode_load(parent, &parent_attributes) != SYSTEM_CALL_ERROR && parent_attributes.nlink > 0) {
+        parent_attributes.nlink--;
+        inode_store(parent, &parent_attributes);
+    }
+
+    pthread_rwlock_unlock(&metadata_lock);
+    reply_err(req, 0);
+}
+
+static void forget_inode(const fuse_ino_t ino) {
+    // A read-only image is never changed, orphans included
+    if (options.read_only || ino == mapped_file->image.superblock->root_inode || ino >= mapped_file->inode_allocation.bit_count) {
+        return;
+    }
+
+    pthread_rwlock_wrlock(&metadata_lock);
+    struct tosfs_attributes attributes;
+    if (inode_load(ino, &attributes) != SYSTEM_CALL_ERROR && attributes.nlink == 0) {
+        release_inode(ino);
+    }
+    pthread_rwlock_unlock(&metadata_lock);
+}
+
+/// The kernel sends a single FORGET when it evicts an inode, whatever its lookup count, so an unlinked inode
+/// can be released on the first one.
+static void ensea_ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+    (void) nlookup;
+    forget_inode(ino);
+    fuse_reply_none(req);
+}
+
+static void ensea_ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets) {
+    for (size_t i = 0; i < count; i++) {
+        forget_inode(forgets[i].ino);
+    }
+    fuse_reply_none(req);
+}
+
+static void ensea_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi) {
+    (void) fi;
+    struct tosfs_attributes attributes;
+    if (inode_load(ino, &attributes) == SYSTEM_CALL_ERROR) {
+        reply_err(req, ENOENT);
+        return;
+    }
+    if ((to_set & FUSE_SET_ATTR_SIZE) && inode_is_directory(ino, &attributes)) {
+        reply_err(req, EISDIR);
+        return;
+    }
+    if ((to_set & FUSE_SET_ATTR_SIZE) && attr->st_size < 0) {
+        reply_err(req, EINVAL);
+        return;
+    }
+
+    pthread_rwlock_wrlock(&metadata_lock);
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+        const int error = truncate_inode(ino, attr->st_size);
+        if (error != EXIT_SUCCESS) {
+            pthread_rwlock_unlock(&metadata_lock);
+            reply_err(req, error);
+            return;
+        }
+    }
+
+    inode_load(ino, &attributes);
+    if (to_set & FUSE_SET_ATTR_MODE) {
+        attributes.perm = attr->st_mode & 0777;
+        attributes.mode = (attributes.mode & S_IFMT) | attributes.perm;
+    }
+    if (to_set & FUSE_SET_ATTR_UID) {
+        attributes.uid = (__u16) attr->st_uid;
+    }
+    if (to_set & FUSE_SET_ATTR_GID) {
+        attributes.gid = (__u16) attr->st_gid;
+    }
+    // tosfs keeps no timestamps, time updates are accepted and dropped
+    inode_store(ino, &attributes);
+
+    struct stat stbuf = {0};
+    ensea_ll_stat(ino, &stbuf);
+    pthread_rwlock_unlock(&metadata_lock);
+
+    fuse_reply_attr(req, &stbuf, options.attr_timeout);
+}
+
+static void ensea_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+    (void) ino;
+    (void) datasync;
+    (void) fi;
+
+    if (msync(mapped_file->image.map, mapped_file->image.file_info.st_size, MS_SYNC) == SYSTEM_CALL_ERROR) {
+        reply_err(req, errno);
+        return;
+    }
+    reply_err(req, 0);
+}
+
+/// Pins the current image for a handler that reads it; only a reloadable image can change under a request.
+static void image_pin() {
+    if (options.reload) {
+        pthread_rwlock_rdlock(&image_lock);
+    }
+}
+
+static void image_unpin() {
+    if (options.reload) {
+        pthread_rwlock_unlock(&image_lock);
+    }
+}
+
+/// One traced request. `result` is what the reply carried: the bytes sent or written, else 0 or minus an errno.
+struct trace_event {
+    __u64 start_ns;
+    __u64 end_ns;
+    __u64 ino;
+    __u64 offset;
+    __u32 size;
+    __s32 result;
+    __u16 op;
+};
+
+/// Last requests served by one thread. Only that thread writes; `head` counts every event ever recorded and is
+/// published after the event it covers, so a dump copies the ring without stopping the thread and drops the
+/// slots that may have been overwritten while it did. A thread that exits hands its ring to the next one started.
+struct trace_ring {
+    struct trace_event* events;
+    __u32 mask;
+    __u32 tid;
+    __u64 head;
+    struct trace_ring* next;
+    struct trace_ring* next_free;
+};
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key;
+static struct trace_ring* trace_rings;
+static struct trace_ring* trace_free_rings;
+static __thread struct trace_ring* trace_ring;
+static __thread int trace_ring_failed;
+
+static void trace_ring_release(void* arg) {
+    struct trace_ring* ring = arg;
+    pthread_mutex_lock(&trace_lock);
+    ring->next_free = trace_free_rings;
+    trace_free_rings = ring;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static void trace_init() {
+    pthread_key_create(&trace_key, trace_ring_release);
+}
+
+/// Ring of the calling thread, NULL when it cannot be allocated.
+static struct trace_ring* trace_thread_ring() {
+    if (trace_ring != NULL || trace_ring_failed) {
+        return trace_ring;
+    }
+
+    pthread_once(&trace_once, trace_init);
+    pthread_mutex_lock(&trace_lock);
+    struct trace_ring* ring = trace_free_rings;
+    if (ring != NULL) {
+        trace_free_rings = ring->next_free;
+    } else {
+        ring = calloc(1, sizeof(struct trace_ring));
+        if (ring != NULL) {
+            ring->events = calloc(options.trace_events, sizeof(struct trace_event));
+            if (ring->events == NULL) {
+                free(ring);
+                ring = NULL;
+            }
+        }
+        if (ring != NULL) {
+            ring->mask = options.trace_events - 1;
+            ring->next = trace_rings;
+            // Dumps walk the list without the lock
+            __atomic_store_n(&trace_rings, ring, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&trace_lock);
+
+    if (ring == NULL) {
+        trace_ring_failed = 1;
+        return NULL;
+    }
+    ring->tid = (__u32) syscall(SYS_gettid);
+    pthread_setspecific(trace_key, ring);
+    trace_ring = ring;
+    return ring;
+}
+
+static void trace_record(const enum ensea_op op, const struct timespec* started, const struct timespec* finished,
+                         const fuse_ino_t ino, const off_t offset, const size_t size) {
+    struct trace_ring* ring = options.trace_events == 0 ? NULL : trace_thread_ring();
+    if (ring == NULL) {
+        return;
+    }
+
+    const __u64 head = ring->head;
+    struct trace_event* event = &ring->events[head & ring->mask];
+    event->start_ns = (__u64) started->tv_sec * 1000000000ull + (__u64) started->tv_nsec;
+    event->end_ns = (__u64) finished->tv_sec * 1000000000ull + (__u64) finished->tv_nsec;
+    event->ino = ino;
+    event->offset = (__u64) offset;
+    event->size = (__u32) min_macro(size, (size_t) UINT32_MAX);
+    event->result = request_outcome.error != 0 ? -request_outcome.error : (__s32) min_macro(request_outcome.bytes, (size_t) INT32_MAX);
+    event->op = op;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Only main starts the dump thread, so programs built with TOSFS_NO_MAIN leave the dumps out
+#ifndef TOSFS_NO_MAIN
+/// Writes the events of one ring still in place once copied, as Chrome trace events.
+static size_t trace_dump_ring(FILE* stream, const struct trace_ring* ring, struct trace_event* copy, size_t written) {
+    const __u64 capacity = (__u64) ring->mask + 1;
+    const __u64 head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    const __u64 first = head > capacity ? head - capacity : 0;
+    for (__u64 index = first; index < head; index++) {
+        copy[index - first] = ring->events[index & ring->mask];
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    // The thread may be writing the event after the last one it published, over the oldest one
+    const __u64 new_head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    const __u64 valid_from = new_head + 1 > capacity ? new_head + 1 - capacity : 0;
+
+    const pid_t pid = getpid();
+    for (__u64 index = max_macro(first, valid_from); index < head; index++) {
+        const struct trace_event* event = &copy[index - first];
+        fprintf(stream,
+                "%s\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": %d, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f, "
+                "\"args\": {\"ino\": %llu, \"offset\": %llu, \"size\": %u, \"result\": %d}}",
+                written++ == 0 ? "" : ",", ensea_op_names[event->op], pid, ring->tid,
+                (double) event->start_ns / 1e3, (double) (event->end_ns - event->start_ns) / 1e3,
+                (unsigned long long) event->ino, (unsigned long long) event->offset, event->size, event->result);
+    }
+    return written;
+}
+
+/// Writes every ring to options.trace_file in the Chrome trace event format, which Perfetto and chrome://tracing
+/// load as is. The file is written aside and renamed, so a reader never sees half a dump.
+static void trace_dump() {
+    char path[PATH_MAX];
+    char temporary_path[PATH_MAX + 8];
+    if (options.trace_file != NULL) {
+        snprintf(path, sizeof(path), "%s", options.trace_file);
+    } else {
+        snprintf(path, sizeof(path), "/tmp/tosfs_trace.%d.json", (int) getpid());
+    }
+    snprintf(temporary_path, sizeof(temporary_path), "%s.tmp", path);
+
+    struct trace_event* copy = calloc(max_macro(options.trace_events, 1u), sizeof(struct trace_event));
+    FILE* stream = copy == NULL ? NULL : fopen(temporary_path, "w");
+    if (stream == NULL) {
+        perror("trace_dump");
+        free(copy);
+        return;
+    }
+
+    size_t written = 0;
+    fprintf(stream, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+    for (const struct trace_ring* ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+        written = trace_dump_ring(stream, ring, copy, written);
+    }
+    fprintf(stream, "\n]}\n");
+    free(copy);
+
+    if (fclose(stream) != 0 || rename(temporary_path, path) == SYSTEM_CALL_ERROR) {
+        perror("trace_dump");
+        unlink(temporary_path);
+        return;
+    }
+    fprintf(stderr, "tosfs: %zu traced requests written to %s\n", written, path);
+}
+
+static pthread_t trace_thread;
+static volatile int trace_stopping;
+
+/// Waits for TRACE_DUMP_SIGNAL, which every other thread keeps blocked, and dumps the traces each time it comes.
+static void* trace_dump_loop(void* arg) {
+    sigset_t* signals = arg;
+    int signal_number;
+
+    while (sigwait(signals, &signal_number) == 0 && !trace_stopping) {
+        trace_dump();
+    }
+    return NULL;
+}
+
+/// Blocks TRACE_DUMP_SIGNAL in the calling thread, and so in every thread it starts afterwards, then starts the
+/// thread that waits for it. Must run before the session starts its workers.
+static int start_trace_dump() {
+    static sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, TRACE_DUMP_SIGNAL);
+    if (pthread_sigmask(SIG_BLOCK, &signals, NULL) != 0 ||
+        pthread_create(&trace_thread, NULL, trace_dump_loop, &signals) != 0) {
+        perror("start_trace_dump");
+        return SYSTEM_CALL_ERROR;
+    }
+    return EXIT_SUCCESS;
+}
+
+static void stop_trace_dump() {
+    trace_stopping = 1;
+    pthread_kill(trace_thread, TRACE_DUMP_SIGNAL);
+    pthread_join(trace_thread, NULL);
+}
+#endif
+
+/// Starts timing a request for the statistics and the trace; request_end records it with what the handler answered.
+static void request_begin(struct timespec* started) {
+    request_outcome.error = 0;
+    request_outcome.bytes = 0;
+    op_stats_start(started);
+}
+
+/// `ino` is the inode of the request, the parent directory for requests naming an entry.
+static void request_end(const enum ensea_op op, const struct timespec* started, const fuse_ino_t ino,
+                        const off_t offset, const size_t size) {
+    struct timespec finished;
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    const __u64 ns = (__u64) ((finished.tv_sec - started->tv_sec) * 1000000000LL + (finished.tv_nsec - started->tv_nsec));
+    op_stats_record_ns(op, ns, request_outcome.error, request_outcome.bytes);
+    trace_record(op, started, &finished, ino, offset, size);
+}
+
+static void pinned_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    struct timespec started;
+    request_begin(&started);
+    image_pin();
+    ensea_ll_lookup(req, parent, name);
+    image_unpin();
+    request_end(ENSEA_OP_LOOKUP, &started, parent, 0, 0);
+}
+
+static void pinned_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct timespec started;
+    request_begin(&started);
+    image_pin();
+    ensea_ll_getattr(req, ino, fi);
+    image_unpin();
+    request_end(ENSEA_OP_GETATTR, &started, ino, 0, 0);
+}
+
+static void pinned_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct timespec started;
+    request_begin(&started);
+    image_pin();
+    ensea_ll_opendir(req, ino, fi);
+    image_unpin();
+    request_end(ENSEA_OP_OPENDIR, &started, ino, 0, 0);
+}
+
+static void pinned_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    struct timespec started;
+    request_begin(&started);
+    image_pin();
+    ensea_ll_readdir(req, ino, size, off, fi);
+    image_unpin();
+    request_end(ENSEA_OP_READDIR, &started, ino, off, size);
+}
+
+static void pinned_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    struct timespec started;
+    request_begin(&started);
+    image_pin();
+    ensea_ll_readdirplus(req, ino, size, off, fi);
+    image_unpin();
+    request_end(ENSEA_OP_READDIRPLUS, &started, ino, off, size);
+}
+
+static void pinned_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct timespec started;
+    request_begin(&started);
+    image_pin();
+    ensea_ll_open(req, ino, fi);
+    image_unpin();
+    request_end(ENSEA_OP_OPEN, &started, ino, 0, 0);
+}
+
+/// The reply splices from the image file descriptor, so the old image must outlive fuse_reply_data.
+static void pinned_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    struct timespec started;
+    request_begin(&started);
+    image_pin();
+    ensea_ll_read(req, ino, size, off, fi);
+    image_unpin();
+    request_end(ENSEA_OP_READ, &started, ino, off, size);
+}
+
+static void pinned_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+    struct timespec started;
+    request_begin(&started);
+    image_pin();
+    ensea_ll_fsync(req, ino, datasync, fi);
+    image_unpin();
+    request_end(ENSEA_OP_FSYNC, &started, ino, 0, 0);
+}
+
+/// Handlers that never run on a reloadable image (writes need a writable one) or do not read it are only counted
+/// and traced.
+static void counted_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+    struct timespec started;
+    request_begin(&started);
+    ensea_ll_forget(req, ino, nlookup);
+    request_end(ENSEA_OP_FORGET, &started, ino, 0, 0);
+}
+
+static void counted_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets) {
+    struct timespec started;
+    request_begin(&started);
+    ensea_ll_forget_multi(req, count, forgets);
+    request_end(ENSEA_OP_FORGET, &started, 0, 0, count);
+}
+
+static void counted_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi) {
+    struct timespec started;
+    request_begin(&started);
+    ensea_ll_setattr(req, ino, attr, to_set, fi);
+    request_end(ENSEA_OP_SETATTR, &started, ino, 0, 0);
+}
+
+static void counted_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+    struct timespec started;
+    request_begin(&started);
+    ensea_ll_mkdir(req, parent, name, mode);
+    request_end(ENSEA_OP_MKDIR, &started, parent, 0, 0);
+}
+
+static void counted_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    struct timespec started;
+    request_begin(&started);
+    ensea_ll_unlink(req, parent, name);
+    request_end(ENSEA_OP_UNLINK, &started, parent, 0, 0);
+}
+
+static void counted_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    struct timespec started;
+    request_begin(&started);
+    ensea_ll_rmdir(req, parent, name);
+    request_end(ENSEA_OP_RMDIR, &started, parent, 0, 0);
+}
+
+static void counted_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi) {
+    struct timespec started;
+    request_begin(&started);
+    ensea_ll_create(req, parent, name, mode, fi);
+    request_end(ENSEA_OP_CREATE, &started, parent, 0, 0);
+}
+
+static void counted_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct timespec started;
+    request_begin(&started);
+    ensea_ll_releasedir(req, ino, fi);
+    request_end(ENSEA_OP_RELEASEDIR, &started, ino, 0, 0);
+}
+
+static void counted_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi) {
+    struct timespec started;
+    request_begin(&started);
+    ensea_ll_write(req, ino, buf, size, off, fi);
+    request_end(ENSEA_OP_WRITE, &started, ino, off, size);
+}
+
+static void counted_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct timespec started;
+    request_begin(&started);
+    ensea_ll_release(req, ino, fi);
+    request_end(ENSEA_OP_RELEASE, &started, ino, 0, 0);
+}
+
+// Only main watches the image, so programs built with TOSFS_NO_MAIN leave the reloads out
+#ifndef TOSFS_NO_MAIN
+/// Table entry of a live inode of an image, or NULL.
+static const void* image_inode(const struct mapped_file_struct* image, const fuse_ino_t ino) {
+    if (ino == 0) {
+        return NULL;
+    }
+    if (image->image.version == TOSFS_VERSION_1) {
+        const struct tosfs_inode* inode = tosfs_inode_v1(&image->image, ino);
+        return inode == NULL || inode->inode == 0 ? NULL : inode;
+    }
+    const struct tosfs_inode_v2* inode = tosfs_inode_v2(&image->image, ino);
+    return inode == NULL || inode->inode == 0 ? NULL : inode;
+}
+
+/// Whether a run of blocks holds the same bytes in both images. A run past the end of either one never does.
+static int image_blocks_equal(const struct mapped_file_struct* old_image, const struct mapped_file_struct* new_image,
+                              const __u32 start, const __u32 length) {
+    if (start >= old_image->image.block_count || length > old_image->image.block_count - start ||
+        start >= new_image->image.block_count || length > new_image->image.block_count - start) {
+        return 0;
+    }
+    return memcmp(tosfs_block(&old_image->image, start), tosfs_block(&new_image->image, start),
+                  (size_t) length * TOSFS_BLOCK_SIZE) == 0;
+}
+
+/// Whether an inode reads back the same from both images. Its table entry is identical in both, so they agree on
+/// where its blocks are.
+static int image_inode_data_equal(const struct mapped_file_struct* old_image, const struct mapped_file_struct* new_image,
+                                  const fuse_ino_t ino) {
+    const __u32 extent_count = tosfs_extent_count(&old_image->image, ino);
+    if (old_image->image.version == TOSFS_VERSION_2 && extent_count > TOSFS_INLINE_EXTENTS &&
+        !image_blocks_equal(old_image, new_image, tosfs_inode_v2(&old_image->image, ino)->extent_block, 1)) {
+        return 0;
+    }
+    for (__u32 index = 0; index < extent_count; index++) {
+        const struct tosfs_extent extent = tosfs_extent_at(&old_image->image, ino, index);
+        if (!image_blocks_equal(old_image, new_image, extent.start, extent.length)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/// Whether the name of an index slot is "." or "..", which the kernel never caches as entries.
+static int dentry_is_dot(const struct tosfs_dentry* dentry) {
+    return strncmp(dentry->name, ".", TOSFS_MAX_NAME_LENGTH) == 0 || strncmp(dentry->name, "..", TOSFS_MAX_NAME_LENGTH) == 0;
+}
+
+/// Sends an entry invalidation for every name of `from` that `to` does not map to the same inode.
+static void invalidate_dentry_changes(const struct mapped_file_struct* from, const struct mapped_file_struct* to) {
+    char name[TOSFS_MAX_NAME_LENGTH + 1];
+
+    for (size_t position = 0; position < from->dentry_index.capacity; position++) {
+        const struct dentry_index_slot* slot = &from->dentry_index.slots[position];
+        if (slot->dentry == NULL || dentry_is_dot(slot->dentry)) {
+            continue;
+        }
+
+        dentry_name_copy(name, slot->dentry);
+        const struct tosfs_dentry* other = dentry_index_find(&to->dentry_index, slot->parent, name);
+        if (other == NULL || other->inode != slot->dentry->inode) {
+            fuse_lowlevel_notify_inval_entry(session, slot->parent, name, strlen(name));
+        }
+    }
+}
+
+/// Tells the kernel to drop what it may hold from the old image and the new one changed: attributes and pages of
+/// every inode whose table entry or data differ, and every name that appeared, vanished or now leads elsewhere.
+/// Entries and inodes the kernel never cached just get ENOENT back, which is ignored.
+static void invalidate_changes(const struct mapped_file_struct* old_image, const struct mapped_file_struct* new_image) {
+    // The same file rewritten in place: the old mapping already shows the new bytes and cannot tell what changed
+    const int rewritten_in_place = old_image->image.file_info.st_dev == new_image->image.file_info.st_dev &&
+        old_image->image.file_info.st_ino == new_image->image.file_info.st_ino;
+    const size_t inode_size = old_image->image.version == TOSFS_VERSION_1 ? sizeof(struct tosfs_inode) : sizeof(struct tosfs_inode_v2);
+
+    for (__u32 ino = 1; ino < old_image->image.inode_table_capacity; ino++) {
+        const void* old_inode = image_inode(old_image, ino);
+        if (old_inode == NULL) {
+            // The kernel cannot know an inode the old image did not have
+            continue;
+        }
+        const void* new_inode = image_inode(new_image, ino);
+        if (new_inode != NULL && !rewritten_in_place && old_image->image.version == new_image->image.version &&
+            memcmp(old_inode, new_inode, inode_size) == 0 && image_inode_data_equal(old_image, new_image, ino)) {
+            continue;
+        }
+        fuse_lowlevel_notify_inval_inode(session, ino, 0, 0);
+    }
+
+    invalidate_dentry_changes(old_image, new_image);
+    // Names new to the image may still sit in the kernel as cached misses
+    invalidate_dentry_changes(new_image, old_image);
+}
+
+/// Maps and indexes the image again while requests go on against the old one, then swaps it in once every
+/// request running on the old one is done. An image that fails the mount checks is ignored and the current one
+/// kept. Only the reload thread replaces mapped_file, so reading it here without image_lock is safe.
+static void reload_image() {
+    struct mapped_file_struct* new_image = map_example_file();
+    if (new_image == NULL) {
+        return;
+    }
+    if (read_mapped_file_as_tosfs_file(new_image) == SYSTEM_CALL_ERROR) {
+        fprintf(stderr, "reload_image: %s rejected, keeping the current image\n", image_path);
+        close_mapped_file(new_image);
+        return;
+    }
+
+    struct mapped_file_struct* old_image = mapped_file;
+    pthread_rwlock_wrlock(&image_lock);
+    mapped_file = new_image;
+    pthread_rwlock_unlock(&image_lock);
+
+    invalidate_changes(old_image, new_image);
+    close_mapped_file(old_image);
+}
+
+static int watch_fd = SYSTEM_CALL_ERROR;
+static int watch_stop_fd = SYSTEM_CALL_ERROR;
+static pthread_t watch_thread;
+
+/// Reloads the image each time a new file is renamed over it, the only safe way to replace it: the file being
+/// served is never truncated under a request. A rewrite in place has already torn the mapping by the time it is
+/// closed and may kill the daemon with SIGBUS, so it is only reported, not reloaded.
+static void* watch_image(void* arg) {
+    const char* image_name = arg;
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd poll_fds[] = {
+        { .fd = watch_fd, .events = POLLIN },
+        { .fd = watch_stop_fd, .events = POLLIN },
+    };
+
+    while (1) {
+        if (poll(poll_fds, 2, -1) == SYSTEM_CALL_ERROR) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("watch_image: poll");
+            break;
+        }
+        if (poll_fds[1].revents != 0) {
+            break;
+        }
+
+        const ssize_t length = read(watch_fd, events, sizeof(events));
+        int image_changed = 0;
+        for (ssize_t offset = 0; offset < length;) {
+            const struct inotify_event* event = (const struct inotify_event*) (events + offset);
+            if (event->len > 0 && strcmp(event->name, image_name) == 0) {
+                if (event->mask & IN_MOVED_TO) {
+                    image_changed = 1;
+                } else {
+                    fprintf(stderr, "tosfs: %s was rewritten in place and is not reloaded, replace it with a rename\n",
+                            image_path);
+                }
+            }
+            offset += sizeof(struct inotify_event) + event->len;
+        }
+        if (image_changed) {
+            reload_image();
+        }
+    }
+    return NULL;
+}
+
+static int start_image_watch() {
+    static char directory[PATH_MAX];
+    strcpy(directory, image_path);
+    char* last_slash = strrchr(directory, '/');
+    const char* image_name = image_path + (last_slash - directory) + 1;
+    if (last_slash == directory) {
+        last_slash++;
+    }
+    *last_slash = '\0';
+
+    watch_fd = inotify_init1(IN_CLOEXEC);
+    if (watch_fd == SYSTEM_CALL_ERROR || inotify_add_watch(watch_fd, directory, IN_CLOSE_WRITE | IN_MOVED_TO) == SYSTEM_CALL_ERROR) {
+        perror("start_image_watch: inotify");
+        return SYSTEM_CALL_ERROR;
+    }
+    watch_stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (watch_stop_fd == SYSTEM_CALL_ERROR) {
+        perror("start_image_watch: eventfd");
+        return SYSTEM_CALL_ERROR;
+    }
+    if (pthread_create(&watch_thread, NULL, watch_image, (void*) image_name) != 0) {
+        perror("start_image_watch: pthread_create");
+        close(watch_stop_fd);
+        watch_stop_fd = SYSTEM_CALL_ERROR;
+        return SYSTEM_CALL_ERROR;
+    }
+    return EXIT_SUCCESS;
+}
+
+static void stop_image_watch() {
+    const uint64_t stop = 1;
+    if (write(watch_stop_fd, &stop, sizeof(stop)) == sizeof(stop)) {
+        pthread_join(watch_thread, NULL);
+    }
+    close(watch_stop_fd);
+    close(watch_fd);
+}
+#endif
+
+static void ensea_ll_init(void *userdata, struct fuse_conn_info *conn) {
+    (void) userdata;
+
+    // Let the kernel send large requests and splice reply pages instead of copying them
+    if (options.max_write != 0) {
+        conn->max_write = options.max_write;
+    }
+    if (options.max_readahead != 0) {
+        conn->max_readahead = options.max_readahead;
+    }
+    if (options.no_splice) {
+        conn->want &= ~(FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+    } else {
+        conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+    }
+    conn->want |= conn->capable & FUSE_CAP_PARALLEL_DIROPS;
+
+    if (options.max_background != 0) {
+        conn->max_background = options.max_background;
+    }
+    if (options.congestion_threshold != 0) {
+        conn->congestion_threshold = options.congestion_threshold;
+    }
+
+    // ENOSYS from open/opendir only means "success, stop asking" when the kernel supports it, and skipping
+    // them is only safe when nothing can change under the kernel's feet
+    if (!options.read_only) {
+        options.no_open = 0;
+        options.no_opendir = 0;
+    }
+    if (!(conn->capable & FUSE_CAP_NO_OPEN_SUPPORT)) {
+        options.no_open = 0;
+    }
+    if (!(conn->capable & FUSE_CAP_NO_OPENDIR_SUPPORT)) {
+        options.no_opendir = 0;
+    }
+}
+
+static struct fuse_lowlevel_ops ensea_ll_oper = {
+    .init		= ensea_ll_init,
+    .lookup		= pinned_lookup,
+    .forget		= counted_forget,
+    .forget_multi	= counted_forget_multi,
+    .getattr	= pinned_getattr,
+    .setattr	= counted_setattr,
+    .mkdir		= counted_mkdir,
+    .unlink		= counted_unlink,
+    .rmdir		= counted_rmdir,
+    .create		= counted_create,
+    .opendir	= pinned_opendir,
+    .readdir	= pinned_readdir,
+    .readdirplus	= pinned_readdirplus,
+    .releasedir	= counted_releasedir,
+    .open		= pinned_open,
+    .read		= pinned_read,
+    .write		= counted_write,
+    .release	= counted_release,
+    .fsync		= pinned_fsync,
+};
+
+
+/// Programs that drive the handlers directly, like bench_ll.c, include this file with TOSFS_NO_MAIN defined.
+#ifndef TOSFS_NO_MAIN
+int main(int argc, char *argv[]) {
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct fuse_cmdline_opts opts;
+    int errors = -1;
+
+    if (fuse_opt_parse(&args, &options, ensea_opts, NULL) == -1) {
+        return EXIT_FAILURE;
+    }
+    if (options.attr_timeout < 0 || options.entry_timeout < 0 || options.negative_timeout < 0) {
+        fprintf(stderr, "%s: timeouts cannot be negative\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (strcmp(options.data_access, "normal") == 0) {
+        data_advice = MADV_NORMAL;
+    } else if (strcmp(options.data_access, "random") == 0) {
+        data_advice = MADV_RANDOM;
+    } else if (strcmp(options.data_access, "sequential") == 0) {
+        data_advice = MADV_SEQUENTIAL;
+    } else {
+        fprintf(stderr, "%s: data_access must be normal, random or sequential\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (options.reload && !options.read_only) {
+        fprintf(stderr, "%s: reload needs readonly\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (options.trace_events > (1u << 31)) {
+        fprintf(stderr, "%s: trace_events cannot exceed 2^31\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (options.trace_events != 0) {
+        // The rings index their events with a mask
+        unsigned int events = 1;
+        while (events < options.trace_events) {
+            events *= 2;
+        }
+        options.trace_events = events;
+    }
+    if (fuse_parse_cmdline(&args, &opts) != 0) {
+        return EXIT_FAILURE;
+    }
+    if (opts.show_help) {
+        printf("usage: %s [options] <mountpoint>\n\n", argv[0]);
+        printf(
+            "tosfs options:\n"
+            "    -o max_write=N             largest WRITE request (default: %u)\n"
+            "    -o max_readahead=N         largest readahead, 0 keeps the kernel value\n"
+            "    -o max_background=N        pending background requests before blocking\n"
+            "    -o congestion_threshold=N  pending background requests before congestion\n"
+            "    -o readonly                map the image read-only, no write operation\n"
+            "    -o no_open                 let the kernel skip OPEN (readonly only)\n"
+            "    -o no_opendir              let the kernel skip OPENDIR (readonly only)\n"
+            "    -o attr_timeout=T          seconds attributes stay cached (default: %.1f, inf for ever)\n"
+            "    -o entry_timeout=T         seconds names stay cached (default: %.1f, inf for ever)\n"
+            "    -o negative_timeout=T      seconds missing names stay cached (default: 0)\n"
+            "    -o reload                  serve a new image renamed over the old one (readonly only)\n"
+            "    -o image=PATH              tosfs image to serve (default: %s)\n"
+            "    -o populate                fault the whole image in at mount\n"
+            "    -o prefetch_metadata       start reading the superblock, bitmaps and inode table at mount\n"
+            "    -o lock_metadata           keep the superblock, bitmaps and inode table in memory (mlock)\n"
+            "    -o data_access=MODE        normal, random or sequential reads of file data (default: normal)\n"
+            "    -o trace_events=N          requests each thread keeps for the traces, 0 for none (default: %u)\n"
+            "    -o trace_file=PATH         where SIGUSR1 dumps the traces (default: /tmp/tosfs_trace.<pid>.json)\n"
+            "    -o cache_blocks=N          decompressed blocks of compressed files kept, 0 for none (default: %u)\n"
+            "    -o no_splice               copy read replies through a buffer instead of splicing them\n"
+            "\n",
+            DEFAULT_MAX_WRITE, DEFAULT_TIMEOUT, DEFAULT_TIMEOUT, EXAMPLE_FILE_PATH, DEFAULT_TRACE_EVENTS,
+            DEFAULT_CACHE_BLOCKS
+        );
+        fuse_cmdline_help();
+        fuse_lowlevel_help();
+        errors = 0;
+    } else if (opts.show_version) {
+        printf("FUSE library version %s\n", fuse_pkgversion());
+        fuse_lowlevel_version();
+        errors = 0;
+    } else if (opts.mountpoint == NULL) {
+        printf("usage: %s [options] <mountpoint>\n", argv[0]);
+        printf("       %s --help\n", argv[0]);
+    } else {
+        if (realpath(options.image, image_path) == NULL) {
+            perror(options.image);
+            goto exit;
+        }
+        mapped_file = map_example_file();
+        if (mapped_file == NULL) {
+            goto exit;
+        }
+        if (read_mapped_file_as_tosfs_file(mapped_file) == SYSTEM_CALL_ERROR) {
+            close_mapped_file(mapped_file);
+            goto exit;
+        }
+        if (options.read_only) {
+            // Lets the kernel turn writes away itself instead of sending them to a read-only mapping
+            fuse_opt_add_arg(&args, "-oro");
+        }
+
+        struct fuse_session *se = fuse_session_new(&args, &ensea_ll_oper, sizeof(ensea_ll_oper), NULL);
+        if (se != NULL) {
+            if (fuse_set_signal_handlers(se) == 0) {
+                if (fuse_session_mount(se, opts.mountpoint) == 0) {
+                    fuse_daemonize(opts.foreground);
+                    session = se;
+                    const int tracing = options.trace_events != 0 && start_trace_dump() == EXIT_SUCCESS;
+                    if (!options.reload || start_image_watch() == EXIT_SUCCESS) {
+                        if (opts.singlethread) {
+                            errors = fuse_session_loop(se);
+                        } else {
+                            struct fuse_loop_config loop_config = {
+                                .clone_fd = opts.clone_fd,
+                                .max_idle_threads = opts.max_idle_threads,
+                            };
+                            errors = fuse_session_loop_mt(se, &loop_config);
+                        }
+                    }
+                    if (options.reload) {
+                        stop_image_watch();
+                    }
+                    if (tracing) {
+                        stop_trace_dump();
+                    }
+                    fuse_session_unmount(se);
+                }
+                fuse_remove_signal_handlers(se);
+            }
+            fuse_session_destroy(se);
+        }
+
+        close_mapped_file(mapped_file);
+    }
+
+exit:
+    free(opts.mountpoint);
+    fuse_opt_free_args(&args);
+	return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+#endif
@@ -7,6 +7,9 @@
   See the file COPYING.
 
   gcc -Wall fusexmp_fh.c `pkg-config fuse --cflags --libs` -lulockmgr -o fusexmp_fh
+
+  Request statistics can be read from the hidden file /.fusexmp_stats of
+  the mount (see op_stats.h for the format).
 */
 
 #define FUSE_USE_VERSION 26
@@ -32,11 +35,96 @@
 #include <sys/xattr.h>
 #endif
 #include <sys/file.h> /* flock(2) */
+#include <sys/mman.h> /* memfd_create(2) */
+
+#include "op_stats.h"
+
+/* hidden file serving the statistics; it shadows a host file of that name */
+#define STATS_PATH "/.fusexmp_stats"
+
+enum xmp_op {
+	XMP_OP_GETATTR, XMP_OP_FGETATTR, XMP_OP_ACCESS, XMP_OP_READLINK,
+	XMP_OP_OPENDIR, XMP_OP_READDIR, XMP_OP_RELEASEDIR, XMP_OP_MKNOD,
+	XMP_OP_MKDIR, XMP_OP_UNLINK, XMP_OP_RMDIR, XMP_OP_SYMLINK,
+	XMP_OP_RENAME, XMP_OP_LINK, XMP_OP_CHMOD, XMP_OP_CHOWN,
+	XMP_OP_TRUNCATE, XMP_OP_FTRUNCATE, XMP_OP_UTIMENS, XMP_OP_CREATE,
+	XMP_OP_OPEN, XMP_OP_READ, XMP_OP_READ_BUF, XMP_OP_WRITE,
+	XMP_OP_WRITE_BUF, XMP_OP_STATFS, XMP_OP_FLUSH, XMP_OP_RELEASE,
+	XMP_OP_FSYNC, XMP_OP_FALLOCATE, XMP_OP_SETXATTR, XMP_OP_GETXATTR,
+	XMP_OP_LISTXATTR, XMP_OP_REMOVEXATTR, XMP_OP_LOCK, XMP_OP_FLOCK,
+	XMP_OP_COUNT
+};
+
+static const char *const xmp_op_names[XMP_OP_COUNT] = {
+	"getattr", "fgetattr", "access", "readlink",
+	"opendir", "readdir", "releasedir", "mknod",
+	"mkdir", "unlink", "rmdir", "symlink",
+	"rename", "link", "chmod", "chown",
+	"truncate", "ftruncate", "utimens", "create",
+	"open", "read", "read_buf", "write",
+	"write_buf", "statfs", "flush", "release",
+	"fsync", "fallocate", "setxattr", "getxattr",
+	"listxattr", "removexattr", "lock", "flock",
+};
+
+static int is_stats_path(const char *path)
+{
+	return path != NULL && strcmp(path, STATS_PATH) == 0;
+}
+
+static int stats_getattr(struct stat *stbuf)
+{
+	size_t size;
+	char *text = op_stats_render(xmp_op_names, XMP_OP_COUNT, &size);
+
+	if (text == NULL)
+		return -ENOMEM;
+	free(text);
+	memset(stbuf, 0, sizeof(*stbuf));
+	stbuf->st_mode = S_IFREG | 0444;
+	stbuf->st_nlink = 1;
+	stbuf->st_uid = getuid();
+	stbuf->st_gid = getgid();
+	stbuf->st_size = size;
+	return 0;
+}
+
+/* The snapshot goes to an anonymous file, so that read, read_buf, fgetattr
+   and release handle it as any other open file. */
+static int stats_open(struct fuse_file_info *fi)
+{
+	size_t size;
+	char *text;
+	int fd, res;
+
+	if ((fi->flags & O_ACCMODE) != O_RDONLY)
+		return -EACCES;
+	text = op_stats_render(xmp_op_names, XMP_OP_COUNT, &size);
+	if (text == NULL)
+		return -ENOMEM;
+
+	fd = memfd_create("fusexmp_stats", MFD_CLOEXEC);
+	res = fd == -1 || write(fd, text, size) != (ssize_t) size ||
+		fchmod(fd, 0444) == -1 ? -errno : 0;
+	free(text);
+	if (res != 0) {
+		if (fd != -1)
+			close(fd);
+		return res;
+	}
+
+	fi->fh = fd;
+	fi->direct_io = 1;
+	return 0;
+}
 
 static int xmp_getattr(const char *path, struct stat *stbuf)
 {
 	int res;
 
+	if (is_stats_path(path))
+		return stats_getattr(stbuf);
+
 	res = lstat(path, stbuf);
 	if (res == -1)
 		return -errno;
@@ -62,6 +150,9 @@ static int xmp_access(const char *path, int mask)
 {
 	int res;
 
+	if (is_stats_path(path))
+		return mask & (W_OK | X_OK) ? -EACCES : 0;
+
 	res = access(path, mask);
 	if (res == -1)
 		return -errno;
@@ -313,6 +404,9 @@ static int xmp_open(const char *path, struct fuse_file_info *fi)
 {
 	int fd;
 
+	if (is_stats_path(path))
+		return stats_open(fi);
+
 	fd = open(path, fi->flags);
 	if (fd == -1)
 		return -errno;
@@ -510,49 +604,134 @@ static int xmp_flock(const char *path, struct fuse_file_info *fi, int op)
 	return 0;
 }
 
+/* Every handler is reached through a wrapper that times it. A handler
+   returns a negative errno on failure; read and write return the bytes
+   they moved. */
+#define COUNTED(op, name, params, args) \
+static int counted_##name params \
+{ \
+	struct timespec started; \
+	op_stats_start(&started); \
+	const int res = xmp_##name args; \
+	op_stats_record(op, &started, res < 0 ? -res : 0, 0); \
+	return res; \
+}
+
+#define COUNTED_BYTES(op, name, params, args) \
+static int counted_##name params \
+{ \
+	struct timespec started; \
+	op_stats_start(&started); \
+	const int res = xmp_##name args; \
+	op_stats_record(op, &started, res < 0 ? -res : 0, res > 0 ? res : 0); \
+	return res; \
+}
+
+COUNTED(XMP_OP_GETATTR, getattr, (const char *path, struct stat *stbuf), (path, stbuf))
+COUNTED(XMP_OP_FGETATTR, fgetattr, (const char *path, struct stat *stbuf, struct fuse_file_info *fi), (path, stbuf, fi))
+COUNTED(XMP_OP_ACCESS, access, (const char *path, int mask), (path, mask))
+COUNTED(XMP_OP_READLINK, readlink, (const char *path, char *buf, size_t size), (path, buf, size))
+COUNTED(XMP_OP_OPENDIR, opendir, (const char *path, struct fuse_file_info *fi), (path, fi))
+COUNTED(XMP_OP_READDIR, readdir, (const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+	struct fuse_file_info *fi), (path, buf, filler, offset, fi))
+COUNTED(XMP_OP_RELEASEDIR, releasedir, (const char *path, struct fuse_file_info *fi), (path, fi))
+COUNTED(XMP_OP_MKNOD, mknod, (const char *path, mode_t mode, dev_t rdev), (path, mode, rdev))
+COUNTED(XMP_OP_MKDIR, mkdir, (const char *path, mode_t mode), (path, mode))
+COUNTED(XMP_OP_UNLINK, unlink, (const char *path), (path))
+COUNTED(XMP_OP_RMDIR, rmdir, (const char *path), (path))
+COUNTED(XMP_OP_SYMLINK, symlink, (const char *from, const char *to), (from, to))
+COUNTED(XMP_OP_RENAME, rename, (const char *from, const char *to), (from, to))
+COUNTED(XMP_OP_LINK, link, (const char *from, const char *to), (from, to))
+COUNTED(XMP_OP_CHMOD, chmod, (const char *path, mode_t mode), (path, mode))
+COUNTED(XMP_OP_CHOWN, chown, (const char *path, uid_t uid, gid_t gid), (path, uid, gid))
+COUNTED(XMP_OP_TRUNCATE, truncate, (const char *path, off_t size), (path, size))
+COUNTED(XMP_OP_FTRUNCATE, ftruncate, (const char *path, off_t size, struct fuse_file_info *fi), (path, size, fi))
+#ifdef HAVE_UTIMENSAT
+COUNTED(XMP_OP_UTIMENS, utimens, (const char *path, const struct timespec ts[2]), (path, ts))
+#endif
+COUNTED(XMP_OP_CREATE, create, (const char *path, mode_t mode, struct fuse_file_info *fi), (path, mode, fi))
+COUNTED(XMP_OP_OPEN, open, (const char *path, struct fuse_file_info *fi), (path, fi))
+COUNTED_BYTES(XMP_OP_READ, read, (const char *path, char *buf, size_t size, off_t offset,
+	struct fuse_file_info *fi), (path, buf, size, offset, fi))
+COUNTED_BYTES(XMP_OP_WRITE, write, (const char *path, const char *buf, size_t size, off_t offset,
+	struct fuse_file_info *fi), (path, buf, size, offset, fi))
+COUNTED_BYTES(XMP_OP_WRITE_BUF, write_buf, (const char *path, struct fuse_bufvec *buf, off_t offset,
+	struct fuse_file_info *fi), (path, buf, offset, fi))
+COUNTED(XMP_OP_STATFS, statfs, (const char *path, struct statvfs *stbuf), (path, stbuf))
+COUNTED(XMP_OP_FLUSH, flush, (const char *path, struct fuse_file_info *fi), (path, fi))
+COUNTED(XMP_OP_RELEASE, release, (const char *path, struct fuse_file_info *fi), (path, fi))
+COUNTED(XMP_OP_FSYNC, fsync, (const char *path, int isdatasync, struct fuse_file_info *fi), (path, isdatasync, fi))
+#ifdef HAVE_POSIX_FALLOCATE
+COUNTED(XMP_OP_FALLOCATE, fallocate, (const char *path, int mode, off_t offset, off_t length,
+	struct fuse_file_info *fi), (path, mode, offset, length, fi))
+#endif
+#ifdef HAVE_SETXATTR
+COUNTED(XMP_OP_SETXATTR, setxattr, (const char *path, const char *name, const char *value, size_t size,
+	int flags), (path, name, value, size, flags))
+COUNTED(XMP_OP_GETXATTR, getxattr, (const char *path, const char *name, char *value, size_t size),
+	(path, name, value, size))
+COUNTED(XMP_OP_LISTXATTR, listxattr, (const char *path, char *list, size_t size), (path, list, size))
+COUNTED(XMP_OP_REMOVEXATTR, removexattr, (const char *path, const char *name), (path, name))
+#endif
+COUNTED(XMP_OP_LOCK, lock, (const char *path, struct fuse_file_info *fi, int cmd, struct flock *lock),
+	(path, fi, cmd, lock))
+COUNTED(XMP_OP_FLOCK, flock, (const char *path, struct fuse_file_info *fi, int op), (path, fi, op))
+
+/* read_buf only describes the read, libfuse splices the data afterwards:
+   the bytes counted are the ones asked for */
+static int counted_read_buf(const char *path, struct fuse_bufvec **bufp,
+			    size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	struct timespec started;
+	op_stats_start(&started);
+	const int res = xmp_read_buf(path, bufp, size, offset, fi);
+	op_stats_record(XMP_OP_READ_BUF, &started, res < 0 ? -res : 0, res == 0 ? size : 0);
+	return res;
+}
+
 static struct fuse_operations xmp_oper = {
-	.getattr	= xmp_getattr,
-	.fgetattr	= xmp_fgetattr,
-	.access		= xmp_access,
-	.readlink	= xmp_readlink,
-	.opendir	= xmp_opendir,
-	.readdir	= xmp_readdir,
-	.releasedir	= xmp_releasedir,
-	.mknod		= xmp_mknod,
-	.mkdir		= xmp_mkdir,
-	.symlink	= xmp_symlink,
-	.unlink		= xmp_unlink,
-	.rmdir		= xmp_rmdir,
-	.rename		= xmp_rename,
-	.link		= xmp_link,
-	.chmod		= xmp_chmod,
-	.chown		= xmp_chown,
-	.truncate	= xmp_truncate,
-	.ftruncate	= xmp_ftruncate,
+	.getattr	= counted_getattr,
+	.fgetattr	= counted_fgetattr,
+	.access		= counted_access,
+	.readlink	= counted_readlink,
+	.opendir	= counted_opendir,
+	.readdir	= counted_readdir,
+	.releasedir	= counted_releasedir,
+	.mknod		= counted_mknod,
+	.mkdir		= counted_mkdir,
+	.symlink	= counted_symlink,
+	.unlink		= counted_unlink,
+	.rmdir		= counted_rmdir,
+	.rename		= counted_rename,
+	.link		= counted_link,
+	.chmod		= counted_chmod,
+	.chown		= counted_chown,
+	.truncate	= counted_truncate,
+	.ftruncate	= counted_ftruncate,
 #ifdef HAVE_UTIMENSAT
-	.utimens	= xmp_utimens,
+	.utimens	= counted_utimens,
 #endif
-	.create		= xmp_create,
-	.open		= xmp_open,
-	.read		= xmp_read,
-	.read_buf	= xmp_read_buf,
-	.write		= xmp_write,
-	.write_buf	= xmp_write_buf,
-	.statfs		= xmp_statfs,
-	.flush		= xmp_flush,
-	.release	= xmp_release,
-	.fsync		= xmp_fsync,
+	.create		= counted_create,
+	.open		= counted_open,
+	.read		= counted_read,
+	.read_buf	= counted_read_buf,
+	.write		= counted_write,
+	.write_buf	= counted_write_buf,
+	.statfs		= counted_statfs,
+	.flush		= counted_flush,
+	.release	= counted_release,
+	.fsync		= counted_fsync,
 #ifdef HAVE_POSIX_FALLOCATE
-	.fallocate	= xmp_fallocate,
+	.fallocate	= counted_fallocate,
 #endif
 #ifdef HAVE_SETXATTR
-	.setxattr	= xmp_setxattr,
-	.getxattr	= xmp_getxattr,
-	.listxattr	= xmp_listxattr,
-	.removexattr	= xmp_removexattr,
+	.setxattr	= counted_setxattr,
+	.getxattr	= counted_getxattr,
+	.listxattr	= counted_listxattr,
+	.removexattr	= counted_removexattr,
 #endif
-	.lock		= xmp_lock,
-	.flock		= xmp_flock,
+	.lock		= counted_lock,
+	.flock		= counted_flock,
 
 	.flag_nullpath_ok = 1,
 #if HAVE_UTIMENSAT
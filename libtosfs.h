@@ -0,0 +1,877 @@
+/*
+ * libtosfs.h
+ *
+ * Access to a tosfs image shared by the daemon, file_mapping and the tools:
+ * opening and mapping the image, checking its superblock and geometry, and
+ * bounds-checked accessors handing out pointers into the mapping rather
+ * than copies. An accessor returns NULL, or an empty extent, for anything
+ * outside the image or the inode table, so that a corrupted number never
+ * turns into a wild read.
+ *
+ * An image is mapped whole, or through TOSFS_WINDOW_SLOTS windows mapped on
+ * demand when it may not fit in memory. A pointer from an accessor stays
+ * valid until the image is closed when it is mapped whole, and until
+ * TOSFS_WINDOW_SLOTS - 1 other windows have been reached otherwise: copy
+ * what must outlive the next few accesses.
+ */
+
+#ifndef __LIBTOSFS__
+#define __LIBTOSFS__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "tosfs.h"
+
+#define TOSFS_INODES_PER_BLOCK (TOSFS_BLOCK_SIZE / sizeof(struct tosfs_inode))
+#define TOSFS_INODES_V2_PER_BLOCK (TOSFS_BLOCK_SIZE / sizeof(struct tosfs_inode_v2))
+#define TOSFS_DENTRIES_PER_BLOCK (TOSFS_BLOCK_SIZE / sizeof(struct tosfs_dentry))
+#define TOSFS_MAX_EXTENTS (TOSFS_INLINE_EXTENTS + TOSFS_EXTENTS_PER_BLOCK)
+#define TOSFS_BITMAP_BLOCK_BITS (TOSFS_BLOCK_SIZE * 8)
+#define TOSFS_WINDOW_SLOTS 4
+/* inodes a batch load prefetches ahead of the one it copies */
+#define TOSFS_PREFETCH_DISTANCE 8
+/* blocks tosfs_for_each_block hands out at once, the next ones being read ahead meanwhile */
+#define TOSFS_BATCH_BLOCKS 2048
+
+/* tosfs_image_open flags */
+#define TOSFS_OPEN_WRITE 0x1 /* mapped writable, and flushed by tosfs_image_close */
+#define TOSFS_OPEN_POPULATE 0x2 /* every page faulted in by the open */
+
+/* blocks [first_block, first_block + blocks) mapped at address, or an unused slot when address is NULL */
+struct tosfs_window {
+	unsigned long long first_block;
+	__u32 blocks;
+	char *address;
+	unsigned long long last_use;
+};
+
+/* windows of window_blocks blocks, aligned on their size, unmapped least recently used first */
+struct tosfs_windows {
+	__u32 window_blocks;
+	struct tosfs_window slots[TOSFS_WINDOW_SLOTS];
+	unsigned long long clock;
+	/* first block of the window after the last one mapped, to tell a sequential walk from a random one */
+	unsigned long long next_sequential_block;
+};
+
+struct tosfs_image {
+	/* fields every accessor reads come first, on the same cache line */
+	/* the whole image, or NULL when it is reached through windows */
+	char *map;
+	struct tosfs_windows *windows;
+	/* in the mapping, or a copy of block 0 that outlives its window */
+	struct tosfs_superblock *superblock;
+	/* table matching version when the image is mapped whole, NULL otherwise */
+	struct tosfs_inode *inodes;
+	struct tosfs_inode_v2 *inodes_v2;
+	unsigned long long file_blocks;
+	__u32 version;
+	/* blocks both declared by the superblock and backed by the file */
+	__u32 block_count;
+	__u32 inode_table_start;
+	__u32 inode_table_capacity;
+	/* blocks [0, metadata_blocks) hold the superblock, the bitmaps and the inode table */
+	__u32 metadata_blocks;
+
+	int fd;
+	int flags;
+	struct stat file_info;
+	struct tosfs_superblock superblock_copy;
+};
+
+/* format independent copy of the attributes of an inode */
+struct tosfs_attributes {
+	__u32 inode;
+	__u16 uid;
+	__u16 gid;
+	__u16 mode;
+	__u16 perm;
+	__u16 nlink;
+	__u64 size;
+};
+
+/* bytes of a file contiguous in the image */
+struct tosfs_span {
+	__u64 position; /* offset in the image */
+	__u64 file_offset;
+	__u64 length;
+};
+
+/* walks the live entries of a directory, block after block along its extents */
+struct tosfs_dentry_cursor {
+	__u64 dir;
+	__u32 extent_count;
+	__u32 extent_index;
+	__u32 block_in_extent;
+	unsigned int entry_number;
+};
+
+/* maps the image at path, whole when window_size is 0, or through windows of window_size bytes, a multiple of
+   the page size. Returns -1 after reporting why on stderr. */
+static inline int tosfs_image_open(struct tosfs_image *image, const char *path, const int flags, const size_t window_size)
+{
+	memset(image, 0, sizeof(*image));
+	image->flags = flags;
+	image->fd = open(path, flags & TOSFS_OPEN_WRITE ? O_RDWR : O_RDONLY);
+	if (image->fd == -1) {
+		perror("tosfs_image_open: open");
+		return -1;
+	}
+	/* fstat, not stat: the path may already name a newer image than the one just opened */
+	if (fstat(image->fd, &image->file_info) == -1) {
+		perror("tosfs_image_open: stat");
+		close(image->fd);
+		return -1;
+	}
+	if (image->file_info.st_size < TOSFS_BLOCK_SIZE) {
+		fprintf(stderr, "tosfs_image_open: %s is too small for a tosfs image\n", path);
+		close(image->fd);
+		return -1;
+	}
+	image->file_blocks = (unsigned long long) image->file_info.st_size / TOSFS_BLOCK_SIZE;
+
+	if (window_size != 0) {
+		image->windows = calloc(1, sizeof(struct tosfs_windows));
+		if (image->windows == NULL) {
+			perror("tosfs_image_open: calloc");
+			close(image->fd);
+			return -1;
+		}
+		image->windows->window_blocks = window_size < TOSFS_BLOCK_SIZE ? 1 : window_size / TOSFS_BLOCK_SIZE;
+		return 0;
+	}
+
+	image->map = mmap(NULL, image->file_info.st_size,
+			  flags & TOSFS_OPEN_WRITE ? PROT_READ | PROT_WRITE : PROT_READ,
+			  MAP_SHARED | (flags & TOSFS_OPEN_POPULATE ? MAP_POPULATE : 0), image->fd, 0);
+	if (image->map == MAP_FAILED) {
+		perror("tosfs_image_open: mmap");
+		image->map = NULL;
+		close(image->fd);
+		return -1;
+	}
+	return 0;
+}
+
+static inline int tosfs_window_unmap(const struct tosfs_image *image, struct tosfs_window *window)
+{
+	const int status = munmap(window->address, (size_t) window->blocks * TOSFS_BLOCK_SIZE);
+
+	/* the image may be far larger than memory: pages already walked go back to the free list rather than
+	   pushing everything else out of the page cache */
+	posix_fadvise(image->fd, (off_t) window->first_block * TOSFS_BLOCK_SIZE,
+		      (off_t) window->blocks * TOSFS_BLOCK_SIZE, POSIX_FADV_DONTNEED);
+	window->address = NULL;
+	return status;
+}
+
+/* unmaps the image, flushing a writable one first. A failed flush is only reported, a failed unmap returns -1. */
+static inline int tosfs_image_close(struct tosfs_image *image)
+{
+	int status = 0;
+	unsigned int slot;
+
+	if (image->windows != NULL) {
+		for (slot = 0; slot < TOSFS_WINDOW_SLOTS; slot++)
+			if (image->windows->slots[slot].address != NULL &&
+			    tosfs_window_unmap(image, &image->windows->slots[slot]) == -1)
+				status = -1;
+		free(image->windows);
+	} else if (image->map != NULL) {
+		if ((image->flags & TOSFS_OPEN_WRITE) && msync(image->map, image->file_info.st_size, MS_SYNC) == -1)
+			perror("tosfs_image_close: msync");
+		if (munmap(image->map, image->file_info.st_size) == -1)
+			status = -1;
+	}
+	if (status == -1)
+		perror("tosfs_image_close: munmap");
+	close(image->fd);
+	image->map = NULL;
+	image->windows = NULL;
+	return status;
+}
+
+/* window holding block_no, mapped in place of the least recently used one when none does; NULL if it cannot be */
+static inline struct tosfs_window *tosfs_window_of_block(const struct tosfs_image *image, const __u32 block_no)
+{
+	struct tosfs_windows *windows = image->windows;
+	const unsigned long long first_block = block_no - block_no % windows->window_blocks;
+	struct tosfs_window *victim = &windows->slots[0];
+	unsigned int slot;
+
+	for (slot = 0; slot < TOSFS_WINDOW_SLOTS; slot++) {
+		struct tosfs_window *window = &windows->slots[slot];
+		if (window->address != NULL && window->first_block == first_block) {
+			window->last_use = ++windows->clock;
+			return window;
+		}
+		if (window->address == NULL || (victim->address != NULL && window->last_use < victim->last_use))
+			victim = window;
+	}
+
+	if (victim->address != NULL && tosfs_window_unmap(image, victim) == -1)
+		perror("tosfs_window_of_block: munmap");
+	victim->first_block = first_block;
+	victim->blocks = (__u32) (image->file_blocks - first_block < windows->window_blocks
+				  ? image->file_blocks - first_block : windows->window_blocks);
+	victim->address = mmap(NULL, (size_t) victim->blocks * TOSFS_BLOCK_SIZE, PROT_READ, MAP_SHARED,
+			       image->fd, (off_t) first_block * TOSFS_BLOCK_SIZE);
+	if (victim->address == MAP_FAILED) {
+		perror("tosfs_window_of_block: mmap");
+		victim->address = NULL;
+		return NULL;
+	}
+	victim->last_use = ++windows->clock;
+
+	/* a walk reaching the window after the previous one reads on: this one is faulted ahead and the next one
+	   started. Others, such as directory blocks reached from the inode table, only get the read around. */
+	if (first_block == windows->next_sequential_block) {
+		madvise(victim->address, (size_t) victim->blocks * TOSFS_BLOCK_SIZE, MADV_SEQUENTIAL);
+		posix_fadvise(image->fd, (off_t) (first_block + victim->blocks) * TOSFS_BLOCK_SIZE,
+			      (off_t) windows->window_blocks * TOSFS_BLOCK_SIZE, POSIX_FADV_WILLNEED);
+	}
+	windows->next_sequential_block = first_block + victim->blocks;
+	return victim;
+}
+
+/* address of block_no, and in *available how many of the count blocks from it follow contiguously in memory:
+   up to the end of the file, and of the window holding it. NULL when block_no is past the end of the file. */
+static inline void *tosfs_blocks(const struct tosfs_image *image, const __u32 block_no, const __u32 count,
+				 __u32 *available)
+{
+	const struct tosfs_window *window;
+
+	if (block_no >= image->file_blocks)
+		return NULL;
+	if (image->windows == NULL) {
+		*available = image->file_blocks - block_no < count ? (__u32) (image->file_blocks - block_no) : count;
+		return image->map + (size_t) block_no * TOSFS_BLOCK_SIZE;
+	}
+	window = tosfs_window_of_block(image, block_no);
+	if (window == NULL)
+		return NULL;
+	*available = window->first_block + window->blocks - block_no < count
+		? (__u32) (window->first_block + window->blocks - block_no) : count;
+	return window->address + (size_t) (block_no - window->first_block) * TOSFS_BLOCK_SIZE;
+}
+
+static inline void *tosfs_block(const struct tosfs_image *image, const __u32 block_no)
+{
+	__u32 available;
+
+	return tosfs_blocks(image, block_no, 1, &available);
+}
+
+/* whether a run of blocks lies past the superblock and inside the blocks the superblock declares */
+static inline int tosfs_range_valid(const struct tosfs_image *image, const __u32 start, const __u32 blocks)
+{
+	return start > TOSFS_SUPERBLOCK && blocks > 0 && start <= image->block_count &&
+		blocks <= image->block_count - start;
+}
+
+/* without regions, a v2 image keeps the 32 block layout: bitmaps in the superblock, inode table in block 1 */
+static inline int tosfs_image_has_regions(const struct tosfs_image *image)
+{
+	return image->version == TOSFS_VERSION_2 && image->superblock->block_bitmap_blocks != 0;
+}
+
+/* slot of an inode in the table, free or not, or NULL when past the table or of the other version */
+static inline struct tosfs_inode *tosfs_inode_v1(const struct tosfs_image *image, const __u64 ino)
+{
+	struct tosfs_inode *table;
+
+	if (image->version != TOSFS_VERSION_1 || ino >= image->inode_table_capacity)
+		return NULL;
+	if (image->inodes != NULL)
+		return &image->inodes[ino];
+	table = tosfs_block(image, image->inode_table_start);
+	return table == NULL ? NULL : &table[ino];
+}
+
+static inline struct tosfs_inode_v2 *tosfs_inode_v2(const struct tosfs_image *image, const __u64 ino)
+{
+	struct tosfs_inode_v2 *block;
+
+	if (image->version != TOSFS_VERSION_2 || ino >= image->inode_table_capacity)
+		return NULL;
+	if (image->inodes_v2 != NULL)
+		return &image->inodes_v2[ino];
+	block = tosfs_block(image, image->inode_table_start + (__u32) (ino / TOSFS_INODES_V2_PER_BLOCK));
+	return block == NULL ? NULL : &block[ino % TOSFS_INODES_V2_PER_BLOCK];
+}
+
+/* copies the attributes of a live inode, or returns -1 for a free or out of range inode number */
+static inline int tosfs_inode_load(const struct tosfs_image *image, const __u64 ino, struct tosfs_attributes *attributes)
+{
+	if (ino == 0)
+		return -1;
+	if (image->version == TOSFS_VERSION_1) {
+		const struct tosfs_inode *inode = tosfs_inode_v1(image, ino);
+		if (inode == NULL || inode->inode == 0)
+			return -1;
+		attributes->inode = inode->inode;
+		attributes->uid = inode->uid;
+		attributes->gid = inode->gid;
+		attributes->mode = inode->mode;
+		attributes->perm = inode->perm;
+		attributes->nlink = inode->nlink;
+		/* a file owns a single block, so a corrupted size can never make a read go past that block */
+		attributes->size = inode->size < TOSFS_BLOCK_SIZE ? inode->size : TOSFS_BLOCK_SIZE;
+		return 0;
+	}
+
+	const struct tosfs_inode_v2 *inode = tosfs_inode_v2(image, ino);
+	if (inode == NULL || inode->inode == 0)
+		return -1;
+	attributes->inode = inode->inode;
+	attributes->uid = inode->uid;
+	attributes->gid = inode->gid;
+	attributes->mode = inode->mode;
+	attributes->perm = inode->perm;
+	attributes->nlink = inode->nlink;
+	attributes->size = inode->size;
+	return 0;
+}
+
+/* images built by hand may leave the mode of the root to zero */
+static inline int tosfs_is_directory(const struct tosfs_image *image, const __u64 ino,
+				     const struct tosfs_attributes *attributes)
+{
+	return ino == image->superblock->root_inode || S_ISDIR(attributes->mode);
+}
+
+static inline int tosfs_inode_compressed(const struct tosfs_image *image, const __u64 ino)
+{
+	const struct tosfs_inode_v2 *inode = tosfs_inode_v2(image, ino);
+
+	return inode != NULL && (inode->flags & TOSFS_INODE_COMPRESSED);
+}
+
+/* runs of blocks of an inode: a v1 inode has a single one, and a v2 one whose extent block lies outside the
+   file only its inline ones */
+static inline __u32 tosfs_extent_count(const struct tosfs_image *image, const __u64 ino)
+{
+	const struct tosfs_inode_v2 *inode;
+	__u32 nr_extents;
+
+	if (image->version == TOSFS_VERSION_1)
+		return tosfs_inode_v1(image, ino) == NULL ? 0 : 1;
+	inode = tosfs_inode_v2(image, ino);
+	if (inode == NULL)
+		return 0;
+	/* a writer publishes the count after the extent it covers */
+	nr_extents = __atomic_load_n(&inode->nr_extents, __ATOMIC_ACQUIRE);
+	if (nr_extents > TOSFS_INLINE_EXTENTS && inode->extent_block >= image->file_blocks)
+		return TOSFS_INLINE_EXTENTS;
+	return nr_extents < TOSFS_MAX_EXTENTS ? nr_extents : TOSFS_MAX_EXTENTS;
+}
+
+/* the index-th run of blocks of an inode, below tosfs_extent_count, or an empty run */
+static inline struct tosfs_extent tosfs_extent_at(const struct tosfs_image *image, const __u64 ino, const __u32 index)
+{
+	struct tosfs_extent extent = { .start = 0, .length = 0 };
+
+	if (image->version == TOSFS_VERSION_1) {
+		const struct tosfs_inode *inode = tosfs_inode_v1(image, ino);
+		if (inode != NULL && index == 0) {
+			extent.start = inode->block_no;
+			extent.length = 1;
+		}
+		return extent;
+	}
+
+	const struct tosfs_inode_v2 *inode = tosfs_inode_v2(image, ino);
+	if (inode == NULL || index >= TOSFS_MAX_EXTENTS)
+		return extent;
+	if (index < TOSFS_INLINE_EXTENTS)
+		return inode->extents[index];
+	const struct tosfs_extent *extents = tosfs_block(image, inode->extent_block);
+	return extents == NULL ? extent : extents[index - TOSFS_INLINE_EXTENTS];
+}
+
+static inline void tosfs_dentry_cursor_init(const struct tosfs_image *image, struct tosfs_dentry_cursor *cursor,
+					    const __u64 dir)
+{
+	memset(cursor, 0, sizeof(*cursor));
+	cursor->dir = dir;
+	cursor->extent_count = tosfs_extent_count(image, dir);
+}
+
+/* next live entry of the directory, or NULL once every block inside the image has been visited */
+static inline struct tosfs_dentry *tosfs_dentry_next(const struct tosfs_image *image, struct tosfs_dentry_cursor *cursor)
+{
+	while (cursor->extent_index < cursor->extent_count) {
+		const struct tosfs_extent extent = tosfs_extent_at(image, cursor->dir, cursor->extent_index);
+		const __u32 block_no = extent.start + cursor->block_in_extent;
+		if (cursor->block_in_extent >= extent.length || block_no >= image->block_count) {
+			cursor->extent_index++;
+			cursor->block_in_extent = 0;
+			continue;
+		}
+		if (cursor->entry_number >= TOSFS_DENTRIES_PER_BLOCK) {
+			cursor->block_in_extent++;
+			cursor->entry_number = 0;
+			continue;
+		}
+
+		struct tosfs_dentry *block = tosfs_block(image, block_no);
+		struct tosfs_dentry *entry = block == NULL ? NULL : &block[cursor->entry_number];
+		cursor->entry_number++;
+		if (entry != NULL && entry->inode != 0)
+			return entry;
+	}
+	return NULL;
+}
+
+/* pieces of the bytes [offset, offset + length) of a live inode, clipped to its size, in file order. Fills at
+   most max_spans of them and returns how many, 0 for a free inode, an offset past the end of file or a
+   compressed inode, whose data is read with tosfs_read_compressed_block. Runs outside the blocks the
+   superblock declares end the walk. */
+static inline size_t tosfs_inode_spans(const struct tosfs_image *image, const __u64 ino, __u64 offset, __u64 length,
+				       struct tosfs_span *spans, const size_t max_spans)
+{
+	struct tosfs_attributes attributes;
+	__u64 extent_offset = 0;
+	__u32 index, extent_count;
+	size_t count = 0;
+
+	if (tosfs_inode_load(image, ino, &attributes) == -1 || offset >= attributes.size ||
+	    tosfs_inode_compressed(image, ino))
+		return 0;
+	if (length > attributes.size - offset)
+		length = attributes.size - offset;
+	extent_count = tosfs_extent_count(image, ino);
+	for (index = 0; index < extent_count && length > 0 && count < max_spans; index++) {
+		const struct tosfs_extent extent = tosfs_extent_at(image, ino, index);
+		const __u64 extent_size = (__u64) extent.length * TOSFS_BLOCK_SIZE;
+		if (!tosfs_range_valid(image, extent.start, extent.length))
+			break;
+		if (offset < extent_offset + extent_size) {
+			const __u64 in_extent = offset - extent_offset;
+			const __u64 chunk = length < extent_size - in_extent ? length : extent_size - in_extent;
+			spans[count].position = (__u64) extent.start * TOSFS_BLOCK_SIZE + in_extent;
+			spans[count].file_offset = offset;
+			spans[count].length = chunk;
+			count++;
+			offset += chunk;
+			length -= chunk;
+		}
+		extent_offset += extent_size;
+	}
+	return count;
+}
+
+/* attributes of count inodes at once, prefetching the table entries a few inodes ahead so that inodes spread
+   over the table cost one memory latency together rather than one each. A free or out of range inode gets
+   zeroed attributes. Returns how many are live. */
+static inline size_t tosfs_inode_load_many(const struct tosfs_image *image, const __u32 *inos, const size_t count,
+					   struct tosfs_attributes *attributes)
+{
+	size_t index, live = 0;
+
+	for (index = 0; index < count; index++) {
+		/* windows could be unmapped by a prefetch: only a whole mapping is prefetched */
+		if (index + TOSFS_PREFETCH_DISTANCE < count && image->windows == NULL) {
+			const __u32 ahead = inos[index + TOSFS_PREFETCH_DISTANCE];
+			if (image->inodes_v2 != NULL && ahead < image->inode_table_capacity)
+				__builtin_prefetch(&image->inodes_v2[ahead]);
+			else if (image->inodes != NULL && ahead < image->inode_table_capacity)
+				__builtin_prefetch(&image->inodes[ahead]);
+		}
+		if (tosfs_inode_load(image, inos[index], &attributes[index]) == 0)
+			live++;
+		else
+			memset(&attributes[index], 0, sizeof(struct tosfs_attributes));
+	}
+	return live;
+}
+
+/* calls visit on blocks [first, first + count) in order, in pieces contiguous in memory of at most
+   TOSFS_BATCH_BLOCKS blocks, reading the next piece ahead while one is visited. Stops at the first non zero
+   value visit returns and returns it, or -1 when the range leaves the file. */
+static inline int tosfs_for_each_block(const struct tosfs_image *image, __u32 first, __u32 count,
+				       int (*visit)(const char *data, __u32 block_no, __u32 blocks, void *arg),
+				       void *arg)
+{
+	while (count > 0) {
+		__u32 available;
+		const char *data = tosfs_blocks(image, first, count < TOSFS_BATCH_BLOCKS ? count : TOSFS_BATCH_BLOCKS,
+						&available);
+		if (data == NULL)
+			return -1;
+		if (image->windows == NULL && available < count) {
+			/* the start of the next piece, rounded down to a page as madvise wants */
+			const size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+			const size_t next = (size_t) (first + available) * TOSFS_BLOCK_SIZE / page_size * page_size;
+			const size_t end = (size_t) (count - available < TOSFS_BATCH_BLOCKS ? count - available : TOSFS_BATCH_BLOCKS)
+				* TOSFS_BLOCK_SIZE + (size_t) (first + available) * TOSFS_BLOCK_SIZE;
+			if (next < (size_t) image->file_info.st_size)
+				madvise(image->map + next, (end < (size_t) image->file_info.st_size ? end
+							    : (size_t) image->file_info.st_size) - next, MADV_WILLNEED);
+		}
+		const int status = visit(data, first, available, arg);
+		if (status != 0)
+			return status;
+		first += available;
+		count -= available;
+	}
+	return 0;
+}
+
+/* the LZ4 block format: sequences of a token (literal count << 4 | match length - 4, 15 meaning that bytes of
+   255 and a last one below it follow to add to the count), the literals, and a little endian 16 bit offset
+   back to the match. The last sequence has literals only, and the last 5 bytes of a block are always
+   literals. */
+#define TOSFS_LZ_MIN_MATCH 4
+#define TOSFS_LZ_LAST_LITERALS 5
+/* no match starts in the last 12 bytes, as the LZ4 format requires */
+#define TOSFS_LZ_MATCH_START_LIMIT 12
+#define TOSFS_LZ_HASH_LOG 12
+
+static inline __u32 tosfs_lz_read32(const unsigned char *bytes)
+{
+	__u32 value;
+
+	memcpy(&value, bytes, sizeof(value));
+	return value;
+}
+
+static inline unsigned int tosfs_lz_hash(const __u32 sequence)
+{
+	return (sequence * 2654435761u) >> (32 - TOSFS_LZ_HASH_LOG);
+}
+
+static inline unsigned char *tosfs_lz_put_length(unsigned char *out, size_t length)
+{
+	for (; length >= 255; length -= 255)
+		*out++ = 255;
+	*out++ = (unsigned char) length;
+	return out;
+}
+
+/* compresses the length bytes at in, at most 64 KiB, into at most capacity bytes at out, with a greedy parse
+   over a hash table of the last position of every 4 byte sequence. Returns the compressed length, or 0 when
+   it does not fit in capacity. */
+static inline size_t tosfs_compress_block(const void *in, const size_t length, void *out, const size_t capacity)
+{
+	const unsigned char *const start = in;
+	const unsigned char *const end = start + length;
+	const unsigned char *const match_limit = end - (length < TOSFS_LZ_LAST_LITERALS ? length : TOSFS_LZ_LAST_LITERALS);
+	const unsigned char *const search_limit = length < TOSFS_LZ_MATCH_START_LIMIT ? start
+		: end - TOSFS_LZ_MATCH_START_LIMIT;
+	const unsigned char *position = start, *anchor = start;
+	unsigned char *output = out;
+	unsigned char *const output_end = output + capacity;
+	__u16 table[1 << TOSFS_LZ_HASH_LOG];
+	size_t literals;
+
+	if (length > 65536)
+		return 0;
+	memset(table, 0, sizeof(table));
+	while (position < search_limit) {
+		const __u32 sequence = tosfs_lz_read32(position);
+		const unsigned int hash = tosfs_lz_hash(sequence);
+		const unsigned char *reference = start + table[hash];
+		table[hash] = (__u16) (position - start);
+		if (reference >= position || tosfs_lz_read32(reference) != sequence) {
+			position++;
+			continue;
+		}
+
+		const unsigned char *match_end = position + TOSFS_LZ_MIN_MATCH;
+		reference += TOSFS_LZ_MIN_MATCH;
+		while (match_end < match_limit && *match_end == *reference) {
+			match_end++;
+			reference++;
+		}
+		literals = (size_t) (position - anchor);
+		const size_t match = (size_t) (match_end - position) - TOSFS_LZ_MIN_MATCH;
+		const size_t offset = (size_t) (match_end - reference);
+		if ((size_t) (output_end - output) < 1 + literals / 255 + 1 + literals + 2 + match / 255 + 1)
+			return 0;
+		unsigned char *token = output++;
+		*token = (unsigned char) ((literals < 15 ? literals : 15) << 4 | (match < 15 ? match : 15));
+		if (literals >= 15)
+			output = tosfs_lz_put_length(output, literals - 15);
+		memcpy(output, anchor, literals);
+		output += literals;
+		*output++ = (unsigned char) offset;
+		*output++ = (unsigned char) (offset >> 8);
+		if (match >= 15)
+			output = tosfs_lz_put_length(output, match - 15);
+		position = anchor = match_end;
+	}
+
+	literals = (size_t) (end - anchor);
+	if ((size_t) (output_end - output) < 1 + literals / 255 + 1 + literals)
+		return 0;
+	*output++ = (unsigned char) ((literals < 15 ? literals : 15) << 4);
+	if (literals >= 15)
+		output = tosfs_lz_put_length(output, literals - 15);
+	memcpy(output, anchor, literals);
+	output += literals;
+	return (size_t) (output - (unsigned char *) out);
+}
+
+/* decompresses the length bytes at in into at most capacity bytes at out. Every count and offset is checked
+   against both buffers: returns the decompressed length, or -1 for input that is not a valid block. */
+static inline long tosfs_decompress_block(const void *in, const size_t length, void *out, const size_t capacity)
+{
+	const unsigned char *input = in;
+	const unsigned char *const input_end = input + length;
+	unsigned char *const output_start = out;
+	unsigned char *output = out;
+	unsigned char *const output_end = output + capacity;
+
+	while (input < input_end) {
+		const unsigned int token = *input++;
+		size_t literals = token >> 4;
+		size_t match = token & 15;
+		unsigned int byte;
+
+		if (literals == 15)
+			do {
+				if (input == input_end)
+					return -1;
+				byte = *input++;
+				literals += byte;
+			} while (byte == 255);
+		if (literals > (size_t) (input_end - input) || literals > (size_t) (output_end - output))
+			return -1;
+		/* short runs, the common case in text, are copied 16 bytes at once while both buffers have room */
+		if (literals <= 16 && input_end - input >= 16 && output_end - output >= 16)
+			memcpy(output, input, 16);
+		else
+			memcpy(output, input, literals);
+		output += literals;
+		input += literals;
+		if (input == input_end)
+			break;
+
+		if (input_end - input < 2)
+			return -1;
+		const size_t offset = input[0] | (size_t) input[1] << 8;
+		input += 2;
+		if (match == 15)
+			do {
+				if (input == input_end)
+					return -1;
+				byte = *input++;
+				match += byte;
+			} while (byte == 255);
+		match += TOSFS_LZ_MIN_MATCH;
+		if (offset == 0 || offset > (size_t) (output - output_start) || match > (size_t) (output_end - output))
+			return -1;
+		const unsigned char *reference = output - offset;
+		if (offset >= 8 && (size_t) (output_end - output) >= match + 8) {
+			/* 8 bytes at a time, each read from bytes already written when the match overlaps them, the
+			   bytes written past the match being overwritten by the next sequences */
+			size_t copied;
+			for (copied = 0; copied < match; copied += 8)
+				memcpy(output + copied, reference + copied, 8);
+			output += match;
+		} else if (offset >= match) {
+			memcpy(output, reference, match);
+			output += match;
+		} else {
+			/* the match overlaps what it writes: a run of the last offset bytes */
+			while (match-- > 0)
+				*output++ = *reference++;
+		}
+	}
+	return (long) (output - output_start);
+}
+
+/* stores one block of a compressed file: compressed at out when that makes it smaller, copied as is otherwise.
+   out holds at least length bytes. Returns the stored length. */
+static inline size_t tosfs_store_block(const void *in, const size_t length, void *out)
+{
+	const size_t compressed = length > 1 ? tosfs_compress_block(in, length, out, length - 1) : 0;
+
+	if (compressed != 0)
+		return compressed;
+	memcpy(out, in, length);
+	return length;
+}
+
+/* bytes of the offset table of a compressed file of size bytes */
+static inline __u64 tosfs_compressed_table_size(const __u64 size)
+{
+	return ((size + TOSFS_BLOCK_SIZE - 1) / TOSFS_BLOCK_SIZE + 1) * sizeof(__u32);
+}
+
+/* builds the stored bytes of a compressed file from its size bytes of data at data, into out, which holds
+   capacity bytes. Returns their length, or 0 when they do not fit or would not spare a single block. */
+static inline __u64 tosfs_compress_file(const void *data, const __u64 size, void *out, const __u64 capacity)
+{
+	const __u64 blocks = (size + TOSFS_BLOCK_SIZE - 1) / TOSFS_BLOCK_SIZE;
+	__u32 *offsets = out;
+	__u64 stored = tosfs_compressed_table_size(size);
+	unsigned char scratch[TOSFS_BLOCK_SIZE];
+	__u64 block;
+
+	if (blocks == 0 || stored > capacity || size > UINT_MAX)
+		return 0;
+	for (block = 0; block < blocks; block++) {
+		const size_t length = block + 1 < blocks ? TOSFS_BLOCK_SIZE : (size_t) (size - block * TOSFS_BLOCK_SIZE);
+		const size_t stored_length = tosfs_store_block((const char *) data + block * TOSFS_BLOCK_SIZE, length,
+							       scratch);
+		offsets[block] = (__u32) stored;
+		if (stored + stored_length > capacity ||
+		    (stored + stored_length + TOSFS_BLOCK_SIZE - 1) / TOSFS_BLOCK_SIZE >= blocks)
+			return 0;
+		memcpy((char *) out + stored, scratch, stored_length);
+		stored += stored_length;
+	}
+	offsets[blocks] = (__u32) stored;
+	return stored;
+}
+
+/* copies the length stored bytes at offset of an inode, along its extents, to dest. Returns -1 when the range
+   leaves its blocks or the image. */
+static inline int tosfs_inode_read_stored(const struct tosfs_image *image, const __u64 ino, __u64 offset,
+					  size_t length, void *dest)
+{
+	const __u32 extent_count = tosfs_extent_count(image, ino);
+	__u64 extent_offset = 0;
+	char *to = dest;
+	__u32 index;
+
+	for (index = 0; index < extent_count && length > 0; index++) {
+		const struct tosfs_extent extent = tosfs_extent_at(image, ino, index);
+		const __u64 extent_size = (__u64) extent.length * TOSFS_BLOCK_SIZE;
+		if (!tosfs_range_valid(image, extent.start, extent.length))
+			return -1;
+		while (length > 0 && offset < extent_offset + extent_size) {
+			const __u64 in_extent = offset - extent_offset;
+			const __u32 block_in_extent = (__u32) (in_extent / TOSFS_BLOCK_SIZE);
+			__u32 available;
+			const char *data = tosfs_blocks(image, extent.start + block_in_extent, extent.length - block_in_extent,
+							&available);
+			if (data == NULL)
+				return -1;
+			const size_t in_block = in_extent % TOSFS_BLOCK_SIZE;
+			const size_t chunk = length < (size_t) available * TOSFS_BLOCK_SIZE - in_block
+				? length : (size_t) available * TOSFS_BLOCK_SIZE - in_block;
+			memcpy(to, data + in_block, chunk);
+			to += chunk;
+			offset += chunk;
+			length -= chunk;
+		}
+		extent_offset += extent_size;
+	}
+	return length == 0 ? 0 : -1;
+}
+
+/* decompresses the block-th block of the data of a compressed inode to dest, which holds TOSFS_BLOCK_SIZE
+   bytes. Returns its length, TOSFS_BLOCK_SIZE but for the last block, or -1 for a block past the end of file
+   or stored bytes that are corrupted. */
+static inline long tosfs_read_compressed_block(const struct tosfs_image *image, const __u64 ino, const __u64 block,
+					       void *dest)
+{
+	const struct tosfs_inode_v2 *inode = tosfs_inode_v2(image, ino);
+	unsigned char stored[TOSFS_BLOCK_SIZE];
+	__u32 bounds[2];
+
+	if (inode == NULL || block >= (inode->size + TOSFS_BLOCK_SIZE - 1) / TOSFS_BLOCK_SIZE)
+		return -1;
+	const __u64 size = inode->size;
+	const size_t expected = size - block * TOSFS_BLOCK_SIZE < TOSFS_BLOCK_SIZE
+		? (size_t) (size - block * TOSFS_BLOCK_SIZE) : TOSFS_BLOCK_SIZE;
+	if (tosfs_inode_read_stored(image, ino, block * sizeof(__u32), sizeof(bounds), bounds) == -1 ||
+	    bounds[0] < tosfs_compressed_table_size(size) || bounds[1] < bounds[0] || bounds[1] - bounds[0] > expected)
+		return -1;
+
+	const size_t length = bounds[1] - bounds[0];
+	if (length == expected)
+		return tosfs_inode_read_stored(image, ino, bounds[0], length, dest) == -1 ? -1 : (long) length;
+	if (tosfs_inode_read_stored(image, ino, bounds[0], length, stored) == -1 ||
+	    tosfs_decompress_block(stored, length, dest, expected) != (long) expected)
+		return -1;
+	return (long) expected;
+}
+
+/* checks the superblock and the geometry it describes. Returns -1 after reporting why on stderr for an image
+   tosfs cannot serve. */
+static inline int tosfs_image_read(struct tosfs_image *image)
+{
+	struct tosfs_superblock *superblock = tosfs_block(image, TOSFS_SUPERBLOCK);
+	struct tosfs_attributes root_attributes;
+
+	if (superblock == NULL)
+		return -1;
+	if (image->windows != NULL) {
+		memcpy(&image->superblock_copy, superblock, sizeof(struct tosfs_superblock));
+		superblock = &image->superblock_copy;
+	}
+	image->superblock = superblock;
+	image->inodes = NULL;
+	image->inodes_v2 = NULL;
+	if (superblock->magic != TOSFS_MAGIC) {
+		fprintf(stderr, "tosfs_image_read: bad magic\n");
+		return -1;
+	}
+	if (superblock->version != TOSFS_VERSION_1 && superblock->version != TOSFS_VERSION_2) {
+		fprintf(stderr, "tosfs_image_read: unknown version %u\n", superblock->version);
+		return -1;
+	}
+
+	image->version = superblock->version;
+	image->block_count = superblock->blocks < image->file_blocks ? superblock->blocks : (__u32) image->file_blocks;
+	if (!tosfs_image_has_regions(image)) {
+		image->inode_table_start = TOSFS_INODE_BLOCK;
+		image->inode_table_capacity = image->version == TOSFS_VERSION_1 ? TOSFS_INODES_PER_BLOCK : TOSFS_INODES_V2_PER_BLOCK;
+		image->metadata_blocks = image->version == TOSFS_VERSION_1 ? TOSFS_ROOT_BLOCK + 1 : TOSFS_INODE_BLOCK + 1;
+		if (!tosfs_range_valid(image, TOSFS_INODE_BLOCK, 1)) {
+			fprintf(stderr, "tosfs_image_read: no inode table\n");
+			return -1;
+		}
+	} else {
+		/* one region per bitmap and one for the inode table, all right after block 0 */
+		if (!tosfs_range_valid(image, superblock->block_bitmap_start, superblock->block_bitmap_blocks) ||
+		    !tosfs_range_valid(image, superblock->inode_bitmap_start, superblock->inode_bitmap_blocks) ||
+		    !tosfs_range_valid(image, superblock->inode_table_start, superblock->inode_table_blocks)) {
+			fprintf(stderr, "tosfs_image_read: bad metadata region\n");
+			return -1;
+		}
+		/* an inode number needs both a bitmap bit and a table slot, and must fit an int */
+		__u64 capacity = (__u64) superblock->inode_bitmap_blocks * TOSFS_BITMAP_BLOCK_BITS;
+		if (capacity > (__u64) superblock->inode_table_blocks * TOSFS_INODES_V2_PER_BLOCK)
+			capacity = (__u64) superblock->inode_table_blocks * TOSFS_INODES_V2_PER_BLOCK;
+		image->inode_table_start = superblock->inode_table_start;
+		image->inode_table_capacity = capacity < INT_MAX ? (__u32) capacity : INT_MAX;
+		image->metadata_blocks = superblock->block_bitmap_start + superblock->block_bitmap_blocks;
+		if (image->metadata_blocks < superblock->inode_bitmap_start + superblock->inode_bitmap_blocks)
+			image->metadata_blocks = superblock->inode_bitmap_start + superblock->inode_bitmap_blocks;
+		if (image->metadata_blocks < superblock->inode_table_start + superblock->inode_table_blocks)
+			image->metadata_blocks = superblock->inode_table_start + superblock->inode_table_blocks;
+	}
+	if (image->map != NULL) {
+		if (image->version == TOSFS_VERSION_1)
+			image->inodes = (struct tosfs_inode *) tosfs_block(image, image->inode_table_start);
+		else
+			image->inodes_v2 = (struct tosfs_inode_v2 *) tosfs_block(image, image->inode_table_start);
+	}
+	if (superblock->inodes > image->inode_table_capacity) {
+		fprintf(stderr, "tosfs_image_read: too many inodes\n");
+		return -1;
+	}
+
+	/* every lookup starts at the root directory, which must own its first block (block 2 for v1 images) */
+	if (tosfs_inode_load(image, superblock->root_inode, &root_attributes) == -1 ||
+	    tosfs_extent_count(image, superblock->root_inode) == 0 ||
+	    tosfs_extent_at(image, superblock->root_inode, 0).start >= image->block_count) {
+		fprintf(stderr, "tosfs_image_read: bad root inode\n");
+		return -1;
+	}
+	return 0;
+}
+
+#endif /* __LIBTOSFS__ */
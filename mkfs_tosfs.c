@@ -0,0 +1,1066 @@
+//
+// mkfs.tosfs: writes v2 tosfs images, either synthetic trees of any size or a copy of a host directory tree.
+//
+// The whole layout is decided before anything is written: block 0 holds the superblock, then come the block
+// bitmap, the inode bitmap and the inode table regions, the directory blocks, the file data, and the free blocks
+// left for the daemon to allocate. Every directory and every file owns a single extent. The metadata is built in
+// memory and written in one pass; the data region is cut into chunks that worker threads fill, from the generator
+// or from the host files, and write with one large pwrite each.
+//
+// With -c every file is compressed block by block before the layout, which then only reserves the blocks of its
+// stored bytes. Only the offset table of each file is kept in memory: the workers filling the data region compress
+// the blocks again as they write them.
+//
+// gcc -Wall -O2 mkfs_tosfs.c -o mkfs.tosfs -lpthread -lm
+//
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "libtosfs.h"
+
+#define SYSTEM_CALL_ERROR (-1)
+#define BITMAP_BITS (32)
+#define DEFAULT_FILES (1000)
+#define DEFAULT_FILE_SIZE (4096)
+#define DEFAULT_SEED (1)
+/// Free blocks and free inodes left for the daemon, in percent of what the tree uses
+#define DEFAULT_HEADROOM (25)
+/// Least free blocks a default sized image keeps, so that even an empty one takes writes
+#define MIN_FREE_BLOCKS (256)
+/// Blocks each worker fills and writes at once
+#define CHUNK_BLOCKS (2048)
+#define NODES_MIN_CAPACITY (1024)
+#define NFTW_OPEN_FILES (64)
+
+#define min_macro(x, y) ((x) < (y) ? (x) : (y))
+#define max_macro(x, y) ((x) > (y) ? (x) : (y))
+
+
+/// A file or directory of the image. Node i is inode i + 1, and the root is node 0.
+struct node {
+    __u32 parent;
+    __u16 mode;
+    __u16 uid;
+    __u16 gid;
+    __u16 nlink;
+    __u64 size;
+    /// First block of the single extent, and its length: the hash buckets of a directory, the data of a file
+    __u32 first_block;
+    __u32 blocks;
+    char name[TOSFS_MAX_NAME_LENGTH];
+    /// Source of an imported file, NULL for a directory or a synthetic file
+    char* host_path;
+    /// Offset table of a file stored compressed, NULL for a file stored as is
+    __u32* offsets;
+};
+
+enum size_distribution {
+    SIZE_FIXED,
+    SIZE_UNIFORM,
+    SIZE_LOGNORMAL,
+};
+
+struct mkfs_settings {
+    __u32 files;
+    __u32 fanout;
+    __u32 levels;
+    enum size_distribution distribution;
+    /// Size of SIZE_FIXED, bounds of SIZE_UNIFORM, median of SIZE_LOGNORMAL
+    __u64 size_a;
+    __u64 size_b;
+    double sigma;
+    const char* import_path;
+    __u64 inode_capacity;
+    __u64 image_size;
+    unsigned int threads;
+    unsigned int seed;
+    int compress;
+};
+
+/// The image being built: its nodes, then the layout decided from them.
+struct image {
+    struct node* nodes;
+    __u32 node_count;
+    __u32 node_capacity;
+    __u32 directory_count;
+    /// Children of node i are child_nodes[child_first[i]] to child_nodes[child_first[i + 1] - 1]
+    __u32* child_first;
+    __u32* child_nodes;
+
+    struct tosfs_superblock superblock;
+    /// Blocks written from memory: the superblock, the bitmaps, the inode table and the directories
+    __u32 metadata_blocks;
+    __u32 data_start;
+    __u32 data_end;
+    char* metadata;
+    /// Files owning data blocks, in the order of their extents
+    __u32* data_nodes;
+    __u32 data_node_count;
+    __u64 data_bytes;
+    /// Bytes the files take in the image, offset tables included, and how many are compressed
+    __u64 stored_bytes;
+    __u32 compressed_count;
+
+    int fd;
+    unsigned int seed;
+    __u32 chunk_count;
+    __u32 next_chunk;
+    /// Next node the compression workers take
+    __u32 next_node;
+    int failed;
+};
+
+/// Imports go through nftw, which takes no argument: the walk state lives here.
+static struct image* import_image;
+static __u32 import_parents[PATH_MAX / 2];
+static size_t import_skipped;
+
+
+static __u32 blocks_for_size(const __u64 size) {
+    return (__u32) ((size + TOSFS_BLOCK_SIZE - 1) / TOSFS_BLOCK_SIZE);
+}
+
+/// Bytes a file takes in its blocks: its data, or the offset table and blocks of a compressed one.
+static __u64 node_stored_size(const struct node* node) {
+    return node->offsets == NULL ? node->size : node->offsets[blocks_for_size(node->size)];
+}
+
+static __u64 divide_round_up(const __u64 value, const __u64 divisor) {
+    return (value + divisor - 1) / divisor;
+}
+
+static __u32 next_power_of_two(const __u32 value) {
+    __u32 power = 1;
+    while (power < value) {
+        power *= 2;
+    }
+    return power;
+}
+
+/// Parses a byte count with an optional K, M, G or T suffix. Returns SYSTEM_CALL_ERROR on garbage.
+static int parse_size(const char* text, __u64* size) {
+    char* end;
+    errno = 0;
+    const unsigned long long value = strtoull(text, &end, 0);
+    if (errno != 0 || end == text) {
+        return SYSTEM_CALL_ERROR;
+    }
+
+    unsigned int shift = 0;
+    switch (*end) {
+        case 'T': case 't': shift = 40; break;
+        case 'G': case 'g': shift = 30; break;
+        case 'M': case 'm': shift = 20; break;
+        case 'K': case 'k': shift = 10; break;
+        case '\0': break;
+        default: return SYSTEM_CALL_ERROR;
+    }
+    if (shift != 0 && end[1] != '\0') {
+        return SYSTEM_CALL_ERROR;
+    }
+    if (value > (~0ull >> shift)) {
+        return SYSTEM_CALL_ERROR;
+    }
+    *size = (__u64) value << shift;
+    return EXIT_SUCCESS;
+}
+
+/// N, uniform:MIN:MAX or lognormal:MEDIAN:SIGMA.
+static int parse_distribution(const char* text, struct mkfs_settings* settings) {
+    char buffer[128];
+    snprintf(buffer, sizeof(buffer), "%s", text);
+    char* first = strchr(buffer, ':');
+    char* second = first == NULL ? NULL : strchr(first + 1, ':');
+    if (first == NULL) {
+        settings->distribution = SIZE_FIXED;
+        return parse_size(buffer, &settings->size_a);
+    }
+    if (second == NULL) {
+        return SYSTEM_CALL_ERROR;
+    }
+    *first = '\0';
+    *second = '\0';
+
+    if (strcmp(buffer, "uniform") == 0) {
+        settings->distribution = SIZE_UNIFORM;
+        if (parse_size(first + 1, &settings->size_a) == SYSTEM_CALL_ERROR ||
+            parse_size(second + 1, &settings->size_b) == SYSTEM_CALL_ERROR || settings->size_a > settings->size_b) {
+            return SYSTEM_CALL_ERROR;
+        }
+        return EXIT_SUCCESS;
+    }
+    if (strcmp(buffer, "lognormal") == 0) {
+        settings->distribution = SIZE_LOGNORMAL;
+        char* end;
+        settings->sigma = strtod(second + 1, &end);
+        if (parse_size(first + 1, &settings->size_a) == SYSTEM_CALL_ERROR || *end != '\0' || settings->sigma < 0) {
+            return SYSTEM_CALL_ERROR;
+        }
+        return EXIT_SUCCESS;
+    }
+    return SYSTEM_CALL_ERROR;
+}
+
+static __u64 draw_file_size(const struct mkfs_settings* settings, unsigned short state[3]) {
+    switch (settings->distribution) {
+        case SIZE_UNIFORM:
+            return settings->size_a + (__u64) (erand48(state) * (double) (settings->size_b - settings->size_a + 1));
+        case SIZE_LOGNORMAL: {
+            // Box-Muller: the median is kept, sigma spreads the sizes over orders of magnitude
+            const double radius = sqrt(-2.0 * log(1.0 - erand48(state)));
+            const double normal = radius * cos(2.0 * M_PI * erand48(state));
+            const double size = (double) settings->size_a * exp(settings->sigma * normal);
+            return size >= 1e15 ? (__u64) 1e15 : (__u64) size;
+        }
+        case SIZE_FIXED:
+        default:
+            return settings->size_a;
+    }
+}
+
+
+/// Appends a node and returns its index, or exits when out of memory or out of inode numbers.
+static __u32 add_node(struct image* image, const __u32 parent, const char* name, const __u16 mode, const __u64 size) {
+    if (image->node_count == image->node_capacity) {
+        if (image->node_capacity >= INT_MAX / 2) {
+            fprintf(stderr, "add_node: too many inodes\n");
+            exit(EXIT_FAILURE);
+        }
+        const __u32 new_capacity = max_macro(2 * image->node_capacity, (__u32) NODES_MIN_CAPACITY);
+        struct node* new_nodes = realloc(image->nodes, (size_t) new_capacity * sizeof(struct node));
+        if (new_nodes == NULL) {
+            perror("add_node: realloc");
+            exit(EXIT_FAILURE);
+        }
+        image->nodes = new_nodes;
+        image->node_capacity = new_capacity;
+    }
+
+    struct node* node = &image->nodes[image->node_count];
+    memset(node, 0, sizeof(struct node));
+    node->parent = parent;
+    node->mode = mode;
+    node->uid = (__u16) getuid();
+    node->gid = (__u16) getgid();
+    node->nlink = S_ISDIR(mode) ? 2 : 1;
+    node->size = size;
+    // An on disk name is not NUL terminated when it uses the whole field
+    memcpy(node->name, name, strnlen(name, TOSFS_MAX_NAME_LENGTH));
+    if (S_ISDIR(mode)) {
+        image->directory_count++;
+    }
+    return image->node_count++;
+}
+
+/// Root, then `levels` levels of `fanout` subdirectories each, then the files dealt round robin over every
+/// directory, the root included.
+static void build_synthetic_tree(struct image* image, const struct mkfs_settings* settings) {
+    char name[TOSFS_MAX_NAME_LENGTH + 1];
+    unsigned short state[3] = { 0x330e, (unsigned short) settings->seed, (unsigned short) (settings->seed >> 16) };
+
+    add_node(image, 0, "", S_IFDIR | 0755, 0);
+    __u32 level_first = 0;
+    __u32 level_end = 1;
+    for (__u32 level = 0; level < settings->levels && settings->fanout > 0; level++) {
+        for (__u32 parent = level_first; parent < level_end; parent++) {
+            for (__u32 child = 0; child < settings->fanout; child++) {
+                snprintf(name, sizeof(name), "d%u", child);
+                add_node(image, parent, name, S_IFDIR | 0755, 0);
+            }
+        }
+        level_first = level_end;
+        level_end = image->node_count;
+    }
+
+    const __u32 directories = image->node_count;
+    for (__u32 file = 0; file < settings->files; file++) {
+        snprintf(name, sizeof(name), "f%u", file);
+        add_node(image, file % directories, name, S_IFREG | 0644, draw_file_size(settings, state));
+    }
+}
+
+static int import_entry(const char* path, const struct stat* info, const int type, struct FTW* walk) {
+    const char* name = path + walk->base;
+    if (walk->level >= (int) (sizeof(import_parents) / sizeof(import_parents[0]))) {
+        fprintf(stderr, "mkfs.tosfs: %s: too deep, skipped\n", path);
+        import_skipped++;
+        return FTW_SKIP_SUBTREE;
+    }
+    if (walk->level == 0) {
+        if (type != FTW_D) {
+            fprintf(stderr, "mkfs.tosfs: %s: not a directory\n", path);
+            return FTW_STOP;
+        }
+        import_parents[0] = add_node(import_image, 0, "", S_IFDIR | (info->st_mode & 0777), 0);
+        import_image->nodes[0].uid = (__u16) info->st_uid;
+        import_image->nodes[0].gid = (__u16) info->st_gid;
+        return FTW_CONTINUE;
+    }
+    if (strlen(name) > TOSFS_MAX_NAME_LENGTH || (type != FTW_D && type != FTW_F) || (type == FTW_F && !S_ISREG(info->st_mode))) {
+        fprintf(stderr, "mkfs.tosfs: %s: %s, skipped\n", path,
+                strlen(name) > TOSFS_MAX_NAME_LENGTH ? "name too long" : "not a regular file or a directory");
+        import_skipped++;
+        return type == FTW_D ? FTW_SKIP_SUBTREE : FTW_CONTINUE;
+    }
+
+    const __u16 mode = (type == FTW_D ? S_IFDIR : S_IFREG) | (info->st_mode & 0777);
+    const __u32 index = add_node(import_image, import_parents[walk->level - 1], name, mode,
+                                 type == FTW_D ? 0 : (__u64) info->st_size);
+    struct node* node = &import_image->nodes[index];
+    node->uid = (__u16) info->st_uid;
+    node->gid = (__u16) info->st_gid;
+    if (type == FTW_D) {
+        import_parents[walk->level] = index;
+    } else if ((node->host_path = strdup(path)) == NULL) {
+        perror("import_entry: strdup");
+        return FTW_STOP;
+    }
+    return FTW_CONTINUE;
+}
+
+/// Copies the tree under `path`: directories and regular files keep their names, modes and owners. Hard links
+/// become separate files; other file types and names longer than TOSFS_MAX_NAME_LENGTH are skipped.
+static int build_imported_tree(struct image* image, const char* path) {
+    import_image = image;
+    const int status = nftw(path, import_entry, NFTW_OPEN_FILES, FTW_PHYS | FTW_ACTIONRETVAL);
+    if (status == SYSTEM_CALL_ERROR) {
+        perror(path);
+    }
+    if (status != 0 || image->node_count == 0) {
+        return SYSTEM_CALL_ERROR;
+    }
+    if (import_skipped > 0) {
+        fprintf(stderr, "mkfs.tosfs: %zu entries skipped\n", import_skipped);
+    }
+    return EXIT_SUCCESS;
+}
+
+
+/// Groups the children of every directory, counting the subdirectories in the nlink of their parent.
+static int index_children(struct image* image) {
+    image->child_first = calloc((size_t) image->node_count + 1, sizeof(__u32));
+    image->child_nodes = calloc(max_macro(image->node_count, 1u), sizeof(__u32));
+    if (image->child_first == NULL || image->child_nodes == NULL) {
+        perror("index_children: calloc");
+        return SYSTEM_CALL_ERROR;
+    }
+
+    for (__u32 index = 1; index < image->node_count; index++) {
+        image->child_first[image->nodes[index].parent + 1]++;
+        if (S_ISDIR(image->nodes[index].mode)) {
+            image->nodes[image->nodes[index].parent].nlink++;
+        }
+    }
+    for (__u32 index = 0; index < image->node_count; index++) {
+        image->child_first[index + 1] += image->child_first[index];
+    }
+    // Each directory fills its range up to where the next one starts, then the starts are shifted back
+    for (__u32 index = 1; index < image->node_count; index++) {
+        image->child_nodes[image->child_first[image->nodes[index].parent]++] = index;
+    }
+    for (__u32 index = image->node_count; index > 0; index--) {
+        image->child_first[index] = image->child_first[index - 1];
+    }
+    image->child_first[0] = 0;
+    return EXIT_SUCCESS;
+}
+
+/// Smallest power of two number of blocks over which the names of a directory, dots included, hash without
+/// filling any block beyond half, the most the daemon leaves after a split. `counts` is scratch space, grown
+/// as needed.
+static int directory_buckets(const struct image* image, const __u32 dir, __u32** counts, __u32* counts_capacity, __u32* buckets) {
+    const __u32 first = image->child_first[dir];
+    const __u32 end = image->child_first[dir + 1];
+    *buckets = next_power_of_two((__u32) divide_round_up((__u64) end - first + 2, TOSFS_DENTRIES_PER_BLOCK / 2));
+
+    while (1) {
+        if (*buckets > *counts_capacity) {
+            free(*counts);
+            *counts_capacity = *buckets;
+            if ((*counts = malloc((size_t) *counts_capacity * sizeof(__u32))) == NULL) {
+                perror("directory_buckets: malloc");
+                return SYSTEM_CALL_ERROR;
+            }
+        }
+
+        const __u32 mask = *buckets - 1;
+        memset(*counts, 0, (size_t) *buckets * sizeof(__u32));
+        const __u32 dot = tosfs_name_hash(".") & mask;
+        const __u32 dot_dot = tosfs_name_hash("..") & mask;
+        (*counts)[dot]++;
+        (*counts)[dot_dot]++;
+        __u32 fullest = max_macro((*counts)[dot], (*counts)[dot_dot]);
+        for (__u32 child = first; child < end && fullest <= TOSFS_DENTRIES_PER_BLOCK / 2; child++) {
+            char name[TOSFS_MAX_NAME_LENGTH + 1] = { 0 };
+            memcpy(name, image->nodes[image->child_nodes[child]].name, TOSFS_MAX_NAME_LENGTH);
+            fullest = max_macro(fullest, ++(*counts)[tosfs_name_hash(name) & mask]);
+        }
+        if (fullest <= TOSFS_DENTRIES_PER_BLOCK / 2) {
+            return EXIT_SUCCESS;
+        }
+        if (*buckets >= 1u << 30) {
+            fprintf(stderr, "directory_buckets: directory too large\n");
+            return SYSTEM_CALL_ERROR;
+        }
+        *buckets *= 2;
+    }
+}
+
+/// Decides where everything goes and fills the superblock. Returns SYSTEM_CALL_ERROR when the tree does not fit
+/// the requested size or the 32 bit block numbers.
+static int layout_image(struct image* image, const struct mkfs_settings* settings) {
+    __u32* counts = NULL;
+    __u32 counts_capacity = 0;
+    __u64 directory_blocks = 0;
+    for (__u32 index = 0; index < image->node_count; index++) {
+        struct node* node = &image->nodes[index];
+        if (!S_ISDIR(node->mode)) {
+            continue;
+        }
+        if (directory_buckets(image, index, &counts, &counts_capacity, &node->blocks) == SYSTEM_CALL_ERROR) {
+            free(counts);
+            return SYSTEM_CALL_ERROR;
+        }
+        node->size = (__u64) node->blocks * TOSFS_BLOCK_SIZE;
+        directory_blocks += node->blocks;
+    }
+    free(counts);
+
+    __u64 file_blocks = 0;
+    image->data_bytes = 0;
+    for (__u32 index = 0; index < image->node_count; index++) {
+        struct node* node = &image->nodes[index];
+        if (!S_ISDIR(node->mode)) {
+            if (node->size > (__u64) UINT32_MAX * TOSFS_BLOCK_SIZE) {
+                fprintf(stderr, "layout_image: file %.*s too large\n", TOSFS_MAX_NAME_LENGTH, node->name);
+                return SYSTEM_CALL_ERROR;
+            }
+            node->blocks = blocks_for_size(node_stored_size(node));
+            file_blocks += node->blocks;
+            image->data_bytes += node->size;
+            image->stored_bytes += node_stored_size(node);
+            image->compressed_count += node->offsets != NULL;
+            image->data_node_count += node->blocks > 0;
+        }
+    }
+
+    // Slot 0 of the inode table is never used, and the table is filled up to its last block
+    const __u64 inodes_needed = (__u64) image->node_count + 1;
+    __u64 inode_capacity = settings->inode_capacity != 0 ? settings->inode_capacity
+        : inodes_needed + inodes_needed * DEFAULT_HEADROOM / 100;
+    inode_capacity = divide_round_up(inode_capacity, TOSFS_INODES_V2_PER_BLOCK) * TOSFS_INODES_V2_PER_BLOCK;
+    if (inode_capacity < inodes_needed || inode_capacity > INT_MAX) {
+        fprintf(stderr, "layout_image: %llu inodes needed, between %llu and %d allowed\n",
+                (unsigned long long) image->node_count, (unsigned long long) inodes_needed, INT_MAX);
+        return SYSTEM_CALL_ERROR;
+    }
+    const __u64 inode_bitmap_blocks = divide_round_up(inode_capacity, TOSFS_BITMAP_BLOCK_BITS);
+    const __u64 inode_table_blocks = inode_capacity / TOSFS_INODES_V2_PER_BLOCK;
+
+    // The block bitmap covers itself: grown until it stops changing
+    const __u64 used_without_block_bitmap = 1 + inode_bitmap_blocks + inode_table_blocks + directory_blocks + file_blocks;
+    __u64 block_bitmap_blocks = 1;
+    __u64 block_count;
+    while (1) {
+        const __u64 used = used_without_block_bitmap + block_bitmap_blocks;
+        block_count = settings->image_size != 0 ? settings->image_size / TOSFS_BLOCK_SIZE
+            : used + max_macro(used * DEFAULT_HEADROOM / 100, (__u64) MIN_FREE_BLOCKS);
+        const __u64 needed = divide_round_up(block_count, TOSFS_BITMAP_BLOCK_BITS);
+        if (needed <= block_bitmap_blocks) {
+            break;
+        }
+        block_bitmap_blocks = needed;
+    }
+    const __u64 used_blocks = used_without_block_bitmap + block_bitmap_blocks;
+    if (block_count < used_blocks || block_count > UINT32_MAX) {
+        fprintf(stderr, "layout_image: %llu blocks needed, %llu available, at most %u allowed\n",
+                (unsigned long long) used_blocks, (unsigned long long) block_count, UINT32_MAX);
+        return SYSTEM_CALL_ERROR;
+    }
+
+    struct tosfs_superblock* superblock = &image->superblock;
+    superblock->magic = TOSFS_MAGIC;
+    superblock->block_size = TOSFS_BLOCK_SIZE;
+    superblock->blocks = (__u32) block_count;
+    superblock->inodes = image->node_count;
+    superblock->root_inode = TOSFS_ROOT_INODE;
+    superblock->version = TOSFS_VERSION_2;
+    superblock->block_bitmap_start = 1;
+    superblock->block_bitmap_blocks = (__u32) block_bitmap_blocks;
+    superblock->inode_bitmap_start = superblock->block_bitmap_start + superblock->block_bitmap_blocks;
+    superblock->inode_bitmap_blocks = (__u32) inode_bitmap_blocks;
+    superblock->inode_table_start = superblock->inode_bitmap_start + superblock->inode_bitmap_blocks;
+    superblock->inode_table_blocks = (__u32) inode_table_blocks;
+
+    __u32 next_block = superblock->inode_table_start + superblock->inode_table_blocks;
+    for (__u32 index = 0; index < image->node_count; index++) {
+        if (S_ISDIR(image->nodes[index].mode)) {
+            image->nodes[index].first_block = next_block;
+            next_block += image->nodes[index].blocks;
+        }
+    }
+    image->metadata_blocks = next_block;
+    image->data_start = next_block;
+
+    image->data_nodes = calloc(max_macro(image->data_node_count, 1u), sizeof(__u32));
+    if (image->data_nodes == NULL) {
+        perror("layout_image: calloc");
+        return SYSTEM_CALL_ERROR;
+    }
+    image->data_node_count = 0;
+    for (__u32 index = 0; index < image->node_count; index++) {
+        struct node* node = &image->nodes[index];
+        if (!S_ISDIR(node->mode) && node->blocks > 0) {
+            node->first_block = next_block;
+            next_block += node->blocks;
+            image->data_nodes[image->data_node_count++] = index;
+        }
+    }
+    image->data_end = next_block;
+    return EXIT_SUCCESS;
+}
+
+static void set_bit_range(__u32* words, __u32 start, const __u32 end) {
+    while (start < end && start % BITMAP_BITS != 0) {
+        words[start / BITMAP_BITS] |= 1u << (start % BITMAP_BITS);
+        start++;
+    }
+    if (end - start >= BITMAP_BITS) {
+        const __u32 whole_words = (end - start) / BITMAP_BITS;
+        memset(&words[start / BITMAP_BITS], 0xff, (size_t) whole_words * sizeof(__u32));
+        start += whole_words * BITMAP_BITS;
+    }
+    while (start < end) {
+        words[start / BITMAP_BITS] |= 1u << (start % BITMAP_BITS);
+        start++;
+    }
+}
+
+static char* metadata_block(const struct image* image, const __u32 block_no) {
+    return image->metadata + (size_t) block_no * TOSFS_BLOCK_SIZE;
+}
+
+/// Writes a name in a free slot of its home block, as the daemon would.
+static void directory_place(const struct image* image, const struct node* dir, const char* name, const __u32 ino) {
+    char padded[TOSFS_MAX_NAME_LENGTH + 1] = { 0 };
+    memcpy(padded, name, strnlen(name, TOSFS_MAX_NAME_LENGTH));
+    struct tosfs_dentry* block = (struct tosfs_dentry*) metadata_block(
+        image, dir->first_block + (tosfs_name_hash(padded) & (dir->blocks - 1)));
+    for (unsigned int entry_number = 0; entry_number < TOSFS_DENTRIES_PER_BLOCK; entry_number++) {
+        if (block[entry_number].inode == 0) {
+            block[entry_number].inode = ino;
+            memcpy(block[entry_number].name, padded, TOSFS_MAX_NAME_LENGTH);
+            return;
+        }
+    }
+}
+
+/// Builds every block before the file data: superblock, bitmaps, inode table and directories.
+static int build_metadata(struct image* image) {
+    image->metadata = calloc(image->metadata_blocks, TOSFS_BLOCK_SIZE);
+    if (image->metadata == NULL) {
+        perror("build_metadata: calloc");
+        return SYSTEM_CALL_ERROR;
+    }
+
+    const struct tosfs_superblock* superblock = &image->superblock;
+    memcpy(image->metadata, superblock, sizeof(struct tosfs_superblock));
+    set_bit_range((__u32*) metadata_block(image, superblock->block_bitmap_start), 0, image->data_end);
+    set_bit_range((__u32*) metadata_block(image, superblock->inode_bitmap_start), TOSFS_ROOT_INODE,
+                  TOSFS_ROOT_INODE + image->node_count);
+
+    struct tosfs_inode_v2* inodes = (struct tosfs_inode_v2*) metadata_block(image, superblock->inode_table_start);
+    for (__u32 index = 0; index < image->node_count; index++) {
+        const struct node* node = &image->nodes[index];
+        const __u32 ino = index + TOSFS_ROOT_INODE;
+        struct tosfs_inode_v2* inode = &inodes[ino];
+        inode->inode = ino;
+        inode->uid = node->uid;
+        inode->gid = node->gid;
+        inode->mode = node->mode;
+        inode->perm = node->mode & 0777;
+        inode->nlink = node->nlink;
+        inode->size = node->size;
+        inode->flags = node->offsets != NULL ? TOSFS_INODE_COMPRESSED : 0;
+        if (node->blocks > 0) {
+            inode->nr_extents = 1;
+            inode->extents[0].start = node->first_block;
+            inode->extents[0].length = node->blocks;
+        }
+        if (S_ISDIR(node->mode)) {
+            directory_place(image, node, ".", ino);
+            directory_place(image, node, "..", node->parent + TOSFS_ROOT_INODE);
+        }
+        if (index > 0) {
+            directory_place(image, &image->nodes[node->parent], node->name, ino);
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+
+/// Stateless generator of the synthetic data: any byte range of any file can be produced by any thread.
+static __u64 synthetic_word(const __u64 seed, const __u64 ino, const __u64 word) {
+    __u64 value = seed * 0x9e3779b97f4a7c15ull ^ ino << 40 ^ word;
+    value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ull;
+    value = (value ^ (value >> 27)) * 0x94d049bb133111ebull;
+    return value ^ (value >> 31);
+}
+
+/// Fills `length` bytes of a file starting at `offset`, reading them from the host for an imported file.
+static int fill_file_range(const struct image* image, const __u32 index, const __u64 offset, char* buffer, size_t length) {
+    const struct node* node = &image->nodes[index];
+    if (node->host_path == NULL) {
+        for (__u64 word = offset / sizeof(__u64); word * sizeof(__u64) < offset + length; word++) {
+            const __u64 value = synthetic_word(image->seed, index + TOSFS_ROOT_INODE, word);
+            const __u64 word_offset = word * sizeof(__u64);
+            const __u64 from = max_macro(word_offset, offset);
+            const __u64 to = min_macro(word_offset + sizeof(__u64), offset + length);
+            memcpy(buffer + (from - offset), (const char*) &value + (from - word_offset), to - from);
+        }
+        return EXIT_SUCCESS;
+    }
+
+    const int fd = open(node->host_path, O_RDONLY);
+    if (fd == SYSTEM_CALL_ERROR) {
+        perror(node->host_path);
+        return SYSTEM_CALL_ERROR;
+    }
+    posix_fadvise(fd, (off_t) offset, (off_t) length, POSIX_FADV_SEQUENTIAL);
+    size_t done = 0;
+    while (done < length) {
+        const ssize_t bytes = pread(fd, buffer + done, length - done, (off_t) (offset + done));
+        if (bytes == SYSTEM_CALL_ERROR && errno == EINTR) {
+            continue;
+        }
+        if (bytes == SYSTEM_CALL_ERROR) {
+            perror(node->host_path);
+            close(fd);
+            return SYSTEM_CALL_ERROR;
+        }
+        if (bytes == 0) {
+            // Shrunk since the walk: the rest reads as zeroes
+            fprintf(stderr, "mkfs.tosfs: %s: shorter than when listed\n", node->host_path);
+            memset(buffer + done, 0, length - done);
+            break;
+        }
+        done += (size_t) bytes;
+    }
+    close(fd);
+    return EXIT_SUCCESS;
+}
+
+/// Largest file stored compressed: its stored bytes must stay far from the 32 bit offsets limit.
+#define MAX_COMPRESSED_SIZE (UINT32_MAX / 2)
+
+/// Compresses every block of a file to learn its stored length, and keeps the offset table when the stored bytes
+/// spare at least one block. `buffer` holds CHUNK_BLOCKS blocks.
+static int compress_node(struct image* image, const __u32 index, char* buffer) {
+    struct node* node = &image->nodes[index];
+    const __u32 blocks = blocks_for_size(node->size);
+    if (blocks == 0 || node->size > MAX_COMPRESSED_SIZE) {
+        return EXIT_SUCCESS;
+    }
+    __u32* offsets = malloc(((size_t) blocks + 1) * sizeof(__u32));
+    if (offsets == NULL) {
+        perror("compress_node: malloc");
+        return SYSTEM_CALL_ERROR;
+    }
+
+    char stored[TOSFS_BLOCK_SIZE];
+    __u64 stored_size = tosfs_compressed_table_size(node->size);
+    for (__u32 first = 0; first < blocks; first += CHUNK_BLOCKS) {
+        const __u64 offset = (__u64) first * TOSFS_BLOCK_SIZE;
+        const size_t length = min_macro(node->size - offset, (__u64) CHUNK_BLOCKS * TOSFS_BLOCK_SIZE);
+        if (fill_file_range(image, index, offset, buffer, length) == SYSTEM_CALL_ERROR) {
+            free(offsets);
+            return SYSTEM_CALL_ERROR;
+        }
+        for (size_t done = 0; done < length; done += TOSFS_BLOCK_SIZE) {
+            offsets[first + done / TOSFS_BLOCK_SIZE] = (__u32) stored_size;
+            stored_size += tosfs_store_block(buffer + done, min_macro(length - done, (size_t) TOSFS_BLOCK_SIZE), stored);
+        }
+        if (blocks_for_size(stored_size) >= blocks) {
+            // Already no smaller than the data: stored as is
+            free(offsets);
+            return EXIT_SUCCESS;
+        }
+    }
+    offsets[blocks] = (__u32) stored_size;
+    node->offsets = offsets;
+    return EXIT_SUCCESS;
+}
+
+/// Takes files in order until none is left.
+static void* node_compressor(void* arg) {
+    struct image* image = arg;
+    char* buffer = malloc((size_t) CHUNK_BLOCKS * TOSFS_BLOCK_SIZE);
+    if (buffer == NULL) {
+        perror("node_compressor: malloc");
+        __atomic_store_n(&image->failed, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    while (!__atomic_load_n(&image->failed, __ATOMIC_RELAXED)) {
+        const __u32 index = __atomic_fetch_add(&image->next_node, 1, __ATOMIC_RELAXED);
+        if (index >= image->node_count) {
+            break;
+        }
+        if (!S_ISDIR(image->nodes[index].mode) && compress_node(image, index, buffer) == SYSTEM_CALL_ERROR) {
+            __atomic_store_n(&image->failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+    free(buffer);
+    return NULL;
+}
+
+/// Decides which files are stored compressed, on `threads` threads, before the layout sizes their extents.
+static int compress_files(struct image* image, const unsigned int threads) {
+    pthread_t* workers = calloc(threads, sizeof(pthread_t));
+    if (workers == NULL) {
+        perror("compress_files: calloc");
+        return SYSTEM_CALL_ERROR;
+    }
+    unsigned int started = 0;
+    while (started < min_macro(threads, max_macro(image->node_count, 1u))) {
+        if (pthread_create(&workers[started], NULL, node_compressor, image) != 0) {
+            perror("compress_files: pthread_create");
+            image->failed = 1;
+            break;
+        }
+        started++;
+    }
+    for (unsigned int worker = 0; worker < started; worker++) {
+        pthread_join(workers[worker], NULL);
+    }
+    free(workers);
+    return image->failed ? SYSTEM_CALL_ERROR : EXIT_SUCCESS;
+}
+
+/// Fills `length` stored bytes of a compressed file starting at `offset`: its offset table, then its blocks,
+/// compressed again a batch at a time. Each one must come out as long as when the table was built.
+static int fill_stored_range(const struct image* image, const __u32 index, __u64 offset, char* buffer, size_t length) {
+    const struct node* node = &image->nodes[index];
+    const __u32* offsets = node->offsets;
+    const __u32 blocks = blocks_for_size(node->size);
+    const __u64 table_size = tosfs_compressed_table_size(node->size);
+    if (offset < table_size) {
+        const size_t chunk = min_macro((__u64) length, table_size - offset);
+        memcpy(buffer, (const char*) offsets + offset, chunk);
+        buffer += chunk;
+        offset += chunk;
+        length -= chunk;
+    }
+
+    // First block ending past offset, then first block starting at or past the end of the range
+    __u32 block = 0;
+    for (__u32 high = blocks; block < high;) {
+        const __u32 middle = block + (high - block) / 2;
+        if (offsets[middle + 1] <= offset) {
+            block = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    __u32 end_block = block;
+    while (end_block < blocks && offsets[end_block] < offset + length) {
+        end_block++;
+    }
+
+    char* data = length == 0 ? NULL : malloc((size_t) min_macro(end_block - block, (__u32) CHUNK_BLOCKS) * TOSFS_BLOCK_SIZE);
+    if (length > 0 && data == NULL) {
+        perror("fill_stored_range: malloc");
+        return SYSTEM_CALL_ERROR;
+    }
+    char stored[TOSFS_BLOCK_SIZE];
+    while (block < end_block) {
+        const __u32 batch = min_macro(end_block - block, (__u32) CHUNK_BLOCKS);
+        const __u64 data_offset = (__u64) block * TOSFS_BLOCK_SIZE;
+        const size_t data_length = min_macro(node->size - data_offset, (__u64) batch * TOSFS_BLOCK_SIZE);
+        if (fill_file_range(image, index, data_offset, data, data_length) == SYSTEM_CALL_ERROR) {
+            free(data);
+            return SYSTEM_CALL_ERROR;
+        }
+        for (size_t done = 0; done < data_length; done += TOSFS_BLOCK_SIZE, block++) {
+            const size_t stored_length = tosfs_store_block(data + done, min_macro(data_length - done, (size_t) TOSFS_BLOCK_SIZE), stored);
+            if (stored_length != offsets[block + 1] - offsets[block]) {
+                fprintf(stderr, "mkfs.tosfs: %.*s: changed since it was compressed\n", TOSFS_MAX_NAME_LENGTH, node->name);
+                free(data);
+                return SYSTEM_CALL_ERROR;
+            }
+            const size_t in_block = offset - offsets[block];
+            const size_t chunk = min_macro((__u64) length, (__u64) offsets[block + 1] - offset);
+            memcpy(buffer, stored + in_block, chunk);
+            buffer += chunk;
+            offset += chunk;
+            length -= chunk;
+        }
+    }
+    free(data);
+    return EXIT_SUCCESS;
+}
+
+/// First file of data_nodes whose extent ends after `block`.
+static __u32 first_data_node_after(const struct image* image, const __u32 block) {
+    __u32 low = 0;
+    __u32 high = image->data_node_count;
+    while (low < high) {
+        const __u32 middle = low + (high - low) / 2;
+        const struct node* node = &image->nodes[image->data_nodes[middle]];
+        if (node->first_block + node->blocks <= block) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+/// Builds one chunk of the data region in `buffer` and writes it at once.
+static int write_data_chunk(const struct image* image, const __u32 chunk, char* buffer) {
+    const __u32 chunk_start = image->data_start + chunk * CHUNK_BLOCKS;
+    const __u32 chunk_end = (__u32) min_macro((__u64) chunk_start + CHUNK_BLOCKS, (__u64) image->data_end);
+    const __u64 chunk_offset = (__u64) chunk_start * TOSFS_BLOCK_SIZE;
+    const size_t chunk_size = (size_t) (chunk_end - chunk_start) * TOSFS_BLOCK_SIZE;
+    memset(buffer, 0, chunk_size);
+
+    for (__u32 data_node = first_data_node_after(image, chunk_start); data_node < image->data_node_count; data_node++) {
+        const __u32 index = image->data_nodes[data_node];
+        const struct node* node = &image->nodes[index];
+        if (node->first_block >= chunk_end) {
+            break;
+        }
+        const __u64 file_offset = (__u64) node->first_block * TOSFS_BLOCK_SIZE;
+        const __u64 from = max_macro(file_offset, chunk_offset);
+        const __u64 to = min_macro(file_offset + node_stored_size(node), chunk_offset + chunk_size);
+        if (from < to && (node->offsets != NULL ? fill_stored_range : fill_file_range)(
+                image, index, from - file_offset, buffer + (from - chunk_offset), to - from) == SYSTEM_CALL_ERROR) {
+            return SYSTEM_CALL_ERROR;
+        }
+    }
+
+    size_t done = 0;
+    while (done < chunk_size) {
+        const ssize_t bytes = pwrite(image->fd, buffer + done, chunk_size - done, (off_t) (chunk_offset + done));
+        if (bytes == SYSTEM_CALL_ERROR && errno != EINTR) {
+            perror("write_data_chunk: pwrite");
+            return SYSTEM_CALL_ERROR;
+        }
+        done += bytes == SYSTEM_CALL_ERROR ? 0 : (size_t) bytes;
+    }
+    return EXIT_SUCCESS;
+}
+
+/// Takes chunks in order until none is left, so that the writes of all threads sweep the image front to back.
+static void* data_writer(void* arg) {
+    struct image* image = arg;
+    char* buffer = malloc((size_t) CHUNK_BLOCKS * TOSFS_BLOCK_SIZE);
+    if (buffer == NULL) {
+        perror("data_writer: malloc");
+        __atomic_store_n(&image->failed, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    while (!__atomic_load_n(&image->failed, __ATOMIC_RELAXED)) {
+        const __u32 chunk = __atomic_fetch_add(&image->next_chunk, 1, __ATOMIC_RELAXED);
+        if (chunk >= image->chunk_count) {
+            break;
+        }
+        if (write_data_chunk(image, chunk, buffer) == SYSTEM_CALL_ERROR) {
+            __atomic_store_n(&image->failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+    free(buffer);
+    return NULL;
+}
+
+static int write_metadata(const struct image* image) {
+    const size_t size = (size_t) image->metadata_blocks * TOSFS_BLOCK_SIZE;
+    size_t done = 0;
+    while (done < size) {
+        const size_t length = min_macro(size - done, (size_t) CHUNK_BLOCKS * TOSFS_BLOCK_SIZE);
+        const ssize_t bytes = pwrite(image->fd, image->metadata + done, length, (off_t) done);
+        if (bytes == SYSTEM_CALL_ERROR && errno != EINTR) {
+            perror("write_metadata: pwrite");
+            return SYSTEM_CALL_ERROR;
+        }
+        done += bytes == SYSTEM_CALL_ERROR ? 0 : (size_t) bytes;
+    }
+    return EXIT_SUCCESS;
+}
+
+/// Sizes the image file, whose free blocks stay holes, then writes the metadata and the data region.
+static int write_image(struct image* image, const char* path, const unsigned int threads) {
+    image->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (image->fd == SYSTEM_CALL_ERROR) {
+        perror(path);
+        return SYSTEM_CALL_ERROR;
+    }
+    if (ftruncate(image->fd, (off_t) image->superblock.blocks * TOSFS_BLOCK_SIZE) == SYSTEM_CALL_ERROR) {
+        perror("write_image: ftruncate");
+        close(image->fd);
+        return SYSTEM_CALL_ERROR;
+    }
+
+    int status = write_metadata(image);
+    image->chunk_count = (__u32) divide_round_up(image->data_end - image->data_start, CHUNK_BLOCKS);
+    pthread_t* workers = calloc(threads, sizeof(pthread_t));
+    unsigned int started = 0;
+    if (workers == NULL) {
+        perror("write_image: calloc");
+        status = SYSTEM_CALL_ERROR;
+    }
+    while (status == EXIT_SUCCESS && started < min_macro(threads, max_macro(image->chunk_count, 1u))) {
+        if (pthread_create(&workers[started], NULL, data_writer, image) != 0) {
+            perror("write_image: pthread_create");
+            image->failed = 1;
+            break;
+        }
+        started++;
+    }
+    for (unsigned int worker = 0; worker < started; worker++) {
+        pthread_join(workers[worker], NULL);
+    }
+    free(workers);
+    if (image->failed) {
+        status = SYSTEM_CALL_ERROR;
+    }
+
+    if (status == EXIT_SUCCESS && fdatasync(image->fd) == SYSTEM_CALL_ERROR) {
+        perror("write_image: fdatasync");
+        status = SYSTEM_CALL_ERROR;
+    }
+    close(image->fd);
+    return status;
+}
+
+
+static void usage(const char* program) {
+    printf("usage: %s [options] image\n\n", program);
+    printf(
+        "Writes a v2 tosfs image: a synthetic tree, or a copy of a host directory tree with -i.\n"
+        "    -n N        synthetic files (default: %u)\n"
+        "    -F N        subdirectories per directory (default: 0)\n"
+        "    -L N        levels of subdirectories under the root (default: 1)\n"
+        "    -z DIST     file sizes: N, uniform:MIN:MAX or lognormal:MEDIAN:SIGMA (default: %u)\n"
+        "    -i DIR      import the directories and regular files under DIR instead\n"
+        "    -N N        inode table capacity (default: the inodes used plus %u%%)\n"
+        "    -s SIZE     image size (default: the blocks used plus %u%%)\n"
+        "    -j N        writer and compressor threads (default: online processors)\n"
+        "    -r SEED     seed of the synthetic sizes and data (default: %u)\n"
+        "    -c          store compressed every file that takes fewer blocks that way\n"
+        "Sizes take a K, M, G or T suffix. Blocks are %u bytes, the only size tosfs reads.\n",
+        DEFAULT_FILES, DEFAULT_FILE_SIZE, DEFAULT_HEADROOM, DEFAULT_HEADROOM, DEFAULT_SEED, TOSFS_BLOCK_SIZE
+    );
+}
+
+int main(int argc, char *argv[]) {
+    struct mkfs_settings settings = {
+        .files = DEFAULT_FILES,
+        .levels = 1,
+        .distribution = SIZE_FIXED,
+        .size_a = DEFAULT_FILE_SIZE,
+        .threads = (unsigned int) max_macro(sysconf(_SC_NPROCESSORS_ONLN), 1L),
+        .seed = DEFAULT_SEED,
+    };
+    int option;
+    int bad_value = 0;
+    while ((option = getopt(argc, argv, "n:F:L:z:i:N:s:j:r:ch")) != -1) {
+        switch (option) {
+            case 'n': settings.files = (__u32) strtoul(optarg, NULL, 0); break;
+            case 'F': settings.fanout = (__u32) strtoul(optarg, NULL, 0); break;
+            case 'L': settings.levels = (__u32) strtoul(optarg, NULL, 0); break;
+            case 'z': bad_value |= parse_distribution(optarg, &settings) == SYSTEM_CALL_ERROR; break;
+            case 'i': settings.import_path = optarg; break;
+            case 'N': bad_value |= parse_size(optarg, &settings.inode_capacity) == SYSTEM_CALL_ERROR; break;
+            case 's': bad_value |= parse_size(optarg, &settings.image_size) == SYSTEM_CALL_ERROR; break;
+            case 'j': settings.threads = (unsigned int) strtoul(optarg, NULL, 0); break;
+            case 'r': settings.seed = (unsigned int) strtoul(optarg, NULL, 0); break;
+            case 'c': settings.compress = 1; break;
+            default:
+                usage(argv[0]);
+                return option == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (bad_value || settings.threads == 0 || optind + 1 != argc) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    struct timespec started, laid_out, finished;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    struct image image = { .seed = settings.seed };
+    if (settings.import_path != NULL) {
+        if (build_imported_tree(&image, settings.import_path) == SYSTEM_CALL_ERROR) {
+            return EXIT_FAILURE;
+        }
+    } else {
+        build_synthetic_tree(&image, &settings);
+    }
+    double compress_seconds = 0.0;
+    if (settings.compress) {
+        struct timespec compress_started, compress_finished;
+        clock_gettime(CLOCK_MONOTONIC, &compress_started);
+        if (compress_files(&image, settings.threads) == SYSTEM_CALL_ERROR) {
+            return EXIT_FAILURE;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &compress_finished);
+        compress_seconds = (double) (compress_finished.tv_sec - compress_started.tv_sec) +
+            (double) (compress_finished.tv_nsec - compress_started.tv_nsec) / 1e9;
+    }
+    if (index_children(&image) == SYSTEM_CALL_ERROR || layout_image(&image, &settings) == SYSTEM_CALL_ERROR ||
+        build_metadata(&image) == SYSTEM_CALL_ERROR) {
+        return EXIT_FAILURE;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &laid_out);
+    if (write_image(&image, argv[optind], settings.threads) == SYSTEM_CALL_ERROR) {
+        return EXIT_FAILURE;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+
+    const double layout_seconds = (double) (laid_out.tv_sec - started.tv_sec) + (double) (laid_out.tv_nsec - started.tv_nsec) / 1e9 -
+        compress_seconds;
+    const double write_seconds = (double) (finished.tv_sec - laid_out.tv_sec) + (double) (finished.tv_nsec - laid_out.tv_nsec) / 1e9;
+    const double written_mib = (double) image.data_end * TOSFS_BLOCK_SIZE / (1024.0 * 1024.0);
+    printf("%s: %u files and %u directories, %.1f MiB of data, %u of %u blocks and %u of %llu inodes used\n",
+           argv[optind], image.node_count - image.directory_count, image.directory_count,
+           (double) image.data_bytes / (1024.0 * 1024.0), image.data_end, image.superblock.blocks, image.node_count,
+           (unsigned long long) image.superblock.inode_table_blocks * TOSFS_INODES_V2_PER_BLOCK - 1);
+    printf("laid out in %.3f s, %.1f MiB written in %.3f s (%.1f MiB/s) by %u threads\n",
+           layout_seconds, written_mib, write_seconds, write_seconds > 0 ? written_mib / write_seconds : 0.0,
+           min_macro(settings.threads, max_macro(image.chunk_count, 1u)));
+    if (settings.compress) {
+        const double data_mib = (double) image.data_bytes / (1024.0 * 1024.0);
+        const double stored_mib = (double) image.stored_bytes / (1024.0 * 1024.0);
+        printf("%u files compressed in %.3f s (%.1f MiB/s): %.1f MiB of data stored in %.1f MiB (%.2fx)\n",
+               image.compressed_count, compress_seconds, compress_seconds > 0 ? data_mib / compress_seconds : 0.0,
+               data_mib, stored_mib, stored_mib > 0 ? data_mib / stored_mib : 0.0);
+    }
+
+    for (__u32 index = 0; index < image.node_count; index++) {
+        free(image.nodes[index].host_path);
+        free(image.nodes[index].offsets);
+    }
+    free(image.nodes);
+    free(image.child_first);
+    free(image.child_nodes);
+    free(image.data_nodes);
+    free(image.metadata);
+    return EXIT_SUCCESS;
+}
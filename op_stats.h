@@ -0,0 +1,203 @@
+/*
+ * op_stats.h
+ *
+ * Per operation counters of a FUSE daemon: requests, errors, bytes and a
+ * latency histogram with one bucket per power of two nanoseconds.
+ *
+ * Every thread serving requests writes to its own block of counters, aligned
+ * on a cache line, so recording a request never bounces a line between
+ * cores. Only the reader adds the blocks up, with relaxed loads: a snapshot
+ * may miss the requests still running, never tears a counter.
+ */
+
+#ifndef __OP_STATS__
+#define __OP_STATS__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#define OP_STATS_BUCKETS 32 /* bucket i counts [2^i, 2^(i+1)) ns, the last one everything above */
+#define OP_STATS_MAX_OPS 48
+#define OP_STATS_CACHE_LINE 64
+
+struct op_counters {
+	uint64_t count;
+	uint64_t errors;
+	uint64_t bytes;
+	uint64_t total_ns;
+	uint64_t buckets[OP_STATS_BUCKETS];
+};
+
+/* counters of one thread. A thread that exits hands its block to the next
+   one started, so the totals never go down and the list stays as long as the
+   largest number of threads ever alive at once. */
+struct thread_op_stats {
+	struct op_counters ops[OP_STATS_MAX_OPS];
+	struct thread_op_stats *next;
+	struct thread_op_stats *next_free;
+} __attribute__((aligned(OP_STATS_CACHE_LINE)));
+
+static pthread_mutex_t op_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t op_stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t op_stats_key;
+static struct thread_op_stats *op_stats_threads;
+static struct thread_op_stats *op_stats_free;
+static __thread struct thread_op_stats *op_stats_mine;
+static struct timespec op_stats_started;
+
+static void op_stats_release(void *arg)
+{
+	struct thread_op_stats *stats = arg;
+
+	pthread_mutex_lock(&op_stats_lock);
+	stats->next_free = op_stats_free;
+	op_stats_free = stats;
+	pthread_mutex_unlock(&op_stats_lock);
+}
+
+static void op_stats_init(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &op_stats_started);
+	pthread_key_create(&op_stats_key, op_stats_release);
+}
+
+/* counters of the calling thread, NULL if they cannot be allocated */
+static inline struct thread_op_stats *op_stats_thread(void)
+{
+	if (op_stats_mine != NULL)
+		return op_stats_mine;
+
+	pthread_once(&op_stats_once, op_stats_init);
+	pthread_mutex_lock(&op_stats_lock);
+	struct thread_op_stats *stats = op_stats_free;
+	if (stats != NULL) {
+		op_stats_free = stats->next_free;
+	} else if (posix_memalign((void **) &stats, OP_STATS_CACHE_LINE, sizeof(*stats)) == 0) {
+		memset(stats, 0, sizeof(*stats));
+		stats->next = op_stats_threads;
+		/* the reader walks the list without the lock */
+		__atomic_store_n(&op_stats_threads, stats, __ATOMIC_RELEASE);
+	} else {
+		stats = NULL;
+	}
+	pthread_mutex_unlock(&op_stats_lock);
+
+	if (stats != NULL)
+		pthread_setspecific(op_stats_key, stats);
+	op_stats_mine = stats;
+	return stats;
+}
+
+/* single writer per block: a plain add published with a relaxed store, no
+   locked instruction */
+static inline void op_stats_add(uint64_t *counter, const uint64_t value)
+{
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+static inline void op_stats_start(struct timespec *started)
+{
+	clock_gettime(CLOCK_MONOTONIC, started);
+}
+
+/* records a request that took `ns` nanoseconds */
+static inline void op_stats_record_ns(const unsigned int op, const uint64_t ns,
+				      const int error, const uint64_t bytes)
+{
+	struct thread_op_stats *stats = op_stats_thread();
+
+	if (stats == NULL || op >= OP_STATS_MAX_OPS)
+		return;
+	unsigned int bucket = ns == 0 ? 0 : 63 - __builtin_clzll(ns);
+	if (bucket >= OP_STATS_BUCKETS)
+		bucket = OP_STATS_BUCKETS - 1;
+
+	struct op_counters *counters = &stats->ops[op];
+	op_stats_add(&counters->count, 1);
+	op_stats_add(&counters->errors, error != 0);
+	op_stats_add(&counters->bytes, bytes);
+	op_stats_add(&counters->total_ns, ns);
+	op_stats_add(&counters->buckets[bucket], 1);
+}
+
+static inline void op_stats_record(const unsigned int op, const struct timespec *started,
+				   const int error, const uint64_t bytes)
+{
+	struct timespec finished;
+
+	clock_gettime(CLOCK_MONOTONIC, &finished);
+	op_stats_record_ns(op, (uint64_t) ((finished.tv_sec - started->tv_sec) * 1000000000LL +
+					   (finished.tv_nsec - started->tv_nsec)), error, bytes);
+}
+
+/* upper edge, in ns, of the bucket holding the given quantile */
+static inline uint64_t op_stats_quantile(const struct op_counters *counters, const double quantile)
+{
+	uint64_t seen = 0;
+	const uint64_t rank = (uint64_t) (quantile * (double) counters->count);
+	unsigned int bucket;
+
+	if (counters->count == 0)
+		return 0;
+	for (bucket = 0; bucket < OP_STATS_BUCKETS - 1; bucket++) {
+		seen += counters->buckets[bucket];
+		if (seen > rank)
+			break;
+	}
+	return 2ull << bucket;
+}
+
+/* adds up every thread and formats one line per operation:
+     <op> count=N errors=N bytes=N total_ns=N p50_ns=N p99_ns=N p999_ns=N buckets=b0,b1,...
+   Returns a malloc'ed, NUL terminated text, NULL when out of memory. */
+static inline char *op_stats_render(const char *const names[], const unsigned int op_count, size_t *size)
+{
+	struct op_counters totals[OP_STATS_MAX_OPS];
+	struct thread_op_stats *stats;
+	unsigned int threads = 0, op, bucket;
+	struct timespec now;
+	char *text = NULL;
+
+	pthread_once(&op_stats_once, op_stats_init);
+	memset(totals, 0, sizeof(totals));
+	for (stats = __atomic_load_n(&op_stats_threads, __ATOMIC_ACQUIRE); stats != NULL; stats = stats->next) {
+		const uint64_t *from = (const uint64_t *) stats->ops;
+		uint64_t *to = (uint64_t *) totals;
+		size_t word;
+		for (word = 0; word < OP_STATS_MAX_OPS * sizeof(struct op_counters) / sizeof(uint64_t); word++)
+			to[word] += __atomic_load_n(&from[word], __ATOMIC_RELAXED);
+		threads++;
+	}
+
+	FILE *stream = open_memstream(&text, size);
+	if (stream == NULL)
+		return NULL;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	fprintf(stream, "# bucket i counts latencies in [2^i, 2^(i+1)) ns\n");
+	fprintf(stream, "uptime_seconds %.3f\nthreads %u\n",
+		(double) (now.tv_sec - op_stats_started.tv_sec) + (double) (now.tv_nsec - op_stats_started.tv_nsec) / 1e9,
+		threads);
+	for (op = 0; op < op_count && op < OP_STATS_MAX_OPS; op++) {
+		const struct op_counters *counters = &totals[op];
+		fprintf(stream, "%s count=%llu errors=%llu bytes=%llu total_ns=%llu p50_ns=%llu p99_ns=%llu p999_ns=%llu buckets=",
+			names[op], (unsigned long long) counters->count, (unsigned long long) counters->errors,
+			(unsigned long long) counters->bytes, (unsigned long long) counters->total_ns,
+			(unsigned long long) op_stats_quantile(counters, 0.50),
+			(unsigned long long) op_stats_quantile(counters, 0.99),
+			(unsigned long long) op_stats_quantile(counters, 0.999));
+		for (bucket = 0; bucket < OP_STATS_BUCKETS; bucket++)
+			fprintf(stream, bucket == 0 ? "%llu" : ",%llu", (unsigned long long) counters->buckets[bucket]);
+		fputc('\n', stream);
+	}
+	if (fclose(stream) != 0) {
+		free(text);
+		return NULL;
+	}
+	return text;
+}
+
+#endif /* __OP_STATS__ */
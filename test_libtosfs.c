@@ -0,0 +1,790 @@
+//
+// Tests of libtosfs.h, with a performance mode for its batch accessors.
+//
+// The program writes a v2 image with regions by hand, without mkfs.tosfs, so that every field it checks is known:
+// a root directory spread over hashed blocks, files whose two extents lie apart so that their data comes in two
+// spans, a compressed file, and a few live but corrupted inodes that no entry names. It then checks:
+//  - the bounds of every accessor: numbers past the inode table, blocks past the file, runs past the image,
+//    extents past the inode, an extent block outside the file, a corrupted compressed file;
+//  - that the image reads the same mapped whole and through windows of 1, 16 and 1024 blocks: attributes,
+//    directory entries, file data along the spans, compressed blocks and every block tosfs_for_each_block visits;
+//  - the LZ4 codec: round trips of text, runs, noise and every length up to 64 bytes, then truncated, flipped and
+//    handcrafted inputs, each decompressed into a buffer of exactly its capacity so that an overrun shows under
+//    -fsanitize=address.
+// It prints every failed check and exits with 1 when there was one.
+//
+// With -p it instead times, on a larger image, tosfs_inode_load_many against tosfs_inode_load one inode at a time
+// over random inode numbers, and tosfs_for_each_block against tosfs_block one block at a time over the whole
+// image, mapped whole then through windows, and reports ns/inode and GB/s.
+//
+// gcc -Wall -O2 test_libtosfs.c -o test_libtosfs
+//
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include "libtosfs.h"
+
+#define SYSTEM_CALL_ERROR (-1)
+#define DEFAULT_FILES (256)
+#define DEFAULT_PERF_FILES (32768)
+#define DEFAULT_PERF_ITERATIONS (8)
+#define BITMAP_BITS (32)
+/// Directory blocks per entry at least, so that no hash bucket of the root fills up
+#define DIRECTORY_SLACK (4)
+/// Blocks of the data of the compressed file, the last one partial
+#define COMPRESSED_SIZE (3 * TOSFS_BLOCK_SIZE + 100)
+#define MAX_SPANS (8)
+#define LZ_SAMPLE_SIZE (TOSFS_BLOCK_SIZE)
+#define LZ_MAX_SHORT_LENGTH (64)
+#define LZ_FLIPS (4096)
+#define STAT_BATCH (4096)
+
+#define min_macro(x, y) ((x) < (y) ? (x) : (y))
+#define max_macro(x, y) ((x) > (y) ? (x) : (y))
+
+#define CHECK(condition) check((condition), #condition, __FILE__, __LINE__)
+
+
+/// Inode numbers and blocks of the generated image, files being numbered from FIRST_FILE_INODE
+struct test_image {
+    __u32 files;
+    __u32 compressed_inode;
+    /// compressed file whose offset table and second block are garbage
+    __u32 corrupt_compressed_inode;
+    /// more than the inline extents, the rest in a block past the end of the file
+    __u32 far_extent_block_inode;
+    /// a single extent running past the blocks the superblock declares
+    __u32 bad_extent_inode;
+    /// first inode number past the live ones
+    __u32 inode_end;
+    __u32 first_data_block;
+    __u32 directory_start;
+    __u32 directory_blocks;
+    __u32 compressed_start;
+    __u32 compressed_blocks;
+    __u32 blocks;
+    char path[64];
+};
+
+#define FIRST_FILE_INODE (2)
+
+static unsigned long checks;
+static unsigned long failures;
+
+
+static void check(const int condition, const char* text, const char* file, const int line) {
+    checks++;
+    if (!condition) {
+        failures++;
+        fprintf(stderr, "%s:%d: check failed: %s\n", file, line, text);
+    }
+}
+
+/// Byte at offset of the data of file ino, different from one file to the next
+static unsigned char file_byte(const __u32 ino, const __u64 offset) {
+    return (unsigned char) (ino * 131 + offset * 7 + offset / TOSFS_BLOCK_SIZE);
+}
+
+static __u64 file_size(const __u32 ino) {
+    return TOSFS_BLOCK_SIZE + 1 + (ino * 97) % (TOSFS_BLOCK_SIZE - 1);
+}
+
+/// Text for the compressed file: words from a short list, which LZ4 shrinks to a fraction
+static void fill_text(char* text, const size_t size, unsigned int seed) {
+    static const char* const words[] = { "tosfs ", "image ", "block ", "inode ", "extent ", "window ", "the ", "of " };
+    size_t position = 0;
+    while (position < size) {
+        seed = seed * 1103515245 + 12345;
+        const char* word = words[(seed >> 16) % (sizeof(words) / sizeof(words[0]))];
+        const size_t length = min_macro(strlen(word), size - position);
+        memcpy(text + position, word, length);
+        position += length;
+    }
+}
+
+static void bitmap_set(char* bitmap, const __u32 bit) {
+    ((__u32*) bitmap)[bit / BITMAP_BITS] |= 1u << (bit % BITMAP_BITS);
+}
+
+static __u32 blocks_for(const __u64 bytes) {
+    return (__u32) ((bytes + TOSFS_BLOCK_SIZE - 1) / TOSFS_BLOCK_SIZE);
+}
+
+/// Writes the image described at the top of the file to a temporary file. Returns -1 on failure.
+static int write_test_image(struct test_image* test, const __u32 files) {
+    memset(test, 0, sizeof(*test));
+    test->files = files;
+    test->compressed_inode = FIRST_FILE_INODE + files;
+    test->corrupt_compressed_inode = test->compressed_inode + 1;
+    test->far_extent_block_inode = test->compressed_inode + 2;
+    test->bad_extent_inode = test->compressed_inode + 3;
+    test->inode_end = test->compressed_inode + 4;
+
+    // Stored bytes of the compressed file, built first to know how many blocks they take
+    char* text = malloc(COMPRESSED_SIZE);
+    char* stored = malloc(COMPRESSED_SIZE);
+    if (text == NULL || stored == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    fill_text(text, COMPRESSED_SIZE, 1);
+    const __u64 stored_size = tosfs_compress_file(text, COMPRESSED_SIZE, stored, COMPRESSED_SIZE);
+    if (stored_size == 0) {
+        fprintf(stderr, "write_test_image: the text does not compress\n");
+        return -1;
+    }
+
+    const __u32 inode_table_blocks = blocks_for((__u64) test->inode_end * sizeof(struct tosfs_inode_v2));
+    const __u32 inode_bitmap_blocks = blocks_for(test->inode_end / 8 + 1);
+    test->directory_blocks = 1;
+    while (test->directory_blocks * TOSFS_DENTRIES_PER_BLOCK < DIRECTORY_SLACK * (files + 4))
+        test->directory_blocks *= 2;
+    test->compressed_blocks = blocks_for(stored_size);
+    // The block bitmap sizes itself with the image, so the layout is computed once per guess of its size
+    __u32 block_bitmap_blocks = 1;
+    for (;;) {
+        test->directory_start = 1 + block_bitmap_blocks + inode_bitmap_blocks + inode_table_blocks;
+        test->compressed_start = test->directory_start + test->directory_blocks;
+        test->first_data_block = test->compressed_start + 2 * test->compressed_blocks;
+        test->blocks = test->first_data_block + 2 * files;
+        if (blocks_for(test->blocks / 8 + 1) <= block_bitmap_blocks)
+            break;
+        block_bitmap_blocks = blocks_for(test->blocks / 8 + 1);
+    }
+
+    char* image = calloc(test->blocks, TOSFS_BLOCK_SIZE);
+    if (image == NULL) {
+        perror("calloc");
+        return -1;
+    }
+#define BLOCK(block_no) (image + (size_t) (block_no) * TOSFS_BLOCK_SIZE)
+    struct tosfs_superblock* superblock = (struct tosfs_superblock*) BLOCK(TOSFS_SUPERBLOCK);
+    superblock->magic = TOSFS_MAGIC;
+    superblock->block_size = TOSFS_BLOCK_SIZE;
+    superblock->blocks = test->blocks;
+    superblock->inodes = test->inode_end - 1;
+    superblock->root_inode = TOSFS_ROOT_INODE;
+    superblock->version = TOSFS_VERSION_2;
+    superblock->block_bitmap_start = 1;
+    superblock->block_bitmap_blocks = block_bitmap_blocks;
+    superblock->inode_bitmap_start = 1 + block_bitmap_blocks;
+    superblock->inode_bitmap_blocks = inode_bitmap_blocks;
+    superblock->inode_table_start = superblock->inode_bitmap_start + inode_bitmap_blocks;
+    superblock->inode_table_blocks = inode_table_blocks;
+
+    struct tosfs_inode_v2* inodes = (struct tosfs_inode_v2*) BLOCK(superblock->inode_table_start);
+    __u32 ino;
+    for (ino = 1; ino < test->inode_end; ino++) {
+        inodes[ino].inode = ino;
+        inodes[ino].mode = S_IFREG | 0644;
+        inodes[ino].perm = 0644;
+        inodes[ino].nlink = 1;
+        bitmap_set(BLOCK(superblock->inode_bitmap_start), ino);
+    }
+    __u32 block_no;
+    for (block_no = 0; block_no < test->blocks; block_no++)
+        bitmap_set(BLOCK(1), block_no);
+
+    struct tosfs_inode_v2* root = &inodes[TOSFS_ROOT_INODE];
+    root->mode = S_IFDIR | 0755;
+    root->perm = 0755;
+    root->nlink = 2;
+    root->size = (__u64) test->directory_blocks * TOSFS_BLOCK_SIZE;
+    root->nr_extents = 1;
+    root->extents[0] = (struct tosfs_extent) { test->directory_start, test->directory_blocks };
+
+    // Every name in the first free slot of its hash bucket
+    char name[TOSFS_MAX_NAME_LENGTH];
+    __u32 entry;
+    for (entry = 0; entry < files + 4; entry++) {
+        __u32 entry_inode;
+        if (entry == 0 || entry == 1) {
+            snprintf(name, sizeof(name), entry == 0 ? "." : "..");
+            entry_inode = TOSFS_ROOT_INODE;
+        } else if (entry == 2) {
+            snprintf(name, sizeof(name), "compressed");
+            entry_inode = test->compressed_inode;
+        } else if (entry == 3) {
+            snprintf(name, sizeof(name), "corrupt");
+            entry_inode = test->corrupt_compressed_inode;
+        } else {
+            snprintf(name, sizeof(name), "file%u", entry - 4);
+            entry_inode = FIRST_FILE_INODE + entry - 4;
+        }
+        struct tosfs_dentry* bucket = (struct tosfs_dentry*)
+            BLOCK(test->directory_start + (tosfs_name_hash(name) & (test->directory_blocks - 1)));
+        unsigned int slot = 0;
+        while (slot < TOSFS_DENTRIES_PER_BLOCK && bucket[slot].inode != 0)
+            slot++;
+        if (slot == TOSFS_DENTRIES_PER_BLOCK) {
+            fprintf(stderr, "write_test_image: hash bucket of %s full\n", name);
+            return -1;
+        }
+        bucket[slot].inode = entry_inode;
+        strncpy(bucket[slot].name, name, TOSFS_MAX_NAME_LENGTH);
+    }
+
+    // Extent 0 of file k in the first half of the data, extent 1 in the second
+    for (ino = FIRST_FILE_INODE; ino < FIRST_FILE_INODE + files; ino++) {
+        const __u32 k = ino - FIRST_FILE_INODE;
+        const __u64 size = file_size(ino);
+        inodes[ino].size = size;
+        inodes[ino].nr_extents = 2;
+        inodes[ino].extents[0] = (struct tosfs_extent) { test->first_data_block + k, 1 };
+        inodes[ino].extents[1] = (struct tosfs_extent) { test->first_data_block + files + k, 1 };
+        __u64 offset;
+        for (offset = 0; offset < size; offset++)
+            BLOCK(inodes[ino].extents[offset / TOSFS_BLOCK_SIZE].start)[offset % TOSFS_BLOCK_SIZE] = file_byte(ino, offset);
+    }
+
+    inodes[test->compressed_inode].flags = TOSFS_INODE_COMPRESSED;
+    inodes[test->compressed_inode].size = COMPRESSED_SIZE;
+    inodes[test->compressed_inode].nr_extents = 1;
+    inodes[test->compressed_inode].extents[0] = (struct tosfs_extent) { test->compressed_start, test->compressed_blocks };
+    memcpy(BLOCK(test->compressed_start), stored, stored_size);
+
+    // Same file, but for block 0 starting inside the table and block 1 a run of 0xff, which no LZ4 block is
+    const __u32 corrupt_start = test->compressed_start + test->compressed_blocks;
+    inodes[test->corrupt_compressed_inode] = inodes[test->compressed_inode];
+    inodes[test->corrupt_compressed_inode].inode = test->corrupt_compressed_inode;
+    inodes[test->corrupt_compressed_inode].extents[0].start = corrupt_start;
+    memcpy(BLOCK(corrupt_start), stored, stored_size);
+    __u32* offsets = (__u32*) BLOCK(corrupt_start);
+    memset(BLOCK(corrupt_start) + offsets[1], 0xff, offsets[2] - offsets[1]);
+    offsets[0] = 0;
+
+    inodes[test->far_extent_block_inode].size = TOSFS_BLOCK_SIZE;
+    inodes[test->far_extent_block_inode].nr_extents = TOSFS_INLINE_EXTENTS + 2;
+    inodes[test->far_extent_block_inode].extent_block = test->blocks + 100;
+    inodes[test->far_extent_block_inode].extents[0] = (struct tosfs_extent) { test->first_data_block, 1 };
+
+    inodes[test->bad_extent_inode].size = 2 * TOSFS_BLOCK_SIZE;
+    inodes[test->bad_extent_inode].nr_extents = 1;
+    inodes[test->bad_extent_inode].extents[0] = (struct tosfs_extent) { test->blocks - 1, 2 };
+#undef BLOCK
+
+    snprintf(test->path, sizeof(test->path), "/tmp/test_libtosfs.XXXXXX");
+    const int fd = mkstemp(test->path);
+    if (fd == SYSTEM_CALL_ERROR) {
+        perror("mkstemp");
+        return -1;
+    }
+    const size_t size = (size_t) test->blocks * TOSFS_BLOCK_SIZE;
+    size_t written = 0;
+    while (written < size) {
+        const ssize_t status = write(fd, image + written, size - written);
+        if (status == SYSTEM_CALL_ERROR) {
+            perror("write");
+            close(fd);
+            return -1;
+        }
+        written += (size_t) status;
+    }
+    close(fd);
+    free(image);
+    free(text);
+    free(stored);
+    return 0;
+}
+
+static int open_test_image(struct tosfs_image* image, const struct test_image* test, const size_t window_size) {
+    if (tosfs_image_open(image, test->path, 0, window_size) == -1)
+        return -1;
+    if (tosfs_image_read(image) == -1) {
+        tosfs_image_close(image);
+        return -1;
+    }
+    return 0;
+}
+
+static void test_bounds(const struct tosfs_image* image, const struct test_image* test) {
+    struct tosfs_attributes attributes;
+    __u32 available;
+
+    CHECK(image->version == TOSFS_VERSION_2);
+    CHECK(image->block_count == test->blocks);
+    CHECK(tosfs_image_has_regions(image));
+
+    // Inode numbers
+    CHECK(tosfs_inode_v1(image, FIRST_FILE_INODE) == NULL);
+    CHECK(tosfs_inode_v2(image, FIRST_FILE_INODE) != NULL);
+    CHECK(tosfs_inode_v2(image, image->inode_table_capacity - 1) != NULL);
+    CHECK(tosfs_inode_v2(image, image->inode_table_capacity) == NULL);
+    CHECK(tosfs_inode_v2(image, UINT64_MAX) == NULL);
+    CHECK(tosfs_inode_load(image, 0, &attributes) == -1);
+    CHECK(tosfs_inode_load(image, test->inode_end, &attributes) == -1);
+    CHECK(tosfs_inode_load(image, image->inode_table_capacity, &attributes) == -1);
+    CHECK(tosfs_inode_load(image, (__u64) UINT32_MAX + FIRST_FILE_INODE, &attributes) == -1);
+    CHECK(tosfs_inode_load(image, FIRST_FILE_INODE, &attributes) == 0 && attributes.size == file_size(FIRST_FILE_INODE));
+    CHECK(!tosfs_inode_compressed(image, FIRST_FILE_INODE));
+    CHECK(tosfs_inode_compressed(image, test->compressed_inode));
+    CHECK(!tosfs_inode_compressed(image, image->inode_table_capacity));
+
+    // Blocks and runs of blocks
+    CHECK(tosfs_block(image, test->blocks - 1) != NULL);
+    CHECK(tosfs_block(image, test->blocks) == NULL);
+    CHECK(tosfs_block(image, UINT32_MAX) == NULL);
+    CHECK(tosfs_blocks(image, test->blocks - 2, 16, &available) != NULL && available <= 2 && available >= 1);
+    CHECK(!tosfs_range_valid(image, TOSFS_SUPERBLOCK, 1));
+    CHECK(!tosfs_range_valid(image, 1, 0));
+    CHECK(tosfs_range_valid(image, test->blocks - 1, 1));
+    CHECK(!tosfs_range_valid(image, test->blocks - 1, 2));
+    CHECK(!tosfs_range_valid(image, test->blocks, 1));
+    CHECK(!tosfs_range_valid(image, 1, UINT32_MAX));
+    CHECK(!tosfs_range_valid(image, UINT32_MAX, 1));
+
+    // Extents
+    CHECK(tosfs_extent_count(image, FIRST_FILE_INODE) == 2);
+    CHECK(tosfs_extent_count(image, image->inode_table_capacity) == 0);
+    CHECK(tosfs_extent_at(image, FIRST_FILE_INODE, 1).start == test->first_data_block + test->files);
+    CHECK(tosfs_extent_at(image, FIRST_FILE_INODE, TOSFS_MAX_EXTENTS).length == 0);
+    CHECK(tosfs_extent_at(image, image->inode_table_capacity, 0).length == 0);
+    CHECK(tosfs_extent_count(image, test->far_extent_block_inode) == TOSFS_INLINE_EXTENTS);
+    CHECK(tosfs_extent_at(image, test->far_extent_block_inode, TOSFS_INLINE_EXTENTS).length == 0);
+
+    // Spans: clipped to the size, none past it, none for a compressed file, none from a run leaving the image
+    struct tosfs_span spans[MAX_SPANS];
+    const __u64 size = file_size(FIRST_FILE_INODE);
+    CHECK(tosfs_inode_spans(image, FIRST_FILE_INODE, 0, UINT64_MAX, spans, MAX_SPANS) == 2 &&
+          spans[0].length + spans[1].length == size);
+    CHECK(tosfs_inode_spans(image, FIRST_FILE_INODE, 0, UINT64_MAX, spans, 1) == 1 &&
+          spans[0].length == TOSFS_BLOCK_SIZE);
+    CHECK(tosfs_inode_spans(image, FIRST_FILE_INODE, size - 1, 10, spans, MAX_SPANS) == 1 && spans[0].length == 1);
+    CHECK(tosfs_inode_spans(image, FIRST_FILE_INODE, size, 1, spans, MAX_SPANS) == 0);
+    CHECK(tosfs_inode_spans(image, FIRST_FILE_INODE, UINT64_MAX, 1, spans, MAX_SPANS) == 0);
+    CHECK(tosfs_inode_spans(image, test->compressed_inode, 0, 1, spans, MAX_SPANS) == 0);
+    CHECK(tosfs_inode_spans(image, test->bad_extent_inode, 0, 1, spans, MAX_SPANS) == 0);
+    CHECK(tosfs_inode_spans(image, test->inode_end, 0, 1, spans, MAX_SPANS) == 0);
+
+    // Stored bytes and compressed blocks
+    char buffer[TOSFS_BLOCK_SIZE];
+    CHECK(tosfs_inode_read_stored(image, test->bad_extent_inode, 0, 1, buffer) == -1);
+    CHECK(tosfs_inode_read_stored(image, test->compressed_inode,
+                                  (__u64) test->compressed_blocks * TOSFS_BLOCK_SIZE - 1, 2, buffer) == -1);
+    CHECK(tosfs_read_compressed_block(image, test->compressed_inode, blocks_for(COMPRESSED_SIZE), buffer) == -1);
+    CHECK(tosfs_read_compressed_block(image, test->corrupt_compressed_inode, 0, buffer) == -1);
+    CHECK(tosfs_read_compressed_block(image, test->corrupt_compressed_inode, 1, buffer) == -1);
+    CHECK(tosfs_read_compressed_block(image, test->inode_end, 0, buffer) == -1);
+
+    // Batches: free and out of range inodes zeroed, walks leaving the file stopped
+    const __u32 inos[] = { FIRST_FILE_INODE, 0, test->inode_end, image->inode_table_capacity, UINT32_MAX,
+                           test->compressed_inode };
+    struct tosfs_attributes many[sizeof(inos) / sizeof(inos[0])];
+    memset(many, 0xa5, sizeof(many));
+    CHECK(tosfs_inode_load_many(image, inos, sizeof(inos) / sizeof(inos[0]), many) == 2);
+    CHECK(many[0].inode == FIRST_FILE_INODE && many[5].inode == test->compressed_inode);
+    CHECK(many[1].inode == 0 && many[2].size == 0 && many[3].mode == 0 && many[4].nlink == 0);
+}
+
+/// FNV-1a, continued from hash
+static __u64 hash_bytes(__u64 hash, const void* bytes, const size_t length) {
+    size_t index;
+    for (index = 0; index < length; index++)
+        hash = (hash ^ ((const unsigned char*) bytes)[index]) * 1099511628211ull;
+    return hash;
+}
+
+static int count_blocks(const char* data, const __u32 block_no, const __u32 blocks, void* arg) {
+    (void) data;
+    (void) block_no;
+    *(__u64*) arg += blocks;
+    return 0;
+}
+
+static int stop_at_second_piece(const char* data, const __u32 block_no, const __u32 blocks, void* arg) {
+    (void) data;
+    (void) blocks;
+    return block_no == *(const __u32*) arg ? 0 : 42;
+}
+
+/// FNV-1a of the blocks visited, with their numbers, so that a block handed twice or out of order shows
+static int hash_blocks(const char* data, const __u32 block_no, const __u32 blocks, void* arg) {
+    __u64* hash = arg;
+    __u32 block;
+    for (block = 0; block < blocks; block++) {
+        const __u32 number = block_no + block;
+        *hash = hash_bytes(hash_bytes(*hash, &number, sizeof(number)), data + (size_t) block * TOSFS_BLOCK_SIZE,
+                           TOSFS_BLOCK_SIZE);
+    }
+    return 0;
+}
+
+static void test_for_each_block(const struct tosfs_image* image, const struct test_image* test) {
+    __u64 blocks = 0;
+    CHECK(tosfs_for_each_block(image, 0, test->blocks, count_blocks, &blocks) == 0 && blocks == test->blocks);
+    blocks = 0;
+    CHECK(tosfs_for_each_block(image, test->blocks - 1, 2, count_blocks, &blocks) == -1 && blocks == 1);
+    CHECK(tosfs_for_each_block(image, test->blocks, 1, count_blocks, &blocks) == -1);
+    CHECK(tosfs_for_each_block(image, 0, 0, count_blocks, &blocks) == 0);
+    // The first piece ends with the file, the batch or the window, and the walk goes on only past it
+    __u32 first = 0, available = 0;
+    CHECK(tosfs_blocks(image, first, min_macro(test->blocks, TOSFS_BATCH_BLOCKS), &available) != NULL);
+    CHECK(tosfs_for_each_block(image, first, test->blocks, stop_at_second_piece, &first) ==
+          (available < test->blocks ? 42 : 0));
+}
+
+/// What the image holds, as read through one mapping, to compare mappings with
+struct image_digest {
+    __u64 attributes;
+    __u64 entries;
+    __u64 entry_count;
+    __u64 data;
+    __u64 compressed;
+    __u64 blocks;
+};
+
+static void digest_image(const struct tosfs_image* image, const struct test_image* test, struct image_digest* digest) {
+    memset(digest, 0, sizeof(*digest));
+    digest->attributes = digest->entries = digest->data = digest->compressed = digest->blocks = 14695981039346656037ull;
+
+    __u32 ino;
+    for (ino = 0; ino < test->inode_end + 2; ino++) {
+        struct tosfs_attributes attributes;
+        memset(&attributes, 0, sizeof(attributes));
+        const int status = tosfs_inode_load(image, ino, &attributes);
+        digest->attributes = hash_bytes(digest->attributes, &status, sizeof(status));
+        digest->attributes = hash_bytes(digest->attributes, &attributes, sizeof(attributes));
+    }
+
+    struct tosfs_dentry_cursor cursor;
+    const struct tosfs_dentry* entry;
+    tosfs_dentry_cursor_init(image, &cursor, TOSFS_ROOT_INODE);
+    while ((entry = tosfs_dentry_next(image, &cursor)) != NULL) {
+        digest->entries = hash_bytes(digest->entries, entry, sizeof(*entry));
+        digest->entry_count++;
+    }
+
+    // File data along the spans, each checked against what was written
+    for (ino = FIRST_FILE_INODE; ino < FIRST_FILE_INODE + test->files; ino++) {
+        struct tosfs_span spans[MAX_SPANS];
+        const size_t count = tosfs_inode_spans(image, ino, 1, UINT64_MAX, spans, MAX_SPANS);
+        size_t index;
+        int matches = count == 2;
+        for (index = 0; index < count; index++) {
+            __u64 done = 0;
+            while (done < spans[index].length) {
+                const __u64 position = spans[index].position + done;
+                const char* block = tosfs_block(image, (__u32) (position / TOSFS_BLOCK_SIZE));
+                if (block == NULL) {
+                    matches = 0;
+                    break;
+                }
+                const size_t in_block = position % TOSFS_BLOCK_SIZE;
+                const size_t chunk = min_macro(spans[index].length - done, TOSFS_BLOCK_SIZE - in_block);
+                size_t byte;
+                for (byte = 0; byte < chunk; byte++)
+                    if ((unsigned char) block[in_block + byte] != file_byte(ino, spans[index].file_offset + done + byte))
+                        matches = 0;
+                digest->data = hash_bytes(digest->data, block + in_block, chunk);
+                done += chunk;
+            }
+        }
+        if (!matches)
+            fprintf(stderr, "inode %u: data does not match\n", ino);
+        CHECK(matches);
+    }
+
+    char text[COMPRESSED_SIZE];
+    char block[TOSFS_BLOCK_SIZE];
+    __u64 block_index;
+    fill_text(text, COMPRESSED_SIZE, 1);
+    for (block_index = 0; block_index < blocks_for(COMPRESSED_SIZE); block_index++) {
+        const long length = tosfs_read_compressed_block(image, test->compressed_inode, block_index, block);
+        const size_t expected = min_macro(TOSFS_BLOCK_SIZE, COMPRESSED_SIZE - block_index * TOSFS_BLOCK_SIZE);
+        CHECK(length == (long) expected && memcmp(block, text + block_index * TOSFS_BLOCK_SIZE, expected) == 0);
+        digest->compressed = hash_bytes(digest->compressed, block, length > 0 ? (size_t) length : 0);
+    }
+
+    CHECK(tosfs_for_each_block(image, 0, test->blocks, hash_blocks, &digest->blocks) == 0);
+}
+
+/// Every window size reads what the whole mapping reads
+static void test_windows(const struct test_image* test) {
+    const size_t window_sizes[] = { 1, 16 * TOSFS_BLOCK_SIZE, 1024 * TOSFS_BLOCK_SIZE };
+    struct tosfs_image image;
+    struct image_digest whole;
+    size_t index;
+
+    if (open_test_image(&image, test, 0) == -1) {
+        CHECK(!"whole mapping opens");
+        return;
+    }
+    test_bounds(&image, test);
+    test_for_each_block(&image, test);
+    digest_image(&image, test, &whole);
+    CHECK(whole.entry_count == test->files + 4);
+    CHECK(tosfs_image_close(&image) == 0);
+
+    for (index = 0; index < sizeof(window_sizes) / sizeof(window_sizes[0]); index++) {
+        struct image_digest windowed;
+        if (open_test_image(&image, test, window_sizes[index]) == -1) {
+            CHECK(!"windowed mapping opens");
+            continue;
+        }
+        test_bounds(&image, test);
+        test_for_each_block(&image, test);
+        digest_image(&image, test, &windowed);
+        CHECK(memcmp(&whole, &windowed, sizeof(whole)) == 0);
+        CHECK(tosfs_image_close(&image) == 0);
+    }
+}
+
+/// Compresses then decompresses length bytes, into an output of exactly length bytes
+static void lz_round_trip(const char* data, const size_t length) {
+    const size_t capacity = length + length / 255 + 16;
+    char* compressed = malloc(capacity);
+    char* output = malloc(max_macro(length, 1));
+    char* stored = malloc(max_macro(length, 1));
+    const size_t compressed_length = tosfs_compress_block(data, length, compressed, capacity);
+    CHECK(length == 0 || compressed_length > 0);
+    if (compressed_length > 0)
+        CHECK(tosfs_decompress_block(compressed, compressed_length, output, length) == (long) length &&
+              memcmp(output, data, length) == 0);
+
+    // A stored block is raw exactly when it is as long as the data
+    if (length > 0) {
+        const size_t stored_length = tosfs_store_block(data, length, stored);
+        CHECK(stored_length <= length);
+        if (stored_length == length)
+            CHECK(memcmp(stored, data, length) == 0);
+        else
+            CHECK(tosfs_decompress_block(stored, stored_length, output, length) == (long) length &&
+                  memcmp(output, data, length) == 0);
+    }
+    free(compressed);
+    free(output);
+    free(stored);
+}
+
+/// Decompresses length bytes that may not be a valid block into exactly capacity bytes: -1 or a length that fits
+static int lz_decompress_bounded(const char* input, const size_t length, const size_t capacity) {
+    char* in = malloc(max_macro(length, 1));
+    char* out = malloc(max_macro(capacity, 1));
+    memcpy(in, input, length);
+    const long status = tosfs_decompress_block(in, length, out, capacity);
+    free(in);
+    free(out);
+    return status == -1 || (status >= 0 && (size_t) status <= capacity);
+}
+
+static void test_lz4(void) {
+    char data[LZ_SAMPLE_SIZE];
+    unsigned int seed = 7;
+    size_t index;
+
+    fill_text(data, sizeof(data), 3);
+    lz_round_trip(data, sizeof(data));
+    memset(data, 'a', sizeof(data));
+    lz_round_trip(data, sizeof(data));
+    for (index = 0; index < sizeof(data); index++) {
+        seed = seed * 1103515245 + 12345;
+        data[index] = (char) (seed >> 16);
+    }
+    lz_round_trip(data, sizeof(data));
+    // Short blocks, where the last literals rule leaves no room for a match
+    fill_text(data, sizeof(data), 5);
+    for (index = 0; index <= LZ_MAX_SHORT_LENGTH; index++)
+        lz_round_trip(data, index);
+    // Matches overlapping what they write, at every offset below 8
+    for (index = 1; index < 8; index++) {
+        size_t byte;
+        for (byte = 0; byte < sizeof(data); byte++)
+            data[byte] = (char) ('a' + byte % index);
+        lz_round_trip(data, sizeof(data));
+    }
+
+    // Compressed text cut short, then with bytes flipped: never more than the capacity
+    char compressed[LZ_SAMPLE_SIZE + LZ_SAMPLE_SIZE / 255 + 16];
+    fill_text(data, sizeof(data), 9);
+    const size_t compressed_length = tosfs_compress_block(data, sizeof(data), compressed, sizeof(compressed));
+    CHECK(compressed_length > 0);
+    for (index = 0; index < compressed_length; index++)
+        CHECK(lz_decompress_bounded(compressed, index, sizeof(data)));
+    CHECK(tosfs_decompress_block(compressed, compressed_length - 1, data, sizeof(data)) != (long) sizeof(data));
+    for (index = 0; index < LZ_FLIPS; index++) {
+        char corrupt[sizeof(compressed)];
+        memcpy(corrupt, compressed, compressed_length);
+        seed = seed * 1103515245 + 12345;
+        corrupt[(seed >> 8) % compressed_length] ^= (char) (1 + (seed >> 24) % 255);
+        CHECK(lz_decompress_bounded(corrupt, compressed_length, sizeof(data)));
+        CHECK(lz_decompress_bounded(corrupt, compressed_length, sizeof(data) / 2));
+    }
+    // Output smaller than the data
+    CHECK(tosfs_decompress_block(compressed, compressed_length, data, sizeof(data) - 1) == -1);
+
+    // Handcrafted blocks: offset 0, offset before the output, literals past the input, a length that never ends,
+    // an offset cut short
+    const unsigned char zero_offset[] = { 0x14, 'a', 0x00, 0x00, 0x50, 'a', 'a', 'a', 'a', 'a' };
+    const unsigned char far_offset[] = { 0x14, 'a', 0x02, 0x00, 0x50, 'a', 'a', 'a', 'a', 'a' };
+    const unsigned char long_literals[] = { 0x50, 'a', 'a' };
+    const unsigned char endless_length[] = { 0xf0, 0xff, 0xff };
+    const unsigned char short_offset[] = { 0x14, 'a', 0x01 };
+    const unsigned char valid[] = { 0x14, 'a', 0x01, 0x00, 0x50, 'a', 'a', 'a', 'a', 'a' };
+    char output[64];
+    CHECK(tosfs_decompress_block(zero_offset, sizeof(zero_offset), output, sizeof(output)) == -1);
+    CHECK(tosfs_decompress_block(far_offset, sizeof(far_offset), output, sizeof(output)) == -1);
+    CHECK(tosfs_decompress_block(long_literals, sizeof(long_literals), output, sizeof(output)) == -1);
+    CHECK(tosfs_decompress_block(endless_length, sizeof(endless_length), output, sizeof(output)) == -1);
+    CHECK(tosfs_decompress_block(short_offset, sizeof(short_offset), output, sizeof(output)) == -1);
+    CHECK(tosfs_decompress_block(valid, sizeof(valid), output, sizeof(output)) == 14 &&
+          memcmp(output, "aaaaaaaaaaaaaa", 14) == 0);
+    CHECK(tosfs_decompress_block(valid, sizeof(valid), output, 13) == -1);
+    CHECK(tosfs_decompress_block(valid, 0, output, sizeof(output)) == 0);
+
+    // A file that does not compress is refused, and the table always fits
+    for (index = 0; index < sizeof(data); index++) {
+        seed = seed * 1103515245 + 12345;
+        data[index] = (char) (seed >> 16);
+    }
+    char stored_file[2 * LZ_SAMPLE_SIZE];
+    CHECK(tosfs_compress_file(data, sizeof(data), stored_file, sizeof(stored_file)) == 0);
+    CHECK(tosfs_compress_file(data, 0, stored_file, sizeof(stored_file)) == 0);
+    CHECK(tosfs_compressed_table_size(1) == 2 * sizeof(__u32));
+    CHECK(tosfs_compressed_table_size(TOSFS_BLOCK_SIZE + 1) == 3 * sizeof(__u32));
+}
+
+
+static double elapsed_ns(const struct timespec* started, const struct timespec* finished) {
+    return (double) (finished->tv_sec - started->tv_sec) * 1e9 + (double) (finished->tv_nsec - started->tv_nsec);
+}
+
+static int sum_blocks(const char* data, const __u32 block_no, const __u32 blocks, void* arg) {
+    const __u64* words = (const __u64*) data;
+    const size_t count = (size_t) blocks * TOSFS_BLOCK_SIZE / sizeof(__u64);
+    size_t index;
+    __u64 sum = 0;
+    (void) block_no;
+    for (index = 0; index < count; index++)
+        sum += words[index];
+    *(__u64*) arg += sum;
+    return 0;
+}
+
+/// Times the batch accessors against their one-at-a-time counterparts on an image mapped whole or through windows
+static void run_perf(const struct test_image* test, const size_t window_size, const int iterations) {
+    struct tosfs_image image;
+    struct timespec started, finished;
+    int iteration;
+
+    if (open_test_image(&image, test, window_size) == -1)
+        return;
+    const char* mapping = window_size == 0 ? "whole" : "windows";
+
+    // Random inode numbers over the whole table, most of them live
+    __u32* inos = malloc(STAT_BATCH * sizeof(__u32));
+    struct tosfs_attributes* attributes = malloc(STAT_BATCH * sizeof(struct tosfs_attributes));
+    unsigned int seed = 11;
+    size_t index, live = 0;
+    for (index = 0; index < STAT_BATCH; index++) {
+        seed = seed * 1103515245 + 12345;
+        inos[index] = 1 + (seed >> 4) % (test->inode_end - 1);
+    }
+    const int stat_rounds = iterations * (int) (test->inode_end / STAT_BATCH + 1);
+
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    for (iteration = 0; iteration < stat_rounds; iteration++)
+        for (index = 0; index < STAT_BATCH; index++)
+            live += tosfs_inode_load(&image, inos[index], &attributes[index]) == 0;
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    printf("%-8s %-20s %12.2f ns/inode\n", mapping, "inode_load", elapsed_ns(&started, &finished) / stat_rounds / STAT_BATCH);
+
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    for (iteration = 0; iteration < stat_rounds; iteration++)
+        live += tosfs_inode_load_many(&image, inos, STAT_BATCH, attributes);
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    printf("%-8s %-20s %12.2f ns/inode\n", mapping, "inode_load_many", elapsed_ns(&started, &finished) / stat_rounds / STAT_BATCH);
+
+    // Every block of the image summed, one block at a time then in batches
+    const double bytes = (double) test->blocks * TOSFS_BLOCK_SIZE * iterations;
+    __u64 sum = 0;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    for (iteration = 0; iteration < iterations; iteration++) {
+        __u32 block_no;
+        for (block_no = 0; block_no < test->blocks; block_no++)
+            sum_blocks(tosfs_block(&image, block_no), block_no, 1, &sum);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    printf("%-8s %-20s %12.2f GB/s\n", mapping, "block", bytes / elapsed_ns(&started, &finished));
+
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    for (iteration = 0; iteration < iterations; iteration++)
+        tosfs_for_each_block(&image, 0, test->blocks, sum_blocks, &sum);
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    printf("%-8s %-20s %12.2f GB/s\n", mapping, "for_each_block", bytes / elapsed_ns(&started, &finished));
+
+    // Keeps the loops from being optimized away
+    if (live == 0 && sum == 1)
+        printf("\n");
+    free(inos);
+    free(attributes);
+    tosfs_image_close(&image);
+}
+
+static void usage(const char* program) {
+    printf("usage: %s [-p] [-f files] [-n iterations]\n", program);
+    printf("  -p  time the batch accessors instead of testing\n");
+    printf("  -f  files in the generated image (default %d, %d with -p)\n", DEFAULT_FILES, DEFAULT_PERF_FILES);
+    printf("  -n  passes over the image with -p (default %d)\n", DEFAULT_PERF_ITERATIONS);
+}
+
+int main(int argc, char *argv[]) {
+    int perf = 0;
+    long files = -1;
+    int iterations = DEFAULT_PERF_ITERATIONS;
+    int option;
+
+    while ((option = getopt(argc, argv, "pf:n:h")) != -1) {
+        switch (option) {
+            case 'p':
+                perf = 1;
+                break;
+            case 'f':
+                files = strtol(optarg, NULL, 10);
+                break;
+            case 'n':
+                iterations = atoi(optarg);
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (files < 0)
+        files = perf ? DEFAULT_PERF_FILES : DEFAULT_FILES;
+    if (files < 1 || files > INT_MAX / 4 || iterations < 1) {
+        fprintf(stderr, "%s: -f and -n take a positive number\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    struct test_image test;
+    if (write_test_image(&test, (__u32) files) == -1)
+        return EXIT_FAILURE;
+
+    if (perf) {
+        printf("%u inodes, %u blocks of %d bytes\n", test.inode_end - 1, test.blocks, TOSFS_BLOCK_SIZE);
+        run_perf(&test, 0, iterations);
+        run_perf(&test, 1024 * TOSFS_BLOCK_SIZE, iterations);
+        unlink(test.path);
+        return EXIT_SUCCESS;
+    }
+
+    test_windows(&test);
+    test_lz4();
+    unlink(test.path);
+    printf("%lu checks, %lu failed\n", checks, failures);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -20,8 +20,15 @@
 #define TOSFS_ROOT_BLOCK 2
 #define TOSFS_MAX_NAME_LENGTH 32
 #define TOSFS_INODE_SIZE sizeof(struct tosfs_inode)
+#define TOSFS_VERSION_1 0 /* original format, version field left to zero */
+#define TOSFS_VERSION_2 2 /* inodes address their data through extents */
+#define TOSFS_INODE_V2_SIZE sizeof(struct tosfs_inode_v2)
+#define TOSFS_INLINE_EXTENTS 4
+#define TOSFS_EXTENTS_PER_BLOCK (TOSFS_BLOCK_SIZE / sizeof(struct tosfs_extent))
+#define TOSFS_INODE_COMPRESSED 0x1 /* v2 inode flag: data stored compressed, see below */
 
-#define tosfs_set_bit(bitmap, block_no) bitmap|=(1<<block_no);
+#define tosfs_set_bit(bitmap, block_no) bitmap|=(1u<<(block_no));
+#define tosfs_clear_bit(bitmap, block_no) bitmap&=~(1u<<(block_no));
 
 /* superblock on disk */
 struct tosfs_superblock {
@@ -32,6 +39,16 @@ struct tosfs_superblock {
 	__u32 blocks; /* number of blocks, set to 32 */
 	__u32 inodes; /* number of ino, max = 32 */
 	__u32 root_inode; /* root inode inode */
+	__u32 version; /* TOSFS_VERSION_1 or TOSFS_VERSION_2 */
+	/* v2 only: regions of whole blocks holding the bitmaps and the inode
+	   table. When block_bitmap_blocks is 0 the image uses the 32 block
+	   layout: bitmaps in the fields above and inode table in block 1. */
+	__u32 block_bitmap_start; /* first block of the block bitmap */
+	__u32 block_bitmap_blocks; /* blocks in the block bitmap */
+	__u32 inode_bitmap_start; /* first block of the inode bitmap */
+	__u32 inode_bitmap_blocks; /* blocks in the inode bitmap */
+	__u32 inode_table_start; /* first block of the inode table */
+	__u32 inode_table_blocks; /* blocks in the inode table */
 };
 
 /* on disk inode */
@@ -47,12 +64,58 @@ struct tosfs_inode {
 	__u16 nlink; /* link (number of hardlink) */
 };
 
+/* run of contiguous blocks on disk (v2) */
+struct tosfs_extent {
+	__u32 start; /* first block of the run */
+	__u32 length; /* number of blocks in the run */
+};
+
+/* on disk inode (v2). Data lives in nr_extents runs of blocks: the first
+   TOSFS_INLINE_EXTENTS are stored in the inode, the next ones in
+   extent_block (TOSFS_EXTENTS_PER_BLOCK at most). The root directory
+   dentries live in the first block of the root inode. */
+struct tosfs_inode_v2 {
+	__u32 inode; /* inode number */
+	__u16 uid; /* user id */
+	__u16 gid; /* group id */
+	__u16 mode; /* mode (fil, dir, etc) */
+	__u16 perm; /* permissions */
+	__u16 nlink; /* link (number of hardlink) */
+	__u16 flags; /* TOSFS_INODE_* flags, 0 for a plain file */
+	__u64 size; /* size in byte */
+	__u32 nr_extents; /* number of extents in use */
+	__u32 extent_block; /* block holding the extents past the inline ones, 0 if none */
+	struct tosfs_extent extents[TOSFS_INLINE_EXTENTS]; /* first extents */
+};
+
+/* compressed file (v2, TOSFS_INODE_COMPRESSED): size stays the size of the
+   data, and the blocks of the extents hold, for the n = size / 4096 rounded
+   up blocks of the data, a table of n + 1 __u32 offsets in the stored bytes,
+   then block i stored in bytes [offsets[i], offsets[i + 1]), offsets[0]
+   being right after the table. Every block is compressed on its own in the
+   LZ4 block format, or kept as is when that would not make it smaller: a
+   stored block as long as the data it holds is raw. */
+
 /* dentry struct on disk */
 struct tosfs_dentry {
 	__u32 inode; /* inode number */
 	char name[TOSFS_MAX_NAME_LENGTH]; /* name of file */
 };
 
+/* directory layout: a directory spans a power of two number of blocks of
+   dentries, and the entry of a name lives in any free slot of block
+   tosfs_name_hash(name) & (blocks - 1). A lookup reads a single block.
+   A v1 directory is a single block. */
+static inline __u32 tosfs_name_hash(const char *name)
+{
+	__u32 hash = 2166136261u; /* 32 bit FNV-1a */
+	int i;
+
+	for (i = 0; i < TOSFS_MAX_NAME_LENGTH && name[i] != '\0'; i++)
+		hash = (hash ^ (unsigned char) name[i]) * 16777619u;
+	return hash;
+}
+
 /* inode cache */
 //yypstruct tosfs_inode inode_cache[32*TOSFS_INODE_SIZE];
 struct tosfs_inode *inode_cache;